@@ -0,0 +1,382 @@
+// Headless benchmark of the pipeline stages, on the bundled datasets.
+// Built with "make bench" (not linked into the app).
+//
+// usage: bench/bench [-d <data dir>] [-o <results file>] [-n <runs>]
+//                    [-p <particle seconds>] [--gl]
+//
+// GL uploads are skipped unless "--gl" is given, in which case they
+// are also timed in the context of a hidden window.
+//
+// Results are written as tab-separated lines, one per stage:
+//   dataset  stage  unit  samples  min  avg  median  max
+// (no timestamps or paths, so that two runs can be diffed).
+
+#include "global.h"
+
+#include "dataset_manager.h"
+#include "gpu_resources.h"
+#include "volume.h"
+#include "isosurface.h"
+#include "slice.h"
+#include "particle_engine.h"
+#include "volume_cache.h"
+#include "util/file.h"
+
+#include <vtkImageData.h>
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+namespace {
+	struct BenchDataSet
+	{
+		const char* fileName;
+		const char* velocityFileName; // (optional)
+	};
+
+	const BenchDataSet benchDataSets[] = {
+		{ "head.vti",     nullptr },
+		{ "ironProt.vtk", nullptr },
+		{ "brain.vtk",    nullptr },
+		{ "FTLE7.vtk",    "Velocities7.vtk" },
+	};
+
+	struct Options
+	{
+		Options() : dataDir("data"), runs(5), particleSeconds(5), gl(false) {}
+		std::string dataDir, outputFileName;
+		int runs, particleSeconds;
+		bool gl;
+	};
+
+	struct Result
+	{
+		std::string dataSet, stage, unit;
+		std::vector<double> samples;
+	};
+
+	// Isosurface sweep (percentages of the data range), and number of
+	// poses of the slice path
+	const double isoPercentages[] = { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9 };
+	const int slicePoseCount = 36;
+
+	const unsigned int particleCount = 1000; // (same as FluidMechanics)
+	const float particleSpeed = 0.15f;
+	const int particleStallMs = 1000;
+
+	class Timer
+	{
+	public:
+		Timer() : mStartNs(Utility::currentTimeNs()) {}
+		double elapsedMs() const { return (Utility::currentTimeNs() - mStartNs) / 1e6; }
+
+	private:
+		long long mStartNs;
+	};
+
+	class Bench
+	{
+	public:
+		Bench(const Options& options) : mOptions(options) {}
+
+		void run(const BenchDataSet& ds);
+		void write(std::ostream& os) const;
+
+	private:
+		Result& result(const std::string& dataSet, const std::string& stage, const std::string& unit = "ms");
+
+		vtkSmartPointer<vtkImageData> load(const std::string& name);
+		void benchIsoSurface(const std::string& name, vtkSmartPointer<vtkImageData> data);
+		void benchSlice(const std::string& name, GpuResourcesSharedPtr resources);
+		void benchParticles(const std::string& name, vtkSmartPointer<vtkImageData> velocityData);
+
+		const Options mOptions;
+		std::vector<Result> mResults;
+	};
+
+	Result& Bench::result(const std::string& dataSet, const std::string& stage, const std::string& unit)
+	{
+		for (Result& r : mResults) {
+			if (r.dataSet == dataSet && r.stage == stage)
+				return r;
+		}
+		mResults.push_back(Result { dataSet, stage, unit, std::vector<double>() });
+		return mResults.back();
+	}
+
+	// The first load of a file without a cache reads the source file
+	// (and writes the cache), the next ones map the cache
+	vtkSmartPointer<vtkImageData> Bench::load(const std::string& name)
+	{
+		const std::string fileName = mOptions.dataDir + "/" + name;
+
+		vtkSmartPointer<vtkImageData> data;
+		for (int i = 0; i < mOptions.runs; ++i) {
+			long long mtimeNs, size;
+			const bool cached = File::getInfo(VolumeCache::getFileName(fileName), mtimeNs, size);
+			data = nullptr; // (unmaps the previous copy first)
+
+			Timer t;
+			data = DataSetManager::loadDataFile(fileName);
+			result(name, cached ? "load.cache" : "load.source").samples.push_back(t.elapsedMs());
+		}
+		return data;
+	}
+
+	void Bench::benchIsoSurface(const std::string& name, vtkSmartPointer<vtkImageData> data)
+	{
+		// (without a tree, the constructor builds it)
+		IsoSurfacePtr isosurface;
+		for (int i = 0; i < mOptions.runs; ++i) {
+			isosurface = nullptr;
+			Timer t;
+			isosurface.reset(new IsoSurface(data));
+			result(name, "isosurface.create").samples.push_back(t.elapsedMs());
+		}
+
+		// Every value is extracted again
+		isosurface->setCacheBudget(0);
+		for (int i = 0; i < mOptions.runs; ++i) {
+			for (double percentage : isoPercentages) {
+				Timer t;
+				isosurface->setPercentage(percentage);
+				result(name, "isosurface.setPercentage").samples.push_back(t.elapsedMs());
+			}
+		}
+	}
+
+	// Scripted pose path: the slice plane spins around a tilted axis
+	// while moving back and forth through the data
+	void Bench::benchSlice(const std::string& name, GpuResourcesSharedPtr resources)
+	{
+		SlicePtr slice(new Slice(resources));
+		slice->setGpuSampling(false);
+
+		const int* dims = resources->getDimensions();
+		const Vector3 size = Vector3(dims[0], dims[1], dims[2]) * resources->getSpacing();
+		const Vector3 center = size / 2;
+		const float clipDist = size.length();
+		const Vector3 axis = Vector3(1, 1, 0).normalized();
+
+		for (int i = 0; i < mOptions.runs; ++i) {
+			for (int pose = 0; pose < slicePoseCount; ++pose) {
+				const float t = float(pose) / slicePoseCount;
+				const Quaternion rot = Quaternion(axis, 2*M_PI*t) * Quaternion(Vector3::unitZ(), M_PI*t);
+				const Vector3 pos = center + rot * Vector3(0, 0, 0.25f*size.z*std::sin(2*M_PI*t));
+
+				Timer timer;
+				slice->setSlice(Matrix4::makeTransform(pos, rot), clipDist, 1.0f);
+				while (!slice->isIdle())
+					tthread::this_thread::yield();
+				result(name, "slice.setSlice").samples.push_back(timer.elapsedMs());
+			}
+		}
+	}
+
+	void Bench::benchParticles(const std::string& name, vtkSmartPointer<vtkImageData> velocityData)
+	{
+		VelocityFieldSharedPtr field;
+		for (int i = 0; i < mOptions.runs; ++i) {
+			field = nullptr;
+			Timer t;
+			field = std::make_shared<VelocityField>(velocityData);
+			result(name, "velocity.field").samples.push_back(t.elapsedMs());
+		}
+
+		const int* dims = field->getDimensions();
+		const Vector3 seed = Vector3(dims[0], dims[1], dims[2]) * 0.4f;
+		const float jitter = 0.2f * std::min(dims[0], std::min(dims[1], dims[2]));
+
+		// Cost of one RK4 step of all the particles (4 samples each)
+		std::srand(0);
+		std::vector<float> x(particleCount), y(particleCount), z(particleCount);
+		for (unsigned int i = 0; i < particleCount; ++i) {
+			x[i] = seed.x + jitter * float(std::rand()) / RAND_MAX;
+			y[i] = seed.y + jitter * float(std::rand()) / RAND_MAX;
+			z[i] = seed.z + jitter * float(std::rand()) / RAND_MAX;
+		}
+		std::vector<float> vx(particleCount), vy(particleCount), vz(particleCount);
+		for (int i = 0; i < mOptions.runs; ++i) {
+			Timer t;
+			for (int k = 0; k < 4; ++k)
+				field->sample(x.data(), y.data(), z.data(), particleCount, vx.data(), vy.data(), vz.data());
+			result(name, "particles.step").samples.push_back(t.elapsedMs());
+		}
+
+		// Real time advection: published updates per second, and
+		// particles alive (released again as soon as they are all
+		// gone)
+		ParticleEngine engine(particleCount, particleSpeed, particleStallMs);
+		engine.setVelocityField(field);
+		engine.release(seed, jitter, 0);
+
+		std::vector<Vector3> positions;
+		for (int s = 0; s < mOptions.particleSeconds; ++s) {
+			unsigned int updates = 0;
+			Timer t;
+			while (t.elapsedMs() < 1000) {
+				if (engine.getSnapshot(positions)) {
+					++updates;
+					result(name, "particles.alive", "particles").samples.push_back(positions.size());
+				}
+				if (!engine.hasParticles())
+					engine.release(seed, jitter, 0);
+				tthread::this_thread::sleep_for(tthread::chrono::milliseconds(1));
+			}
+			result(name, "particles.updates", "1/s").samples.push_back(updates * 1000 / t.elapsedMs());
+		}
+	}
+
+	void Bench::run(const BenchDataSet& ds)
+	{
+		const std::string name = ds.fileName;
+		LOGI("Benchmarking %s...", name.c_str());
+
+		vtkSmartPointer<vtkImageData> data = load(name);
+
+		GpuResourcesSharedPtr resources;
+		for (int i = 0; i < mOptions.runs; ++i) {
+			resources = nullptr;
+			Timer t;
+			resources = std::make_shared<GpuResources>(data);
+			result(name, "resources.create").samples.push_back(t.elapsedMs());
+
+			if (mOptions.gl) {
+				Timer upload;
+				resources->bind();
+				glFinish();
+				result(name, "resources.upload").samples.push_back(upload.elapsedMs());
+			}
+		}
+
+		for (int i = 0; i < mOptions.runs; ++i) {
+			Timer t;
+			VolumePtr volume(new Volume(resources));
+			if (mOptions.gl) {
+				volume->bind();
+				glFinish();
+			}
+			result(name, "volume.create").samples.push_back(t.elapsedMs());
+		}
+
+		benchIsoSurface(name, data);
+		benchSlice(name, resources);
+
+		if (ds.velocityFileName)
+			benchParticles(name, load(ds.velocityFileName));
+	}
+
+	void Bench::write(std::ostream& os) const
+	{
+		os << "# dataset\tstage\tunit\tsamples\tmin\tavg\tmedian\tmax\n";
+		for (const Result& r : mResults) {
+			std::vector<double> s = r.samples;
+			if (s.empty())
+				continue;
+			std::sort(s.begin(), s.end());
+			double sum = 0;
+			for (double v : s)
+				sum += v;
+
+			char line[256];
+			std::snprintf(line, sizeof(line), "%s\t%s\t%s\t%u\t%.3f\t%.3f\t%.3f\t%.3f\n",
+			              r.dataSet.c_str(), r.stage.c_str(), r.unit.c_str(), (unsigned int)s.size(),
+			              s.front(), sum / s.size(), s[s.size()/2], s.back());
+			os << line;
+		}
+	}
+
+	void usage(const char* program)
+	{
+		LOGE("usage: %s [-d <data dir>] [-o <results file>] [-n <runs>] [-p <particle seconds>] [--gl]", program);
+	}
+
+	bool parseOptions(int argc, char** argv, Options& options)
+	{
+		for (int i = 1; i < argc; ++i) {
+			const std::string arg = argv[i];
+			const bool hasValue = (i+1 < argc);
+			if (arg == "--gl")
+				options.gl = true;
+			else if (arg == "-d" && hasValue)
+				options.dataDir = argv[++i];
+			else if (arg == "-o" && hasValue)
+				options.outputFileName = argv[++i];
+			else if (arg == "-n" && hasValue)
+				options.runs = Utility::fromString<int>(argv[++i]);
+			else if (arg == "-p" && hasValue)
+				options.particleSeconds = Utility::fromString<int>(argv[++i]);
+			else
+				return false;
+
+			if (options.runs < 1 || options.particleSeconds < 0)
+				return false;
+		}
+		return true;
+	}
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	SDL_Window* window = nullptr;
+	SDL_GLContext context = nullptr;
+	if (options.gl) {
+		if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+			LOGE("Unable to initialize SDL: %s", SDL_GetError());
+			return EXIT_FAILURE;
+		}
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+		window = SDL_CreateWindow("Fluids Bench", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+		                          64, 64, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+		if (window)
+			context = SDL_GL_CreateContext(window);
+		if (!context) {
+			LOGE("Unable to create context: %s", SDL_GetError());
+			SDL_Quit();
+			return EXIT_FAILURE;
+		}
+		LOGD("OpenGL version: %s", glGetString(GL_VERSION));
+	}
+
+	Bench bench(options);
+	int status = EXIT_SUCCESS;
+	for (const BenchDataSet& ds : benchDataSets) {
+		try {
+			bench.run(ds);
+		} catch (const std::exception& e) {
+			LOGE("Error benchmarking %s: %s", ds.fileName, e.what());
+			status = EXIT_FAILURE;
+		}
+	}
+
+	if (options.outputFileName.empty()) {
+		bench.write(std::cout);
+	} else {
+		std::ofstream file(options.outputFileName.c_str());
+		bench.write(file);
+		if (!file) {
+			LOGE("Unable to write results: %s", options.outputFileName.c_str());
+			status = EXIT_FAILURE;
+		}
+	}
+
+	if (options.gl) {
+		SDL_GL_DeleteContext(context);
+		SDL_DestroyWindow(window);
+		SDL_Quit();
+	}
+
+	return status;
+}
@@ -0,0 +1,477 @@
+#include "brick_pager.h"
+
+#include "gpu_resources.h"
+
+#include <vtkImageData.h>
+
+#include <algorithm>
+#include <climits>
+#include <iterator>
+#include <limits>
+
+namespace {
+	// Atlas size, in bricks (8x8x4 bricks of 66^3 8-bit samples: 74 MB)
+	const int atlasSlots[3] = { 8, 8, 4 };
+
+	// Bricks decoded at the same time, and uploaded per frame
+	const unsigned int maxPendingPerThread = 2;
+	const unsigned int maxUploadsPerFrame = 8;
+
+	const uint64_t emptyKey = ~uint64_t(0);
+
+	// Computes the projected size (in pixels) of a box (in box
+	// coordinates), and returns false if it is outside of the view
+	// frustum or clipped
+	bool projectBox(const Matrix4& boxToClip, const float* clipEq, const GLint* viewport,
+	                const Vector3& min, const Vector3& max, float& pixels)
+	{
+		Vector3 ndcMin(std::numeric_limits<float>::max()), ndcMax(std::numeric_limits<float>::lowest());
+		unsigned int outside[6] = { 0, 0, 0, 0, 0, 0 }; // (corners outside of each frustum plane)
+		unsigned int clipped = 0;
+		bool behind = false; // (corners behind the eye: the box is big on screen)
+
+		for (int i = 0; i < 8; ++i) {
+			const Vector3 p((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+
+			float c[4];
+			for (int r = 0; r < 4; ++r)
+				c[r] = boxToClip[0][r]*p.x + boxToClip[1][r]*p.y + boxToClip[2][r]*p.z + boxToClip[3][r];
+
+			for (int d = 0; d < 3; ++d) {
+				outside[d*2+0] += (c[d] < -c[3]);
+				outside[d*2+1] += (c[d] > c[3]);
+			}
+			clipped += (clipEq[0]*p.x + clipEq[1]*p.y + clipEq[2]*p.z + clipEq[3] > 0);
+
+			if (c[3] <= 1e-6f) {
+				behind = true;
+			} else {
+				const Vector3 ndc(c[0]/c[3], c[1]/c[3], c[2]/c[3]);
+				ndcMin = Vector3(std::min(ndcMin.x, ndc.x), std::min(ndcMin.y, ndc.y), std::min(ndcMin.z, ndc.z));
+				ndcMax = Vector3(std::max(ndcMax.x, ndc.x), std::max(ndcMax.y, ndc.y), std::max(ndcMax.z, ndc.z));
+			}
+		}
+
+		if (clipped == 8 || std::count(outside, outside+6, 8u) > 0)
+			return false;
+
+		pixels = (behind ? std::numeric_limits<float>::max()
+			: std::max((ndcMax.x - ndcMin.x) * viewport[2], (ndcMax.y - ndcMin.y) * viewport[3]) / 2);
+		return true;
+	}
+} // namespace
+
+BrickPager::BrickPager(vtkSmartPointer<vtkImageData> data, const double* range)
+ : mShared(std::make_shared<Shared>()),
+   mGeneration(0),
+   mPageTableDirty(true),
+   mFrame(0),
+   mAtlasHandle(0), mPageTableHandle(0),
+   mBound(false)
+{
+	android_assert(data);
+
+	std::shared_ptr<Source> source = std::make_shared<Source>();
+	source->data = data;
+	std::copy(range, range+2, source->range);
+	mSource = source;
+
+	data->GetDimensions(mDimensions);
+
+	int maxDim = 0;
+	for (int d = 0; d < 3; ++d) {
+		mPageDimensions[d] = (mDimensions[d] + brickSize-1) / brickSize;
+		android_assert(mPageDimensions[d] < (1 << 16)); // (see makeKey())
+		mSlotDimensions[d] = atlasSlots[d];
+		mAtlasDimensions[d] = atlasSlots[d] * paddedBrickSize;
+		maxDim = std::max(maxDim, mDimensions[d]);
+	}
+
+	// (the last level is a single brick)
+	mLevelCount = 1;
+	while ((brickSize << (mLevelCount-1)) < maxDim)
+		++mLevelCount;
+
+	const Slot freeSlot = { emptyKey, 0 };
+	mSlots.assign(mSlotDimensions[0]*mSlotDimensions[1]*mSlotDimensions[2], freeSlot);
+	mPageTable.resize(4*mPageDimensions[0]*mPageDimensions[1]*mPageDimensions[2]);
+
+	LOGD("brick pager: %d x %d x %d bricks, %d levels, %zu slots",
+	     mPageDimensions[0], mPageDimensions[1], mPageDimensions[2], mLevelCount, mSlots.size());
+}
+
+BrickPager::~BrickPager()
+{
+	// (the textures are deleted with the other textures of
+	// GpuResources, see ~GpuResources())
+	for (auto& entry : mPending)
+		entry.second.cancel();
+}
+
+BrickPager::Key BrickPager::makeKey(int level, int x, int y, int z)
+{
+	return (Key(level) << 48) | (Key(x) << 32) | (Key(y) << 16) | Key(z);
+}
+
+void BrickPager::splitKey(Key key, int& level, int& x, int& y, int& z)
+{
+	level = int(key >> 48);
+	x = int((key >> 32) & 0xffff);
+	y = int((key >> 16) & 0xffff);
+	z = int(key & 0xffff);
+}
+
+void BrickPager::replaceData(vtkSmartPointer<vtkImageData> data, const double* range)
+{
+	std::shared_ptr<Source> source = std::make_shared<Source>();
+	source->data = data;
+	std::copy(range, range+2, source->range);
+	mSource = source;
+
+	// (the bricks being decoded are dropped when they are done)
+	++mGeneration;
+	for (auto& entry : mPending)
+		entry.second.cancel();
+	mPending.clear();
+
+	const Slot freeSlot = { emptyKey, 0 };
+	std::fill(mSlots.begin(), mSlots.end(), freeSlot);
+	mResident.clear();
+	mPageTableDirty = true;
+}
+
+void BrickPager::invalidate()
+{
+	// (the old handles belong to the lost context, and so does the
+	// content of the atlas)
+	mAtlasHandle = mPageTableHandle = 0;
+	mBound = false;
+
+	const Slot freeSlot = { emptyKey, 0 };
+	std::fill(mSlots.begin(), mSlots.end(), freeSlot);
+	mResident.clear();
+	mPageTableDirty = true;
+}
+
+bool BrickPager::isIdle() const
+{
+	if (!mPending.empty())
+		return false;
+
+	tthread::lock_guard<tthread::mutex> g(mShared->lock);
+	return mShared->decoded.empty();
+}
+
+std::size_t BrickPager::getMemoryUsage() const
+{
+	std::size_t result = mPageTable.capacity() + mSlots.capacity()*sizeof(Slot);
+
+	tthread::lock_guard<tthread::mutex> g(mShared->lock);
+	for (const Decoded& brick : mShared->decoded)
+		result += brick.samples.capacity();
+	return result;
+}
+
+void BrickPager::decode(const Source& source, Key key, unsigned char* dst)
+{
+	int level, x, y, z;
+	splitKey(key, level, x, y, z);
+
+	// (starts one sample before the brick, for the border)
+	const int stride = 1 << level;
+	const int origin[3] = {
+		x*brickSize*stride - stride,
+		y*brickSize*stride - stride,
+		z*brickSize*stride - stride
+	};
+	GpuResources::extractBrick(source.data, source.range, origin, stride, paddedBrickSize, dst);
+}
+
+// (GL context)
+void BrickPager::bind()
+{
+	glGenTextures(1, &mAtlasHandle);
+	glBindTexture(GL_TEXTURE_3D, mAtlasHandle);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexImage3D(
+		GL_TEXTURE_3D,
+		0,
+		GL_R8,
+		mAtlasDimensions[0], mAtlasDimensions[1], mAtlasDimensions[2],
+		0,
+		GL_RED,
+		GL_UNSIGNED_BYTE,
+		nullptr // (filled brick by brick)
+	);
+
+	// (sampled at texel centers)
+	glGenTextures(1, &mPageTableHandle);
+	glBindTexture(GL_TEXTURE_3D, mPageTableHandle);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glTexImage3D(
+		GL_TEXTURE_3D,
+		0,
+		GL_RGBA,
+		mPageDimensions[0], mPageDimensions[1], mPageDimensions[2],
+		0,
+		GL_RGBA,
+		GL_UNSIGNED_BYTE,
+		nullptr // (see updatePageTable())
+	);
+
+	glBindTexture(GL_TEXTURE_3D, 0);
+	mBound = true;
+}
+
+// (GL context)
+void BrickPager::uploadBrick(int slot, Key key, const unsigned char* samples)
+{
+	const int sx = slot % mSlotDimensions[0];
+	const int sy = (slot / mSlotDimensions[0]) % mSlotDimensions[1];
+	const int sz = slot / (mSlotDimensions[0]*mSlotDimensions[1]);
+
+	// Required because input is not RGBA (i.e. not aligned to a 4-byte boundary)
+	glBindTexture(GL_TEXTURE_3D, mAtlasHandle);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(
+		GL_TEXTURE_3D,
+		0,
+		sx*paddedBrickSize, sy*paddedBrickSize, sz*paddedBrickSize,
+		paddedBrickSize, paddedBrickSize, paddedBrickSize,
+		GL_RED,
+		GL_UNSIGNED_BYTE,
+		samples
+	);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	if (mSlots[slot].key != emptyKey)
+		mResident.erase(mSlots[slot].key);
+
+	// (the first slot is never evicted)
+	mSlots[slot].key = key;
+	mSlots[slot].lastUsed = (slot == 0 ? UINT_MAX : mFrame);
+	mResident[key] = slot;
+	mPageTableDirty = true;
+}
+
+// (GL context)
+void BrickPager::updatePageTable()
+{
+	const int top = mLevelCount-1;
+
+	unsigned char* entry = mPageTable.data();
+	for (int z = 0; z < mPageDimensions[2]; ++z) {
+		for (int y = 0; y < mPageDimensions[1]; ++y) {
+			for (int x = 0; x < mPageDimensions[0]; ++x) {
+				// Finest resident level (the last one always is)
+				for (int level = 0; level <= top; ++level) {
+					const auto it = mResident.find(makeKey(level, x >> level, y >> level, z >> level));
+					if (it == mResident.end() && level < top)
+						continue;
+
+					const int slot = (it != mResident.end() ? it->second : 0);
+					entry[0] = slot % mSlotDimensions[0];
+					entry[1] = (slot / mSlotDimensions[0]) % mSlotDimensions[1];
+					entry[2] = slot / (mSlotDimensions[0]*mSlotDimensions[1]);
+					entry[3] = level;
+					break;
+				}
+				entry += 4;
+			}
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_3D, mPageTableHandle);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(
+		GL_TEXTURE_3D,
+		0,
+		0, 0, 0,
+		mPageDimensions[0], mPageDimensions[1], mPageDimensions[2],
+		GL_RGBA,
+		GL_UNSIGNED_BYTE,
+		mPageTable.data()
+	);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	mPageTableDirty = false;
+}
+
+void BrickPager::collectVisible(const Matrix4& boxToClip, const float* clipEq, std::vector<Key>& result)
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	// (the box z axis is flipped, see Volume3d)
+	const Vector3 dims(mDimensions[0], mDimensions[1], mDimensions[2]);
+	auto getBounds = [&](int level, int x, int y, int z, Vector3& min, Vector3& max) {
+		const int span = brickSize << level;
+		const Vector3 v0(x*span, y*span, z*span);
+		const Vector3 v1(std::min(v0.x + span, dims.x), std::min(v0.y + span, dims.y), std::min(v0.z + span, dims.z));
+		min = Vector3(v0.x / dims.x, v0.y / dims.y, 1 - v1.z / dims.z);
+		max = Vector3(v1.x / dims.x, v1.y / dims.y, 1 - v0.z / dims.z);
+	};
+
+	// Breadth-first: a brick is only refined if all its visible
+	// children fit in the atlas (the last level being always shown)
+	result.clear();
+	result.push_back(makeKey(mLevelCount-1, 0, 0, 0));
+
+	for (std::size_t i = 0; i < result.size(); ++i) {
+		int level, x, y, z;
+		splitKey(result[i], level, x, y, z);
+		if (level == 0)
+			continue;
+
+		// Refined while its samples are bigger than a pixel
+		Vector3 min, max;
+		float pixels;
+		getBounds(level, x, y, z, min, max);
+		if (!projectBox(boxToClip, clipEq, viewport, min, max, pixels) || pixels <= brickSize)
+			continue;
+
+		Key children[8];
+		unsigned int count = 0;
+		const int childSpan = brickSize << (level-1);
+		for (int cz = 2*z; cz <= 2*z+1; ++cz) {
+			for (int cy = 2*y; cy <= 2*y+1; ++cy) {
+				for (int cx = 2*x; cx <= 2*x+1; ++cx) {
+					if (cx*childSpan >= mDimensions[0] || cy*childSpan >= mDimensions[1] || cz*childSpan >= mDimensions[2])
+						continue;
+
+					float childPixels;
+					getBounds(level-1, cx, cy, cz, min, max);
+					if (projectBox(boxToClip, clipEq, viewport, min, max, childPixels))
+						children[count++] = makeKey(level-1, cx, cy, cz);
+				}
+			}
+		}
+
+		if (result.size() + count > mSlots.size())
+			break;
+		result.insert(result.end(), children, children+count);
+	}
+}
+
+int BrickPager::findSlot()
+{
+	int result = -1;
+	unsigned int oldest = mFrame;
+
+	for (std::size_t i = 1; i < mSlots.size(); ++i) {
+		if (mSlots[i].key == emptyKey)
+			return i;
+		if (mSlots[i].lastUsed < oldest) {
+			oldest = mSlots[i].lastUsed;
+			result = i;
+		}
+	}
+
+	return result;
+}
+
+// (GL context)
+void BrickPager::update(const Matrix4& boxToClip, const float* clipEq)
+{
+	++mFrame;
+
+	if (!mBound)
+		bind();
+
+	// The last level is loaded right away
+	const Key root = makeKey(mLevelCount-1, 0, 0, 0);
+	if (!mResident.count(root)) {
+		std::vector<unsigned char> samples(paddedBrickSize*paddedBrickSize*paddedBrickSize);
+		decode(*mSource, root, samples.data());
+		uploadBrick(0, root, samples.data());
+	}
+
+	collectVisible(boxToClip, clipEq, mVisible);
+
+	std::vector<Key> wanted(mVisible);
+	std::sort(wanted.begin(), wanted.end());
+
+	for (Key key : mVisible) {
+		const auto it = mResident.find(key);
+		if (it != mResident.end() && it->second != 0)
+			mSlots[it->second].lastUsed = mFrame;
+	}
+
+	// Cancels the bricks not needed anymore, and requests the
+	// missing ones, coarsest first
+	for (auto it = mPending.begin(); it != mPending.end(); ) {
+		if (std::binary_search(wanted.begin(), wanted.end(), it->first)) {
+			++it;
+		} else {
+			it->second.cancel();
+			mPending.erase(it++);
+		}
+	}
+
+	const std::size_t maxPending = maxPendingPerThread * TaskPool::threadCount();
+	for (Key key : mVisible) {
+		if (mPending.size() >= maxPending)
+			break;
+		if (mResident.count(key) || mPending.count(key))
+			continue;
+
+		const TaskPool::CancellationToken token;
+		mPending[key] = token;
+
+		const std::shared_ptr<const Source> source = mSource;
+		const std::shared_ptr<Shared> shared = mShared;
+		const unsigned int generation = mGeneration;
+
+		TaskPool::submit([source, shared, key, generation]() {
+			Decoded brick;
+			brick.key = key;
+			brick.generation = generation;
+			try {
+				brick.samples.resize(paddedBrickSize*paddedBrickSize*paddedBrickSize);
+				decode(*source, key, brick.samples.data());
+			} catch (const std::exception& e) {
+				LOGE("Error decoding brick: %s", e.what());
+				brick.samples.clear(); // (dropped, but no longer pending)
+			}
+
+			tthread::lock_guard<tthread::mutex> g(shared->lock);
+			shared->decoded.push_back(std::move(brick));
+		}, TaskPool::INTERACTIVE, token);
+	}
+
+	// Uploads the decoded bricks (the next ones wait for the next
+	// frames)
+	std::vector<Decoded> decoded;
+	{
+		tthread::lock_guard<tthread::mutex> g(mShared->lock);
+		const std::size_t count = std::min<std::size_t>(maxUploadsPerFrame, mShared->decoded.size());
+		std::move(mShared->decoded.begin(), mShared->decoded.begin() + count, std::back_inserter(decoded));
+		mShared->decoded.erase(mShared->decoded.begin(), mShared->decoded.begin() + count);
+	}
+
+	for (const Decoded& brick : decoded) {
+		if (brick.generation != mGeneration)
+			continue; // (stale data)
+
+		mPending.erase(brick.key);
+		if (brick.samples.empty() || mResident.count(brick.key))
+			continue;
+
+		// (dropped if the atlas is full of visible bricks, it will be
+		// requested again if still needed)
+		const int slot = findSlot();
+		if (slot >= 0)
+			uploadBrick(slot, brick.key, brick.samples.data());
+	}
+
+	if (mPageTableDirty)
+		updatePageTable();
+}
@@ -0,0 +1,141 @@
+#ifndef BRICK_PAGER_H
+#define BRICK_PAGER_H
+
+#include "global.h"
+
+#include "thirdparty/tinythread.h"
+#include "util/task_pool.h"
+
+#include <vtkSmartPointer.h>
+
+#include <cstdint>
+#include <map>
+
+class vtkImageData;
+
+// Out-of-core version of the scalar texture, for the datasets too big
+// to fit in GPU memory (see GpuResources::pagingThreshold).
+//
+// The volume is split into bricks of brickSize^3 samples at several
+// levels of detail: a level "l" brick covers brickSize*2^l voxels
+// along each axis, taking every 2^l-th voxel, and the last level is a
+// single brick covering the whole volume. Only the bricks visible
+// from the current view (and behind the clip plane) are kept in an
+// atlas texture, at the level matching their size on screen. The page
+// table texture holds, for each level 0 brick, the atlas slot and the
+// level of the finest resident brick covering it (see the PAGED code
+// of the Volume3d fragment shader).
+//
+// Bricks are read from the dataset (memory-mapped from its cache
+// file, see VolumeCache) on the task pool, and a few of them are
+// uploaded per frame. The last level is always resident, so that
+// every brick is covered by some level.
+class BrickPager
+{
+public:
+	static const int brickSize = 64;
+	static const int paddedBrickSize = brickSize + 2; // (one sample border, for interpolation)
+
+	// "range" is the scalar range of the whole dataset
+	BrickPager(vtkSmartPointer<vtkImageData> data, const double* range);
+	~BrickPager();
+
+	// Drops all the bricks, to page those of the new data (another
+	// timestep of the same grid)
+	// (GL context)
+	void replaceData(vtkSmartPointer<vtkImageData> data, const double* range);
+
+	// Forgets the textures (to be called when the GL context is
+	// recreated)
+	void invalidate();
+
+	// Requests the bricks needed by the view "boxToClip" (from the
+	// box coordinates of Volume3d) with the clip plane "clipEq" (box
+	// coordinates, the points where ax+by+cz+d > 0 being clipped),
+	// uploads the ones decoded since the last call, and updates the
+	// page table (once per frame)
+	// (GL context)
+	void update(const Matrix4& boxToClip, const float* clipEq);
+
+	// (0 before the first update())
+	GLuint getAtlasTexture() const { return mAtlasHandle; }
+	GLuint getPageTableTexture() const { return mPageTableHandle; }
+
+	const int* getAtlasDimensions() const { return mAtlasDimensions; } // (in samples)
+	const int* getPageTableDimensions() const { return mPageDimensions; }
+
+	// True if no brick is being decoded or waiting to be uploaded
+	bool isIdle() const;
+
+	// CPU-side memory held by the pager, in bytes (not including the
+	// dataset)
+	std::size_t getMemoryUsage() const;
+
+private:
+	BrickPager(const BrickPager&); // not implemented
+	void operator=(const BrickPager&); // not implemented
+
+	// (level, x, y, z) of a brick
+	typedef uint64_t Key;
+	static Key makeKey(int level, int x, int y, int z);
+	static void splitKey(Key key, int& level, int& x, int& y, int& z);
+
+	struct Source
+	{
+		vtkSmartPointer<vtkImageData> data;
+		double range[2];
+	};
+
+	struct Decoded
+	{
+		Key key;
+		unsigned int generation;
+		std::vector<unsigned char> samples; // paddedBrickSize^3 texels (see GpuResources::extractBrick())
+	};
+
+	// Bricks decoded by the tasks, shared with them (they may finish
+	// after the destruction of the pager)
+	struct Shared
+	{
+		tthread::mutex lock;
+		std::vector<Decoded> decoded;
+	};
+
+	struct Slot
+	{
+		Key key; // (emptyKey if free)
+		unsigned int lastUsed; // (frame)
+	};
+
+	// (any thread)
+	static void decode(const Source& source, Key key, unsigned char* dst);
+
+	// (GL context)
+	void bind();
+	void uploadBrick(int slot, Key key, const unsigned char* samples);
+	void updatePageTable();
+
+	// Bricks to be shown, coarsest first (at most one per slot)
+	void collectVisible(const Matrix4& boxToClip, const float* clipEq, std::vector<Key>& result);
+
+	// Free slot, or the least recently used one not used by this
+	// frame (-1 if none)
+	int findSlot();
+
+	std::shared_ptr<const Source> mSource;
+	std::shared_ptr<Shared> mShared;
+	unsigned int mGeneration; // (incremented by replaceData(), so that stale bricks are dropped)
+	int mDimensions[3], mPageDimensions[3], mSlotDimensions[3], mAtlasDimensions[3];
+	int mLevelCount;
+	std::vector<Slot> mSlots; // (the first slot holds the last level)
+	std::map<Key, int> mResident; // (slots)
+	std::map<Key, TaskPool::CancellationToken> mPending; // (being decoded)
+	std::vector<unsigned char> mPageTable; // (slot x, y, z and level per level 0 brick)
+	bool mPageTableDirty;
+	unsigned int mFrame;
+	GLuint mAtlasHandle, mPageTableHandle;
+	bool mBound;
+	std::vector<Key> mVisible; // (reused between frames)
+};
+
+#endif /* BRICK_PAGER_H */
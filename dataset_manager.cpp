@@ -0,0 +1,378 @@
+#include "dataset_manager.h"
+
+#include "volume.h"
+#include "volume3d.h"
+#include "isosurface.h"
+#include "slice.h"
+#include "minmax_tree.h"
+#include "particle_engine.h"
+#include "gpu_particles.h"
+#include "streamlines.h"
+#include "rendering/cube.h"
+#include "vtk_error_observer.h"
+#include "volume_cache.h"
+#include "gpu_resources.h"
+#include "derived_fields.h"
+#include "util/task_pool.h"
+
+#include <vtkNew.h>
+#include <vtkDataSetReader.h>
+#include <vtkXMLImageDataReader.h>
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+
+#include <algorithm>
+
+#include "definitions.h"
+
+namespace {
+	struct Files
+	{
+		int id;
+		const char* fileName;
+		const char* velocityFileName; // (optional)
+	};
+
+	const Files knownDataSets[DataSetManager::dataSetCount] = {
+		{ ftle,     "ftlelog.vtk",  nullptr },
+		{ head,     "head.vti",     nullptr },
+		{ ironProt, "ironProt.vtk", nullptr },
+		{ velocity, "FTLE7.vtk",    "Velocities7.vtk" },
+	};
+
+	const Files* findFiles(int id)
+	{
+		for (const Files& files : knownDataSets) {
+			if (files.id == id)
+				return &files;
+		}
+		return nullptr;
+	}
+
+	template <typename T>
+	vtkSmartPointer<vtkImageData> loadTypedDataSet(const std::string& fileName)
+	{
+		vtkNew<T> reader;
+
+		LOGI("Loading file: %s...", fileName.c_str());
+		reader->SetFileName(fileName.c_str());
+
+		vtkNew<VTKErrorObserver> errorObserver;
+		reader->AddObserver(vtkCommand::ErrorEvent, errorObserver.GetPointer());
+
+		reader->Update();
+
+		if (errorObserver->hasError()) {
+			// TODO? Throw a different type of error to let Java code
+			// display a helpful message to the user
+			throw std::runtime_error("Error loading data: " + errorObserver->getErrorMessage());
+		}
+
+		// (the arrays are shared with the reader output, which is
+		// released with the reader)
+		vtkSmartPointer<vtkImageData> data = vtkSmartPointer<vtkImageData>::New();
+		data->ShallowCopy(reader->GetOutputDataObject(0));
+
+		return data;
+	}
+} // namespace
+
+vtkSmartPointer<vtkImageData> DataSetManager::loadDataFile(const std::string& fileName)
+{
+	vtkSmartPointer<vtkImageData> data = VolumeCache::load(fileName);
+	if (data)
+		return data;
+
+	const std::string ext = fileName.substr(fileName.find_last_of(".") + 1);
+
+	if (ext == "vtk")
+		data = loadTypedDataSet<vtkDataSetReader>(fileName);
+	else if (ext == "vti")
+		data = loadTypedDataSet<vtkXMLImageDataReader>(fileName);
+	else
+		throw std::runtime_error("Error loading data: unknown extension: \"" + ext + "\"");
+
+	VolumeCache::save(fileName, data);
+	return data;
+}
+
+DataSetManager::DataSet::DataSet()
+ : zoomFactor(1.0f),
+   uploadStep(0)
+{
+	dimensions[0] = dimensions[1] = dimensions[2] = 0;
+}
+
+// (GL context)
+bool DataSetManager::DataSet::upload()
+{
+	// One object per call, largest uploads first
+	switch (uploadStep) {
+		case 0: if (resources) resources->bind(); break;
+		case 1: if (volume) volume->bind(); break;
+		case 2: if (slice) slice->bind(); break;
+		case 3: if (isosurface) isosurface->bind(); break;
+		case 4: if (gpuParticles) gpuParticles->bind(); break;
+		case 5: if (volume3d) volume3d->bind(); break;
+		case 6: if (outline) outline->bind(); break;
+		default: return true;
+	}
+	++uploadStep;
+	return false;
+}
+
+void DataSetManager::DataSet::invalidate()
+{
+	uploadStep = 0;
+	if (resources)
+		resources->invalidate();
+}
+
+DataSetManager::DataSetManager(const std::string& baseDir, unsigned int gpuParticleCount,
+                               float particleSpeed, int particleStallMs)
+ : mBaseDir(baseDir),
+   mGpuParticleCount(gpuParticleCount),
+   mParticleSpeed(particleSpeed),
+   mParticleStallMs(particleStallMs),
+   mStopped(false), mScheduled(false)
+{}
+
+DataSetManager::~DataSetManager()
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	mStopped = true;
+	// (waits for the dataset being prepared, if any)
+	while (mScheduled)
+		mCond.wait(mLock);
+}
+
+bool DataSetManager::request(int id)
+{
+	if (!findFiles(id)) {
+		LOGE("Unknown dataset: %d", id);
+		return false;
+	}
+
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	if (mPrepared.count(id))
+		return true;
+
+	for (auto it = mQueue.begin(); it != mQueue.end(); ++it) {
+		if (*it == id) {
+			mQueue.erase(it);
+			break;
+		}
+	}
+	mQueue.push_front(id);
+	if (std::find(mRequested.begin(), mRequested.end(), id) == mRequested.end())
+		mRequested.push_back(id);
+	schedule();
+	return true;
+}
+
+void DataSetManager::preloadAll()
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	for (const Files& files : knownDataSets) {
+		if (!mPrepared.count(files.id) && !isQueued(files.id))
+			mQueue.push_back(files.id);
+	}
+	schedule();
+}
+
+// (mLock must be held)
+void DataSetManager::schedule()
+{
+	if (mScheduled || mStopped || mQueue.empty())
+		return;
+
+	// (a request waited for by the user is never queued behind the
+	// background work)
+	const bool requested = (std::find(mRequested.begin(), mRequested.end(), mQueue.front()) != mRequested.end());
+	mScheduled = true;
+	TaskPool::submit([this]() { run(); },
+		requested ? TaskPool::INTERACTIVE : TaskPool::BACKGROUND);
+}
+
+bool DataSetManager::getPrepared(int id, DataSetPtr& dataSet)
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	auto it = mPrepared.find(id);
+	if (it == mPrepared.end())
+		return false;
+	dataSet = it->second;
+	return true;
+}
+
+void DataSetManager::invalidateAll()
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	for (auto& entry : mPrepared) {
+		if (entry.second)
+			entry.second->invalidate();
+	}
+}
+
+// (mLock must be held)
+bool DataSetManager::isQueued(int id) const
+{
+	for (int queued : mQueue) {
+		if (queued == id)
+			return true;
+	}
+	return false;
+}
+
+void DataSetManager::prepareScalars(DataSet& ds, bool withSurface)
+{
+	LOGD("creating outline...");
+	ds.outline.reset(new Cube(true));
+	ds.outline->setScale(Vector3(ds.dimensions[0]/2, ds.dimensions[1]/2, ds.dimensions[2]/2) * ds.spacing);
+
+	LOGD("creating shared GPU resources...");
+	ds.resources = std::make_shared<GpuResources>(ds.data);
+
+	LOGD("creating volume...");
+	ds.volume.reset(new Volume(ds.resources));
+
+	if (withSurface) {
+		// Built once per dataset, to let surface extractions skip the
+		// bricks that cannot intersect the surface. The downsampled
+		// levels used for previews are only built by the isosurface
+		// worker thread when first needed.
+		LOGD("building min/max tree...");
+		MinMaxTreeSharedPtr tree(new MinMaxTree(ds.data));
+
+		LOGD("creating isosurface...");
+		ds.isosurface.reset(new IsoSurface(ds.data, false, tree));
+	}
+
+	LOGD("creating slice...");
+	ds.slice.reset(new Slice(ds.resources));
+}
+
+DataSetManager::DataSetPtr DataSetManager::prepare(const std::string& fileName, const std::string& velocityFileName) const
+{
+	DataSetPtr result = std::make_shared<DataSet>();
+	DataSet& ds = *result;
+
+	ds.fileName = fileName;
+	ds.velocityFileName = velocityFileName;
+	ds.data = loadDataFile(fileName);
+	ds.data->GetDimensions(ds.dimensions);
+
+	double spacing[3];
+	ds.data->GetSpacing(spacing);
+	ds.spacing = Vector3(spacing[0], spacing[1], spacing[2]);
+
+	// Compute a default zoom value according to the data dimensions
+	// static const float nativeSize = 128.0f;
+	static const float nativeSize = 110.0f;
+	ds.zoomFactor = nativeSize / std::max(ds.spacing.x*ds.dimensions[0], std::max(ds.spacing.y*ds.dimensions[1], ds.spacing.z*ds.dimensions[2]));
+	// FIXME: hardcoded value: 0.25 (minimum zoom level, see the
+	// onTouch() handler in Java code)
+	ds.zoomFactor = std::max(ds.zoomFactor, 0.25f);
+
+	// HACK: no surface for FTLE7.vtk
+	prepareScalars(ds, fileName.find("FTLE7.vtk") == std::string::npos);
+
+	if (velocityFileName.empty())
+		return result;
+
+	ds.velocityData = loadDataFile(velocityFileName);
+
+	int velocityDataDim[3];
+	ds.velocityData->GetDimensions(velocityDataDim);
+
+	if (velocityDataDim[0] != ds.dimensions[0]
+	    || velocityDataDim[1] != ds.dimensions[1]
+	    || velocityDataDim[2] != ds.dimensions[2])
+	{
+		throw std::runtime_error(
+			"Dimensions do not match: "
+			"vel: " + Utility::toString(velocityDataDim[0]) + "x" + Utility::toString(velocityDataDim[1]) + "x" + Utility::toString(velocityDataDim[2])
+			+ ", data: " + Utility::toString(ds.dimensions[0]) + "x" + Utility::toString(ds.dimensions[1]) + "x" + Utility::toString(ds.dimensions[2])
+		);
+	}
+
+	int dim = ds.velocityData->GetDataDimension();
+	if (dim != 3)
+		throw std::runtime_error("Velocity data is not 3D (dimension = " + Utility::toString(dim) + ")");
+
+	if (!ds.velocityData->GetPointData() || !ds.velocityData->GetPointData()->GetVectors())
+		throw std::runtime_error("Invalid velocity data: no vectors found");
+
+	VelocityFieldSharedPtr field = std::make_shared<VelocityField>(ds.velocityData);
+	ds.velocityField = field;
+	ds.derivedFields = std::make_shared<DerivedFields>(field, ds.velocityData);
+	ds.gpuParticles.reset(new GpuParticles(field, mGpuParticleCount, mParticleSpeed, mParticleStallMs));
+	ds.streamlines.reset(new Streamlines(field, mParticleSpeed));
+
+	return result;
+}
+
+DataSetManager::DataSetPtr DataSetManager::prepareDerived(const DataSet& source, int field)
+{
+	android_assert(source.derivedFields);
+	android_assert(field >= 0 && field < DerivedFields::fieldCount);
+
+	DataSetPtr result = std::make_shared<DataSet>();
+	DataSet& ds = *result;
+
+	ds.fileName = source.fileName;
+	ds.velocityFileName = source.velocityFileName;
+	ds.data = source.derivedFields->get(DerivedFields::Field(field));
+	std::copy(source.dimensions, source.dimensions+3, ds.dimensions);
+	ds.spacing = source.spacing;
+	ds.zoomFactor = source.zoomFactor;
+
+	prepareScalars(ds, true);
+
+	return result;
+}
+
+void DataSetManager::run()
+{
+	int id;
+
+	{
+		tthread::lock_guard<tthread::mutex> g(mLock);
+		while (!mStopped && !mQueue.empty() && mPrepared.count(mQueue.front()))
+			mQueue.pop_front();
+
+		if (mStopped || mQueue.empty()) {
+			mScheduled = false;
+			mCond.notify_all();
+			return;
+		}
+
+		id = mQueue.front();
+		mQueue.pop_front();
+	}
+
+	// "mLock" is released here, so that requests can be queued
+	// while a dataset is being prepared
+	const Files* files = findFiles(id);
+	android_assert(files);
+
+	DataSetPtr dataSet;
+	try {
+		LOGD("preparing dataset %d...", id);
+		dataSet = prepare(mBaseDir + "/" + files->fileName,
+		                  files->velocityFileName ? mBaseDir + "/" + files->velocityFileName : "");
+		LOGD("dataset %d ready", id);
+
+	} catch (const std::exception& e) {
+		LOGE("Error preparing dataset %d: %s", id, e.what());
+	}
+
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	mPrepared[id] = dataSet;
+	mRequested.erase(std::remove(mRequested.begin(), mRequested.end(), id), mRequested.end());
+
+	// (one dataset per task, so that the next one gets the priority
+	// of its own request)
+	mScheduled = false;
+	schedule();
+	mCond.notify_all();
+}
@@ -0,0 +1,137 @@
+#ifndef DATASET_MANAGER_H
+#define DATASET_MANAGER_H
+
+#include "global.h"
+
+#include <vtkSmartPointer.h>
+
+#include "thirdparty/tinythread.h"
+
+#include <deque>
+#include <map>
+
+class vtkImageData;
+class VelocityField;
+
+// Reads and prepares the datasets listed in definitions.h on the task
+// pool (one at a time), so that switching datasets never stalls the
+// render thread. Prepared datasets are kept in memory: switching
+// back to a dataset seen before is immediate.
+class DataSetManager
+{
+public:
+	// Everything built from a dataset file (and its optional
+	// velocity file). Only the render thread touches a dataset once
+	// it has been returned by getPrepared().
+	struct DataSet
+	{
+		DataSet();
+
+		// Performs the next pending GL upload and returns true when
+		// there is nothing left to upload (one call per frame
+		// spreads the uploads over several frames)
+		// (GL context)
+		bool upload();
+
+		// The next install will upload everything again (the shared
+		// resources are forgotten right away)
+		void invalidate();
+
+		std::string fileName, velocityFileName;
+		vtkSmartPointer<vtkImageData> data, velocityData;
+		int dimensions[3];
+		Vector3 spacing;
+		float zoomFactor; // default zoom value for these dimensions
+		std::shared_ptr<const VelocityField> velocityField; // (null without velocity data)
+		DerivedFieldsSharedPtr derivedFields; // (null without velocity data)
+		GpuResourcesSharedPtr resources; // (shared by volume, volume3d and slice)
+
+		// Renderables, swapped in and out of FluidMechanics when the
+		// dataset is installed/uninstalled
+		CubePtr outline;
+		VolumePtr volume;
+		Volume3dPtr volume3d; // (created on first use)
+		IsoSurfacePtr isosurface; // (null for datasets without surface)
+		SlicePtr slice;
+		GpuParticlesPtr gpuParticles; // (null without velocity data)
+		StreamlinesPtr streamlines;   // (null without velocity data)
+
+		unsigned int uploadStep;
+	};
+
+	typedef std::shared_ptr<DataSet> DataSetPtr;
+
+	// Dataset files are looked up in "baseDir". Velocity data is
+	// prepared with "gpuParticleCount" GPU particles moving at
+	// "particleSpeed" (see GpuParticles).
+	DataSetManager(const std::string& baseDir, unsigned int gpuParticleCount,
+	               float particleSpeed, int particleStallMs);
+	~DataSetManager();
+
+	// Number of known datasets (ids are the definitions.h values)
+	static const int dataSetCount = 4;
+
+	// Queues the given dataset in front of all the other pending
+	// ones, at interactive priority. Returns false if the id is
+	// unknown.
+	bool request(int id);
+
+	// Queues all the datasets that are not prepared yet, after the
+	// pending requests (background priority)
+	void preloadAll();
+
+	// Returns true when the loader is done with the given dataset,
+	// "dataSet" being null if it couldn't be prepared
+	bool getPrepared(int id, DataSetPtr& dataSet);
+
+	// Marks all the prepared datasets as not uploaded (to be called
+	// when the GL context is recreated)
+	void invalidateAll();
+
+	// Reads a dataset and builds everything needed to render it
+	// (any thread, throws on error)
+	DataSetPtr prepare(const std::string& fileName, const std::string& velocityFileName) const;
+
+	// Builds the objects rendering one of the derived fields of
+	// "source" instead of its scalars (computing the field if needed).
+	// The result only holds the scalar objects (resources, outline,
+	// volume, isosurface and slice).
+	// (any thread, throws on error)
+	static DataSetPtr prepareDerived(const DataSet& source, int field);
+
+	// Maps the binary cache of the file if it is up to date, or
+	// reads the file and writes its cache (any thread, throws on
+	// error)
+	static vtkSmartPointer<vtkImageData> loadDataFile(const std::string& fileName);
+
+private:
+	// Builds the scalar objects of "ds" from ds.data
+	static void prepareScalars(DataSet& ds, bool withSurface);
+
+	// Prepares the next queued dataset (pool thread)
+	void run();
+
+	// Submits run() if the queue is not empty and no task is
+	// scheduled yet
+	// (mLock must be held)
+	void schedule();
+
+	// (mLock must be held)
+	bool isQueued(int id) const;
+
+	const std::string mBaseDir;
+	const unsigned int mGpuParticleCount;
+	const float mParticleSpeed;
+	const int mParticleStallMs;
+
+	// (protected by mLock, failed datasets are stored as null)
+	std::deque<int> mQueue;
+	std::map<int, DataSetPtr> mPrepared;
+	std::vector<int> mRequested; // (queued by request(), see schedule())
+	bool mStopped, mScheduled;
+
+	tthread::mutex mLock;
+	tthread::condition_variable mCond; // (mScheduled changes)
+};
+
+#endif /* DATASET_MANAGER_H */
@@ -0,0 +1,181 @@
+#include "derived_fields.h"
+
+#include "util/parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+#include <vtkFloatArray.h>
+
+namespace {
+	// Value of "field" at a voxel of velocity "v" and velocity
+	// gradient "g" (g[3*i+j]: derivative of v[i] along axis j)
+	template <DerivedFields::Field field>
+	inline float derive(const float* v, const float* g)
+	{
+		switch (field) {
+			case DerivedFields::VELOCITY_MAGNITUDE:
+				return std::sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+
+			case DerivedFields::VORTICITY: {
+				const float wx = g[7] - g[5], wy = g[2] - g[6], wz = g[3] - g[1];
+				return std::sqrt(wx*wx + wy*wy + wz*wz);
+			}
+
+			case DerivedFields::Q_CRITERION:
+				// (|rotation|^2 - |strain|^2)/2 = -tr(g^2)/2
+				return -0.5f * (g[0]*g[0] + g[4]*g[4] + g[8]*g[8])
+					- (g[1]*g[3] + g[2]*g[6] + g[5]*g[7]);
+
+			default:
+				return 0;
+		}
+	}
+
+	// Computes one row of "field". "row" is the velocity row, "ym",
+	// "yp", "zm" and "zp" its neighbor rows (or the row itself on the
+	// borders), and "fx", "fy" and "fz" the central difference factors
+	// (1/(2*spacing), or 1/spacing for one-sided differences).
+	template <DerivedFields::Field field>
+	inline float deriveVoxel(const float* row, const float* ym, const float* yp, const float* zm, const float* zp,
+	                         int x, int xm, int xp, float fx, float fy, float fz)
+	{
+		float g[9];
+		if (field != DerivedFields::VELOCITY_MAGNITUDE) {
+			for (int i = 0; i < 3; ++i) {
+				g[3*i+0] = (row[3*xp+i] - row[3*xm+i]) * fx;
+				g[3*i+1] = (yp[3*x+i] - ym[3*x+i]) * fy;
+				g[3*i+2] = (zp[3*x+i] - zm[3*x+i]) * fz;
+			}
+		}
+		return derive<field>(row + 3*x, g);
+	}
+
+	template <DerivedFields::Field field>
+	void deriveRow(const float* row, const float* ym, const float* yp, const float* zm, const float* zp,
+	               int dx, float fx, float fy, float fz, float* dst)
+	{
+		// (one-sided on the x borders, a row has at least 2 voxels)
+		dst[0] = deriveVoxel<field>(row, ym, yp, zm, zp, 0, 0, 1, 2*fx, fy, fz);
+
+		// (branchless, so that the compiler can vectorize it)
+		for (int x = 1; x < dx-1; ++x)
+			dst[x] = deriveVoxel<field>(row, ym, yp, zm, zp, x, x-1, x+1, fx, fy, fz);
+
+		dst[dx-1] = deriveVoxel<field>(row, ym, yp, zm, zp, dx-1, dx-2, dx-1, 2*fx, fy, fz);
+	}
+
+	template <DerivedFields::Field field>
+	void deriveSlice(const VelocityField& velocity, const double* spacing, int z, float* dst)
+	{
+		const int* dims = velocity.getDimensions();
+		const std::size_t rowSize = 3*std::size_t(dims[0]), sliceSize = rowSize*dims[1];
+		const float* slice = velocity.getData() + z*sliceSize;
+
+		const int zm = std::max(z-1, 0), zp = std::min(z+1, dims[2]-1);
+		const float fx = 0.5 / spacing[0];
+		const float fz = 1.0 / ((zp - zm) * spacing[2]);
+
+		for (int y = 0; y < dims[1]; ++y) {
+			const int ym = std::max(y-1, 0), yp = std::min(y+1, dims[1]-1);
+			const float fy = 1.0 / ((yp - ym) * spacing[1]);
+			const float* row = slice + y*rowSize;
+
+			deriveRow<field>(row,
+				slice + ym*rowSize, slice + yp*rowSize,
+				row + (zm - z)*std::ptrdiff_t(sliceSize), row + (zp - z)*std::ptrdiff_t(sliceSize),
+				dims[0], fx, fy, fz, dst + y*std::size_t(dims[0]));
+		}
+	}
+} // namespace
+
+DerivedFields::DerivedFields(VelocityFieldSharedPtr field, vtkImageData* grid)
+ : mField(field)
+{
+	android_assert(field && grid);
+
+	grid->GetSpacing(mSpacing);
+	grid->GetOrigin(mOrigin);
+
+	for (int i = 0; i < 3; ++i) {
+		if (!(mSpacing[i] > 0))
+			throw std::runtime_error("DerivedFields: invalid spacing");
+	}
+}
+
+const char* DerivedFields::getName(Field field)
+{
+	switch (field) {
+		case VELOCITY_MAGNITUDE: return "velocity magnitude";
+		case VORTICITY: return "vorticity";
+		case Q_CRITERION: return "Q-criterion";
+		default: android_assert(false); return "";
+	}
+}
+
+vtkSmartPointer<vtkImageData> DerivedFields::get(Field field)
+{
+	android_assert(field >= 0 && field < fieldCount);
+
+	tthread::lock_guard<tthread::mutex> g(mComputeLock);
+
+	{
+		tthread::lock_guard<tthread::mutex> g2(mLock);
+		if (mFields[field])
+			return mFields[field];
+	}
+
+	vtkSmartPointer<vtkImageData> result = compute(field);
+
+	tthread::lock_guard<tthread::mutex> g2(mLock);
+	mFields[field] = result;
+	return result;
+}
+
+vtkSmartPointer<vtkImageData> DerivedFields::compute(Field field) const
+{
+	const int* dims = mField->getDimensions();
+	const std::size_t sliceSize = std::size_t(dims[0]) * dims[1];
+
+	LOGD("computing %s...", getName(field));
+	const long long startNs = Utility::currentTimeNs();
+
+	vtkSmartPointer<vtkFloatArray> array = vtkSmartPointer<vtkFloatArray>::New();
+	array->SetName(getName(field));
+	array->SetNumberOfComponents(1);
+	array->SetNumberOfTuples(sliceSize * dims[2]);
+	float* dst = array->GetPointer(0);
+
+	// One slice per task (reading 3 slices of the velocity field)
+	Parallel::forEach(0, dims[2], [&](int z) {
+		float* sliceDst = dst + z*sliceSize;
+		switch (field) {
+			case VELOCITY_MAGNITUDE: deriveSlice<VELOCITY_MAGNITUDE>(*mField, mSpacing, z, sliceDst); break;
+			case VORTICITY: deriveSlice<VORTICITY>(*mField, mSpacing, z, sliceDst); break;
+			case Q_CRITERION: deriveSlice<Q_CRITERION>(*mField, mSpacing, z, sliceDst); break;
+			default: android_assert(false);
+		}
+	});
+
+	vtkSmartPointer<vtkImageData> data = vtkSmartPointer<vtkImageData>::New();
+	data->SetDimensions(dims[0], dims[1], dims[2]);
+	data->SetSpacing(mSpacing[0], mSpacing[1], mSpacing[2]);
+	data->SetOrigin(mOrigin[0], mOrigin[1], mOrigin[2]);
+	data->GetPointData()->SetScalars(array);
+
+	LOGD("%s computed in %.1f ms", getName(field), (Utility::currentTimeNs() - startNs) / 1e6);
+	return data;
+}
+
+std::size_t DerivedFields::getMemoryUsage() const
+{
+	std::size_t result = 0;
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	for (const vtkSmartPointer<vtkImageData>& data : mFields) {
+		if (data)
+			result += data->GetActualMemorySize() * std::size_t(1024); // (KiB)
+	}
+	return result;
+}
@@ -0,0 +1,58 @@
+#ifndef DERIVED_FIELDS_H
+#define DERIVED_FIELDS_H
+
+#include "global.h"
+
+#include "particle_engine.h"
+
+#include "thirdparty/tinythread.h"
+
+#include <vtkSmartPointer.h>
+
+class vtkImageData;
+
+// Scalar fields computed from a velocity field, on the grid of the
+// dataset: they can be shown by Volume, Slice and IsoSurface like the
+// scalars of a dataset file (see FluidMechanics::setScalarField()).
+// The velocity gradient is estimated with central differences
+// (one-sided on the borders), in world units. Each field is computed
+// on first use, one z slice per task, then kept.
+class DerivedFields
+{
+public:
+	enum Field {
+		VELOCITY_MAGNITUDE,
+		VORTICITY, // (magnitude of the curl)
+		Q_CRITERION, // (positive where rotation dominates strain)
+		fieldCount
+	};
+
+	// "grid" gives the spacing and origin of the results (the velocity
+	// data, or the scalar data of the same dimensions)
+	DerivedFields(VelocityFieldSharedPtr field, vtkImageData* grid);
+
+	// Computes the field on the first call, and returns the same data
+	// afterwards (any thread, the callers asking for a field being
+	// computed wait for it)
+	vtkSmartPointer<vtkImageData> get(Field field);
+
+	static const char* getName(Field field);
+
+	// Memory held by the computed fields, in bytes
+	std::size_t getMemoryUsage() const;
+
+private:
+	DerivedFields(const DerivedFields&); // not implemented
+	void operator=(const DerivedFields&); // not implemented
+
+	vtkSmartPointer<vtkImageData> compute(Field field) const;
+
+	const VelocityFieldSharedPtr mField;
+	double mSpacing[3], mOrigin[3];
+
+	tthread::mutex mComputeLock; // (held by get())
+	mutable tthread::mutex mLock;
+	vtkSmartPointer<vtkImageData> mFields[fieldCount]; // (protected by mLock, null until computed)
+};
+
+#endif /* DERIVED_FIELDS_H */
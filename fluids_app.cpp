@@ -1,51 +1,94 @@
 #include "fluids_app.h"
 
 #include "vtk_output_window.h"
-#include "vtk_error_observer.h"
 #include "volume.h"
 #include "volume3d.h"
 #include "isosurface.h"
+#include "particle_engine.h"
+#include "gpu_particles.h"
+#include "streamlines.h"
+#include "dataset_manager.h"
+#include "minmax_tree.h"
 #include "slice.h"
+#include "gpu_resources.h"
+#include "time_series.h"
+#include "derived_fields.h"
+#include "probe.h"
 #include "rendering/cube.h"
 #include "loaders/loader_obj.h"
 #include "rendering/mesh.h"
 #include "rendering/lines.h"
+#include "rendering/particles.h"
+#include "rendering/reduced_resolution_pass.h"
+#include "rendering/material.h"
+#include "util/frame_arena.h"
+#include "util/profiler.h"
 
 #include <array>
 #include <map>
+#include <set>
 #include <time.h>
 
 #include <vtkSmartPointer.h>
 #include <vtkNew.h>
-#include <vtkDataSetReader.h>
-#include <vtkXMLImageDataReader.h>
 #include <vtkImageData.h>
-#include <vtkImageResize.h>
 #include <vtkPointData.h>
 #include <vtkDataArray.h>
-#include <vtkProbeFilter.h>
-#include <vtkPoints.h>
-#include <vtkPolyData.h>
 
 #define NEW_STYLUS_RENDER
 
-struct Particle
-{
-	Vector3 pos;
-	bool valid;
-	int delayMs, stallMs;
-	timespec lastTime;
-};
-
 struct FluidMechanics::Impl
 {
 	Impl(const std::string& baseDir);
 
-	bool loadDataSet(const std::string& fileName);
-	bool loadVelocityDataSet(const std::string& fileName);
+	bool loadDataSet(const std::string& fileName, const std::string& velocityFileName);
+	void requestDataSet(int id);
 
-	template <typename T>
-	vtkSmartPointer<vtkImageData> loadTypedDataSet(const std::string& fileName);
+	// Loads the first step of "pattern" right away, the next ones
+	// being decoded in the background (see TimeSeries)
+	// (GL context)
+	bool loadTimeSeries(const std::string& pattern, const std::string& velocityPattern);
+	void setTimeStep(unsigned int step);
+
+	// Shows the requested step once it is decoded, and requests the
+	// next one when playing
+	// (GL context)
+	void updateTimeSeries();
+	void applyTimeStep(const TimeSeries::Step& step);
+
+	// Installs the requested dataset once it is prepared and all
+	// its GL uploads are done (one upload per call)
+	// (GL context)
+	void updateDataSet();
+
+	// Swaps the renderables of "dataSet" with the current ones
+	void exchangeObjects(DataSetManager::DataSet& dataSet);
+	void exchangeScalarObjects(DataSetManager::DataSet& dataSet); // (only the ones rendering the scalars)
+	void installDataSet(DataSetManager::DataSetPtr dataSet);
+
+	// Prepares the given derived field of the current dataset in the
+	// background, if not done yet (see DataSetManager::prepareDerived())
+	bool setScalarField(ScalarField field);
+
+	// Shows the requested scalar field once it is prepared and all
+	// its GL uploads are done (one upload per call)
+	// (GL context)
+	void updateScalarField();
+
+	// Renders the scalars of "dataSet" (currentDataSet, or one of its
+	// derived fields)
+	void showScalars(DataSetManager::DataSetPtr dataSet);
+
+	// Goes back to the scalars of the dataset file and drops the
+	// derived field datasets
+	void resetScalarField();
+
+	// Logs the CPU-side memory held by the current dataset
+	void reportMemoryUsage();
+
+	// True if particles are moving, or if a dataset, surface, slice,
+	// streamline computation or brick paging is pending
+	bool isBusy();
 
 	// (GL context)
 	void rebind();
@@ -60,8 +103,6 @@ struct FluidMechanics::Impl
 	float buttonReleased();
 
 	void releaseParticles();
-	Vector3 particleJitter();
-	void integrateParticleMotion(Particle& p);
 
 	bool computeCameraClipPlane(Vector3& point, Vector3& normal);
 	bool computeAxisClipPlane(Vector3& point, Vector3& normal);
@@ -69,8 +110,18 @@ struct FluidMechanics::Impl
 
 	Vector3 posToDataCoords(const Vector3& pos); // "pos" is in eye coordinates
 	Vector3 dataCoordsToPos(const Vector3& dataCoordsToPos);
+	void dataCoordsToPos(const Vector3* dataCoords, std::size_t count, Vector3* result); // ("result" may be "dataCoords")
+	Matrix4 sliceToDataMatrix(const Matrix4& sliceModelMatrix); // same transform as posToDataCoords()
+
+	// Inverses of the model and stylus matrices, and their transposes
+	// (normal matrices)
+	const Matrix4& getModelInverse();
+	const Matrix3& getModelNormalMatrix();
+	const Matrix4& getStylusInverse();
+	const Matrix3& getStylusNormalMatrix();
 
 	void updateSurfacePreview();
+	void updateSurfaceCacheStats();
 	void setSeedPoint(float x, float y, float z);
 	void resetParticles();
 
@@ -80,18 +131,39 @@ struct FluidMechanics::Impl
 
 	CubePtr cube, axisCube;
 
-	vtkSmartPointer<vtkImageData> data, dataLow;
+	vtkSmartPointer<vtkImageData> data;
 	int dataDim[3];
 	Vector3 dataSpacing;
 
 	vtkSmartPointer<vtkImageData> velocityData;
 
+	std::unique_ptr<DataSetManager> dataSetManager;
+	DataSetManager::DataSetPtr currentDataSet;
+	int currentDataSetId, requestedDataSetId; // (-1: none)
+
+	// Derived fields of currentDataSet, prepared on the task pool
+	// (shared with the tasks, which may finish after a dataset switch)
+	struct DerivedDataSets
+	{
+		tthread::mutex lock;
+		std::map<int, DataSetManager::DataSetPtr> prepared; // (null if it couldn't be prepared)
+		std::set<int> pending;
+	};
+	std::shared_ptr<DerivedDataSets> derivedDataSets;
+	DataSetManager::DataSetPtr scalarDataSet; // (the one whose scalar objects are rendered)
+	ScalarField scalarField, requestedScalarField;
+
+	TimeSeriesPtr timeSeries; // (null unless loaded with loadTimeSeries())
+	unsigned int timeStep, requestedTimeStep;
+	bool timeSeriesPlaying;
+
 	typedef LinearMath::Vector3<int> DataCoords;
-	// std::array<Particle, 10> particles;
-	// std::array<Particle, 50> particles;
-	// std::array<Particle, 100> particles;
-	Synchronized<std::array<Particle, 200>> particles;
-	timespec particleStartTime;
+	// static constexpr unsigned int particleCount = 200;
+	static constexpr unsigned int particleCount = 1000;
+	ParticleEnginePtr particleEngine;
+	static constexpr unsigned int gpuParticleCount = 200000;
+	Synchronized<GpuParticlesPtr> gpuParticles; // (prepared with the velocity data)
+	Synchronized<StreamlinesPtr> streamlines; // (prepared with the velocity data)
 	static constexpr float particleSpeed = 0.15f;
 	// static constexpr int particleReleaseDuration = 500; // ms
 	static constexpr int particleReleaseDuration = 700; // ms
@@ -102,8 +174,8 @@ struct FluidMechanics::Impl
 	// static constexpr float stylusEffectorDist = 30.0f;
 
 	Synchronized<VolumePtr> volume;
-	// Synchronized<Volume3dPtr> volume; // true volumetric rendering
-	Synchronized<IsoSurfacePtr> isosurface, isosurfaceLow;
+	Synchronized<Volume3dPtr> volume3d; // true volumetric rendering (created on first use)
+	Synchronized<IsoSurfacePtr> isosurface;
 	Synchronized<SlicePtr> slice;
 	Synchronized<CubePtr> outline;
 	Vector3 slicePoint, sliceNormal;
@@ -112,217 +184,484 @@ struct FluidMechanics::Impl
 
 	MeshPtr particleSphere, cylinder;
 	LinesPtr lines;
+	ParticlesPtr particleRenderer;
+	LinesPtr streamlineRenderer;
+	ReducedResolutionPassPtr volumePass;
+	std::vector<Vector3> streamlineSegments; // (reused between frames)
+	std::vector<Vector3> particlePositions; // (reused between frames)
+	FrameArena frameArena; // (rendering thread, reset after each frame)
 
 	Vector3 seedPoint;
 
-	vtkSmartPointer<vtkProbeFilter> probeFilter;
+	// Reads the scalars shown ("data") and the velocity field of the
+	// current dataset, replaced with them (see FluidMechanics::probeScalar())
+	Synchronized<ProbeSharedPtr> probe;
+	void updateProbe();
+	ProbeSharedPtr getProbe() const;
+
+	// Copies of state->modelMatrix and state->stylusModelMatrix, and
+	// their inverses computed on first use after each setMatrices()
+	// (render thread only, read without locking)
+	struct Transforms
+	{
+		Matrix4 model, stylus;
+		Matrix4 modelInverse, stylusInverse;
+		Matrix3 modelNormal, stylusNormal;
+		bool hasModelInverse, hasStylusInverse;
+	};
+	Transforms transforms;
 
 	Synchronized<Vector3> effectorIntersection;
 	// Vector3 effectorIntersectionNormal;
 	bool effectorIntersectionValid;
 
 	bool buttonIsPressed;
+
+	// (see FluidMechanics::needsRedraw())
+	bool changed; // since the last render()
+	bool busy; // at the start of the last render()
 };
 
 FluidMechanics::Impl::Impl(const std::string& baseDir)
- : buttonIsPressed(false)
+ : currentDataSetId(-1), requestedDataSetId(-1),
+   derivedDataSets(std::make_shared<DerivedDataSets>()),
+   scalarField(SCALAR_DATA_FILE), requestedScalarField(SCALAR_DATA_FILE),
+   timeStep(0), requestedTimeStep(0), timeSeriesPlaying(false),
+   buttonIsPressed(false),
+   changed(true), busy(false)
 {
+	dataDim[0] = dataDim[1] = dataDim[2] = 0;
+
+	transforms.model = transforms.stylus = Matrix4::identity();
+	transforms.hasModelInverse = transforms.hasStylusInverse = false;
+
+	VTKOutputWindow::install();
+
+	// (shares data/*.cache with the dataset caches)
+	Material::setBinaryCacheDir(baseDir);
+
 	cube.reset(new Cube);
 	axisCube.reset(new Cube(true));
 	particleSphere = LoaderOBJ::load(baseDir + "/sphere.obj");
 	cylinder = LoaderOBJ::load(baseDir + "/cylinder.obj");
 	lines.reset(new Lines);
+	particleRenderer.reset(new Particles);
+	particleRenderer->setRadius(1.125f); // same size as the former sphere meshes
+	particleRenderer->setViewportHeight(SCREEN_HEIGHT);
+	streamlineRenderer.reset(new Lines);
+	streamlineRenderer->setColor(Vector3(1, 1, 0));
+	volumePass.reset(new ReducedResolutionPass);
 	seedPoint = Vector3(-10000.0,-10000.0,-10000.0);
 
-	for (Particle& p : particles)
-		p.valid = false;
+	particleEngine.reset(new ParticleEngine(particleCount, particleSpeed, particleStallDuration));
+	dataSetManager.reset(new DataSetManager(baseDir, gpuParticleCount, particleSpeed, particleStallDuration));
 }
 
 void FluidMechanics::Impl::rebind()
 {
+	// Everything compiled or uploaded in the previous context is
+	// gone (the other prepared datasets are uploaded again when
+	// installed)
+	changed = true;
+
+	Material::invalidateAll();
+	dataSetManager->invalidateAll();
+	if (currentDataSet)
+		currentDataSet->invalidate();
+	if (scalarDataSet && scalarDataSet != currentDataSet)
+		scalarDataSet->invalidate();
+	{
+		tthread::lock_guard<tthread::mutex> g(derivedDataSets->lock);
+		for (auto& entry : derivedDataSets->prepared) {
+			if (entry.second)
+				entry.second->invalidate();
+		}
+	}
+
 	cube->bind();
 	axisCube->bind();
 	lines->bind();
+	particleRenderer->bind();
+	streamlineRenderer->bind();
+	volumePass->bind();
 	particleSphere->bind();
 	cylinder->bind();
 
 	synchronized_if(volume) { volume->bind(); }
+	synchronized_if(volume3d) { volume3d->bind(); }
+	synchronized_if(gpuParticles) { gpuParticles->bind(); }
 	synchronized_if(isosurface) { isosurface->bind(); }
-	synchronized_if(isosurfaceLow) { isosurfaceLow->bind(); }
 	synchronized_if(slice) { slice->bind(); }
 	synchronized_if(outline) { outline->bind(); }
 }
 
-template <typename T>
-vtkSmartPointer<vtkImageData> FluidMechanics::Impl::loadTypedDataSet(const std::string& fileName)
+void FluidMechanics::Impl::setSeedPoint(float x, float y, float z){
+	changed = changed || (Vector3(x, y, z) != seedPoint);
+	seedPoint.x = x;
+	seedPoint.y = y;
+	seedPoint.z = z;
+}
+
+bool FluidMechanics::Impl::loadDataSet(const std::string& fileName, const std::string& velocityFileName)
 {
-	vtkNew<T> reader;
+	installDataSet(dataSetManager->prepare(fileName, velocityFileName));
+	currentDataSetId = requestedDataSetId = -1;
+	timeSeries.reset();
+	return true;
+}
 
-	LOGI("Loading file: %s...", fileName.c_str());
-	reader->SetFileName(fileName.c_str());
+bool FluidMechanics::Impl::loadTimeSeries(const std::string& pattern, const std::string& velocityPattern)
+{
+	TimeSeriesPtr series(new TimeSeries(pattern, velocityPattern));
+
+	// (the first step is loaded like a single dataset, the next ones
+	// only replace its data)
+	loadDataSet(series->getFileName(0), series->getVelocityFileName(0));
+	timeSeries = std::move(series);
+	timeStep = requestedTimeStep = 0;
+
+	// (prefetches the next steps, the first one is decoded already)
+	if (timeSeries->getStepCount() > 1)
+		timeSeries->seek(1);
+
+	return true;
+}
+
+void FluidMechanics::Impl::setTimeStep(unsigned int step)
+{
+	if (!timeSeries)
+		return;
+
+	android_assert(step < timeSeries->getStepCount());
+	requestedTimeStep = step;
+	timeSeries->seek(step);
+	changed = true;
+}
+
+void FluidMechanics::Impl::updateTimeSeries()
+{
+	if (!timeSeries)
+		return;
+
+	const unsigned int count = timeSeries->getStepCount();
+	if (timeSeriesPlaying && count > 1 && requestedTimeStep == timeStep)
+		setTimeStep((timeStep + 1) % count);
 
-	vtkNew<VTKErrorObserver> errorObserver;
-	reader->AddObserver(vtkCommand::ErrorEvent, errorObserver.GetPointer());
+	if (requestedTimeStep == timeStep)
+		return;
 
-	reader->Update();
+	// The current step keeps being rendered until the requested one
+	// is decoded
+	TimeSeries::StepPtr step;
+	if (!timeSeries->get(requestedTimeStep, step))
+		return;
 
-	if (errorObserver->hasError()) {
-		// TODO? Throw a different type of error to let Java code
-		// display a helpful message to the user
-		throw std::runtime_error("Error loading data: " + errorObserver->getErrorMessage());
+	if (!step) {
+		LOGE("timestep %d could not be loaded", timeSeries->getStepNumber(requestedTimeStep));
+	} else {
+		try {
+			applyTimeStep(*step);
+		} catch (const std::exception& e) {
+			LOGE("Error applying timestep %d: %s", timeSeries->getStepNumber(requestedTimeStep), e.what());
+		}
 	}
 
-	vtkSmartPointer<vtkImageData> data = vtkSmartPointer<vtkImageData>::New();
-	data->DeepCopy(reader->GetOutputDataObject(0));
+	// (skipped on errors, so that playback goes on)
+	timeStep = requestedTimeStep;
+	changed = true;
+}
+
+void FluidMechanics::Impl::applyTimeStep(const TimeSeries::Step& step)
+{
+	android_assert(currentDataSet && currentDataSet->resources);
+
+	// (derived fields are computed from the velocity data of a step)
+	resetScalarField();
+
+	// Same grid: the textures and the derived objects are updated in
+	// place, the particles keep moving through the new field
+	currentDataSet->resources->replaceData(*step.resources);
+	data = currentDataSet->resources->getData();
+	currentDataSet->data = data;
+
+	// (extracted again in the background, the surface of the previous
+	// step is rendered until then)
+	synchronized_if(isosurface) { isosurface->setData(data); }
+
+	if (step.velocityField) {
+		currentDataSet->velocityField = step.velocityField;
+		currentDataSet->derivedFields = std::make_shared<DerivedFields>(step.velocityField, velocityData);
+		particleEngine->setVelocityField(step.velocityField);
+		synchronized_if(gpuParticles) { gpuParticles->setVelocityField(step.velocityField); }
+		synchronized_if(streamlines) { streamlines->setVelocityField(step.velocityField); }
+	}
 
-	return data;
+	updateProbe();
 }
 
-void FluidMechanics::Impl::setSeedPoint(float x, float y, float z){
-	seedPoint.x = x;
-	seedPoint.y = y;
-	seedPoint.z = z;
+void FluidMechanics::Impl::requestDataSet(int id)
+{
+	if (id == currentDataSetId) {
+		// (cancels the request of another dataset, if any)
+		requestedDataSetId = -1;
+		return;
+	}
+
+	if (dataSetManager->request(id)) {
+		requestedDataSetId = id;
+		changed = true;
+	}
 }
 
-bool FluidMechanics::Impl::loadDataSet(const std::string& fileName)
+void FluidMechanics::Impl::updateDataSet()
 {
-	// // Unload mesh data
-	// mesh.reset();
+	if (requestedDataSetId < 0)
+		return;
 
-	synchronized (particles) {
-		// Unload velocity data
-		velocityData = nullptr;
+	// The current dataset keeps being rendered until the requested
+	// one is prepared and uploaded
+	DataSetManager::DataSetPtr dataSet;
+	if (!dataSetManager->getPrepared(requestedDataSetId, dataSet))
+		return;
 
-		// Delete particles
-		for (Particle& p : particles)
-			p.valid = false;
+	if (!dataSet) {
+		LOGE("dataset %d could not be loaded", requestedDataSetId);
+		requestedDataSetId = -1;
+		return;
 	}
 
-	VTKOutputWindow::install();
+	if (!dataSet->upload())
+		return;
 
-	const std::string ext = fileName.substr(fileName.find_last_of(".") + 1);
+	installDataSet(dataSet);
+	currentDataSetId = requestedDataSetId;
+	requestedDataSetId = -1;
+	timeSeries.reset();
+}
 
-	if (ext == "vtk")
-		data = loadTypedDataSet<vtkDataSetReader>(fileName);
-	else if (ext == "vti")
-		data = loadTypedDataSet<vtkXMLImageDataReader>(fileName);
-	else
-		throw std::runtime_error("Error loading data: unknown extension: \"" + ext + "\"");
-
-	data->GetDimensions(dataDim);
-
-	double spacing[3];
-	data->GetSpacing(spacing);
-	dataSpacing = Vector3(spacing[0], spacing[1], spacing[2]);
-
-	// Compute a default zoom value according to the data dimensions
-	// static const float nativeSize = 128.0f;
-	static const float nativeSize = 110.0f;
-	state->computedZoomFactor = nativeSize / std::max(dataSpacing.x*dataDim[0], std::max(dataSpacing.y*dataDim[1], dataSpacing.z*dataDim[2]));
-	// FIXME: hardcoded value: 0.25 (minimum zoom level, see the
-	// onTouch() handler in Java code)
-	state->computedZoomFactor = std::max(state->computedZoomFactor, 0.25f);
-
-	dataLow = vtkSmartPointer<vtkImageData>::New();
-	vtkNew<vtkImageResize> resizeFilter;
-	resizeFilter->SetInputData(data.GetPointer());
-	resizeFilter->SetOutputDimensions(std::max(dataDim[0]/3, 1), std::max(dataDim[1]/3, 1), std::max(dataDim[2]/3, 1));
-	resizeFilter->InterpolateOn();
-	resizeFilter->Update();
-	dataLow->DeepCopy(resizeFilter->GetOutput());
-
-	probeFilter = vtkSmartPointer<vtkProbeFilter>::New();
-	probeFilter->SetSourceData(data.GetPointer());
-
-	synchronized(outline) {
-		LOGD("creating outline...");
-		outline.reset(new Cube(true));
-		outline->setScale(Vector3(dataDim[0]/2, dataDim[1]/2, dataDim[2]/2) * dataSpacing);
+void FluidMechanics::Impl::exchangeObjects(DataSetManager::DataSet& dataSet)
+{
+	synchronized(outline) { outline.swap(dataSet.outline); }
+	synchronized(volume) { volume.swap(dataSet.volume); }
+	synchronized(volume3d) { volume3d.swap(dataSet.volume3d); }
+	synchronized(isosurface) { isosurface.swap(dataSet.isosurface); }
+	synchronized(slice) { slice.swap(dataSet.slice); }
+	synchronized(gpuParticles) { gpuParticles.swap(dataSet.gpuParticles); }
+	synchronized(streamlines) { streamlines.swap(dataSet.streamlines); }
+}
+
+void FluidMechanics::Impl::exchangeScalarObjects(DataSetManager::DataSet& dataSet)
+{
+	synchronized(outline) { outline.swap(dataSet.outline); }
+	synchronized(volume) { volume.swap(dataSet.volume); }
+	synchronized(volume3d) { volume3d.swap(dataSet.volume3d); }
+	synchronized(isosurface) { isosurface.swap(dataSet.isosurface); }
+	synchronized(slice) { slice.swap(dataSet.slice); }
+}
+
+void FluidMechanics::Impl::installDataSet(DataSetManager::DataSetPtr dataSet)
+{
+	android_assert(dataSet);
+	LOGD("installing dataset: %s", dataSet->fileName.c_str());
+	changed = true;
+
+	// Hand the objects of the current dataset back to it (it stays
+	// prepared if the manager keeps it), then take the new ones
+	resetScalarField();
+	if (currentDataSet)
+		exchangeObjects(*currentDataSet);
+	exchangeObjects(*dataSet);
+	currentDataSet = scalarDataSet = dataSet;
+
+	data = dataSet->data;
+	std::copy(dataSet->dimensions, dataSet->dimensions+3, dataDim);
+	dataSpacing = dataSet->spacing;
+	velocityData = dataSet->velocityData;
+	updateProbe();
+	state->computedZoomFactor = dataSet->zoomFactor;
+
+	// Particles and streamlines of the previous dataset are dropped
+	particleEngine->clear();
+	particleEngine->setVelocityField(dataSet->velocityField);
+	synchronized_if(gpuParticles) { gpuParticles->clear(); }
+	synchronized_if(streamlines) { streamlines->clear(); }
+
+	synchronized_if(isosurface) {
+		isosurface->setPercentageAsync(settings->surfacePercentage);
 	}
 
-	synchronized(volume) {
-		LOGD("creating volume...");
-		volume.reset(new Volume(data));
-		// volume.reset(new Volume3d(data));
-		// if (fileName.find("FTLE7.vtk") != std::string::npos) { // HACK
-		// 	// volume->setOpacity(0.25f);
-		// 	volume->setOpacity(0.15f);
-		// }
+	reportMemoryUsage();
+}
+
+bool FluidMechanics::Impl::setScalarField(ScalarField field)
+{
+	if (field == SCALAR_DATA_FILE) {
+		requestedScalarField = field;
+		changed = true;
+		return true;
 	}
 
-	if (fileName.find("FTLE7.vtk") == std::string::npos) { // HACK
-		synchronized(isosurface) {
-			LOGD("creating isosurface...");
-			isosurface.reset(new IsoSurface(data));
-			isosurface->setPercentage(settings->surfacePercentage);
-		}
+	if (!currentDataSet || !currentDataSet->derivedFields)
+		return false;
 
-		synchronized(isosurfaceLow) {
-			LOGD("creating low-res isosurface...");
-			isosurfaceLow.reset(new IsoSurface(dataLow, true));
-			isosurfaceLow->setPercentage(settings->surfacePercentage);
+	android_assert(field >= 0 && int(field) < DerivedFields::fieldCount);
+	requestedScalarField = field;
+	changed = true;
+
+	tthread::lock_guard<tthread::mutex> g(derivedDataSets->lock);
+	if (derivedDataSets->prepared.count(field) || derivedDataSets->pending.count(field))
+		return true;
+	derivedDataSets->pending.insert(field);
+
+	const std::shared_ptr<DerivedDataSets> shared = derivedDataSets;
+	const DataSetManager::DataSetPtr source = currentDataSet;
+	TaskPool::submit([shared, source, field]() {
+		DataSetManager::DataSetPtr result;
+		try {
+			result = DataSetManager::prepareDerived(*source, field);
+		} catch (const std::exception& e) {
+			LOGE("Error preparing the %s: %s", DerivedFields::getName(DerivedFields::Field(field)), e.what());
 		}
-	} else {
-		isosurface.reset();
-		isosurfaceLow.reset();
-	}
 
-	synchronized(slice) {
-		LOGD("creating slice...");
-		slice.reset(new Slice(data));
-	}
+		tthread::lock_guard<tthread::mutex> g(shared->lock);
+		shared->pending.erase(field);
+		shared->prepared[field] = result;
+	}, TaskPool::INTERACTIVE);
 
 	return true;
 }
 
-bool FluidMechanics::Impl::loadVelocityDataSet(const std::string& fileName)
+void FluidMechanics::Impl::updateScalarField()
 {
-	if (!data)
-		throw std::runtime_error("No dataset currently loaded");
+	if (requestedScalarField == scalarField)
+		return;
 
-	VTKOutputWindow::install();
+	if (requestedScalarField == SCALAR_DATA_FILE) {
+		showScalars(currentDataSet);
+		scalarField = requestedScalarField;
+		return;
+	}
 
-	const std::string ext = fileName.substr(fileName.find_last_of(".") + 1);
+	// The current field keeps being rendered until the requested one
+	// is prepared and uploaded
+	DataSetManager::DataSetPtr dataSet;
+	{
+		tthread::lock_guard<tthread::mutex> g(derivedDataSets->lock);
+		auto it = derivedDataSets->prepared.find(requestedScalarField);
+		if (it == derivedDataSets->prepared.end())
+			return;
+		dataSet = it->second;
+	}
 
-	if (ext == "vtk")
-		velocityData = loadTypedDataSet<vtkDataSetReader>(fileName);
-	else if (ext == "vti")
-		velocityData = loadTypedDataSet<vtkXMLImageDataReader>(fileName);
-	else
-		throw std::runtime_error("Error loading data: unknown extension: \"" + ext + "\"");
+	if (!dataSet) {
+		LOGE("%s could not be prepared", DerivedFields::getName(DerivedFields::Field(requestedScalarField)));
+		requestedScalarField = scalarField;
+		return;
+	}
 
-	int velocityDataDim[3];
-	velocityData->GetDimensions(velocityDataDim);
+	if (!dataSet->upload())
+		return;
 
-	if (velocityDataDim[0] != dataDim[0]
-	    || velocityDataDim[1] != dataDim[1]
-	    || velocityDataDim[2] != dataDim[2])
-	{
-		throw std::runtime_error(
-			"Dimensions do not match: "
-			"vel: " + Utility::toString(velocityDataDim[0]) + "x" + Utility::toString(velocityDataDim[1]) + "x" + Utility::toString(velocityDataDim[2])
-			+ ", data: " + Utility::toString(dataDim[0]) + "x" + Utility::toString(dataDim[1]) + "x" + Utility::toString(dataDim[2])
-		);
+	showScalars(dataSet);
+	scalarField = requestedScalarField;
+}
+
+void FluidMechanics::Impl::showScalars(DataSetManager::DataSetPtr dataSet)
+{
+	android_assert(dataSet && scalarDataSet);
+	changed = true;
+
+	if (dataSet == scalarDataSet)
+		return;
+
+	exchangeScalarObjects(*scalarDataSet);
+	exchangeScalarObjects(*dataSet);
+	scalarDataSet = dataSet;
+
+	data = dataSet->data;
+	updateProbe();
+
+	synchronized_if(isosurface) {
+		isosurface->setPercentageAsync(settings->surfacePercentage);
 	}
+}
 
-	int dim = velocityData->GetDataDimension();
-	if (dim != 3)
-		throw std::runtime_error("Velocity data is not 3D (dimension = " + Utility::toString(dim) + ")");
+void FluidMechanics::Impl::resetScalarField()
+{
+	if (currentDataSet)
+		showScalars(currentDataSet);
+	scalarField = requestedScalarField = SCALAR_DATA_FILE;
 
-	if (!velocityData->GetPointData() || !velocityData->GetPointData()->GetVectors())
-		throw std::runtime_error("Invalid velocity data: no vectors found");
+	// (the tasks still running fill the previous ones)
+	derivedDataSets = std::make_shared<DerivedDataSets>();
+}
 
-	return true;
+void FluidMechanics::Impl::updateProbe()
+{
+	ProbeSharedPtr p;
+	if (data)
+		p = std::make_shared<const Probe>(data, currentDataSet ? currentDataSet->velocityField : nullptr);
+
+	synchronized(probe) { probe = p; }
 }
 
-Vector3 FluidMechanics::Impl::posToDataCoords(const Vector3& pos)
+ProbeSharedPtr FluidMechanics::Impl::getProbe() const
 {
-	Vector3 result;
+	// (the queries run without the lock, on a probe that stays valid)
+	ProbeSharedPtr result;
+	synchronized(probe) { result = probe; }
+	return result;
+}
 
-	synchronized(state->modelMatrix) {
-		// Transform "pos" into object space
-		result = state->modelMatrix.inverse() * pos;
-	}
+void FluidMechanics::Impl::reportMemoryUsage()
+{
+	const double mb = 1.0 / (1 << 20);
+
+	// (GetActualMemorySize() is in KiB)
+	const double dataMb = (data ? data->GetActualMemorySize() * 1024.0 * mb : 0);
+	const double velocityDataMb = (velocityData ? velocityData->GetActualMemorySize() * 1024.0 * mb : 0);
+	const double fieldMb = (currentDataSet && currentDataSet->velocityField ? currentDataSet->velocityField->getMemoryUsage() * mb : 0);
+	const double resourcesMb = (scalarDataSet && scalarDataSet->resources ? scalarDataSet->resources->getMemoryUsage() * mb : 0);
+	const double derivedMb = (currentDataSet && currentDataSet->derivedFields ? currentDataSet->derivedFields->getMemoryUsage() * mb : 0);
+
+	double volumeMb = 0, volume3dMb = 0, surfaceMb = 0;
+	synchronized_if(volume) { volumeMb = volume->getMemoryUsage() * mb; }
+	synchronized_if(volume3d) { volume3dMb = volume3d->getMemoryUsage() * mb; }
+	synchronized_if(isosurface) { surfaceMb = isosurface->getCacheSize() * mb; }
+
+	LOGD("memory: data %.1f MB, velocity data %.1f MB, velocity field %.1f MB, derived fields %.1f MB, "
+	     "GPU resources %.1f MB, volume %.1f MB, ray casting volume %.1f MB, surface cache %.1f MB",
+	     dataMb, velocityDataMb, fieldMb, derivedMb, resourcesMb, volumeMb, volume3dMb, surfaceMb);
+}
+
+bool FluidMechanics::Impl::isBusy()
+{
+	if (requestedDataSetId >= 0 || particleEngine->hasParticles())
+		return true;
+
+	if (timeSeries && (timeSeriesPlaying || requestedTimeStep != timeStep))
+		return true;
+
+	if (requestedScalarField != scalarField)
+		return true;
+
+	// (bricks of paged datasets, see BrickPager)
+	if (scalarDataSet && scalarDataSet->resources && !scalarDataSet->resources->isIdle())
+		return true;
+
+	bool result = false;
+	// (GPU particles are never read back: busy until cleared)
+	synchronized_if(gpuParticles) { result = result || gpuParticles->hasParticles(); }
+	synchronized_if(streamlines) { result = result || !streamlines->isIdle(); }
+	synchronized_if(isosurface) { result = result || !isosurface->isIdle(); }
+	synchronized_if(slice) { result = result || !slice->isIdle(); }
+	return result;
+}
+
+Vector3 FluidMechanics::Impl::posToDataCoords(const Vector3& pos)
+{
+	// Transform "pos" into object space
+	Vector3 result = getModelInverse() * pos;
 
 	// Compensate for the scale factor
 	result *= 1/settings->zoomFactor;
@@ -333,24 +672,57 @@ Vector3 FluidMechanics::Impl::posToDataCoords(const Vector3& pos)
 	return result;
 }
 
-Vector3 FluidMechanics::Impl::particleJitter()
+Matrix4 FluidMechanics::Impl::sliceToDataMatrix(const Matrix4& sliceModelMatrix)
+{
+	return Matrix4::makeTransform(
+		Vector3(dataDim[0]/2, dataDim[1]/2, dataDim[2]/2) * dataSpacing,
+		Quaternion::identity(),
+		Vector3(1/settings->zoomFactor)
+	) * (getModelInverse() * sliceModelMatrix);
+}
+
+const Matrix4& FluidMechanics::Impl::getModelInverse()
+{
+	if (!transforms.hasModelInverse) {
+		transforms.modelInverse = transforms.model.inverse();
+		transforms.modelNormal = transforms.modelInverse.transpose().get3x3Matrix();
+		transforms.hasModelInverse = true;
+	}
+	return transforms.modelInverse;
+}
+
+const Matrix3& FluidMechanics::Impl::getModelNormalMatrix()
+{
+	getModelInverse();
+	return transforms.modelNormal;
+}
+
+const Matrix4& FluidMechanics::Impl::getStylusInverse()
 {
-	return Vector3(
-		(float(std::rand()) / RAND_MAX),
-		(float(std::rand()) / RAND_MAX),
-		(float(std::rand()) / RAND_MAX)
-	) * 1.0f;
-	// ) * 0.5f;
+	if (!transforms.hasStylusInverse) {
+		transforms.stylusInverse = transforms.stylus.inverse();
+		transforms.stylusNormal = transforms.stylusInverse.transpose().get3x3Matrix();
+		transforms.hasStylusInverse = true;
+	}
+	return transforms.stylusInverse;
+}
+
+const Matrix3& FluidMechanics::Impl::getStylusNormalMatrix()
+{
+	getStylusInverse();
+	return transforms.stylusNormal;
 }
 
 void FluidMechanics::Impl::buttonPressed()
 {
 	buttonIsPressed = true;
+	changed = true;
 }
 
 float FluidMechanics::Impl::buttonReleased()
 {
 	buttonIsPressed = false;
+	changed = true;
 
 	settings->surfacePreview = false;
 	try {
@@ -363,11 +735,10 @@ float FluidMechanics::Impl::buttonReleased()
 }
 
 void FluidMechanics::Impl::resetParticles(){
-	for (Particle& p : particles) {
-			p.pos = Vector3(0, 0, 0);
-			p.stallMs = 0;
-			p.valid = false;
-	}
+	changed = true;
+	particleEngine->clear();
+	synchronized_if(gpuParticles) { gpuParticles->clear(); }
+	synchronized_if(streamlines) { streamlines->clear(); }
 }
 
 void FluidMechanics::Impl::releaseParticles()
@@ -382,10 +753,7 @@ void FluidMechanics::Impl::releaseParticles()
 	}*/
 		
 	//LOGD("Conditions met to place particles");
-	Matrix4 smm;
-	synchronized (state->stylusModelMatrix) {
-		smm = state->stylusModelMatrix;
-	}
+	Matrix4 smm = transforms.stylus;
 	//LOGD("Got stylus Model Matrix");
 	//const float size = 0.5f * (stylusEffectorDist + std::max(dataSpacing.x*dataDim[0], std::max(dataSpacing.y*dataDim[1], dataSpacing.z*dataDim[2])));
 	//Vector3 dataPos = posToDataCoords(smm * Matrix4::makeTransform(Vector3(-size, 0, 0)*settings->zoomFactor) * Vector3::zero());
@@ -402,21 +770,20 @@ void FluidMechanics::Impl::releaseParticles()
 		return;
 	}
 	LOGD("Coords correct");
+	changed = true;
 	DataCoords coords(dataPos.x, dataPos.y, dataPos.z);
 
-	clock_gettime(CLOCK_REALTIME, &particleStartTime);
-
-	int delay = 0;
 	LOGD("Starting Particle Computation");
-	synchronized (particles) {
-		for (Particle& p : particles) {
-			p.pos = Vector3(coords.x, coords.y, coords.z) + particleJitter();
-			p.lastTime = particleStartTime;
-			p.delayMs = delay;
-			delay += particleReleaseDuration/particles.size();
-			p.stallMs = 0;
-			p.valid = true;
-		}
+	const Vector3 seed(coords.x, coords.y, coords.z);
+	if (settings->gpuParticles) {
+		particleEngine->clear();
+		synchronized_if(gpuParticles) { gpuParticles->release(seed, 1.0f, particleReleaseDuration); }
+	} else {
+		synchronized_if(gpuParticles) { gpuParticles->clear(); }
+		particleEngine->release(seed, 1.0f, particleReleaseDuration);
+	}
+	if (settings->showStreamlines) {
+		synchronized_if(streamlines) { streamlines->request(seed); }
 	}
 }
 
@@ -425,10 +792,7 @@ void FluidMechanics::Impl::releaseParticles()
 	if (!velocityData || !state->tangibleVisible || !state->stylusVisible)
 		return;
 
-	Matrix4 smm;
-	synchronized (state->stylusModelMatrix) {
-		smm = state->stylusModelMatrix;
-	}
+	Matrix4 smm = transforms.stylus;
 
 	const float size = 0.5f * (stylusEffectorDist + std::max(dataSpacing.x*dataDim[0], std::max(dataSpacing.y*dataDim[1], dataSpacing.z*dataDim[2])));
 	Vector3 dataPos = posToDataCoords(smm * Matrix4::makeTransform(Vector3(-size, 0, 0)*settings->zoomFactor) * Vector3::zero());
@@ -483,70 +847,6 @@ void FluidMechanics::Impl::releaseParticles()
 	}
 }*/
 
-void FluidMechanics::Impl::integrateParticleMotion(Particle& p)
-{
-	if (!p.valid)
-		return;
-
-	// Pause particle motion when the data is not visible
-	if (!state->tangibleVisible)
-		return;
-
-	timespec now;
-	clock_gettime(CLOCK_REALTIME, &now);
-
-	int elapsedMs = (now.tv_sec - p.lastTime.tv_sec) * 1000
-		+ (now.tv_nsec - p.lastTime.tv_nsec) / 1000000;
-
-	p.lastTime = now;
-
-	if (p.delayMs > 0) {
-		p.delayMs -= elapsedMs;
-		if (p.delayMs < 0)
-			elapsedMs = -p.delayMs;
-		else
-			return;
-	}
-
-	if (p.stallMs > 0) {
-		p.stallMs -= elapsedMs;
-		if (p.stallMs < 0)
-			p.valid = false;
-		return;
-	}
-
-	vtkDataArray* vectors = velocityData->GetPointData()->GetVectors();
-
-	while (elapsedMs > 0) {
-		--elapsedMs;
-
-		DataCoords coords = DataCoords(p.pos.x, p.pos.y, p.pos.z);
-
-		if (coords.x < 0 || coords.y < 0 || coords.z < 0
-		    || coords.x >= dataDim[0] || coords.y >= dataDim[1] || coords.z >= dataDim[2])
-		{
-			// LOGD("particle moved outside bounds");
-			p.valid = false;
-			return;
-		}
-
-		double* v = vectors->GetTuple3(coords.z*(dataDim[0]*dataDim[1]) + coords.y*dataDim[0] + coords.x);
-		// LOGD("v = %f, %f, %f", v[0], v[1], v[2]);
-
-		// Vector3 vel(v[0], v[1], v[2]);
-		Vector3 vel(v[1], v[0], v[2]); // XXX: workaround for a wrong data orientation
-
-		//if (!vel.isNull()) {
-		if (vel.length() > 0.001f) {
-			p.pos += vel * particleSpeed;
-		} else {
-			// LOGD("particle stopped");
-			p.stallMs = particleStallDuration;
-			break;
-		}
-	}
-}
-
 bool FluidMechanics::Impl::computeCameraClipPlane(Vector3& point, Vector3& normal)
 {
 	// static const float weight = 0.3f;
@@ -564,7 +864,7 @@ bool FluidMechanics::Impl::computeCameraClipPlane(Vector3& point, Vector3& norma
 	// synchronized(modelMatrix) { // not needed since this thread is the only one to write to "modelMatrix"
 	// Compute the inverse rotation matrix to render this
 	// slicing plane
-	slicingMatrix = Matrix4((app->getProjMatrix() * state->modelMatrix).inverse().get3x3Matrix());
+	slicingMatrix = Matrix4((app->getProjMatrix() * transforms.model).inverse().get3x3Matrix());
 	// }
 
 	// Compute the slicing origin location in data coordinates:
@@ -573,10 +873,10 @@ bool FluidMechanics::Impl::computeCameraClipPlane(Vector3& point, Vector3& norma
 	Vector3 screenSpacePos = Vector3(0, 0, settings->clipDist);
 
 	// Transform the position in object space
-	Vector3 pos = state->modelMatrix.inverse() * screenSpacePos;
+	Vector3 pos = getModelInverse() * screenSpacePos;
 
 	// Transform the screen normal in object space
-	Vector3 n = (state->modelMatrix.transpose().get3x3Matrix() * Vector3::unitZ()).normalized();
+	Vector3 n = (transforms.model.transpose().get3x3Matrix() * Vector3::unitZ()).normalized();
 
 	// Filter "pos" using a weighted average, but only in the
 	// "n" direction (the screen direction)
@@ -587,7 +887,7 @@ bool FluidMechanics::Impl::computeCameraClipPlane(Vector3& point, Vector3& norma
 	prevPos = pos;
 
 	// Transform the position back in screen space
-	screenSpacePos = state->modelMatrix * pos;
+	screenSpacePos = transforms.model * pos;
 
 	// Store the computed depth
 	sliceDepth = screenSpacePos.z;
@@ -611,7 +911,7 @@ bool FluidMechanics::Impl::computeCameraClipPlane(Vector3& point, Vector3& norma
 bool FluidMechanics::Impl::computeAxisClipPlane(Vector3& point, Vector3& normal)
 {
 	if (state->tangibleVisible) {
-		Matrix3 normalMatrix = state->modelMatrix.inverse().transpose().get3x3Matrix();
+		const Matrix3& normalMatrix = getModelNormalMatrix();
 		float xDot = (normalMatrix*Vector3::unitX()).normalized().dot(Vector3::unitZ());
 		float yDot = (normalMatrix*Vector3::unitY()).normalized().dot(Vector3::unitZ());
 		float zDot = (normalMatrix*Vector3::unitZ()).normalized().dot(Vector3::unitZ());
@@ -665,12 +965,12 @@ bool FluidMechanics::Impl::computeAxisClipPlane(Vector3& point, Vector3& normal)
 	}
 
 	// Project "pt" on the chosen axis in object space
-	Vector3 pt = state->modelMatrix.inverse() * app->getProjMatrix().inverse() * Vector3(0, 0, app->getDepthValue(settings->clipDist));
+	Vector3 pt = getModelInverse() * app->getProjMatrix().inverse() * Vector3(0, 0, app->getDepthValue(settings->clipDist));
 	Vector3 absAxis = Vector3(std::abs(axis.x), std::abs(axis.y), std::abs(axis.z));
 	Vector3 pt2 = absAxis * absAxis.dot(pt);
 
 	// Return to eye space
-	pt2 = state->modelMatrix * pt2;
+	pt2 = transforms.model * pt2;
 
 	Vector3 dataCoords = posToDataCoords(pt2);
 
@@ -680,12 +980,14 @@ bool FluidMechanics::Impl::computeAxisClipPlane(Vector3& point, Vector3& normal)
 	Matrix4 proj = app->getProjMatrix(); proj[0][0] = -proj[1][1] / 1.0f; // same as "projMatrix", but with aspect = 1
 	Matrix4 slicingMatrix = Matrix4((proj * Matrix4::makeTransform(dataCoords, rot)).inverse().get3x3Matrix());
 	slicingMatrix.setPosition(dataCoords);
+	const Matrix4 sliceModelMatrix = transforms.model * Matrix4::makeTransform(getModelInverse() * pt2, rot, settings->zoomFactor*Vector3(size, size, 0.0f));
 	synchronized(slice) {
-		slice->setSlice(slicingMatrix, -proj[1][1]*size*settings->zoomFactor, settings->zoomFactor);
+		slice->setGpuSampling(settings->gpuSlice);
+		slice->setSlice(slicingMatrix, -proj[1][1]*size*settings->zoomFactor, settings->zoomFactor, sliceToDataMatrix(sliceModelMatrix));
 	}
 
 	synchronized(state->sliceModelMatrix) {
-		state->sliceModelMatrix = Matrix4(state->modelMatrix * Matrix4::makeTransform(state->modelMatrix.inverse() * pt2, rot, settings->zoomFactor*Vector3(size, size, 0.0f)));
+		state->sliceModelMatrix = sliceModelMatrix;
 	}
 
 	if (!slice->isEmpty())
@@ -694,7 +996,7 @@ bool FluidMechanics::Impl::computeAxisClipPlane(Vector3& point, Vector3& normal)
 		state->lockedClipAxis = CLIP_NONE;
 
 	point = pt2;
-	normal = state->modelMatrix.inverse().transpose().get3x3Matrix() * axis;
+	normal = getModelNormalMatrix() * axis;
 
 	return true;
 }
@@ -730,13 +1032,13 @@ bool FluidMechanics::Impl::computeStylusClipPlane(Vector3& point, Vector3& norma
 	// static const float size = 180.0f;
 	const float size = 0.5f * (60.0f + std::max(dataSpacing.x*dataDim[0], std::max(dataSpacing.y*dataDim[1], dataSpacing.z*dataDim[2])));
 
-	Matrix4 planeMatrix = state->stylusModelMatrix;
+	Matrix4 planeMatrix = transforms.stylus;
 
 	// Matrix4 planeMatrix = state->stylusModelMatrix;
 	// // planeMatrix = planeMatrix * Matrix4::makeTransform(Vector3(-size, 0, 0)*settings->zoomFactor);
 
 	// Project the stylus->data vector onto the stylus X axis
-	Vector3 dataPosInStylusSpace = state->stylusModelMatrix.inverse() * state->modelMatrix * Vector3::zero();
+	Vector3 dataPosInStylusSpace = getStylusInverse() * transforms.model * Vector3::zero();
 
 	// Shift the clip plane along the stylus X axis in order to
 	// reach the data, even if the stylus is far away
@@ -755,7 +1057,7 @@ bool FluidMechanics::Impl::computeStylusClipPlane(Vector3& point, Vector3& norma
 
 	// The slice will be rendered from the viewpoint of the plane
 	Matrix4 proj = app->getProjMatrix(); proj[0][0] = -proj[1][1] / 1.0f; // same as "projMatrix", but with aspect = 1
-	Matrix4 slicingMatrix = Matrix4((proj * planeMatrix.inverse() * state->modelMatrix).inverse().get3x3Matrix());
+	Matrix4 slicingMatrix = Matrix4((proj * planeMatrix.inverse() * transforms.model).inverse().get3x3Matrix());
 
 	Vector3 pt2 = planeMatrix * Vector3::zero();
 
@@ -764,16 +1066,18 @@ bool FluidMechanics::Impl::computeStylusClipPlane(Vector3& point, Vector3& norma
 	// LOGD("dataCoords = %s", Utility::toString(dataCoords).c_str());
 	slicingMatrix.setPosition(dataCoords);
 
+	const Matrix4 sliceModelMatrix = planeMatrix * Matrix4::makeTransform(Vector3::zero(), Quaternion::identity(), settings->zoomFactor*Vector3(size, size, 0.0f));
 	synchronized(slice) {
-		slice->setSlice(slicingMatrix, -proj[1][1]*size*settings->zoomFactor, settings->zoomFactor);
+		slice->setGpuSampling(settings->gpuSlice);
+		slice->setSlice(slicingMatrix, -proj[1][1]*size*settings->zoomFactor, settings->zoomFactor, sliceToDataMatrix(sliceModelMatrix));
 	}
 
 	synchronized(state->sliceModelMatrix) {
-		state->sliceModelMatrix = Matrix4(planeMatrix * Matrix4::makeTransform(Vector3::zero(), Quaternion::identity(), settings->zoomFactor*Vector3(size, size, 0.0f)));
+		state->sliceModelMatrix = sliceModelMatrix;
 	}
 
 	point = pt2;
-	normal = state->stylusModelMatrix.inverse().transpose().get3x3Matrix() * Vector3::unitZ();
+	normal = getStylusNormalMatrix() * Vector3::unitZ();
 
 	} catch (const std::exception& e) { LOGD("%s", e.what()); return false; }
 
@@ -790,18 +1094,28 @@ Vector3 FluidMechanics::Impl::dataCoordsToPos(const Vector3& dataCoords)
 	// Compensate for the scale factor
 	result *= settings->zoomFactor;
 
-	synchronized(state->modelMatrix) {
-		// Transform "result" into eye space
-		result = state->modelMatrix * result;
+	// Transform "result" into eye space
+	return transforms.model * result;
+}
+
+void FluidMechanics::Impl::dataCoordsToPos(const Vector3* dataCoords, std::size_t count, Vector3* result)
+{
+	const Vector3 offset = Vector3(dataDim[0]/2, dataDim[1]/2, dataDim[2]/2) * dataSpacing;
+	for (std::size_t i = 0; i < count; ++i) {
+		result[i] = dataCoords[i] - offset;
+		result[i] *= settings->zoomFactor;
 	}
 
-	return result;
+	transforms.model.transformPoints(result, count, result);
 }
 
 template <typename T>
 T lowPassFilter(const T& cur, const T& prev, float alpha)
 { return prev + alpha * (cur-prev); }
 
+inline bool sameMatrix(const Matrix4& a, const Matrix4& b)
+{ return std::equal(a.data_, a.data_+16, b.data_); }
+
 void FluidMechanics::Impl::setMatrices(const Matrix4& volumeMatrix, const Matrix4& stylusMatrix)
 {
 	synchronized(state->modelMatrix) {
@@ -812,6 +1126,18 @@ void FluidMechanics::Impl::setMatrices(const Matrix4& volumeMatrix, const Matrix
 		state->stylusModelMatrix = stylusMatrix;
 	}
 
+	// (the inverses are only computed again if the matrices change)
+	if (!sameMatrix(transforms.model, volumeMatrix)) {
+		transforms.model = volumeMatrix;
+		transforms.hasModelInverse = false;
+		changed = true;
+	}
+	if (!sameMatrix(transforms.stylus, stylusMatrix)) {
+		transforms.stylus = stylusMatrix;
+		transforms.hasStylusInverse = false;
+		changed = true;
+	}
+
 	updateSlicePlanes();
 }
 
@@ -821,7 +1147,7 @@ void FluidMechanics::Impl::updateSlicePlanes()
 		if (state->tangibleVisible) { // <-- because of posToDataCoords()
 			// Effector 2
 			const float size = 0.5f * (stylusEffectorDist + std::max(dataSpacing.x*dataDim[0], std::max(dataSpacing.y*dataDim[1], dataSpacing.z*dataDim[2])));
-			Vector3 dataPos = posToDataCoords(state->stylusModelMatrix * Matrix4::makeTransform(Vector3(-size, 0, 0)*settings->zoomFactor) * Vector3::zero());
+			Vector3 dataPos = posToDataCoords(transforms.stylus * Matrix4::makeTransform(Vector3(-size, 0, 0)*settings->zoomFactor) * Vector3::zero());
 
 			if (dataPos.x >= 0 && dataPos.y >= 0 && dataPos.z >= 0
 			    && dataPos.x < dataDim[0]*dataSpacing.x && dataPos.y < dataDim[1]*dataSpacing.y && dataPos.z < dataDim[2]*dataSpacing.z)
@@ -907,7 +1233,7 @@ void FluidMechanics::Impl::updateSlicePlanes()
 
 				// Same as posToDataCoords(), but for directions (not positions)
 				// (direction goes from the effector to the stylus: +X axis)
-				Vector3 dataDir = state->modelMatrix.transpose().get3x3Matrix() * state->stylusModelMatrix.inverse().transpose().get3x3Matrix() * Vector3::unitX();
+				Vector3 dataDir = transforms.model.transpose().get3x3Matrix() * getStylusNormalMatrix() * Vector3::unitX();
 
 				// static const float min = 0.0f;
 				// const float max = settings->zoomFactor;
@@ -942,18 +1268,10 @@ void FluidMechanics::Impl::updateSlicePlanes()
 					// settings->showSurface = true;
 					settings->surfacePreview = true;
 
-					vtkNew<vtkPoints> points;
-					points->InsertNextPoint(dataPos.x, dataPos.y, dataPos.z);
-					vtkNew<vtkPolyData> polyData;
-					polyData->SetPoints(points.GetPointer());
-					probeFilter->SetInputData(polyData.GetPointer());
-					probeFilter->Update();
-
-					vtkDataArray* scalars = probeFilter->GetOutput()->GetPointData()->GetScalars();
-					android_assert(scalars);
-					unsigned int num = scalars->GetNumberOfTuples();
-					android_assert(num > 0);
-					double value = scalars->GetComponent(0, 0);
+					// (zero outside of the grid, as with vtkProbeFilter)
+					double value = 0;
+					if (ProbeSharedPtr p = getProbe())
+						p->sampleScalar(dataPos, value);
 					static double prevValue = 0.0;
 					if (prevValue != 0.0)
 						value = lowPassFilter(value, prevValue, 0.5f);
@@ -962,15 +1280,12 @@ void FluidMechanics::Impl::updateSlicePlanes()
 					// LOGD("probed value = %f (range = %f / %f)", value, range[0], range[1]);
 					settings->surfacePercentage = (value - range[0]) / (range[1] - range[0]);
 
-					// NOTE: updateSurfacePreview cannot be used to update isosurfaceLow
-					// from settings->surfacePercentage, since isosurfaceLow and isosurface
-					// have different value ranges, hence expect different percentages.
-					// updateSurfacePreview();
-
-					// Directly use setValue() instead
-					synchronized_if(isosurfaceLow) {
-						isosurfaceLow->setValue(value);
+					// The coarse levels of the surface are displayed while
+					// the finer ones are being extracted
+					synchronized_if(isosurface) {
+						isosurface->setValueAsync(value);
 					}
+					updateSurfaceCacheStats();
 				}
 			} else {
 				effectorIntersectionValid = false;
@@ -1002,11 +1317,10 @@ void FluidMechanics::Impl::updateSlicePlanes()
 
 	if (clipPlaneSet) {
 		synchronized_if(isosurface) { isosurface->setClipPlane(sliceNormal.x, sliceNormal.y, sliceNormal.z, -sliceNormal.dot(slicePoint)); }
-		synchronized_if(isosurfaceLow) { isosurfaceLow->setClipPlane(sliceNormal.x, sliceNormal.y, sliceNormal.z, -sliceNormal.dot(slicePoint)); }
 		synchronized_if(volume) { volume->setClipPlane(sliceNormal.x, sliceNormal.y, sliceNormal.z, -sliceNormal.dot(slicePoint)); }
+		synchronized_if(volume3d) { volume3d->setClipPlane(sliceNormal.x, sliceNormal.y, sliceNormal.z, -sliceNormal.dot(slicePoint)); }
 
-		// pt: data space
-		// dir: eye space
+		// pt, dir: eye space
 		const auto rayPlaneIntersection = [this](const Vector3& pt, const Vector3& dir, float& t) -> bool {
 			// float dot = dir.dot(posToDataCoords(sliceNormal));
 			// float dot = dataCoordsToPos(dir).dot(sliceNormal);
@@ -1014,8 +1328,7 @@ void FluidMechanics::Impl::updateSlicePlanes()
 			if (dot == 0)
 				return false;
 			// t = -(pt.dot(posToDataCoords(sliceNormal)) - sliceNormal.dot(slicePoint)) / dot;
-			t = -(dataCoordsToPos(pt).dot(sliceNormal) - sliceNormal.dot(slicePoint)) / dot;
-			// t = -(pt.dot(sliceNormal) - sliceNormal.dot(slicePoint)) / dot;
+			t = -(pt.dot(sliceNormal) - sliceNormal.dot(slicePoint)) / dot;
 			// LOGD("t = %f", t);
 			return true;
 		};
@@ -1040,46 +1353,31 @@ void FluidMechanics::Impl::updateSlicePlanes()
 			// static const float max = 2*settings->zoomFactor*state->computedZoomFactor;
 			// LOGD("%f %f %d %f", settings->zoomFactor, state->computedZoomFactor, dataDim[0], dataSpacing.x);
 
+			// Cube corners (bit 0: x, bit 1: y, bit 2: z), in eye space
+			const float size[3] = { dataDim[0]*dataSpacing.x, dataDim[1]*dataSpacing.y, dataDim[2]*dataSpacing.z };
+			Vector3 corners[8];
+			for (int i = 0; i < 8; ++i)
+				corners[i] = Vector3((i & 1) ? size[0] : 0, (i & 2) ? size[1] : 0, (i & 4) ? size[2] : 0);
+			dataCoordsToPos(corners, 8, corners);
+
 			// Same as dataCoordsToPos(), but for directions (not positions)
-			dir = state->modelMatrix.inverse().transpose().get3x3Matrix() * (Vector3(dataDim[0]*dataSpacing.x, 0, 0));// / settings->zoomFactor);
-
-			if (rayPlaneIntersection(Vector3(0, 0, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, 0, 0)) + dir*t);
-			if (rayPlaneIntersection(Vector3(0, dataDim[1]*dataSpacing.y, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, dataDim[1]*dataSpacing.y, 0)) + dir*t);
-			if (rayPlaneIntersection(Vector3(0, 0, dataDim[2]*dataSpacing.z), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, 0, dataDim[2]*dataSpacing.z)) + dir*t);
-			if (rayPlaneIntersection(Vector3(0, dataDim[1]*dataSpacing.y, dataDim[2]*dataSpacing.z), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, dataDim[1]*dataSpacing.y, dataDim[2]*dataSpacing.z)) + dir*t);
-
-			// dir = Vector3(0, dataDim[1]*dataSpacing.y, 0);
-			dir = state->modelMatrix.inverse().transpose().get3x3Matrix() * (Vector3(0, dataDim[1]*dataSpacing.y, 0));// / settings->zoomFactor);
-			if (rayPlaneIntersection(Vector3(0, 0, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, 0, 0)) + dir*t);
-			if (rayPlaneIntersection(Vector3(dataDim[0]*dataSpacing.x, 0, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(dataDim[0]*dataSpacing.x, 0, 0)) + dir*t);
-			if (rayPlaneIntersection(Vector3(0, 0, dataDim[2]*dataSpacing.z), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, 0, dataDim[2]*dataSpacing.z)) + dir*t);
-			if (rayPlaneIntersection(Vector3(dataDim[0]*dataSpacing.x, 0, dataDim[2]*dataSpacing.z), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(dataDim[0]*dataSpacing.x, 0, dataDim[2]*dataSpacing.z)) + dir*t);
-
-			// dir = Vector3(0, 0, dataDim[2]*dataSpacing.z);
-			dir = state->modelMatrix.inverse().transpose().get3x3Matrix() * (Vector3(0, 0, dataDim[2]*dataSpacing.z));// / settings->zoomFactor);
-			if (rayPlaneIntersection(Vector3(0, 0, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, 0, 0)) + dir*t);
-			if (rayPlaneIntersection(Vector3(dataDim[0]*dataSpacing.x, 0, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(dataDim[0]*dataSpacing.x, 0, 0)) + dir*t);
-			if (rayPlaneIntersection(Vector3(0, dataDim[1]*dataSpacing.y, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(0, dataDim[1]*dataSpacing.y, 0)) + dir*t);
-			if (rayPlaneIntersection(Vector3(dataDim[0]*dataSpacing.x, dataDim[1]*dataSpacing.y, 0), dir, t) && t >= min && t <= max)
-				slicePoints.push_back(dataCoordsToPos(Vector3(dataDim[0]*dataSpacing.x, dataDim[1]*dataSpacing.y, 0)) + dir*t);
+			const Matrix3& dirMatrix = getModelNormalMatrix();
+
+			// Edges along each axis, from the corners at 0 on that axis
+			for (int axis = 0; axis < 3; ++axis) {
+				dir = dirMatrix * Vector3(axis == 0 ? size[0] : 0, axis == 1 ? size[1] : 0, axis == 2 ? size[2] : 0);// / settings->zoomFactor);
+				for (int i = 0; i < 8; ++i) {
+					if (!(i & (1 << axis)) && rayPlaneIntersection(corners[i], dir, t) && t >= min && t <= max)
+						slicePoints.push_back(corners[i] + dir*t);
+				}
+			}
 
 			// LOGD("slicePoints.size() = %d", slicePoints.size());
 		}
 	} else {
 		synchronized_if(isosurface) { isosurface->clearClipPlane(); }
-		synchronized_if(isosurfaceLow) { isosurfaceLow->clearClipPlane(); }
 		synchronized_if(volume) { volume->clearClipPlane(); }
+		synchronized_if(volume3d) { volume3d->clearClipPlane(); }
 	}
 }
 
@@ -1090,6 +1388,8 @@ void FluidMechanics::Impl::renderObjects()
 LOGD("sliceMatrix = %s", Utility::toString(state->sliceModelMatrix).c_str());
 LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 
+	PROFILE_SCOPE("renderObjects");
+
 	glClearColor(0, 0, 0, 1);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -1102,10 +1402,7 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 	glEnable(GL_DEPTH_TEST);
 
 	// XXX: test
-	Matrix4 mm;
-	synchronized(state->modelMatrix) {
-		mm = state->modelMatrix;
-	}
+	Matrix4 mm = transforms.model;
 
 	// Apply the zoom factor
 	mm = mm * Matrix4::makeTransform(
@@ -1116,6 +1413,7 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 
 	glDisable(GL_BLEND);
 	synchronized_if(isosurface) {
+		PROFILE_GPU_SCOPE("isosurface");
 		glDepthMask(true);
 		glDisable(GL_CULL_FACE);
 		isosurface->render(proj, mm);
@@ -1148,37 +1446,46 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 	}
 
 
-	bool exists = false;
-	synchronized (particles) {
-		for (Particle& p : particles) {
-			if (p.valid) {
-				exists = true;
-				break;
-			}
-		}
-	}
+	bool exists = particleEngine->hasParticles();
+	synchronized_if(gpuParticles) { exists = exists || gpuParticles->hasParticles(); }
 
-	if (!exists) {
-		synchronized(slice) {
-			slice->setOpaque(false);
-			slice->render(proj, s2mm);
-		}
+	// The right viewport only shows the slice, so both views of the
+	// slice are submitted together (the 3D one being hidden by
+	// particles)
+	synchronized(slice) {
+		PROFILE_GPU_SCOPE("slice");
+		const Matrix4 sliceProj[2] = { proj, app->getOrthoProjMatrix() };
+		const Matrix4 sliceMv[2] = { s2mm, Matrix4::identity() };
+		const GLint sliceViewports[2][4] = {
+			{ 0, 0, SCREEN_WIDTH/2, SCREEN_HEIGHT },
+			{ SCREEN_WIDTH/2, 0, SCREEN_WIDTH, SCREEN_HEIGHT } // (see orthoProjMatrix)
+		};
+		const unsigned int first = (exists ? 1 : 0);
+		slice->setResolution(settings->sliceResolution);
+		slice->setOpaque(false);
+		slice->render(sliceProj + first, sliceMv + first, sliceViewports + first, 2 - first);
 	}
+	glViewport(0, 0, SCREEN_WIDTH/2, SCREEN_HEIGHT);
 
 	synchronized(slicePoints) {
+		PROFILE_GPU_SCOPE("slice points");
 		if (!slicePoints.empty()) {
-			std::vector<Vector3> lineVec;
-			std::map<unsigned int, std::map<unsigned int, float>> graph;
+			const FrameAllocator<Vector3> allocator(frameArena);
+			FrameVector<Vector3> lineVec(allocator);
+			// (once per point, not per pair)
+			FrameVector<Vector3> dataPoints(slicePoints.size(), Vector3::zero(), allocator);
+			for (unsigned int i = 0; i < slicePoints.size(); ++i)
+				dataPoints[i] = posToDataCoords(slicePoints[i]);
 			for (unsigned int i = 0; i < slicePoints.size(); ++i) {
 				for (unsigned int j = 0; j < slicePoints.size(); ++j) {
 					// std::pair<unsigned int, unsigned int> pair(i, j);
 					// if (i == j || pairs.count(pair))
-					if (i == j || (graph.count(j) && graph.at(j).count(i)))
+					if (i == j)
 						continue;
 					const Vector3 pt1 = slicePoints.at(i);
 					const Vector3 pt2 = slicePoints.at(j);
-					const Vector3 dpt1 = posToDataCoords(pt1);
-					const Vector3 dpt2 = posToDataCoords(pt2);
+					const Vector3& dpt1 = dataPoints[i];
+					const Vector3& dpt2 = dataPoints[j];
 					static const float epsilon = 0.1f;
 					if (std::abs(dpt1.x-dpt2.x) < epsilon || std::abs(dpt1.y-dpt2.y) < epsilon || std::abs(dpt1.z-dpt2.z) < epsilon) {
 						// float dot = (pt2 - pt1).normalized().dot((center - pt1).normalized());
@@ -1192,7 +1499,7 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 					// }
 				}
 			}
-			lines->setLines(lineVec);
+			lines->setLines(lineVec.data(), lineVec.size());
 			// glLineWidth(1.0f);
 			glLineWidth(5.0f);
 			lines->setColor(Vector3(0, 1, 0));
@@ -1204,24 +1511,42 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 
 	//printf("Render Particle %f, %f, %f", seedPoint.x, seedPoint.y, seedPoint.z);
 		//std::cout << "Render Particle " << seedPoint.x << " - " << seedPoint.y << " - " << seedPoint.z << std::endl ;
-		synchronized (particles) {
-		for (Particle& p : particles) {
-			if (!p.valid)
-				continue;
-			integrateParticleMotion(p);
-			if (!p.valid || p.delayMs > 0)
-				continue;
-			Vector3 pos = p.pos;
-			pos -= Vector3(dataDim[0]/2, dataDim[1]/2, dataDim[2]/2) * dataSpacing;
-			// particleSphere->render(proj, mm * Matrix4::makeTransform(pos, Quaternion::identity(), Vector3(0.3f)));
-			// particleSphere->render(proj, mm * Matrix4::makeTransform(pos, Quaternion::identity(), Vector3(0.2f)));
-			particleSphere->render(proj, mm * Matrix4::makeTransform(pos, Quaternion::identity(), Vector3(0.15f)));
+	// Pause particle motion when the data is not visible
+	particleEngine->setPaused(!state->tangibleVisible);
+	const Vector3 particleOffset = Vector3(dataDim[0]/2, dataDim[1]/2, dataDim[2]/2) * dataSpacing;
+	{
+		PROFILE_GPU_SCOPE("particles");
+		if (particleEngine->getSnapshot(particlePositions))
+			particleRenderer->setPositions(particlePositions);
+		// All particles in a single draw call
+		particleRenderer->render(proj, mm * Matrix4::makeTransform(-particleOffset));
+		synchronized_if(gpuParticles) {
+			gpuParticles->update(!state->tangibleVisible);
+			gpuParticles->render(*particleRenderer, proj, mm * Matrix4::makeTransform(-particleOffset));
 		}
 	}
+	synchronized_if(streamlines) {
+		if (streamlines->getLines(streamlineSegments))
+			streamlineRenderer->setLines(streamlineSegments);
+	}
+	if (settings->showStreamlines) {
+		PROFILE_GPU_SCOPE("streamlines");
+		glLineWidth(2.0f);
+		streamlineRenderer->render(proj, mm * Matrix4::makeTransform(-particleOffset));
+	}
 
 
 	glEnable(GL_DEPTH_TEST);
+	if (settings->rayCastVolume && scalarDataSet && scalarDataSet->resources) {
+		synchronized(volume3d) {
+			if (!volume3d) {
+				LOGD("creating ray casting volume...");
+				volume3d.reset(new Volume3d(scalarDataSet->resources));
+			}
+		}
+	}
 	synchronized_if(volume) {
+		PROFILE_GPU_SCOPE("volume");
 		// glDepthMask(false);
 		glDepthMask(true);
 		glEnable(GL_BLEND);
@@ -1229,11 +1554,31 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 		// glBlendFunc(GL_SRC_ALPHA, GL_ONE); // additive
 		glDisable(GL_CULL_FACE);
 
-		volume->setOpacity(exists ? 0.025 : 1.0);
-		if (exists) volume->clearClipPlane();
-		volume->render(proj, mm);
+		// Off-screen at a lower resolution, composited over the
+		// opaque objects rendered above
+		const bool reduced = (settings->volumeResolution < 1.0f
+		                      && volumePass->begin(settings->volumeResolution,
+		                                           app->getNearClipDist(), app->getFarClipDist()));
+
+		if (settings->rayCastVolume) {
+			synchronized_if(volume3d) {
+				volume3d->setOpacity(exists ? 0.025 : 1.0);
+				volume3d->setStepSize(settings->rayStepSize);
+				if (exists) volume3d->clearClipPlane();
+				volume3d->render(proj, mm);
+			}
+		} else {
+			volume->setOpacity(exists ? 0.025 : 1.0);
+			volume->setPlaneStep(settings->volumePlaneStep);
+			if (exists) volume->clearClipPlane();
+			volume->render(proj, mm);
+		}
+
+		if (reduced)
+			volumePass->end();
 	}
 	synchronized_if(outline) {
+		PROFILE_GPU_SCOPE("outline");
 		glDepthMask(true);
 		glLineWidth(2.0f);
 		outline->setColor(Vector3(1.0f, 0, 0));
@@ -1244,19 +1589,6 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 	}
 
 
-
-	glViewport( SCREEN_WIDTH/2, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
-
-		//glClearColor(0, 0, 0, 1);
-		//glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-
-	synchronized(slice) {
-		slice->setOpaque(false);
-		slice->render(app->getOrthoProjMatrix(), Matrix4::identity());
-	}
-
-
 	return;
 
 	// Stylus (paddle?) z-buffer occlusion
@@ -1351,10 +1683,7 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 		glDepthMask(true);
 		glEnable(GL_CULL_FACE);
 
-		Matrix4 smm;
-		synchronized(state->stylusModelMatrix) {
-			smm = state->stylusModelMatrix;
-		}
+		Matrix4 smm = transforms.stylus;
 
 #ifndef NEW_STYLUS_RENDER
 		// Effector
@@ -1495,10 +1824,7 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 			if (insideVolume && settings->showCrossingLines) {
 				// Show crossing axes to help the user locate
 				// the effector position in the data
-				Matrix4 mm;
-				synchronized(state->modelMatrix) {
-					mm = state->modelMatrix;
-				}
+				Matrix4 mm = transforms.model;
 
 				glLineWidth(2.0f);
 				axisCube->setColor(Vector3(1.0f));
@@ -1543,10 +1869,7 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 
 
 	if (state->tangibleVisible) {
-		Matrix4 mm;
-		synchronized(state->modelMatrix) {
-			mm = state->modelMatrix;
-		}
+		Matrix4 mm = transforms.model;
 
 		// Apply the zoom factor
 		mm = mm * Matrix4::makeTransform(
@@ -1568,16 +1891,8 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 			glDisable(GL_BLEND);
 			glDepthMask(true);
 
-			if (!settings->surfacePreview || !isosurfaceLow) {
-				synchronized_if(isosurface) {
-					isosurface->render(proj, mm);
-				}
-			}
-
-			if (settings->surfacePreview) {
-				synchronized_if(isosurfaceLow) {
-					isosurfaceLow->render(proj, mm);
-				}
+			synchronized_if(isosurface) {
+				isosurface->render(proj, mm);
 			}
 		}
 
@@ -1586,24 +1901,11 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 		//printf("Render Particle %f, %f, %f", seedPoint.x, seedPoint.y, seedPoint.z);
 		//printf("Render Particle %f, %f, %f", seedPoint.x, seedPoint.y, seedPoint.z);
 		//std::cout << "Render Particle " << seedPoint.x << " - " << seedPoint.y << " - " << seedPoint.z << std::endl ;
-		synchronized (particles) {
-			for (Particle& p : particles) {
-				if (!p.valid)
-					continue;
-				integrateParticleMotion(p);
-				if (!p.valid || p.delayMs > 0)
-					continue;
-				Vector3 pos = p.pos;
-				pos -= Vector3(dataDim[0]/2, dataDim[1]/2, dataDim[2]/2) * dataSpacing;
-				// particleSphere->render(proj, mm * Matrix4::makeTransform(pos, Quaternion::identity(), Vector3(0.3f)));
-				// particleSphere->render(proj, mm * Matrix4::makeTransform(pos, Quaternion::identity(), Vector3(0.2f)));
-				particleSphere->render(proj, mm * Matrix4::makeTransform(pos, Quaternion::identity(), Vector3(0.15f)));
-			}
-		}
+		particleRenderer->render(proj, mm * Matrix4::makeTransform(-Vector3(dataDim[0]/2, dataDim[1]/2, dataDim[2]/2) * dataSpacing));
 
 		// NOTE: must be rendered before "slice" (because of
 		// transparency sorting)
-		std::cout << "Show Slice = " << settings->showSlice << " state->clipAxis = " << state->clipAxis << "   state->lockedClipAxis  " << state->lockedClipAxis << std::endl ; 
+		// LOGD("showSlice = %d, clipAxis = %d, lockedClipAxis = %d", settings->showSlice, state->clipAxis, state->lockedClipAxis);
 		if (settings->showSlice && state->clipAxis != CLIP_NONE && state->lockedClipAxis == CLIP_NONE) {
 			Vector3 scale;
 			Vector3 color;
@@ -1855,17 +2157,27 @@ LOGD("settings->zoomFactor = %f", settings->zoomFactor);*/
 	// }
 }
 
+void FluidMechanics::Impl::updateSurfaceCacheStats()
+{
+	unsigned int hits = 0, misses = 0;
+
+	synchronized_if(isosurface) {
+		isosurface->getCacheStats(hits, misses);
+	}
+
+	state->surfaceCacheHits = hits;
+	state->surfaceCacheMisses = misses;
+}
+
 void FluidMechanics::Impl::updateSurfacePreview()
 {
-	if (!settings->surfacePreview) {
-		synchronized_if(isosurface) {
-			isosurface->setPercentage(settings->surfacePercentage);
-		}
-	} else if (settings->surfacePreview) {
-		synchronized_if(isosurfaceLow) {
-			isosurfaceLow->setPercentage(settings->surfacePercentage);
-		}
+	changed = true;
+
+	synchronized_if(isosurface) {
+		isosurface->setPercentageAsync(settings->surfacePercentage);
 	}
+
+	updateSurfaceCacheStats();
 	
 	if(settings->considerX+settings->considerY+settings->considerZ == 3){
 		state->clipAxis = CLIP_NONE ;
@@ -1881,7 +2193,7 @@ void FluidMechanics::Impl::updateSurfacePreview()
 		state->clipAxis = CLIP_AXIS_Z ;
 	}
 	
-	std::cout<< "-------->Updated SURFACE PREVIEW" << std::endl ;
+	LOGD("updated surface preview");
 }
 
 FluidMechanics::FluidMechanics(const std::string& baseDir)
@@ -1912,14 +2224,88 @@ FluidMechanics::~FluidMechanics()
 	//
 }
 
-bool FluidMechanics::loadDataSet(const std::string& fileName)
+bool FluidMechanics::loadDataSet(const std::string& fileName, const std::string& velocityFileName)
 {
-	return impl->loadDataSet(fileName);
+	return impl->loadDataSet(fileName, velocityFileName);
 }
 
-bool FluidMechanics::loadVelocityDataSet(const std::string& fileName)
+bool FluidMechanics::setScalarField(ScalarField field)
 {
-	return impl->loadVelocityDataSet(fileName);
+	return impl->setScalarField(field);
+}
+
+ScalarField FluidMechanics::getScalarField() const
+{
+	return impl->scalarField;
+}
+
+bool FluidMechanics::probeScalar(const Vector3& pos, double& value) const
+{
+	ProbeSharedPtr probe = impl->getProbe();
+	return probe && probe->sampleScalar(pos, value);
+}
+
+bool FluidMechanics::probeVelocity(const Vector3& pos, Vector3& velocity) const
+{
+	ProbeSharedPtr probe = impl->getProbe();
+	return probe && probe->sampleVelocity(pos, velocity);
+}
+
+bool FluidMechanics::probeLine(const Vector3& from, const Vector3& to, unsigned int count, float* values) const
+{
+	ProbeSharedPtr probe = impl->getProbe();
+	if (!probe)
+		return false;
+
+	probe->sampleLine(from, to, count, values);
+	return true;
+}
+
+bool FluidMechanics::probeRange(const Vector3& min, const Vector3& max, double& minValue, double& maxValue) const
+{
+	ProbeSharedPtr probe = impl->getProbe();
+	return probe && probe->getRange(min, max, minValue, maxValue);
+}
+
+void FluidMechanics::reportMemoryUsage()
+{
+	impl->reportMemoryUsage();
+}
+
+void FluidMechanics::requestDataSet(int id)
+{
+	impl->requestDataSet(id);
+}
+
+void FluidMechanics::preloadDataSets()
+{
+	impl->dataSetManager->preloadAll();
+}
+
+bool FluidMechanics::loadTimeSeries(const std::string& pattern, const std::string& velocityPattern)
+{
+	return impl->loadTimeSeries(pattern, velocityPattern);
+}
+
+unsigned int FluidMechanics::getTimeStepCount() const
+{
+	return (impl->timeSeries ? impl->timeSeries->getStepCount() : 1);
+}
+
+unsigned int FluidMechanics::getTimeStep() const
+{
+	return impl->timeStep;
+}
+
+void FluidMechanics::setTimeStep(unsigned int step)
+{
+	impl->setTimeStep(step);
+}
+
+void FluidMechanics::setTimeSeriesPlaying(bool playing)
+{
+	impl->timeSeriesPlaying = playing;
+	impl->changed = true;
 }
 
 void FluidMechanics::releaseParticles()
@@ -1957,7 +2343,21 @@ void FluidMechanics::setMatrices(const Matrix4& volumeMatrix, const Matrix4& sty
 
 void FluidMechanics::render()
 {
+	// (before the results of the background work are consumed, since
+	// the ones published during this frame need another frame)
+	impl->busy = impl->isBusy();
+	impl->changed = false;
+
+	impl->updateDataSet();
+	impl->updateScalarField();
+	impl->updateTimeSeries();
 	impl->renderObjects();
+	impl->frameArena.reset();
+}
+
+bool FluidMechanics::needsRedraw() const
+{
+	return impl->changed || impl->busy;
 }
 
 void FluidMechanics::updateSurfacePreview()
@@ -4,6 +4,15 @@
 #include "global.h"
 
 
+// (see FluidMechanics::setScalarField(), same order as
+// DerivedFields::Field)
+enum ScalarField {
+	SCALAR_DATA_FILE = -1,
+	SCALAR_VELOCITY_MAGNITUDE = 0,
+	SCALAR_VORTICITY = 1,
+	SCALAR_Q_CRITERION = 2
+};
+
 class FluidMechanics
 {
 public:
@@ -16,10 +25,66 @@ public:
 	// (GL context)
 	void render();
 
+	// True if the next render() may differ from the previous one:
+	// new matrices, particles, datasets or surface values requested
+	// since then, or animations and background work in progress.
+	// Settings are not tracked: a frame must also be rendered after
+	// changing them.
+	bool needsRedraw() const;
+
 	void setMatrices(const Matrix4& volumeMatrix, const Matrix4& stylusMatrix);
 
-	bool loadDataSet(const std::string& fileName);
-	bool loadVelocityDataSet(const std::string& fileName);
+	// Loads a dataset (and its optional velocity data) right away
+	// (GL context)
+	bool loadDataSet(const std::string& fileName, const std::string& velocityFileName = "");
+
+	// Switches to one of the datasets of definitions.h once it has
+	// been loaded in the background, the current one being rendered
+	// meanwhile (render thread)
+	void requestDataSet(int id);
+
+	// Loads all the datasets of definitions.h in the background, to
+	// make switching to them immediate (they are kept in memory)
+	void preloadDataSets();
+
+	// Loads a time-varying dataset (one file per step, see
+	// TimeSeries), showing its first step right away. The next steps
+	// are decoded in the background, and shown once decoded when set
+	// with setTimeStep() or when playing. Throws if no step is found.
+	// (GL context)
+	bool loadTimeSeries(const std::string& pattern, const std::string& velocityPattern = "");
+	unsigned int getTimeStepCount() const; // (1 without time series)
+	unsigned int getTimeStep() const; // (the one being shown)
+	void setTimeStep(unsigned int step);
+	void setTimeSeriesPlaying(bool playing);
+
+	// Scalar field shown by the volume, the slice and the isosurface:
+	// the scalars of the dataset file, or a field derived from its
+	// velocity data (see DerivedFields). Derived fields are computed
+	// and uploaded in the background when first set, the current
+	// field being rendered meanwhile. Returns false if the current
+	// dataset has no velocity data. Switching datasets or time steps
+	// goes back to the scalars of the file.
+	// (render thread)
+	bool setScalarField(ScalarField field);
+	ScalarField getScalarField() const; // (the one being shown)
+
+	// Values of the current dataset at "pos", in data coordinates
+	// (from the corner of the grid, in the units of the spacing; see
+	// Probe). The scalars are those of the field shown. Read straight
+	// from the arrays, without blocking the rendering: any thread
+	// (e.g. input handling). Return false outside of the grid, without
+	// dataset, or without velocity data.
+	bool probeScalar(const Vector3& pos, double& value) const;
+	bool probeVelocity(const Vector3& pos, Vector3& velocity) const;
+	// "count" scalars evenly spaced from "from" to "to" (NaN outside
+	// of the grid)
+	bool probeLine(const Vector3& from, const Vector3& to, unsigned int count, float* values) const;
+	// Range of the scalars within the box [min, max]
+	bool probeRange(const Vector3& min, const Vector3& max, double& minValue, double& maxValue) const;
+
+	// Logs the CPU-side memory held by the current dataset (per object)
+	void reportMemoryUsage();
 
 	void updateSurfacePreview(); // must be called after updating the isosurface value in Settings
 
@@ -86,13 +151,21 @@ struct FluidMechanics::Settings
 	   showStylus(true),
 	   showSlice(false),
 	   showCrossingLines(true),
+	   rayCastVolume(false),
+	   gpuParticles(false),
+	   gpuSlice(false),
+	   showStreamlines(false),
 	   sliceType(SLICE_CAMERA),
 	   clipDist(defaultClipDist),
 	   surfacePercentage(0.13), // XXX: hardcoded testing value
 	   surfacePreview(false),
 	   considerX(1),
 	   considerY(1),
-	   considerZ(1)
+	   considerZ(1),
+	   volumePlaneStep(1),
+	   rayStepSize(1.0f),
+	   sliceResolution(1.0f),
+	   volumeResolution(1.0f)
 	{}
 
 	static constexpr float nativeZoomFactor = 2.0f; // global zoom multiplier
@@ -100,6 +173,10 @@ struct FluidMechanics::Settings
 
 	float zoomFactor;
 	bool showVolume, showSurface, showStylus, showSlice, showCrossingLines;
+	bool rayCastVolume; // Volume3d instead of the slice-based Volume
+	bool gpuParticles; // particles released next are advected on the GPU (GpuParticles)
+	bool gpuSlice; // axis and stylus slices sampled from a 3D texture instead of resliced (see Slice)
+	bool showStreamlines; // streamlines from the seed point, along with the particles
 	SliceType sliceType;
 	float clipDist; // if clipDist == 0, the clip plane is disabled
 	double surfacePercentage;
@@ -107,6 +184,12 @@ struct FluidMechanics::Settings
 	short considerX = 1 ;
 	short considerY = 1 ;
 	short considerZ = 1 ;
+
+	// Sampling quality (see QualityGovernor)
+	unsigned int volumePlaneStep; // see Volume::setPlaneStep()
+	float rayStepSize; // see Volume3d::setStepSize()
+	float sliceResolution; // see Slice::setResolution()
+	float volumeResolution; // the volume is rendered off-screen when < 1 (see ReducedResolutionPass)
 };
 
 // ======================================================================
@@ -123,7 +206,8 @@ struct FluidMechanics::State
 	State()
 	 : tangibleVisible(true), stylusVisible(true),
 	   computedZoomFactor(1.0f),
-	   clipAxis(CLIP_NONE), lockedClipAxis(CLIP_NONE)
+	   clipAxis(CLIP_NONE), lockedClipAxis(CLIP_NONE),
+	   surfaceCacheHits(0), surfaceCacheMisses(0)
 	{}
 
 	const bool tangibleVisible;
@@ -135,6 +219,9 @@ struct FluidMechanics::State
 	Synchronized<Matrix4> modelMatrix;
 	Synchronized<Matrix4> sliceModelMatrix;
 	Synchronized<Matrix4> stylusModelMatrix;
+
+	// Isosurface requests served from/missing the surface cache
+	unsigned int surfaceCacheHits, surfaceCacheMisses;
 };
 
 #endif /* FLUID_MECHANICS_H */
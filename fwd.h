@@ -7,12 +7,30 @@ typedef std::unique_ptr<Volume> VolumePtr;
 class Volume3d;
 typedef std::unique_ptr<Volume3d> Volume3dPtr;
 
+class GpuResources;
+typedef std::shared_ptr<GpuResources> GpuResourcesSharedPtr;
+
+class BrickPager;
+typedef std::unique_ptr<BrickPager> BrickPagerPtr;
+
 class Slice;
 typedef std::unique_ptr<Slice> SlicePtr;
 
 class IsoSurface;
 typedef std::unique_ptr<IsoSurface> IsoSurfacePtr;
 
+class ParticleEngine;
+typedef std::unique_ptr<ParticleEngine> ParticleEnginePtr;
+
+class GpuParticles;
+typedef std::unique_ptr<GpuParticles> GpuParticlesPtr;
+
+class Streamlines;
+typedef std::unique_ptr<Streamlines> StreamlinesPtr;
+
+class MinMaxTree;
+typedef std::shared_ptr<MinMaxTree> MinMaxTreeSharedPtr;
+
 class Material;
 typedef std::shared_ptr<Material> MaterialSharedPtr;
 
@@ -28,7 +46,19 @@ typedef std::unique_ptr<Mesh> MeshPtr;
 class Lines;
 typedef std::unique_ptr<Lines> LinesPtr;
 
+class Particles;
+typedef std::unique_ptr<Particles> ParticlesPtr;
+
+class ReducedResolutionPass;
+typedef std::unique_ptr<ReducedResolutionPass> ReducedResolutionPassPtr;
+
 class Texture;
 typedef std::shared_ptr<Texture> TexturePtr;
 
+class TimeSeries;
+typedef std::unique_ptr<TimeSeries> TimeSeriesPtr;
+
+class DerivedFields;
+typedef std::shared_ptr<DerivedFields> DerivedFieldsSharedPtr;
+
 #endif /* FWD_H */
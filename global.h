@@ -12,10 +12,12 @@
 
 #define android_assert assert
 
-#define LOGD(...) (printf(__VA_ARGS__), printf("\n"))
-#define LOGI(...) (printf(__VA_ARGS__), printf("\n"))
-#define LOGW(...) (fprintf(stderr, __VA_ARGS__), fprintf(stderr, "\n"))
-#define LOGE(...) (fprintf(stderr, __VA_ARGS__), fprintf(stderr, "\n"))
+// (asynchronous, see util/log.h)
+#include "util/log.h"
+#define LOGD(...) LOG_AT(Log::LEVEL_DEBUG, __VA_ARGS__)
+#define LOGI(...) LOG_AT(Log::LEVEL_INFO, __VA_ARGS__)
+#define LOGW(...) LOG_AT(Log::LEVEL_WARNING, __VA_ARGS__)
+#define LOGE(...) LOG_AT(Log::LEVEL_ERROR, __VA_ARGS__)
 
 // #define DOUBLE_PRECISION
 #include "util/linear_math.h"
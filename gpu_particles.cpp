@@ -0,0 +1,316 @@
+#include "gpu_particles.h"
+
+#include "rendering/material.h"
+#include "rendering/particles.h"
+#include "rendering/gl_objects.h"
+
+#include <cstdlib>
+#include <cstddef>
+
+namespace {
+	// NOTE: transform feedback is not available with OpenGL ES 2.0
+	const char* vertexShader =
+		"#define timeStep 1.0\n" // ms (ParticleEngine::timeStepMs)
+		"#define minVelocity 0.001\n"
+
+		"uniform sampler3D velocity;\n"
+		"uniform vec3 dimensions;\n"
+		"uniform float elapsed;\n" // ms (whole steps)
+		"uniform float speed;\n"
+		"uniform float stallDuration;\n"
+		"attribute vec4 state;\n"
+		"attribute vec2 timers;\n"
+		"varying vec4 outState;\n"
+		"varying vec2 outTimers;\n"
+
+		"vec3 sampleVelocity(vec3 p) {\n"
+		// (trilinear interpolation through texture filtering)
+		"  return texture3D(velocity, (p + 0.5) / dimensions).xyz;\n"
+		"}\n"
+
+		"bool inside(vec3 p) {\n"
+		"  return all(greaterThanEqual(p, vec3(0.0))) && all(lessThanEqual(p, dimensions - 1.0));\n"
+		"}\n"
+
+		"void main() {\n"
+		"  vec3 p = state.xyz;\n"
+		"  float visible = state.w;\n"
+		"  float delay = timers.x;\n"
+		"  float stall = timers.y;\n"
+		"  float ms = elapsed;\n"
+
+		// Not released yet
+		"  if (delay > 0.0) {\n"
+		"    delay -= ms;\n"
+		"    ms = -delay;\n"
+		"    if (delay <= 0.0) {\n"
+		"      delay = 0.0;\n"
+		"      visible = 1.0;\n"
+		"    }\n"
+		"  }\n"
+
+		// Stopped, removed after stallDuration
+		"  if (visible > 0.0 && stall > 0.0) {\n"
+		"    stall -= ms;\n"
+		"    if (stall <= 0.0) visible = 0.0;\n"
+		"    ms = 0.0;\n"
+		"  }\n"
+
+		"  if (visible > 0.0) {\n"
+		"    float h = speed * timeStep;\n"
+		"    int steps = int(ms / timeStep + 0.5);\n"
+		"    for (int i = 0; i < steps; ++i) {\n"
+		"      if (!inside(p)) {\n"
+		"        visible = 0.0;\n"
+		"        break;\n"
+		"      }\n"
+		"      vec3 k1 = sampleVelocity(p);\n"
+		"      if (dot(k1, k1) <= minVelocity*minVelocity) {\n"
+		"        stall = stallDuration;\n"
+		"        break;\n"
+		"      }\n"
+		"      vec3 k2 = sampleVelocity(p + 0.5*h*k1);\n"
+		"      vec3 k3 = sampleVelocity(p + 0.5*h*k2);\n"
+		"      vec3 k4 = sampleVelocity(p + h*k3);\n"
+		"      p += h/6.0 * (k1 + 2.0*k2 + 2.0*k3 + k4);\n"
+		"    }\n"
+		"  }\n"
+
+		"  outState = vec4(p, visible);\n"
+		"  outTimers = vec2(delay, stall);\n"
+		"  gl_Position = vec4(0.0, 0.0, 0.0, 1.0);\n"
+		"}";
+
+	// (never executed: rasterization is disabled)
+	const char* fragmentShader =
+		"void main() {\n"
+		"  gl_FragColor = vec4(0.0);\n"
+		"}";
+} // namespace
+
+GpuParticles::GpuParticles(VelocityFieldSharedPtr field, unsigned int count, float speed, int stallMs)
+ : mField(field),
+   mCount(count), mSpeed(speed), mStallMs(stallMs),
+   mMaterial(Material::get(vertexShader, fragmentShader, { "outState", "outTimers" })),
+   mBound(false),
+   mStateAttrib(-1), mTimersAttrib(-1),
+   mVelocityUniform(-1), mDimensionsUniform(-1), mElapsedUniform(-1), mSpeedUniform(-1), mStallDurationUniform(-1),
+   mCurrent(0),
+   mVelocityTexture(0),
+   mLastTimeNs(Utility::currentTimeNs()),
+   mSeedPending(false), mClearPending(false), mHasParticles(false),
+   mJitter(0), mDurationMs(0)
+{
+	android_assert(mField);
+	mBuffers[0] = mBuffers[1] = 0;
+	mVertexArrays[0] = mVertexArrays[1] = 0;
+}
+
+GpuParticles::~GpuParticles()
+{
+	GlObjects::deleteVertexArrays({ mVertexArrays[0], mVertexArrays[1] });
+	GlObjects::deleteBuffers({ mBuffers[0], mBuffers[1] });
+	GlObjects::deleteTextures({ mVelocityTexture });
+}
+
+// (GL context)
+void GpuParticles::bind()
+{
+	mMaterial->bind();
+
+	mStateAttrib = mMaterial->getAttribute("state");
+	mTimersAttrib = mMaterial->getAttribute("timers");
+	mVelocityUniform = mMaterial->getUniform("velocity");
+	mDimensionsUniform = mMaterial->getUniform("dimensions");
+	mElapsedUniform = mMaterial->getUniform("elapsed");
+	mSpeedUniform = mMaterial->getUniform("speed");
+	mStallDurationUniform = mMaterial->getUniform("stallDuration");
+
+	android_assert(mStateAttrib != -1);
+	android_assert(mTimersAttrib != -1);
+	android_assert(mVelocityUniform != -1);
+	android_assert(mDimensionsUniform != -1);
+	android_assert(mElapsedUniform != -1);
+	android_assert(mSpeedUniform != -1);
+	android_assert(mStallDurationUniform != -1);
+
+	// Particle state (all particles dead, the previous state being
+	// lost with the context)
+	const std::vector<State> empty(mCount, State { { 0, 0, 0, 0 }, { 0, 0 } });
+	for (GLuint& buffer : mBuffers) {
+		if (buffer == 0)
+			glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, mCount*sizeof(State), empty.data(), GL_DYNAMIC_COPY);
+	}
+	// (one vertex array per buffer, read by the update which writes
+	// into the other one; specified again since the attributes may
+	// have moved)
+	for (int i = 0; i < 2; ++i) {
+		if (mVertexArrays[i] == 0)
+			glGenVertexArrays(1, &mVertexArrays[i]);
+		glBindVertexArray(mVertexArrays[i]);
+		glBindBuffer(GL_ARRAY_BUFFER, mBuffers[i]);
+		glVertexAttribPointer(mStateAttrib, 4, GL_FLOAT, false, sizeof(State), (const GLvoid*)offsetof(State, position));
+		glEnableVertexAttribArray(mStateAttrib);
+		glVertexAttribPointer(mTimersAttrib, 2, GL_FLOAT, false, sizeof(State), (const GLvoid*)offsetof(State, timers));
+		glEnableVertexAttribArray(mTimersAttrib);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	mCurrent = 0;
+
+	// Velocity field
+	const int* dims = mField->getDimensions();
+	if (mVelocityTexture == 0)
+		glGenTextures(1, &mVelocityTexture);
+	glBindTexture(GL_TEXTURE_3D, mVelocityTexture);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB32F, dims[0], dims[1], dims[2], 0, GL_RGB, GL_FLOAT, mField->getData());
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	mBound = true;
+}
+
+void GpuParticles::release(const Vector3& seed, float jitter, int durationMs)
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	mSeed = seed;
+	mJitter = jitter;
+	mDurationMs = durationMs;
+	mSeedPending = true;
+	mClearPending = false;
+	mHasParticles = true;
+}
+
+void GpuParticles::clear()
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	mSeedPending = false;
+	mClearPending = true;
+	mHasParticles = false;
+}
+
+// (GL context)
+void GpuParticles::setVelocityField(VelocityFieldSharedPtr field)
+{
+	android_assert(field);
+	const int* dims = field->getDimensions();
+	android_assert(std::equal(dims, dims+3, mField->getDimensions()));
+	mField = field;
+
+	if (!mBound)
+		return; // (uploaded by bind())
+
+	glBindTexture(GL_TEXTURE_3D, mVelocityTexture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, dims[0], dims[1], dims[2], GL_RGB, GL_FLOAT, mField->getData());
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+bool GpuParticles::hasParticles()
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	return mHasParticles;
+}
+
+// (GL context)
+void GpuParticles::seed()
+{
+	Vector3 seed;
+	float jitter;
+	int durationMs;
+	bool clear;
+
+	{
+		tthread::lock_guard<tthread::mutex> g(mLock);
+		if (!mSeedPending && !mClearPending)
+			return;
+		seed = mSeed;
+		jitter = mJitter;
+		durationMs = mDurationMs;
+		clear = mClearPending;
+		mSeedPending = mClearPending = false;
+	}
+
+	std::vector<State> states(mCount, State { { 0, 0, 0, 0 }, { 0, 0 } });
+	if (!clear) {
+		for (unsigned int i = 0; i < mCount; ++i) {
+			State& s = states[i];
+			s.position[0] = seed.x + jitter * float(std::rand()) / RAND_MAX;
+			s.position[1] = seed.y + jitter * float(std::rand()) / RAND_MAX;
+			s.position[2] = seed.z + jitter * float(std::rand()) / RAND_MAX;
+			// (released by the first update if the delay is zero)
+			s.timers[0] = std::max(1LL, (long long)i * durationMs / mCount);
+		}
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, mBuffers[mCurrent]);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, mCount*sizeof(State), states.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// (GL context)
+void GpuParticles::update(bool paused)
+{
+	if (!mBound)
+		bind();
+
+	seed();
+
+	const long long now = Utility::currentTimeNs();
+	const int elapsedMs = (now - mLastTimeNs) / 1000000;
+	if (paused) {
+		mLastTimeNs = now;
+		return;
+	}
+	if (elapsedMs < 1)
+		return;
+	mLastTimeNs += elapsedMs * 1000000LL;
+
+	if (!hasParticles())
+		return;
+
+	glUseProgram(mMaterial->getHandle());
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_3D, mVelocityTexture);
+	const int* dims = mField->getDimensions();
+	glUniform1i(mVelocityUniform, 0);
+	glUniform3f(mDimensionsUniform, dims[0], dims[1], dims[2]);
+	glUniform1f(mElapsedUniform, std::min(elapsedMs, maxElapsedMs));
+	glUniform1f(mSpeedUniform, mSpeed);
+	glUniform1f(mStallDurationUniform, mStallMs);
+
+	// Current state
+	glBindVertexArray(mVertexArrays[mCurrent]);
+
+	// New state
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, mBuffers[1 - mCurrent]);
+
+	glEnable(GL_RASTERIZER_DISCARD);
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, mCount);
+	glEndTransformFeedback();
+	glDisable(GL_RASTERIZER_DISCARD);
+
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glBindVertexArray(0);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	mCurrent = 1 - mCurrent;
+}
+
+// (GL context)
+void GpuParticles::render(Particles& renderer, const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix)
+{
+	if (!mBound || !hasParticles())
+		return;
+
+	renderer.render(projectionMatrix, modelViewMatrix, mBuffers[mCurrent], mCount, sizeof(State));
+}
@@ -0,0 +1,86 @@
+#ifndef GPU_PARTICLES_H
+#define GPU_PARTICLES_H
+
+#include "global.h"
+
+#include "particle_engine.h"
+
+// GPU counterpart of ParticleEngine: particles live in buffer objects
+// and are advected with transform feedback (RK4 at the same fixed
+// time step), sampling the velocity field from a 3D texture. The
+// positions never go through the CPU, which is only involved when
+// seeding.
+class GpuParticles
+{
+public:
+	GpuParticles(VelocityFieldSharedPtr field, unsigned int count, float speed, int stallMs);
+	~GpuParticles();
+
+	// (GL context)
+	void bind();
+
+	// Same as ParticleEngine::release(), applied by the next update()
+	void release(const Vector3& seed, float jitter, int durationMs);
+
+	void clear();
+
+	// Replaces the velocity field by another timestep of the same
+	// grid (the particles keep moving; the velocity texture is
+	// updated in place)
+	// (GL context)
+	void setVelocityField(VelocityFieldSharedPtr field);
+
+	// True between release() and clear() (the GPU state is never
+	// read back)
+	bool hasParticles();
+
+	unsigned int getCount() const { return mCount; }
+
+	// Advances the particles to the current time, time not flowing
+	// while "paused"
+	// (GL context)
+	void update(bool paused);
+
+	// Draws the particles with "renderer"
+	// (GL context)
+	void render(Particles& renderer, const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix);
+
+	// Maximum time simulated by a single update (longer frames slow
+	// the particles down instead of stalling the GPU)
+	static const int maxElapsedMs = 100;
+
+private:
+	// Per-particle state, as captured by transform feedback
+	struct State
+	{
+		GLfloat position[4]; // (x, y, z, visible)
+		GLfloat timers[2]; // (release delay, stall time left), in ms
+	};
+
+	// (GL context)
+	void seed();
+
+	VelocityFieldSharedPtr mField;
+	const unsigned int mCount;
+	const float mSpeed;
+	const int mStallMs;
+
+	MaterialSharedPtr mMaterial;
+	bool mBound;
+	GLint mStateAttrib, mTimersAttrib;
+	GLint mVelocityUniform, mDimensionsUniform, mElapsedUniform, mSpeedUniform, mStallDurationUniform;
+	GLuint mBuffers[2]; // (ping-pong)
+	GLuint mVertexArrays[2]; // (update() input, one per buffer)
+	unsigned int mCurrent; // index of the buffer holding the current state
+	GLuint mVelocityTexture;
+	long long mLastTimeNs;
+
+	// Pending seeding or clearing (protected by mLock)
+	tthread::mutex mLock;
+	bool mSeedPending, mClearPending, mHasParticles;
+	Vector3 mSeed;
+	float mJitter;
+	int mDurationMs;
+};
+
+#endif /* GPU_PARTICLES_H */
@@ -0,0 +1,423 @@
+#include "gpu_resources.h"
+
+#include "transfer_function.h"
+#include "brick_pager.h"
+#include "util/parallel.h"
+
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+#include <vtkDataArray.h>
+
+#include <list>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+namespace {
+	// Converts a scalar to a texel: 0 for invalid (infinite) voxels,
+	// the normalized value otherwise ("scale" maps the scalar range to
+	// the texel range, and valid values are never below 1). The
+	// sentinel values of some datasets are only handled by the CPU
+	// slice (see Slice), the maximum value being a valid voxel here.
+	template <typename Texel>
+	inline Texel convertScalar(double value, double min, double scale)
+	{
+		const bool invalid = std::isinf(value);
+		const double norm = (value-min)*scale + 0.5;
+		const double maxTexel = std::numeric_limits<Texel>::max();
+		return (invalid ? 0 : Texel(std::max(1.0, std::min(norm, maxTexel)))); // (NaNs give 1)
+	}
+
+	// Converts "count" scalars from "first" to "dst"
+	template <typename T, typename Texel>
+	void convertScalars(const T* src, int components, std::size_t first, std::size_t count,
+	                    double min, double scale, Texel* dst)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			dst[i] = convertScalar<Texel>(src[(first+i)*components], min, scale);
+	}
+
+	// Converts size[0] x size[1] x size[2] scalars, taking every
+	// "stride"-th voxel from "origin" (coordinates clamped to the
+	// grid)
+	template <typename T, typename Texel>
+	void gatherScalars(const T* src, int components, const int* dims, const int* origin,
+	                   int stride, const int* size, double min, double scale, Texel* dst)
+	{
+		for (int k = 0; k < size[2]; ++k) {
+			const int z = std::max(0, std::min(origin[2] + k*stride, dims[2]-1));
+			for (int j = 0; j < size[1]; ++j) {
+				const int y = std::max(0, std::min(origin[1] + j*stride, dims[1]-1));
+				const std::size_t row = (std::size_t(z)*dims[1] + y)*dims[0];
+				for (int i = 0; i < size[0]; ++i) {
+					const int x = std::max(0, std::min(origin[0] + i*stride, dims[0]-1));
+					*dst++ = convertScalar<Texel>(src[(row + x)*components], min, scale);
+				}
+			}
+		}
+	}
+
+	// Converts the scalars of "data" into a texture of "size" texels,
+	// taking every "stride"-th voxel
+	template <typename Texel>
+	void convertVolume(vtkDataArray* scalars, const int* dims, const int* size, int stride,
+	                   const double* range, Texel* dst)
+	{
+		const double scale = (range[1] > range[0] ? std::numeric_limits<Texel>::max() / (range[1]-range[0]) : 0);
+		const void* src = scalars->GetVoidPointer(0);
+		const int components = scalars->GetNumberOfComponents();
+		const std::size_t sliceSize = std::size_t(size[0])*size[1];
+
+		Parallel::forEach(0, size[2], [&](int z) {
+			if (stride == 1) {
+				switch (scalars->GetDataType()) {
+					vtkTemplateMacro(
+						convertScalars(static_cast<const VTK_TT*>(src), components,
+						               z*sliceSize, sliceSize, range[0], scale, dst + z*sliceSize)
+					);
+					default:
+						throw std::runtime_error("GpuResources: unsupported scalar type");
+				}
+			} else {
+				const int origin[3] = { 0, 0, z*stride };
+				const int sliceDims[3] = { size[0], size[1], 1 };
+				switch (scalars->GetDataType()) {
+					vtkTemplateMacro(
+						gatherScalars(static_cast<const VTK_TT*>(src), components, dims, origin,
+						              stride, sliceDims, range[0], scale, dst + z*sliceSize)
+					);
+					default:
+						throw std::runtime_error("GpuResources: unsupported scalar type");
+				}
+			}
+		});
+	}
+	// Textures of destroyed resources, deleted by the next GL
+	// context user
+	Synchronized<std::list<GLuint>> staleTexturesList;
+
+	// (GL context)
+	void freeStaleTextures()
+	{
+		synchronized (staleTexturesList) {
+			if (!staleTexturesList.empty()) {
+				LOGD("freeing %ld texture(s)", staleTexturesList.size());
+				for (GLuint texture : staleTexturesList)
+					glDeleteTextures(1, &texture);
+				staleTexturesList.clear();
+			}
+		}
+	}
+} // namespace
+
+GpuResources::GpuResources(vtkSmartPointer<vtkImageData> data)
+ : mData(data),
+   mFormat(R8), mTextureStride(1),
+   mTextureHandle(0), mTextureDirty(false),
+   mGeneration(0)
+{
+	android_assert(data);
+
+	// Check if the data dimension is 3
+	int dim = data->GetDataDimension();
+	if (dim != 3) {
+		throw std::runtime_error(
+			"GpuResources: data is not 3D (dimension = " + Utility::toString(dim) + ")"
+		);
+	}
+
+	if (!data->GetPointData() || !data->GetPointData()->GetScalars())
+		throw std::runtime_error("GpuResources: unsupported data");
+
+	data->GetDimensions(mDimensions);
+
+	double spacing[3];
+	data->GetSpacing(spacing);
+	mSpacing = Vector3(spacing[0], spacing[1], spacing[2]);
+
+	data->GetPointData()->GetScalars()->GetRange(mRange);
+
+	// Datasets too big for a single texture are paged, the shared
+	// texture being a downsampled overview
+	const std::size_t voxelCount = std::size_t(mDimensions[0])*mDimensions[1]*mDimensions[2];
+	if (voxelCount > pagingThreshold) {
+		mPager.reset(new BrickPager(mData, mRange));
+		while (voxelCount / (std::size_t(mTextureStride)*mTextureStride*mTextureStride) > overviewVoxels)
+			mTextureStride *= 2;
+		LOGD("paged dataset: %zu MB, overview stride %d", voxelCount >> 20, mTextureStride);
+	}
+
+	// (the transfer function has more entries than 8-bit values)
+	if (!mPager && data->GetPointData()->GetScalars()->GetDataTypeSize() > 1 && 2*voxelCount <= maxR16Bytes)
+		mFormat = R16;
+
+	for (int d = 0; d < 3; ++d)
+		mTextureDimensions[d] = (mDimensions[d] + mTextureStride-1) / mTextureStride;
+
+	buildTexture();
+	computeBrickRanges();
+}
+
+GpuResources::~GpuResources()
+{
+	// Schedule textures to be cleared
+	synchronized (staleTexturesList) {
+		if (mTextureHandle != 0)
+			staleTexturesList.emplace_back(mTextureHandle);
+		for (const auto& entry : mTransferFunctions)
+			staleTexturesList.emplace_back(entry.second);
+		if (mPager) {
+			// (not deleted by the pager, see ~BrickPager())
+			if (mPager->getAtlasTexture() != 0)
+				staleTexturesList.emplace_back(mPager->getAtlasTexture());
+			if (mPager->getPageTableTexture() != 0)
+				staleTexturesList.emplace_back(mPager->getPageTableTexture());
+		}
+	}
+}
+
+void GpuResources::extractBrick(vtkImageData* data, const double* range, const int* origin,
+                                int stride, int size, unsigned char* dst)
+{
+	vtkDataArray* scalars = data->GetPointData()->GetScalars();
+	android_assert(scalars);
+
+	int dims[3];
+	data->GetDimensions(dims);
+	const int sizes[3] = { size, size, size };
+	const double scale = (range[1] > range[0] ? 255 / (range[1]-range[0]) : 0);
+
+	switch (scalars->GetDataType()) {
+		vtkTemplateMacro(
+			gatherScalars(static_cast<const VTK_TT*>(scalars->GetVoidPointer(0)), scalars->GetNumberOfComponents(),
+			              dims, origin, stride, sizes, range[0], scale, dst)
+		);
+		default:
+			throw std::runtime_error("GpuResources: unsupported scalar type");
+	}
+}
+
+void GpuResources::buildTexture()
+{
+	vtkDataArray* scalars = mData->GetPointData()->GetScalars();
+	android_assert(scalars);
+	android_assert(std::size_t(scalars->GetNumberOfTuples()) == std::size_t(mDimensions[0])*mDimensions[1]*mDimensions[2]);
+
+	// (downsampled for the overview of paged datasets)
+	const std::size_t count = std::size_t(mTextureDimensions[0])*mTextureDimensions[1]*mTextureDimensions[2];
+
+	if (mFormat == R16) {
+		mTexture.resize(2*count);
+		convertVolume(scalars, mDimensions, mTextureDimensions, mTextureStride, mRange,
+		              reinterpret_cast<uint16_t*>(mTexture.data()));
+	} else {
+		mTexture.resize(count);
+		convertVolume(scalars, mDimensions, mTextureDimensions, mTextureStride, mRange,
+		              mTexture.data());
+	}
+}
+
+void GpuResources::computeBrickRanges()
+{
+	for (int d = 0; d < 3; ++d)
+		mBrickDimensions[d] = (mDimensions[d] + brickSize-1) / brickSize;
+
+	const int nx = mDimensions[0], ny = mDimensions[1], nz = mDimensions[2];
+	const int bx = mBrickDimensions[0], by = mBrickDimensions[1];
+
+	// (min, max) pairs, empty ranges first
+	mBrickRanges.resize(2*bx*by*mBrickDimensions[2]);
+	for (std::size_t i = 0; i < mBrickRanges.size(); i += 2) {
+		mBrickRanges[i+0] = 255;
+		mBrickRanges[i+1] = 0;
+	}
+
+	// The ranges are computed on 8-bit values: the slices of R16
+	// textures are narrowed, and those of paged datasets (whose
+	// texture is only an overview) are converted again, one at a time
+	vtkDataArray* scalars = mData->GetPointData()->GetScalars();
+	const std::size_t sliceSize = std::size_t(nx)*ny;
+	const double scale = (mRange[1] > mRange[0] ? 255 / (mRange[1]-mRange[0]) : 0);
+
+	Parallel::forEach(0, mBrickDimensions[2], [&](int k) {
+		std::vector<unsigned char> buffer(mPager || mFormat == R16 ? sliceSize : 0);
+
+		const int z1 = std::min((k+1)*brickSize, nz-1);
+		for (int z = k*brickSize; z <= z1; ++z) {
+			const unsigned char* slice = buffer.data();
+			if (mPager) {
+				switch (scalars->GetDataType()) {
+					vtkTemplateMacro(
+						convertScalars(static_cast<const VTK_TT*>(scalars->GetVoidPointer(0)), scalars->GetNumberOfComponents(),
+						               z*sliceSize, sliceSize, mRange[0], scale, buffer.data())
+					);
+					default:
+						throw std::runtime_error("GpuResources: unsupported scalar type");
+				}
+			} else if (mFormat == R16) {
+				// (valid values stay non-zero)
+				const uint16_t* src = reinterpret_cast<const uint16_t*>(mTexture.data()) + z*sliceSize;
+				for (std::size_t i = 0; i < sliceSize; ++i)
+					buffer[i] = (src[i] != 0 ? std::max(1, src[i] >> 8) : 0);
+			} else {
+				slice = mTexture.data() + z*sliceSize;
+			}
+
+			for (int y = 0; y < ny; ++y) {
+				const unsigned char* row = &slice[std::size_t(y)*nx];
+				for (int j = std::max(y-1, 0)/brickSize; j <= std::min(y/brickSize, by-1); ++j) {
+					unsigned char* range = &mBrickRanges[(std::size_t(k)*by + j)*bx*2];
+					for (int x = 0; x < nx; ++x) {
+						const unsigned char value = row[x];
+						if (value == 0)
+							continue; // (invalid voxel)
+						const int i0 = std::max(x-1, 0)/brickSize, i1 = std::min(x/brickSize, bx-1);
+						for (int i = i0; i <= i1; ++i) {
+							range[i*2+0] = std::min(range[i*2+0], value);
+							range[i*2+1] = std::max(range[i*2+1], value);
+						}
+					}
+				}
+			}
+		}
+	});
+}
+
+std::size_t GpuResources::getMemoryUsage() const
+{
+	return mTexture.capacity() + mBrickRanges.capacity() + (mPager ? mPager->getMemoryUsage() : 0);
+}
+
+bool GpuResources::isIdle() const
+{
+	return !mPager || mPager->isIdle();
+}
+
+void GpuResources::invalidate()
+{
+	// (the old handles belong to the lost context)
+	mTextureHandle = 0;
+	mTextureDirty = false;
+	mTransferFunctions.clear();
+	if (mPager)
+		mPager->invalidate();
+}
+
+void GpuResources::replaceData(GpuResources& next)
+{
+	if (!std::equal(mDimensions, mDimensions+3, next.mDimensions) || mFormat != next.mFormat)
+		throw std::runtime_error("GpuResources: the dimensions or the type of the new data don't match");
+
+	mData = next.mData;
+	mSpacing = next.mSpacing;
+	std::copy(next.mRange, next.mRange+2, mRange);
+	mBrickRanges = next.mBrickRanges;
+	if (mPager)
+		mPager->replaceData(mData, mRange);
+
+	// (the staging texture is taken: it is converted again if "next"
+	// is used again)
+	mTexture.swap(next.mTexture);
+	std::vector<unsigned char>().swap(next.mTexture);
+	if (mTexture.empty())
+		buildTexture();
+
+	mTextureDirty = (mTextureHandle != 0);
+	++mGeneration;
+}
+
+// (GL context)
+void GpuResources::bind()
+{
+	freeStaleTextures();
+
+	if (mTextureHandle != 0 && mTextureDirty) {
+		// Same size: the storage of the texture is kept
+		glBindTexture(GL_TEXTURE_3D, mTextureHandle);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage3D(
+			GL_TEXTURE_3D,
+			0,
+			0, 0, 0,
+			mTextureDimensions[0], mTextureDimensions[1], mTextureDimensions[2],
+			GL_RED,
+			(mFormat == R16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE),
+			mTexture.data()
+		);
+		std::vector<unsigned char>().swap(mTexture);
+		glBindTexture(GL_TEXTURE_3D, 0);
+		mTextureDirty = false;
+	}
+
+	if (mTextureHandle != 0)
+		return;
+
+	glGenTextures(1, &mTextureHandle);
+	glBindTexture(GL_TEXTURE_3D, mTextureHandle);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+	// (the staging buffer is released after each upload)
+	if (mTexture.empty())
+		buildTexture();
+
+	// Required because input is not RGBA (i.e. not aligned to a 4-byte boundary)
+	// http://www.opengl.org/wiki/Common_Mistakes#Texture_upload_and_pixel_reads
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	glTexImage3D(
+		GL_TEXTURE_3D,
+		0,
+		(mFormat == R16 ? GL_R16 : GL_R8),
+		mTextureDimensions[0], mTextureDimensions[1], mTextureDimensions[2],
+		0,
+		GL_RED,
+		(mFormat == R16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE),
+		mTexture.data()
+	);
+	std::vector<unsigned char>().swap(mTexture);
+
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+// (GL context)
+GLuint GpuResources::getScalarTexture()
+{
+	bind();
+	return mTextureHandle;
+}
+
+// (GL context)
+GLuint GpuResources::getTransferFunctionTexture(float alphaOffset, float alphaScale)
+{
+	GLuint& handle = mTransferFunctions[std::make_pair(alphaOffset, alphaScale)];
+	if (handle != 0)
+		return handle;
+
+	const TransferFunction tf(alphaOffset, alphaScale);
+
+	glGenTextures(1, &handle);
+	glBindTexture(GL_TEXTURE_2D, handle);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glTexImage2D(
+		GL_TEXTURE_2D,
+		0,
+		GL_RGBA,
+		TransferFunction::lutSize, 1,
+		0,
+		GL_RGBA,
+		GL_UNSIGNED_BYTE,
+		tf.getLut()
+	);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return handle;
+}
@@ -0,0 +1,120 @@
+#ifndef GPU_RESOURCES_H
+#define GPU_RESOURCES_H
+
+#include "global.h"
+
+#include <vtkSmartPointer.h>
+
+#include <map>
+
+class vtkImageData;
+
+// GL resources derived from a dataset, shared by all the renderables
+// drawing it (Volume, Volume3d, Slice): one single-channel 3D texture
+// of the normalized scalars, and one texture per transfer function.
+// Built on any thread, uploaded on first use.
+// Datasets whose scalar texture would exceed pagingThreshold are
+// paged instead (see BrickPager): the scalar texture is then only a
+// downsampled overview of at most overviewVoxels voxels, and Volume3d
+// samples the full resolution bricks through the pager.
+class GpuResources
+{
+public:
+	// Converts the scalars of "data" (throws if "data" is not a 3D
+	// image with point scalars)
+	GpuResources(vtkSmartPointer<vtkImageData> data);
+	~GpuResources();
+
+	// Uploads the scalar texture if needed
+	// (GL context)
+	void bind();
+
+	// Forgets all the textures (to be called when the GL context is
+	// recreated)
+	void invalidate();
+
+	// Takes the data, scalars and brick ranges of "next" (another
+	// timestep of the same grid, built on any thread): the scalar
+	// texture is updated in place by the next bind(), and the
+	// generation is incremented. Throws if the grids don't match.
+	// (GL thread)
+	void replaceData(GpuResources& next);
+
+	// Incremented by replaceData(), so that the objects derived from
+	// the data can tell when to update
+	unsigned int getGeneration() const { return mGeneration; }
+
+	// 3D texture of the normalized scalars (red channel), 0 being
+	// reserved for invalid voxels: valid values start at the first
+	// step above 0, so that a sample is non-zero as long as one of the
+	// interpolated voxels is valid. 16-bit for the scalar types wider
+	// than 8 bits, unless the texture would exceed maxR16Bytes.
+	// (downsampled if the dataset is paged)
+	// (GL context)
+	GLuint getScalarTexture();
+
+	enum ScalarFormat { R8, R16 };
+	ScalarFormat getScalarFormat() const { return mFormat; }
+
+	static const std::size_t maxR16Bytes = std::size_t(64) << 20;
+	static const std::size_t pagingThreshold = std::size_t(512) << 20; // bytes (8-bit voxels)
+	static const std::size_t overviewVoxels = std::size_t(16) << 20;
+
+	// Null unless the dataset is paged
+	BrickPager* getPager() const { return mPager.get(); }
+
+	// False while bricks are being paged in
+	bool isIdle() const;
+
+	// Converts size^3 voxels of "data", taking every "stride"-th voxel
+	// from "origin" (clamped to the grid), into 8-bit texels like the
+	// scalar texture ("range" being the scalar range of the whole
+	// dataset). Thread-safe.
+	static void extractBrick(vtkImageData* data, const double* range, const int* origin,
+	                         int stride, int size, unsigned char* dst);
+
+	// TransferFunction::lutSize x 1 RGBA texture of the given
+	// transfer function (see TransferFunction), created on first
+	// request
+	// (GL context)
+	GLuint getTransferFunctionTexture(float alphaOffset, float alphaScale);
+
+	// Minimum and maximum normalized values (1..255) of the valid
+	// voxels of each brick of brickSize^3 voxels, x first (min > max
+	// if there is none). Bricks overlap by one voxel, since the
+	// samples taken near the border of a brick interpolate the voxels
+	// of the next one.
+	static const int brickSize = 8;
+	const std::vector<unsigned char>& getBrickRanges() const { return mBrickRanges; }
+	const int* getBrickDimensions() const { return mBrickDimensions; }
+
+	vtkSmartPointer<vtkImageData> getData() const { return mData; }
+	const int* getDimensions() const { return mDimensions; }
+	const Vector3& getSpacing() const { return mSpacing; }
+	const double* getRange() const { return mRange; }
+
+	// CPU-side memory held by the resources, in bytes (the texture
+	// staging buffer is released once uploaded)
+	std::size_t getMemoryUsage() const;
+
+private:
+	// Normalized scalars in mTexture (8 or 16-bit texels)
+	void buildTexture();
+
+	void computeBrickRanges();
+
+	vtkSmartPointer<vtkImageData> mData; // (shared, not copied)
+	int mDimensions[3], mBrickDimensions[3];
+	Vector3 mSpacing;
+	double mRange[2];
+	ScalarFormat mFormat;
+	int mTextureDimensions[3], mTextureStride; // (stride > 1 for the overview of paged datasets)
+	std::vector<unsigned char> mTexture, mBrickRanges;
+	BrickPagerPtr mPager;
+	GLuint mTextureHandle;
+	bool mTextureDirty; // (mTextureHandle holds the previous data)
+	unsigned int mGeneration;
+	std::map<std::pair<float, float>, GLuint> mTransferFunctions;
+};
+
+#endif /* GPU_RESOURCES_H */
@@ -1,22 +1,22 @@
 #include "isosurface.h"
 
+#include "isosurface_tables.h"
+#include "minmax_tree.h"
 #include "rendering/material.h"
+#include "rendering/gl_objects.h"
+#include "util/parallel.h"
 
+#include <algorithm>
 #include <limits>
 #include <climits>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#include <vtkNew.h>
 #include <vtkImageData.h>
 #include <vtkPointData.h>
-#include <vtkCellData.h>
-#include <vtkCellArray.h>
-#include <vtkTriangleFilter.h>
-#include <vtkMarchingCubes.h>
-#include <vtkDecimatePro.h>
-#include <vtkPolyDataNormals.h>
-#include <vtkTransform.h>
-#include <vtkTransformPolyDataFilter.h>
-#include <vtkWindowedSincPolyDataFilter.h>
 
 namespace {
 	const char* vertexShader =
@@ -124,16 +124,396 @@ namespace {
 		// "}"
 
 		;
+
+	// Raw scalar grid, as stored in vtkImageData (x varies fastest)
+	struct ScalarField
+	{
+		const void* data;
+		int type, components;
+		int dims[3];
+
+		// Position of grid point (i,j,k), in the normalized
+		// coordinates used for rendering: offset + (i,j,k)*scale
+		float offset[3], scale[3];
+
+		// Grid spacing, for gradient computations
+		float spacing[3];
+	};
+
+	// Vertices and triangles extracted from one z-slab of the field
+	struct Slab
+	{
+		std::vector<GLfloat> vertices; // (x, y, z, nx, ny, nz) per vertex
+		std::vector<unsigned int> indices;
+	};
+
+	// Origin corner and axis of the grid edge matching each cube edge
+	const int edgeCorner[12] = { 0, 1, 3, 0, 4, 5, 7, 4, 0, 1, 2, 3 };
+	const int edgeAxis[12]   = { 0, 1, 0, 1, 0, 1, 0, 1, 2, 2, 2, 2 };
+	const int cornerOffset[8][3] = {
+		{0,0,0}, {1,0,0}, {1,1,0}, {0,1,0},
+		{0,0,1}, {1,0,1}, {1,1,1}, {0,1,1}
+	};
+
+	// Sets out[n] to 1 if plane[n] is below the isovalue, 0 otherwise
+	template <typename T>
+	void classifyPlane(const T* plane, int count, int components, float value, unsigned char* out)
+	{
+		for (int n = 0; n < count; ++n)
+			out[n] = (float(plane[n*components]) < value);
+	}
+
+#ifdef __SSE2__
+	template <>
+	void classifyPlane<float>(const float* plane, int count, int components, float value, unsigned char* out)
+	{
+		int n = 0;
+
+		if (components == 1) {
+			// 16 comparisons at a time, packed into 16 bytes
+			const __m128 v = _mm_set1_ps(value);
+			const __m128i one = _mm_set1_epi8(1);
+			for (; n+16 <= count; n += 16) {
+				__m128i a = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(plane+n+0), v));
+				__m128i b = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(plane+n+4), v));
+				__m128i c = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(plane+n+8), v));
+				__m128i d = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(plane+n+12), v));
+				__m128i bytes = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out+n), _mm_and_si128(bytes, one));
+			}
+		}
+
+		for (; n < count; ++n)
+			out[n] = (plane[n*components] < value);
+	}
+#endif
+
+	template <typename T>
+	class SlabExtractor
+	{
+	public:
+		SlabExtractor(const ScalarField& field, float value, Slab& slab)
+		 : mField(field), mScalars(static_cast<const T*>(field.data)),
+		   mValue(value), mSlab(slab),
+		   nx(field.dims[0]), ny(field.dims[1]), nz(field.dims[2]),
+		   mPlaneCache(2*nx*ny*2), mZCache(nx*ny)
+		{
+			mClassifiedPlane[0] = mClassifiedPlane[1] = -1;
+		}
+
+		// Extracts the cell layers [zBegin, zEnd) entirely
+		void extractLayers(int zBegin, int zEnd)
+		{
+			for (int k = zBegin; k < zEnd; ++k)
+				processCells(k, 0, nx-1, 0, ny-1, classifiedPlane(k), classifiedPlane(k+1), nx);
+		}
+
+		// Extracts the cell layers [zBegin, zEnd) of the given bricks
+		// only ("bx + by*bricksX" indices)
+		void extractBricks(int zBegin, int zEnd, const std::vector<int>& bricks, int bricksX)
+		{
+			const int bs = MinMaxTree::brickSize;
+			const int components = mField.components;
+			std::vector<unsigned char> patches[2] = {
+				std::vector<unsigned char>((bs+1)*(bs+1)),
+				std::vector<unsigned char>((bs+1)*(bs+1))
+			};
+
+			for (int k = zBegin; k < zEnd; ++k) {
+				for (int brick : bricks) {
+					const int x0 = (brick % bricksX)*bs, x1 = std::min(x0+bs, nx-1);
+					const int y0 = (brick / bricksX)*bs, y1 = std::min(y0+bs, ny-1);
+					const int stride = x1-x0+1;
+
+					for (int p = 0; p < 2; ++p) {
+						for (int j = y0; j <= y1; ++j) {
+							classifyPlane(mScalars + ((std::size_t(k+p)*ny + j)*nx + x0)*components,
+							              stride, components, mValue, patches[p].data() + (j-y0)*stride);
+						}
+					}
+
+					processCells(k, x0, x1, y0, y1, patches[0].data(), patches[1].data(), stride);
+				}
+			}
+		}
+
+	private:
+		struct CacheEntry
+		{
+			CacheEntry() : stamp(-1), index(0) {}
+			int stamp;
+			unsigned int index;
+		};
+
+		// Cells [i0, i1) x [j0, j1) of layer k, given the classified grid
+		// points of planes k (c0) and k+1 (c1), stored by rows of
+		// "stride" points starting at point (i0, j0)
+		void processCells(int k, int i0, int i1, int j0, int j1,
+		                  const unsigned char* c0, const unsigned char* c1, int stride)
+		{
+			for (int j = j0; j < j1; ++j) {
+				const unsigned char* r0 = c0 + (j-j0)*stride;
+				const unsigned char* r1 = r0 + stride;
+				const unsigned char* r2 = c1 + (j-j0)*stride;
+				const unsigned char* r3 = r2 + stride;
+
+				for (int i = i0, n = 0; i < i1; ++i, ++n) {
+					const unsigned int cubeIndex =
+						(r0[n]        ) | (r0[n+1] << 1) | (r1[n+1] << 2) | (r1[n] << 3) |
+						(r2[n]   << 4) | (r2[n+1] << 5) | (r3[n+1] << 6) | (r3[n] << 7);
+
+					if (cubeIndex == 0 || cubeIndex == 255)
+						continue;
+
+					const signed char* tri = MarchingCubes::triTable[cubeIndex];
+					for (int t = 0; tri[t] != -1; ++t)
+						mSlab.indices.push_back(getVertex(i, j, k, tri[t]));
+				}
+			}
+		}
+
+		// Classification of the whole plane k (computed at most once)
+		const unsigned char* classifiedPlane(int k)
+		{
+			std::vector<unsigned char>& plane = mPlanes[k & 1];
+			if (mClassifiedPlane[k & 1] != k) {
+				plane.resize(nx*ny);
+				classifyPlane(mScalars + std::size_t(k)*nx*ny*mField.components,
+				              nx*ny, mField.components, mValue, plane.data());
+				mClassifiedPlane[k & 1] = k;
+			}
+			return plane.data();
+		}
+
+		float at(int i, int j, int k) const
+		{ return float(mScalars[((std::size_t(k)*ny + j)*nx + i)*mField.components]); }
+
+		// Central differences (one-sided on the borders)
+		void gradient(int i, int j, int k, float* g) const
+		{
+			const int p[3] = { i, j, k };
+			for (int axis = 0; axis < 3; ++axis) {
+				int lo[3] = { i, j, k }, hi[3] = { i, j, k };
+				if (p[axis] > 0) --lo[axis];
+				if (p[axis] < mField.dims[axis]-1) ++hi[axis];
+				const float h = (hi[axis] - lo[axis]) * mField.spacing[axis];
+				g[axis] = (h > 0 ? (at(hi[0], hi[1], hi[2]) - at(lo[0], lo[1], lo[2])) / h : 0.0f);
+			}
+		}
+
+		// Returns the index of the vertex on the given cube edge,
+		// creating it if it doesn't exist yet
+		unsigned int getVertex(int i, int j, int k, int edge)
+		{
+			const int* o = cornerOffset[edgeCorner[edge]];
+			const int axis = edgeAxis[edge];
+			const int vi = i+o[0], vj = j+o[1], vk = k+o[2];
+
+			// Each vertex is shared by up to 4 cells: edges along x and y
+			// are cached per z-plane, edges along z per cell layer
+			CacheEntry& entry = (axis < 2
+				? mPlaneCache[((vk & 1)*nx*ny + vj*nx + vi)*2 + axis]
+				: mZCache[vj*nx + vi]);
+
+			const int stamp = (axis < 2 ? vk : k);
+			if (entry.stamp == stamp)
+				return entry.index;
+
+			const int wi = vi + (axis == 0), wj = vj + (axis == 1), wk = vk + (axis == 2);
+			const float a = at(vi, vj, vk), b = at(wi, wj, wk);
+			const float t = (mValue - a) / (b - a);
+
+			float ga[3], gb[3];
+			gradient(vi, vj, vk, ga);
+			gradient(wi, wj, wk, gb);
+
+			const float p[3] = { float(vi), float(vj), float(vk) };
+
+			// Normals point towards lower values (same as
+			// vtkMarchingCubes), to match the light directions used by
+			// the fragment shader
+			float n[3], len = 0;
+			for (int d = 0; d < 3; ++d) {
+				n[d] = -(ga[d] + t*(gb[d]-ga[d]));
+				len += n[d]*n[d];
+			}
+			len = (len > 0 ? 1.0f/std::sqrt(len) : 0.0f);
+
+			std::vector<GLfloat>& vertices = mSlab.vertices;
+			for (int d = 0; d < 3; ++d)
+				vertices.push_back(mField.offset[d] + (p[d] + (d == axis ? t : 0.0f)) * mField.scale[d]);
+			for (int d = 0; d < 3; ++d)
+				vertices.push_back(n[d]*len);
+
+			entry.stamp = stamp;
+			entry.index = vertices.size()/6 - 1;
+			return entry.index;
+		}
+
+		const ScalarField& mField;
+		const T* mScalars;
+		const float mValue;
+		Slab& mSlab;
+		const int nx, ny, nz;
+		std::vector<CacheEntry> mPlaneCache, mZCache;
+		std::vector<unsigned char> mPlanes[2];
+		int mClassifiedPlane[2];
+	};
+
+	// Extracts the brick layers [bzBegin, bzEnd). "layers" lists the
+	// active bricks of each brick layer (all of them if null).
+	template <typename T>
+	void extractSlab(const ScalarField& field, float value,
+	                 const std::vector<std::vector<int> >* layers, int bricksX, int bricksPerLayer,
+	                 int bzBegin, int bzEnd, Slab& slab)
+	{
+		const int bs = MinMaxTree::brickSize;
+		const int cellLayers = field.dims[2]-1;
+		SlabExtractor<T> extractor(field, value, slab);
+
+		for (int bz = bzBegin; bz < bzEnd; ++bz) {
+			const int zBegin = bz*bs, zEnd = std::min(zBegin+bs, cellLayers);
+
+			if (!layers) {
+				extractor.extractLayers(zBegin, zEnd);
+				continue;
+			}
+
+			const std::vector<int>& bricks = (*layers)[bz];
+			if (bricks.empty())
+				continue;
+
+			// Whole planes are classified faster (and with SIMD) when
+			// most bricks need to be visited anyway
+			if (int(bricks.size())*2 > bricksPerLayer)
+				extractor.extractLayers(zBegin, zEnd);
+			else
+				extractor.extractBricks(zBegin, zEnd, bricks, bricksX);
+		}
+	}
+
+	// Marching cubes on a raw scalar grid: the volume is split into
+	// z-slabs extracted in parallel, then concatenated. If "tree" is
+	// not null, only the bricks that may contain the surface are visited.
+	void marchingCubes(const ScalarField& field, float value, const MinMaxTree* tree,
+	                   std::vector<GLfloat>& vertices, std::vector<unsigned int>& indices)
+	{
+		const int bs = MinMaxTree::brickSize;
+		const int cellLayers = field.dims[2]-1;
+		const int brickLayers = (cellLayers + bs-1) / bs;
+
+		vertices.clear();
+		indices.clear();
+
+		std::vector<std::vector<int> > layers;
+		int bricksX = 0, bricksPerLayer = 0;
+
+		if (tree) {
+			const int* brickDims = tree->getBrickDimensions();
+			android_assert(brickDims[2] == brickLayers);
+			bricksX = brickDims[0];
+			bricksPerLayer = brickDims[0]*brickDims[1];
+
+			std::vector<int> bricks;
+			tree->findBricks(value, bricks);
+			if (bricks.empty())
+				return;
+
+			layers.resize(brickLayers);
+			for (int brick : bricks)
+				layers[brick / bricksPerLayer].push_back(brick % bricksPerLayer);
+		}
+
+		const int slabCount = std::min<int>(brickLayers, Parallel::threadCount()*4);
+		std::vector<Slab> slabs(slabCount);
+
+		Parallel::forEach(0, slabCount, [&](int s) {
+			const int bzBegin = brickLayers * s / slabCount;
+			const int bzEnd = brickLayers * (s+1) / slabCount;
+			switch (field.type) {
+				vtkTemplateMacro(
+					extractSlab<VTK_TT>(field, value, (tree ? &layers : nullptr), bricksX, bricksPerLayer,
+					                    bzBegin, bzEnd, slabs[s])
+				);
+				default:
+					throw std::runtime_error("IsoSurface: unsupported scalar type");
+			}
+		});
+
+		std::size_t vertexCount = 0, indexCount = 0;
+		for (const Slab& slab : slabs) {
+			vertexCount += slab.vertices.size()/6;
+			indexCount += slab.indices.size();
+		}
+
+		vertices.reserve(vertexCount*6);
+		indices.reserve(indexCount);
+
+		for (const Slab& slab : slabs) {
+			const unsigned int base = vertices.size()/6;
+			vertices.insert(vertices.end(), slab.vertices.begin(), slab.vertices.end());
+			for (unsigned int index : slab.indices)
+				indices.push_back(base + index);
+		}
+	}
+
+	// Trilinear resampling of the first component of "src" to a grid
+	// of "dstDims" points spanning the same bounds (the values stay
+	// within the range of the source data)
+	template <typename T>
+	void resample(const T* src, int components, const int srcDims[3], float* dst, const int dstDims[3])
+	{
+		// Lower source index and interpolation weight along each axis
+		std::vector<int> index[3];
+		std::vector<float> weight[3];
+		for (int d = 0; d < 3; ++d) {
+			const float ratio = float(srcDims[d]-1) / (dstDims[d]-1);
+			index[d].resize(dstDims[d]);
+			weight[d].resize(dstDims[d]);
+			for (int i = 0; i < dstDims[d]; ++i) {
+				const float f = i * ratio;
+				index[d][i] = std::min(int(f), srcDims[d]-2);
+				weight[d][i] = f - index[d][i];
+			}
+		}
+
+		const int sx = components, sy = srcDims[0]*sx, sz = srcDims[1]*sy;
+
+		Parallel::forEach(0, dstDims[2], [&](int k) {
+			const float wz = weight[2][k];
+			float* out = dst + std::size_t(k)*dstDims[1]*dstDims[0];
+
+			for (int j = 0; j < dstDims[1]; ++j) {
+				const float wy = weight[1][j];
+				const T* row = src + std::size_t(index[2][k])*sz + std::size_t(index[1][j])*sy;
+
+				for (int i = 0; i < dstDims[0]; ++i) {
+					const float wx = weight[0][i];
+					const T* p = row + std::size_t(index[0][i])*sx;
+
+					const float c00 = float(p[0])     + wx*(float(p[sx])       - float(p[0]));
+					const float c10 = float(p[sy])    + wx*(float(p[sy+sx])    - float(p[sy]));
+					const float c01 = float(p[sz])    + wx*(float(p[sz+sx])    - float(p[sz]));
+					const float c11 = float(p[sz+sy]) + wx*(float(p[sz+sy+sx]) - float(p[sz+sy]));
+					const float c0 = c00 + wy*(c10 - c00);
+					const float c1 = c01 + wy*(c11 - c01);
+					*out++ = c0 + wz*(c1 - c0);
+				}
+			}
+		});
+	}
 } // namespace
 
-IsoSurface::IsoSurface(vtkSmartPointer<vtkImageData> data, bool stream)
- : mMaterial(MaterialSharedPtr(new Material(vertexShader, fragmentShader))),
-   mData(data),
-   mValue(0), mPendingValue(0),
-   mBound(false), mIsEmpty(true), mDirty(false), mStream(stream),
+IsoSurface::IsoSurface(vtkSmartPointer<vtkImageData> data, bool stream, MinMaxTreeSharedPtr tree)
+ : mMaterial(Material::get(vertexShader, fragmentShader)),
+   mData(data), mLevels(levelCount),
+   mValue(0), mRequestedValue(std::numeric_limits<double>::quiet_NaN()),
+   mBound(false), mIsEmpty(true), mStream(stream),
    mVertexAttrib(-1), mNormalAttrib(-1),
    mProjectionUniform(-1), mModelViewUniform(-1), mNormalMatrixUniform(-1), mDimensionsUniform(-1), mValueUniform(-1), mOpacityUniform(-1), mClipPlaneUniform(-1),
-   mVertexBuffer(0), mNormalBuffer(0), mIndexBuffer(0)
+   mDirty(false), mRequestSerial(0), mPublishedSerial(0),
+   mCacheSize(0), mCacheBudget(64 << 20), // 64 MiB
+   mCacheHits(0), mCacheMisses(0), mDataSerial(0)
 {
 	android_assert(mData);
 
@@ -155,208 +535,375 @@ IsoSurface::IsoSurface(vtkSmartPointer<vtkImageData> data, bool stream)
 	LOGD("dimensions %d %d %d", mDimensions[0], mDimensions[1], mDimensions[2]);
 	mData->GetPointData()->GetScalars()->GetRange(mRange);
 	LOGD("range min=%f max=%f", mRange[0], mRange[1]);
+
+	mLevels[0].data = mData;
+	mLevels[0].tree = (tree ? tree : MinMaxTreeSharedPtr(new MinMaxTree(mData)));
+	mTree = mLevels[0].tree;
+
+	mWorker.reset(new WorkerThread<Request>([this](Request request) {
+		if (request.source.data != mLevels[0].data) {
+			// New data (see setData()): the downsampled levels are
+			// built again when needed
+			mLevels.assign(levelCount, Level());
+			mLevels[0].data = request.source.data;
+			mLevels[0].tree = (request.source.tree ? request.source.tree : MinMaxTreeSharedPtr(new MinMaxTree(request.source.data)));
+		}
+
+		// Coarsest levels first, so that an approximation of the
+		// surface is displayed quickly
+		for (int l = levelCount-1; l >= 0; --l) {
+			if (request.serial != mRequestSerial)
+				return; // superseded
+
+			const Level* level = getLevel(l);
+			if (!level)
+				continue;
+
+			GeometryPtr geometry = extract(*level, request.value);
+			if (l == 0)
+				addToCache(geometry, request.dataSerial);
+			publish(geometry, request.serial);
+		}
+	}));
+}
+
+IsoSurface::~IsoSurface()
+{
+	// Waits for the extraction in progress (if any), since it
+	// accesses this object
+	mWorker.reset();
+
+	std::vector<GLuint> buffers, vertexArrays;
+	for (const ChunkBuffers& chunk : mBuffers) {
+		buffers.push_back(chunk.vertexBuffer);
+		buffers.push_back(chunk.indexBuffer);
+		vertexArrays.push_back(chunk.vertexArray);
+	}
+	GlObjects::deleteVertexArrays(vertexArrays);
+	GlObjects::deleteBuffers(buffers);
 }
 
 void IsoSurface::setValue(double value)
 {
-	// LOGD("computing surface for value: %f", value);
+	if (value == mRequestedValue) {
+		// LOGD("surface value didn't change");
+		return;
+	}
+
+	mRequestedValue = value;
+	const unsigned int serial = ++mRequestSerial;
+
+	GeometryPtr geometry = findCached(value);
+	if (!geometry) {
+		if (!mTree)
+			mTree.reset(new MinMaxTree(mData));
+
+		const Level source = { mData, mTree };
+		geometry = extract(source, value);
+		addToCache(geometry, mDataSerial);
+	}
+
+	publish(geometry, serial);
+}
 
-	if (value == mPendingValue) {
+void IsoSurface::setValueAsync(double value)
+{
+	if (value == mRequestedValue) {
 		// LOGD("surface value didn't change");
 		return;
 	}
 
-	mVertices.clear();
-	mNormals.clear();
-	mIndices.clear();
+	mRequestedValue = value;
+	const unsigned int serial = ++mRequestSerial;
 
-	if (value < mRange[0] || value > mRange[1]) {
-		// LOGD("surface value is outside bounds");
-		mIsEmpty = true;
+	if (GeometryPtr geometry = findCached(value)) {
+		publish(geometry, serial);
 		return;
 	}
 
-	double datasetBounds[6], datasetCenter[3];
-	mData->GetBounds(datasetBounds);
-	mData->GetCenter(datasetCenter);
-
-	// Triangulation filter
-	vtkNew<vtkTriangleFilter> triangleFilter;
-
-	// Filter out lines and single vertices
-	triangleFilter->PassLinesOff();
-	triangleFilter->PassVertsOff();
-
-	if (!vtkPolyData::SafeDownCast(mData)) {
-		vtkNew<vtkMarchingCubes> filter;
-		filter->SetInputData(mData);
-		filter->SetValue(0, value);
-		filter->ComputeNormalsOff();
-		triangleFilter->SetInputConnection(filter->GetOutputPort());
-	} else {
-		triangleFilter->SetInputData(mData);
+	Request request = { value, serial, { mData, mTree }, mDataSerial };
+	mWorker->process(request);
+}
+
+void IsoSurface::setData(vtkSmartPointer<vtkImageData> data, MinMaxTreeSharedPtr tree)
+{
+	android_assert(data);
+
+	int dims[3];
+	data->GetDimensions(dims);
+	if (!std::equal(dims, dims+3, mDimensions) || !data->GetPointData() || !data->GetPointData()->GetScalars())
+		throw std::runtime_error("IsoSurface: the new data doesn't match the grid");
+
+	mData = data;
+	mTree = tree;
+
+	synchronized(mCache) {
+		mCache.clear();
+		mCacheSize = 0;
+		++mDataSerial;
 	}
 
-	// Triangulate mesh
-	triangleFilter->Update();
+	if (std::isnan(mRequestedValue))
+		return; // no surface yet
+
+	const double value = mRequestedValue;
+	mRequestedValue = std::numeric_limits<double>::quiet_NaN();
+	setValueAsync(value);
+}
 
-	vtkPolyData* polyData = triangleFilter->GetOutput();
-	android_assert(polyData);
+void IsoSurface::publish(GeometryPtr geometry, unsigned int serial)
+{
+	synchronized(mPending) {
+		if (serial < mPublishedSerial)
+			return;
 
-	unsigned int vertexCount = polyData->GetNumberOfPoints();
-	// LOGD("number of points = %u (limit: %u)", vertexCount, USHRT_MAX);
+		mPublishedSerial = serial;
+		mPending = geometry;
+		mDirty = true;
+	}
+}
 
-	if (vertexCount < 3) {
-		// Not enough points for displaying at least one triangle...
-		mIsEmpty = true;
-		return;
+long long IsoSurface::cacheKey(double value) const
+{
+	const double range = mRange[1] - mRange[0];
+	return (range > 0 ? std::llround((value - mRange[0]) / range * cacheResolution) : 0);
+}
+
+IsoSurface::GeometryPtr IsoSurface::findCached(double value)
+{
+	const long long key = cacheKey(value);
+
+	synchronized(mCache) {
+		for (auto it = mCache.begin(); it != mCache.end(); ++it) {
+			if (cacheKey((*it)->value) == key) {
+				mCache.splice(mCache.begin(), mCache, it);
+				++mCacheHits;
+				return mCache.front();
+			}
+		}
+
+		++mCacheMisses;
 	}
 
-	vtkNew<vtkDecimatePro> decimateFilter;
-	decimateFilter->SetInputData(polyData);
-	decimateFilter->SetTargetReduction(0);
-	decimateFilter->PreserveTopologyOff();
-	decimateFilter->SplittingOn();
-	decimateFilter->BoundaryVertexDeletionOn();
-	decimateFilter->SetMaximumError(VTK_DOUBLE_MAX);
-	decimateFilter->SetFeatureAngle(30.0);
-	decimateFilter->SetSplitAngle(10.0);
+	return nullptr;
+}
+
+void IsoSurface::addToCache(GeometryPtr geometry, unsigned int dataSerial)
+{
+	const long long key = cacheKey(geometry->value);
 
-	// FIXME: instead of decimation, create multiple meshes (i.e. multiple mIndices arrays)
-	// and render all of them at the same time
+	synchronized(mCache) {
+		if (dataSerial != mDataSerial || geometry->size > mCacheBudget)
+			return;
 
-	// OpenGL ES 2.0 only supports GL_UNSIGNED_SHORT as datatype
-	// for indices, so the maximum number of vertices is USHRT_MAX
-	// (unless the GL_OES_element_index_uint extension is available)
-
-	if (vertexCount > USHRT_MAX) {
-		LOGD("decimation required");
-
-		// Try to decimate polyData
-		double target = 1.0 - USHRT_MAX/double(vertexCount) + 0.1; // 0.1: safety margin
-		do {
-			if (target >= 1.0)
-				throw std::runtime_error("IsoSurface: decimation failed, unable to render the surface");
-			LOGD("decimation factor = %f", target);
-			decimateFilter->SetTargetReduction(target);
-			decimateFilter->Update();
-			vertexCount = decimateFilter->GetOutput()->GetNumberOfPoints();
-			LOGD("result: %u points", vertexCount);
-			target += 0.1;
-		} while (vertexCount > USHRT_MAX);
-
-		LOGD("decimation finished (factor: %f)", target);
+		for (const GeometryPtr& cached : mCache) {
+			if (cacheKey(cached->value) == key)
+				return;
+		}
+
+		mCache.push_front(geometry);
+		mCacheSize += geometry->size;
+
+		// Evict the least recently used surfaces
+		while (mCacheSize > mCacheBudget) {
+			mCacheSize -= mCache.back()->size;
+			mCache.pop_back();
+		}
 	}
+}
 
-	// TODO: triangle strips? (vtkStripper)
-
-	if (!mStream) {
-		vtkNew<vtkWindowedSincPolyDataFilter> smoothFilter;
-		smoothFilter->SetInputConnection(decimateFilter->GetOutputPort());
-		// smoothFilter->SetNumberOfIterations(15);
-		smoothFilter->SetNumberOfIterations(10);
-		smoothFilter->BoundarySmoothingOff();
-		smoothFilter->FeatureEdgeSmoothingOff();
-		smoothFilter->SetFeatureAngle(30.0);
-		// smoothFilter->SetPassBand(0.001);
-		smoothFilter->SetPassBand(0.1);
-		smoothFilter->NonManifoldSmoothingOn();
-		smoothFilter->NormalizeCoordinatesOn();
-
-		smoothFilter->Update();
-		polyData = decimateFilter->GetOutput();
-
-	} else {
-		decimateFilter->Update();
-		polyData = decimateFilter->GetOutput();
+void IsoSurface::setCacheBudget(std::size_t bytes)
+{
+	synchronized(mCache) {
+		mCacheBudget = bytes;
+		while (mCacheSize > mCacheBudget) {
+			mCacheSize -= mCache.back()->size;
+			mCache.pop_back();
+		}
 	}
+}
 
-	android_assert(polyData);
+void IsoSurface::getCacheStats(unsigned int& hits, unsigned int& misses)
+{
+	synchronized(mCache) {
+		hits = mCacheHits;
+		misses = mCacheMisses;
+	}
+}
 
-	// Normalize the vertex coordinates, in order to match the
-	// volume rendering
-	vtkNew<vtkTransform> transform;
-	transform->PostMultiply();
-	transform->Translate(
-		-datasetCenter[0],
-		-datasetCenter[1],
-		-datasetCenter[2]
-	);
-	transform->Scale(
-		1.0 / mDimensions[0],
-		1.0 / mDimensions[1],
-		1.0 / mDimensions[2]
-	);
-	vtkNew<vtkTransformPolyDataFilter> transformFilter;
-	transformFilter->SetInputData(polyData);
-	transformFilter->SetTransform(transform.GetPointer());
-
-	// Generate normals
-	vtkNew<vtkPolyDataNormals> normalGenerator;
-	normalGenerator->SetInputConnection(transformFilter->GetOutputPort());
-	normalGenerator->ComputePointNormalsOn();
-	normalGenerator->ComputeCellNormalsOff();
-	normalGenerator->SetFeatureAngle(30.0);
-	normalGenerator->SplittingOff();
-
-	normalGenerator->Update();
-	polyData = normalGenerator->GetOutput();
-
-	// transformFilter->Update();
-	// polyData = transformFilter->GetOutput();
-
-	android_assert(polyData);
-	android_assert(polyData->GetPointData());
-	android_assert(polyData->GetPointData()->GetNormals());
-	android_assert(polyData->GetPolys());
-
-	// Read vertex positions
-	mVertices.resize(vertexCount*3);
-	for (unsigned int i = 0; i < vertexCount; ++i) {
-		double* pt = polyData->GetPoint(i);
-		mVertices[i*3+0] = pt[0];
-		mVertices[i*3+1] = pt[1];
-		mVertices[i*3+2] = pt[2];
-		// LOGD("adding vertex: %f %f %f", pt[0], pt[1], pt[2]);
+std::size_t IsoSurface::getCacheSize()
+{
+	std::size_t size = 0;
+	synchronized(mCache) {
+		size = mCacheSize;
 	}
+	return size;
+}
 
-	// Read vertex normals
-	vtkDataArray* normals = polyData->GetPointData()->GetNormals();
-	int normalCount = normals->GetNumberOfTuples();
-	mNormals.resize(normalCount*3);
-	for (int i = 0; i < normalCount; ++i) {
-		double* n = normals->GetTuple(i);
-		mNormals[i*3+0] = n[0];
-		mNormals[i*3+1] = n[1];
-		mNormals[i*3+2] = n[2];
-		// LOGD("adding normal: %f %f %f", n[0], n[1], n[2]);
+const IsoSurface::Level* IsoSurface::getLevel(int level)
+{
+	android_assert(level >= 0 && level < levelCount);
+
+	Level& result = mLevels[level];
+	if (result.data)
+		return &result;
+
+	// Each level halves the number of points along each axis
+	int dims[3];
+	for (int d = 0; d < 3; ++d)
+		dims[d] = std::max((mDimensions[d] + (1 << level) - 1) >> level, 2);
+
+	// Not worth it below a couple of bricks
+	if (std::max(dims[0], std::max(dims[1], dims[2])) < 2*MinMaxTree::brickSize)
+		return nullptr;
+
+	// (not mData, which setData() may change meanwhile)
+	vtkImageData* source = mLevels[0].data;
+
+	double origin[3], spacing[3];
+	int extent[6];
+	source->GetOrigin(origin);
+	source->GetSpacing(spacing);
+	source->GetExtent(extent);
+
+	// Same bounds as the full resolution data
+	for (int d = 0; d < 3; ++d) {
+		origin[d] += extent[d*2]*spacing[d];
+		spacing[d] *= double(mDimensions[d]-1) / (dims[d]-1);
 	}
 
-	// Read indices
-	vtkCellArray* polys = polyData->GetPolys();
-	polys->InitTraversal();
-	int indexCount = polys->GetNumberOfCells();
-	mIndices.resize(indexCount*3);
-	// LOGD("GetNumberOfCells() = %d", indexCount);
-	for (int i = 0; i < indexCount; ++i) {
-		vtkIdType numPts;
-		vtkIdType* pts;
-		polys->GetNextCell(numPts, pts);
-		android_assert(numPts == 3);
-		mIndices[i*3+0] = pts[0];
-		mIndices[i*3+1] = pts[1];
-		mIndices[i*3+2] = pts[2];
-		// LOGD("adding indices: %u %u %u", pts[0], pts[1], pts[2]);
+	// LOGD("building level %d (%d %d %d)", level, dims[0], dims[1], dims[2]);
+
+	vtkSmartPointer<vtkImageData> data = vtkSmartPointer<vtkImageData>::New();
+	data->SetDimensions(dims);
+	data->SetOrigin(origin);
+	data->SetSpacing(spacing);
+	data->AllocateScalars(VTK_FLOAT, 1);
+
+	vtkDataArray* scalars = source->GetPointData()->GetScalars();
+	const void* src = scalars->GetVoidPointer(0);
+	float* dst = static_cast<float*>(data->GetScalarPointer());
+
+	switch (scalars->GetDataType()) {
+		vtkTemplateMacro(
+			resample(static_cast<const VTK_TT*>(src), scalars->GetNumberOfComponents(),
+			         mDimensions, dst, dims)
+		);
+		default:
+			throw std::runtime_error("IsoSurface: unsupported scalar type");
+	}
+
+	result.tree.reset(new MinMaxTree(data));
+	result.data = data;
+	return &result;
+}
+
+IsoSurface::GeometryPtr IsoSurface::extract(const Level& level, double value)
+{
+	// LOGD("computing surface for value: %f", value);
+
+	std::shared_ptr<Geometry> geometry(new Geometry);
+	geometry->value = value;
+	geometry->size = 0;
+
+	if (value < mRange[0] || value > mRange[1]) {
+		// LOGD("surface value is outside bounds");
+		return geometry;
 	}
 
-	// LOGD("%d %d %d", mVertices.size(), mNormals.size(), mIndices.size());
+	vtkImageData* data = level.data;
+	vtkDataArray* scalars = data->GetPointData()->GetScalars();
+	android_assert(scalars);
+
+	double origin[3], spacing[3], center[3];
+	int dims[3], extent[6];
+	data->GetOrigin(origin);
+	data->GetSpacing(spacing);
+	data->GetCenter(center);
+	data->GetDimensions(dims);
+	data->GetExtent(extent);
+
+	ScalarField field;
+	field.data = scalars->GetVoidPointer(0);
+	field.type = scalars->GetDataType();
+	field.components = scalars->GetNumberOfComponents();
+
+	// Normalize the vertex coordinates, in order to match the
+	// volume rendering (always relative to the full resolution
+	// dimensions, so that all levels line up)
+	for (int d = 0; d < 3; ++d) {
+		field.dims[d] = dims[d];
+		field.offset[d] = (origin[d] + extent[d*2]*spacing[d] - center[d]) / mDimensions[d];
+		field.scale[d] = spacing[d] / mDimensions[d];
+		field.spacing[d] = spacing[d];
+	}
 
-	mPendingValue = value;
-	mIsEmpty = false;
+	std::vector<GLfloat> vertices;
+	std::vector<unsigned int> indices;
+	marchingCubes(field, value, level.tree.get(), vertices, indices);
 
-	mDirty = true;
+	// LOGD("number of points = %u", vertices.size()/6);
 
-	// LOGD("surface computed");
+	// OpenGL ES 2.0 only supports GL_UNSIGNED_SHORT as datatype
+	// for indices, so big surfaces are split into several chunks
+	// (instead of being decimated) and drawn separately
+	split(vertices, indices, geometry->chunks);
+
+	for (const Chunk& chunk : geometry->chunks)
+		geometry->size += chunk.vertices.size()*sizeof(GLfloat) + chunk.indices.size()*sizeof(GLushort);
+
+	// LOGD("surface computed (%u chunks)", geometry->chunks.size());
+	return geometry;
+}
+
+void IsoSurface::split(std::vector<GLfloat>& vertices, const std::vector<unsigned int>& indices,
+                       std::vector<Chunk>& chunks)
+{
+	const unsigned int maxVertices = USHRT_MAX+1;
+	const unsigned int vertexCount = vertices.size()/6;
+
+	if (indices.empty())
+		return;
+
+	if (vertexCount <= maxVertices) {
+		chunks.resize(1);
+		chunks[0].vertices.swap(vertices);
+		chunks[0].indices.assign(indices.begin(), indices.end());
+		return;
+	}
+
+	// Index of each vertex in the chunk it was last copied to
+	// (vertices shared by two chunks are duplicated)
+	std::vector<int> chunkOf(vertexCount, -1);
+	std::vector<GLushort> localIndex(vertexCount);
+
+	chunks.push_back(Chunk());
+	chunks.back().vertices.reserve(maxVertices*6);
+
+	for (std::size_t n = 0; n < indices.size(); n += 3) {
+		int current = chunks.size()-1;
+
+		unsigned int missing = 0;
+		for (int k = 0; k < 3; ++k)
+			missing += (chunkOf[indices[n+k]] != current);
+
+		if (chunks.back().vertices.size()/6 + missing > maxVertices) {
+			chunks.push_back(Chunk());
+			chunks.back().vertices.reserve(maxVertices*6);
+			++current;
+		}
+
+		Chunk& chunk = chunks.back();
+		for (int k = 0; k < 3; ++k) {
+			const unsigned int v = indices[n+k];
+			if (chunkOf[v] != current) {
+				chunkOf[v] = current;
+				localIndex[v] = chunk.vertices.size()/6;
+				chunk.vertices.insert(chunk.vertices.end(), &vertices[v*6], &vertices[v*6] + 6);
+			}
+			chunk.indices.push_back(localIndex[v]);
+		}
+	}
 }
 
 void IsoSurface::setPercentage(double value)
@@ -365,6 +912,12 @@ void IsoSurface::setPercentage(double value)
 	setValue(value*(mRange[1]-mRange[0]) + mRange[0]);
 }
 
+void IsoSurface::setPercentageAsync(double value)
+{
+	android_assert(0.0 <= value && value <= 1.0);
+	setValueAsync(value*(mRange[1]-mRange[0]) + mRange[0]);
+}
+
 void IsoSurface::setClipPlane(float a, float b, float c, float d)
 {
 	mClipEq[0] = a;
@@ -383,9 +936,6 @@ void IsoSurface::clearClipPlane()
 // (GL context)
 void IsoSurface::bind()
 {
-	if (mIsEmpty)
-		return;
-
 	mMaterial->bind();
 
 	mVertexAttrib = mMaterial->getAttribute("vertex");
@@ -408,96 +958,89 @@ void IsoSurface::bind()
 	android_assert(mOpacityUniform != -1);
 	android_assert(mClipPlaneUniform != -1);
 
-	// Allocate 3 VBOs
-	GLuint vbos[3];
-	glGenBuffers(3, vbos);
-	mVertexBuffer = vbos[0];
-	mNormalBuffer = vbos[1];
-	mIndexBuffer  = vbos[2];
-
-	// // Vertices
-	// glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
-	// LOGD("vertex size = %d", mVertices.size());
-	// glBufferData(GL_ARRAY_BUFFER, USHRT_MAX*sizeof(GLfloat), nullptr, GL_STATIC_DRAW);
-	// glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// // Normals
-	// glBindBuffer(GL_ARRAY_BUFFER, mNormalBuffer);
-	// LOGD("normal size = %d", mNormals.size());
-	// glBufferData(GL_ARRAY_BUFFER, USHRT_MAX*sizeof(GLfloat), nullptr, GL_STATIC_DRAW);
-	// glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// // Indices
-	// glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
-	// LOGD("index size = %d", mIndices.size());
-	// glBufferData(GL_ELEMENT_ARRAY_BUFFER, mIndices.size()*sizeof(GLushort), nullptr, GL_STATIC_DRAW);
-	// glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	mBound = true;
 
 	update();
-
-	mBound = true;
 }
 
 // (GL context)
 void IsoSurface::update()
 {
-	mValue = mPendingValue;
+	synchronized(mPending) {
+		if (!mDirty)
+			return;
+
+		mGeometry = mPending;
+		mDirty = false;
+	}
+
+	const std::vector<Chunk>& chunks = mGeometry->chunks;
+	mValue = mGeometry->value;
+	mIsEmpty = chunks.empty();
 
 	const GLenum type = (mStream ? GL_STATIC_DRAW : GL_STREAM_DRAW);
 
-	// Vertices
-	android_assert(mVertexBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
-	glBufferData(GL_ARRAY_BUFFER, mVertices.size()*sizeof(GLfloat), nullptr, type);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, mVertices.size()*sizeof(GLfloat), mVertices.data());
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Normals
-	android_assert(mNormalBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, mNormalBuffer);
-	glBufferData(GL_ARRAY_BUFFER, mNormals.size()*sizeof(GLfloat), nullptr, type);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, mNormals.size()*sizeof(GLfloat), mNormals.data());
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// Indices
-	android_assert(mIndexBuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, mIndices.size()*sizeof(GLushort), nullptr, type);
-	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, mIndices.size()*sizeof(GLushort), mIndices.data());
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-	mDirty = false;
+	// Allocate 2 VBOs per chunk (interleaved vertices/normals, and
+	// indices) and a vertex array pointing to them, and release the
+	// ones that are not used anymore
+	const GLsizei stride = 6*sizeof(GLfloat);
+	while (mBuffers.size() < chunks.size()) {
+		GLuint vbos[2];
+		glGenBuffers(2, vbos);
+		ChunkBuffers buffers = { vbos[0], vbos[1], 0, 0 };
+
+		glGenVertexArrays(1, &buffers.vertexArray);
+		glBindVertexArray(buffers.vertexArray);
+		glBindBuffer(GL_ARRAY_BUFFER, buffers.vertexBuffer);
+		glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, stride, nullptr);
+		glVertexAttribPointer(mNormalAttrib, 3, GL_FLOAT, false, stride, reinterpret_cast<const GLvoid*>(3*sizeof(GLfloat)));
+		glEnableVertexAttribArray(mVertexAttrib);
+		glEnableVertexAttribArray(mNormalAttrib);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.indexBuffer);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		mBuffers.push_back(buffers);
+	}
+
+	while (mBuffers.size() > chunks.size()) {
+		GLuint vbos[2] = { mBuffers.back().vertexBuffer, mBuffers.back().indexBuffer };
+		glDeleteVertexArrays(1, &mBuffers.back().vertexArray);
+		glDeleteBuffers(2, vbos);
+		mBuffers.pop_back();
+	}
+
+	for (unsigned int i = 0; i < chunks.size(); ++i) {
+		const Chunk& chunk = chunks[i];
+		ChunkBuffers& buffers = mBuffers[i];
+
+		// Vertices and normals
+		android_assert(buffers.vertexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, buffers.vertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, chunk.vertices.size()*sizeof(GLfloat), chunk.vertices.data(), type);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		// Indices (bound through the vertex array, so that the binding
+		// of the other arrays is not affected)
+		android_assert(buffers.indexBuffer);
+		glBindVertexArray(buffers.vertexArray);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, chunk.indices.size()*sizeof(GLushort), chunk.indices.data(), type);
+		glBindVertexArray(0);
+
+		buffers.indexCount = chunk.indices.size();
+	}
 }
 
 // (GL context)
 void IsoSurface::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix)
 {
-	if (mIsEmpty)
-		return;
-
 	if (!mBound)
 		bind();
-
-	if (mDirty)
+	else
 		update();
 
-	// Vertices
-	android_assert(mVertexAttrib != -1);
-	glEnableVertexAttribArray(mVertexAttrib);
-	android_assert(mVertexBuffer != 0);
-	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
-	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, nullptr);
-
-	// Normals
-	android_assert(mNormalAttrib != -1);
-	glEnableVertexAttribArray(mNormalAttrib);
-	android_assert(mNormalBuffer != 0);
-	glBindBuffer(GL_ARRAY_BUFFER, mNormalBuffer);
-	glVertexAttribPointer(mNormalAttrib, 3, GL_FLOAT, false, 0, nullptr);
-
-	// Indices
-	android_assert(mIndexBuffer != 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer);
+	if (mIsEmpty)
+		return;
 
 	// Rendering
 
@@ -511,11 +1054,12 @@ void IsoSurface::render(const Matrix4& projectionMatrix, const Matrix4& modelVie
 	glUniform1f(mOpacityUniform, 1.0f);
 	glUniform4fv(mClipPlaneUniform, 1, mClipEq);
 
-	glDrawElements(GL_TRIANGLES, mIndices.size(), GL_UNSIGNED_SHORT, nullptr);
-
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	// One draw call per chunk
+	for (const ChunkBuffers& buffers : mBuffers) {
+		android_assert(buffers.vertexArray != 0);
+		glBindVertexArray(buffers.vertexArray);
+		glDrawElements(GL_TRIANGLES, buffers.indexCount, GL_UNSIGNED_SHORT, nullptr);
+	}
 
-	glDisableVertexAttribArray(mVertexAttrib);
-	glDisableVertexAttribArray(mNormalAttrib);
+	glBindVertexArray(0);
 }
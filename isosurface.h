@@ -6,18 +6,64 @@
 #include <vtkSmartPointer.h>
 
 #include "rendering/renderable.h"
+#include "util/worker_thread.h"
+
+#include <list>
+#include <atomic>
 
 class vtkImageData;
 
 class IsoSurface : public Renderable
 {
 public:
-	IsoSurface(vtkSmartPointer<vtkImageData> data, bool stream = false);
+	// "tree" must have been built from "data" (it is built by the
+	// constructor if not given)
+	IsoSurface(vtkSmartPointer<vtkImageData> data, bool stream = false, MinMaxTreeSharedPtr tree = nullptr);
+	~IsoSurface();
 
-	// bind(true) must be called afterwards to update OpenGL buffers
+	// The new surface is uploaded to OpenGL buffers by the next
+	// render() call
 	void setValue(double value);
 	void setPercentage(double value);
 
+	// Same as setValue()/setPercentage(), but the surface is
+	// extracted by a background thread. The previous surface keeps
+	// being rendered until the new one is ready, and only the most
+	// recent pending request is actually computed. The surface is
+	// first extracted from downsampled copies of the data (coarsest
+	// first), each level replacing the previous one until the full
+	// resolution surface is ready.
+	void setValueAsync(double value);
+	void setPercentageAsync(double value);
+
+	// Replaces the data with "data", on the same grid (e.g. the next
+	// step of a time series): the cache is cleared, and the current
+	// surface is extracted again in the background, the previous one
+	// being rendered until then. "tree" is built by the worker thread
+	// if not given. The value range stays the one of the first data,
+	// so that the surface keeps its value from one step to the next.
+	void setData(vtkSmartPointer<vtkImageData> data, MinMaxTreeSharedPtr tree = nullptr);
+
+	// True if no asynchronous extraction is pending or running
+	bool isIdle() { return mWorker->isWaiting(); }
+
+	// Number of resolution levels: full, 1/2, 1/4 and 1/8
+	static const int levelCount = 4;
+
+	// Recently extracted surfaces are kept in memory (up to
+	// "bytes"), so that values seen before are displayed without
+	// extracting them again. Values are compared after quantization
+	// to 1/cacheResolution of the data range.
+	static const int cacheResolution = 10000;
+	void setCacheBudget(std::size_t bytes);
+
+	// Number of surface requests served from the cache (hits) or
+	// extracted (misses)
+	void getCacheStats(unsigned int& hits, unsigned int& misses);
+
+	// Memory held by the cached surfaces, in bytes
+	std::size_t getCacheSize();
+
 	void setClipPlane(float a, float b, float c, float d); // plane equation: ax+by+cz+d=0
 	void clearClipPlane();
 
@@ -30,21 +76,103 @@ public:
 	bool isEmpty() const { return mIsEmpty; }
 
 private:
+	// Part of a surface, small enough to be drawn with 16-bit indices
+	struct Chunk
+	{
+		std::vector<GLfloat> vertices; // (x, y, z, nx, ny, nz) per vertex
+		std::vector<GLushort> indices;
+	};
+
+	struct Geometry
+	{
+		std::vector<Chunk> chunks;
+		double value;
+		std::size_t size; // in bytes
+	};
+
+	typedef std::shared_ptr<const Geometry> GeometryPtr;
+
+	// Copy of the data at a given resolution, with the matching
+	// min/max tree
+	struct Level
+	{
+		vtkSmartPointer<vtkImageData> data;
+		MinMaxTreeSharedPtr tree;
+	};
+
+	struct Request
+	{
+		double value;
+		unsigned int serial;
+		Level source; // (full resolution data, the tree may be null)
+		unsigned int dataSerial;
+	};
+
+	struct ChunkBuffers
+	{
+		GLuint vertexBuffer, indexBuffer;
+		GLsizei indexCount;
+		GLuint vertexArray; // (both buffers, as mVertexAttrib and mNormalAttrib)
+	};
+
+	// Computes the surface for the given value (any thread)
+	GeometryPtr extract(const Level& level, double value);
+
+	// Returns the given resolution level, downsampling the data on
+	// first use, or null if the data is too small for that level
+	// (worker thread only)
+	const Level* getLevel(int level);
+
+	// Splits a triangle mesh into chunks of at most USHRT_MAX+1 vertices
+	// (the content of "vertices" may be moved into "chunks")
+	static void split(std::vector<GLfloat>& vertices, const std::vector<unsigned int>& indices,
+	                  std::vector<Chunk>& chunks);
+
+	// Hands a surface over to the GL thread (any thread). Surfaces
+	// of requests older than the last published one are ignored.
+	void publish(GeometryPtr geometry, unsigned int serial);
+
+	// Returns the surface from the cache or null (counts a hit or
+	// a miss), and marks it as the most recently used
+	// Surfaces of a previous data (see setData()) are not cached
+	GeometryPtr findCached(double value);
+	void addToCache(GeometryPtr geometry, unsigned int dataSerial);
+	long long cacheKey(double value) const;
+
 	// (GL context)
 	void update();
 
 	MaterialSharedPtr mMaterial;
 	vtkSmartPointer<vtkImageData> mData;
-	double mValue, mPendingValue;
-	bool mBound, mIsEmpty, mDirty, mStream;
+	MinMaxTreeSharedPtr mTree; // (null if given to the worker thread to build)
+	std::vector<Level> mLevels; // (worker thread, see getLevel())
+	double mValue, mRequestedValue;
+	bool mBound, mIsEmpty, mStream;
 	GLint mVertexAttrib, mNormalAttrib;
 	GLint mProjectionUniform, mModelViewUniform, mNormalMatrixUniform, mDimensionsUniform, mValueUniform, mOpacityUniform, mClipPlaneUniform;
-	GLuint mVertexBuffer, mNormalBuffer, mIndexBuffer;
-	std::vector<GLfloat> mVertices, mNormals;
-	std::vector<GLushort> mIndices;
+	GeometryPtr mGeometry;
+	std::vector<ChunkBuffers> mBuffers;
 	int mDimensions[3];
 	double mRange[2];
 	float mClipEq[4];
+
+	// Last published surface, not uploaded yet if "mDirty" is true
+	// (mDirty and mPublishedSerial are protected by the mPending lock).
+	// The worker gives up on a request as soon as mRequestSerial
+	// doesn't match it anymore.
+	Synchronized<GeometryPtr> mPending;
+	bool mDirty;
+	std::atomic<unsigned int> mRequestSerial;
+	unsigned int mPublishedSerial;
+
+	// Most recently used surfaces first (mCache* members are
+	// protected by the mCache lock)
+	Synchronized<std::list<GeometryPtr> > mCache;
+	std::size_t mCacheSize, mCacheBudget;
+	unsigned int mCacheHits, mCacheMisses;
+	unsigned int mDataSerial; // (incremented by setData())
+
+	std::unique_ptr<WorkerThread<Request> > mWorker;
 };
 
 #endif /* ISOSURFACE_H */
@@ -1,67 +1,54 @@
 #include "loader_obj.h"
 
+#include "loaders/mesh_cache.h"
+#include "loaders/text_scanner.h"
 #include "rendering/mesh.h"
 #include "util/file.h"
 
-#include <sstream>
-#include <streambuf>
-#include <climits>
-
 namespace
 {
-	void parseV(std::istream& stream, MeshData& data)
+	std::string where(const std::string& fileName, const TextScanner& scanner)
 	{
-		std::string str;
-		stream >> str;
-
-		// std::cout << "parseV " << str << '\n';
+		return " (" + fileName + ", line " + Utility::toString(scanner.getLine()) + ")";
+	}
 
-		if (str == "v") {
+	void parseV(TextScanner& scanner, MeshData& data, const std::string& fileName)
+	{
+		if (scanner.skipWord("v")) {
 			float x, y, z;
-			stream >> x >> y >> z;
-			// std::cout << x << ' ' << y << ' ' << z << '\n';
+			if (!scanner.parseFloat(x) || !scanner.parseFloat(y) || !scanner.parseFloat(z))
+				throw std::runtime_error("Invalid vertex" + where(fileName, scanner));
 			data.vertices.push_back(Vector3(x, y, z));
-		} else if (str == "vt") {
+		} else if (scanner.skipWord("vt")) {
 			float u, v;
-			stream >> u >> v;
-			// std::cout << u << ' ' << v << '\n';
+			if (!scanner.parseFloat(u) || !scanner.parseFloat(v))
+				throw std::runtime_error("Invalid texture coordinates" + where(fileName, scanner));
 			data.texCoords.push_back(Vector2(u, 1.0f - v));
-		} else if (str == "vn") {
+		} else if (scanner.skipWord("vn")) {
 			float x, y, z;
-			stream >> x >> y >> z;
-			// std::cout << x << ' ' << y << ' ' << z << '\n';
+			if (!scanner.parseFloat(x) || !scanner.parseFloat(y) || !scanner.parseFloat(z))
+				throw std::runtime_error("Invalid vertex normal" + where(fileName, scanner));
 			data.normals.push_back(Vector3(x, y, z));
 		}
 	}
 
-	void parseF(std::istream& stream, MeshData& data, const std::string& fileName)
+	void parseF(TextScanner& scanner, MeshData& data, const std::string& fileName)
 	{
-		stream.ignore(1, '\n'); // skip 'f'
-
-		// std::cout << "parseF" << '\n';
+		if (!scanner.skipWord("f"))
+			return;
 
 		for (int i = 0; i < 3; ++i) {
-			std::string str;
-			stream >> str;
-
-			const std::vector<std::string> indices = Utility::split(str, '/');
-
-			if (indices.empty())
-				throw std::runtime_error("Invalid face: \"" + str + "\"");
-
-			if (indices.size() < 2 || indices[1].empty())
-				throw std::runtime_error("Missing texture coordinate index (" + fileName + ")");
-			if (indices.size() < 3 || indices[2].empty())
-				throw std::runtime_error("Missing vertex normal index (" + fileName + ")");
-
 			MeshData::Index index;
-			index.v = Utility::fromStringExcept<unsigned int>(indices[0]);
-			index.t = Utility::fromStringExcept<unsigned int>(indices[1]);
-			index.n = Utility::fromStringExcept<unsigned int>(indices[2]);
+			if (!scanner.parseUInt(index.v))
+				throw std::runtime_error("Invalid face" + where(fileName, scanner));
+			if (!scanner.skip('/') || !scanner.parseUInt(index.t))
+				throw std::runtime_error("Missing texture coordinate index" + where(fileName, scanner));
+			if (!scanner.skip('/') || !scanner.parseUInt(index.n))
+				throw std::runtime_error("Missing vertex normal index" + where(fileName, scanner));
 			index.c = 0; // no vertex colors in OBJ files
 
 			if (index.v == 0 || index.t == 0 || index.n == 0)
-				throw std::runtime_error("Invalid index: 0 (" + fileName + ")");
+				throw std::runtime_error("Invalid index: 0" + where(fileName, scanner));
 
 			// OBJ indices are 1-indexed
 			--index.v;
@@ -72,44 +59,45 @@ namespace
 		}
 	}
 
-	MeshData parse(const File::Buffer& buf)
+	MeshData parse(const File::Mapping& file, const std::string& fileName)
 	{
-		// A std::streambuf that points to a memory buffer
-		struct MemoryReadBuf : public std::streambuf
-		{
-			MemoryReadBuf(char* s, const std::size_t n)
-			{ setg(s, s, s + n); }
-		};
-
-		// Construct a std::istream that points to "buf.data"
-		MemoryReadBuf rb(const_cast<char*>(&buf.data[0]), buf.data.size());
-		std::istream stream(&rb);
-		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		TextScanner scanner(file.getData(), file.getData() + file.getSize());
 
 		MeshData result;
 
-		while (!stream.eof()) {
-			switch (stream.peek()) {
+		// Counting pass, so that the arrays are allocated only once
+		const char* const prefixes[] = { "v", "vt", "vn", "f" };
+		std::size_t counts[4];
+		scanner.countLines(prefixes, 4, counts);
+		result.vertices.reserve(counts[0]);
+		result.texCoords.reserve(counts[1]);
+		result.normals.reserve(counts[2]);
+		result.indices.reserve(counts[3]*3);
+
+		while (!scanner.atEnd()) {
+			switch (scanner.peek()) {
 				case 'v':
-					parseV(stream, result);
+					parseV(scanner, result, fileName);
 					break;
 
 				case 'f':
-					parseF(stream, result, buf.fileName);
+					parseF(scanner, result, fileName);
 					break;
 
-				// case 'u':
-				// 		parseU(stream, mesh);
-				// 		break;
-
 				case '#': // comments
 				default:
 					break;
 			}
 
-			if (!stream.eof()) {
-				// Skip until the next line
-				stream.ignore(INT_MAX, '\n');
+			// Skip until the next line
+			scanner.nextLine();
+		}
+
+		for (const MeshData::Index& index : result.indices) {
+			if (index.v >= result.vertices.size() || index.t >= result.texCoords.size()
+			    || index.n >= result.normals.size())
+			{
+				throw std::runtime_error("Index out of range (" + fileName + ")");
 			}
 		}
 
@@ -118,14 +106,26 @@ namespace
 
 } // namespace
 
-MeshPtr LoaderOBJ::load(const std::string& fileName)
+MeshPtr LoaderOBJ::load(const std::string& fileName, bool useCache)
 {
-	const File::Buffer buf = File::read(fileName);
+	MeshBuffer buffer;
+	if (useCache && MeshCache::load(fileName, buffer))
+		return MeshPtr(new Mesh(std::move(buffer)));
+
+	MeshData data;
+
+	{
+		const File::Mapping file(fileName);
+		data = parse(file, fileName);
+	}
+
+	if (data.indices.empty() || data.indices.size() % 3)
+		throw std::runtime_error("Invalid number of faces (" + fileName + ")");
 
-	MeshData data = parse(buf);
+	buffer = MeshBuffer::build(data, false);
 
-	if (data.indices.size() % 3)
-		throw std::runtime_error("Invalid number of faces (" + buf.fileName + ")");
+	if (useCache)
+		MeshCache::save(fileName, buffer);
 
-	return MeshPtr(new Mesh(data));
+	return MeshPtr(new Mesh(std::move(buffer)));
 }
@@ -5,7 +5,9 @@
 
 namespace LoaderOBJ
 {
-	MeshPtr load(const std::string& fileName);
+	// Reads (or writes) the parsed mesh from (to) a MeshCache if
+	// "useCache" is set
+	MeshPtr load(const std::string& fileName, bool useCache = true);
 }
 
 #endif /* LOADER_OBJ_H */
@@ -1,92 +1,106 @@
 #include "loader_ply.h"
 
+#include "loaders/mesh_cache.h"
+#include "loaders/text_scanner.h"
 #include "rendering/mesh.h"
 #include "util/file.h"
 
-#include <sstream>
-#include <streambuf>
-#include <climits>
-
 namespace
 {
-	MeshData parse(const File::Buffer& buf)
+	std::string where(const std::string& fileName, const TextScanner& scanner)
 	{
-		// A std::streambuf that points to a memory buffer
-		struct MemoryReadBuf : public std::streambuf
-		{
-			MemoryReadBuf(char* s, const std::size_t n)
-			{ setg(s, s, s + n); }
-		};
-
-		// Construct a std::istream that points to "buf.data"
-		MemoryReadBuf rb(const_cast<char*>(&buf.data[0]), buf.data.size());
-		std::istream stream(&rb);
-		// stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-
-		MeshData result;
-
-		std::string line;
-		bool headerEnded = false;
-
-		while (std::getline(stream, line)) {
-			const std::vector<std::string> tokens = Utility::split(line, ' ');
-
-			if (tokens.empty())
-				throw std::runtime_error("Empty line (" + buf.fileName + ")");
-
-			const std::string keyword = tokens[0];
-
-			if (!headerEnded) {
-				if (keyword == "end_header") {
-					headerEnded = true;
-
-				} else if (keyword != "ply" && keyword != "format"
-				           && keyword != "comment" && keyword != "element"
-				           && keyword != "property")
-				{
-					throw std::runtime_error("Unknown keyword: \"" + keyword + "\" (" + buf.fileName + ")");
-				}
-
-			} else if (keyword == "3") {
-				if (tokens.size() < 4)
-					throw std::runtime_error("Not enough indices for one face (" + buf.fileName + ")");
+		return " (" + fileName + ", line " + Utility::toString(scanner.getLine()) + ")";
+	}
 
-				for (int i = 1; i < 4; ++i) {
-					MeshData::Index index;
-					index.v = index.t = index.n = index.c =
-						Utility::fromStringExcept<unsigned int>(tokens[i]);
-					result.indices.push_back(index);
-				}
+	// Reads the header, returning the number of vertices and faces
+	void parseHeader(TextScanner& scanner, const std::string& fileName,
+	                 unsigned int& vertexCount, unsigned int& faceCount)
+	{
+		bool hasVertexCount = false, hasFaceCount = false;
+
+		for (; !scanner.atEnd(); scanner.nextLine()) {
+			if (scanner.atEndOfLine())
+				throw std::runtime_error("Empty line" + where(fileName, scanner));
+
+			if (scanner.skipWord("end_header")) {
+				scanner.nextLine();
+				if (!hasVertexCount || !hasFaceCount)
+					throw std::runtime_error("Missing vertex or face count (" + fileName + ")");
+				return;
+
+			} else if (scanner.skipWord("element")) {
+				if (scanner.skipWord("vertex"))
+					hasVertexCount = scanner.parseUInt(vertexCount);
+				else if (scanner.skipWord("face"))
+					hasFaceCount = scanner.parseUInt(faceCount);
+
+			} else if (!scanner.skipWord("ply") && !scanner.skipWord("format")
+			           && !scanner.skipWord("comment") && !scanner.skipWord("property"))
+			{
+				throw std::runtime_error("Unknown keyword" + where(fileName, scanner));
+			}
+		}
 
-			} else { // keyword != "3"
-				if (keyword == "4")
-					throw std::runtime_error("Quad faces are not allowed (" + buf.fileName + ")");
+		throw std::runtime_error("Missing end_header (" + fileName + ")");
+	}
 
-				if (tokens.size() < 8)
-					throw std::runtime_error("Missing data (" + buf.fileName + ")");
-				else if (tokens.size() >= 8 && tokens.size() < 11)
-					throw std::runtime_error("Missing color components (" + buf.fileName + ")");
+	MeshData parse(const File::Mapping& file, const std::string& fileName)
+	{
+		TextScanner scanner(file.getData(), file.getData() + file.getSize());
 
-				std::istringstream iss(line);
-				iss.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		unsigned int vertexCount, faceCount;
+		parseHeader(scanner, fileName, vertexCount, faceCount);
 
-				float x, y, z;
-				iss >> x >> y >> z;
-				result.vertices.push_back(Vector3(x, y, z));
+		// (the header gives the sizes of all the arrays)
+		MeshData result;
+		result.vertices.reserve(vertexCount);
+		result.normals.reserve(vertexCount);
+		result.texCoords.reserve(vertexCount);
+		result.colors.reserve(vertexCount);
+		result.indices.reserve(std::size_t(faceCount)*3);
+
+		for (unsigned int i = 0; i < vertexCount; ++i, scanner.nextLine()) {
+			if (scanner.atEnd())
+				throw std::runtime_error("Missing vertices (" + fileName + ")");
+			if (scanner.atEndOfLine())
+				throw std::runtime_error("Empty line" + where(fileName, scanner));
+
+			float x, y, z, nx, ny, nz, u, v;
+			if (!scanner.parseFloat(x) || !scanner.parseFloat(y) || !scanner.parseFloat(z)
+			    || !scanner.parseFloat(nx) || !scanner.parseFloat(ny) || !scanner.parseFloat(nz)
+			    || !scanner.parseFloat(u) || !scanner.parseFloat(v))
+			{
+				throw std::runtime_error("Missing data" + where(fileName, scanner));
+			}
 
-				float nx, ny, nz;
-				iss >> nx >> ny >> nz;
-				result.normals.push_back(Vector3(nx, ny, nz));
+			unsigned int r, g, b;
+			if (!scanner.parseUInt(r) || !scanner.parseUInt(g) || !scanner.parseUInt(b))
+				throw std::runtime_error("Missing color components" + where(fileName, scanner));
 
-				float u, v;
-				iss >> u >> v;
-				result.texCoords.push_back(Vector2(u, 1.0f - v));
+			result.vertices.push_back(Vector3(x, y, z));
+			result.normals.push_back(Vector3(nx, ny, nz));
+			result.texCoords.push_back(Vector2(u, 1.0f - v));
+			result.colors.push_back(Vector3(r, g, b) / 255.0f);
+		}
 
-				if (tokens.size() == 11) {
-					unsigned int r, g, b;
-					iss >> r >> g >> b;
-					result.colors.push_back(Vector3(r, g, b) / 255.0f);
-				}
+		for (unsigned int i = 0; i < faceCount; ++i, scanner.nextLine()) {
+			if (scanner.atEnd())
+				throw std::runtime_error("Missing faces (" + fileName + ")");
+
+			unsigned int count;
+			if (!scanner.parseUInt(count))
+				throw std::runtime_error("Invalid face" + where(fileName, scanner));
+			if (count == 4)
+				throw std::runtime_error("Quad faces are not allowed" + where(fileName, scanner));
+
+			for (int j = 0; j < 3; ++j) {
+				MeshData::Index index;
+				if (count < 3 || !scanner.parseUInt(index.v))
+					throw std::runtime_error("Not enough indices for one face" + where(fileName, scanner));
+				if (index.v >= vertexCount)
+					throw std::runtime_error("Index out of range" + where(fileName, scanner));
+				index.t = index.n = index.c = index.v;
+				result.indices.push_back(index);
 			}
 		}
 
@@ -95,14 +109,26 @@ namespace
 
 } // namespace
 
-MeshPtr LoaderPLY::load(const std::string& fileName)
+MeshPtr LoaderPLY::load(const std::string& fileName, bool useCache)
 {
-	const File::Buffer buf = File::read(fileName);
+	MeshBuffer buffer;
+	if (useCache && MeshCache::load(fileName, buffer))
+		return MeshPtr(new Mesh(std::move(buffer)));
+
+	MeshData data;
+
+	{
+		const File::Mapping file(fileName);
+		data = parse(file, fileName);
+	}
+
+	if (data.indices.empty())
+		throw std::runtime_error("Invalid number of faces (" + fileName + ")");
 
-	MeshData data = parse(buf);
+	buffer = MeshBuffer::build(data, false);
 
-	if (data.indices.size() % 3)
-		throw std::runtime_error("Invalid number of faces (" + buf.fileName + ")");
+	if (useCache)
+		MeshCache::save(fileName, buffer);
 
-	return MeshPtr(new Mesh(data));
+	return MeshPtr(new Mesh(std::move(buffer)));
 }
@@ -0,0 +1,136 @@
+#include "mesh_cache.h"
+
+#include "rendering/mesh.h"
+#include "util/file.h"
+
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+namespace {
+	const char cacheMagic[4] = { 'F', 'L', 'M', 'C' };
+	const uint32_t cacheVersion = 1;
+
+	enum Flags { FLAG_TEXTURED = 1, FLAG_COLORED = 2 };
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		int64_t sourceMtimeNs, sourceSize; // (staleness check)
+		uint32_t flags, stride;
+		uint64_t floatCount; // (followed by the floats)
+	};
+
+	static_assert(sizeof(Header) == 40, "unexpected cache header size");
+} // namespace
+
+std::string MeshCache::getFileName(const std::string& sourceFileName)
+{
+	return sourceFileName + ".mesh";
+}
+
+bool MeshCache::load(const std::string& sourceFileName, MeshBuffer& result)
+{
+	const std::string fileName = getFileName(sourceFileName);
+
+	long long mtimeNs, size, sourceMtimeNs, sourceSize;
+	if (!File::getInfo(fileName, mtimeNs, size))
+		return false;
+	if (!File::getInfo(sourceFileName, sourceMtimeNs, sourceSize))
+		return false;
+
+	try {
+		const File::Mapping mapping(fileName);
+		const char* base = mapping.getData();
+		const uint64_t mappedSize = mapping.getSize();
+
+		Header header;
+		if (mappedSize < sizeof(header))
+			throw std::runtime_error("truncated header");
+		std::memcpy(&header, base, sizeof(header));
+
+		if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion)
+			throw std::runtime_error("unknown format");
+
+		if (header.sourceMtimeNs != sourceMtimeNs || header.sourceSize != sourceSize) {
+			LOGI("Ignoring stale cache: %s", fileName.c_str());
+			return false;
+		}
+
+		MeshBuffer buffer;
+		buffer.textured = (header.flags & FLAG_TEXTURED);
+		buffer.colored = (header.flags & FLAG_COLORED);
+
+		if (header.stride != buffer.getStride() || header.floatCount == 0 || header.floatCount % header.stride != 0)
+			throw std::runtime_error("invalid layout");
+
+		if (header.floatCount > (mappedSize - sizeof(Header)) / sizeof(GLfloat))
+			throw std::runtime_error("truncated data");
+
+		buffer.data.resize(header.floatCount);
+		std::memcpy(buffer.data.data(), base + sizeof(Header), header.floatCount*sizeof(GLfloat));
+
+		result.data.swap(buffer.data);
+		result.textured = buffer.textured;
+		result.colored = buffer.colored;
+		return true;
+
+	} catch (const std::exception& e) {
+		LOGW("Ignoring invalid cache: %s: %s", fileName.c_str(), e.what());
+		return false;
+	}
+}
+
+bool MeshCache::save(const std::string& sourceFileName, const MeshBuffer& buffer)
+{
+	android_assert(!buffer.data.empty());
+
+	const std::string fileName = getFileName(sourceFileName);
+
+	long long sourceMtimeNs, sourceSize;
+	if (!File::getInfo(sourceFileName, sourceMtimeNs, sourceSize))
+		return false;
+
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version = cacheVersion;
+	header.sourceMtimeNs = sourceMtimeNs;
+	header.sourceSize = sourceSize;
+	header.flags = (buffer.textured ? FLAG_TEXTURED : 0) | (buffer.colored ? FLAG_COLORED : 0);
+	header.stride = buffer.getStride();
+	header.floatCount = buffer.data.size();
+
+	// Written to a temporary file first, so that an interrupted write
+	// never leaves a truncated cache behind
+	const std::string tmpFileName = fileName + ".tmp";
+
+	{
+		std::ofstream file(tmpFileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			LOGW("Unable to write cache: %s", tmpFileName.c_str());
+			return false;
+		}
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(buffer.data.data()), buffer.data.size()*sizeof(GLfloat));
+
+		if (!file) {
+			LOGW("Unable to write cache: %s", tmpFileName.c_str());
+			file.close();
+			std::remove(tmpFileName.c_str());
+			return false;
+		}
+	}
+
+	if (std::rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+		LOGW("Unable to write cache: %s", fileName.c_str());
+		std::remove(tmpFileName.c_str());
+		return false;
+	}
+
+	LOGI("Wrote cache: %s", fileName.c_str());
+	return true;
+}
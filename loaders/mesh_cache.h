@@ -0,0 +1,26 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "global.h"
+
+struct MeshBuffer;
+
+// Binary copy of the interleaved vertex buffer of a mesh, written next
+// to the source file ("<source>.mesh") on first load, so that later
+// loads skip parsing and building the buffer altogether. As with
+// VolumeCache, a cache whose recorded source modification time or
+// size doesn't match the source file anymore is ignored (and
+// rewritten).
+namespace MeshCache
+{
+	std::string getFileName(const std::string& sourceFileName);
+
+	// Returns false if there is no valid cache for "sourceFileName"
+	bool load(const std::string& sourceFileName, MeshBuffer& result);
+
+	// Returns false if the cache couldn't be written (e.g. read-only
+	// directory)
+	bool save(const std::string& sourceFileName, const MeshBuffer& buffer);
+}
+
+#endif /* MESH_CACHE_H */
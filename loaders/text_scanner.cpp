@@ -0,0 +1,194 @@
+#include "text_scanner.h"
+
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+namespace {
+	// Powers of ten that are exact in double precision
+	const double exactPowersOf10[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const int maxExactPower = 22;
+
+	// (above this, extra digits only change the exponent)
+	const uint64_t maxMantissa = 100000000000000000ULL; // 1e17
+
+	inline bool isBlank(char c)
+	{
+		return (c == ' ' || c == '\t');
+	}
+
+	inline bool isDigit(char c)
+	{
+		return (c >= '0' && c <= '9');
+	}
+
+	inline bool isDelimiter(const char* p, const char* end)
+	{
+		return (p >= end || isBlank(*p) || *p == '/' || *p == '\r' || *p == '\n');
+	}
+
+	// Prefix "prefix" followed by a blank (or a line break) at "p"
+	inline bool matchesWord(const char* p, const char* end, const char* prefix)
+	{
+		for (; *prefix; ++prefix, ++p) {
+			if (p >= end || *p != *prefix)
+				return false;
+		}
+		return (p >= end || isBlank(*p) || *p == '\r' || *p == '\n');
+	}
+} // namespace
+
+void TextScanner::skipBlanks()
+{
+	while (mPos < mEnd && isBlank(*mPos))
+		++mPos;
+}
+
+bool TextScanner::atEndOfLine()
+{
+	skipBlanks();
+	return (mPos >= mEnd || *mPos == '\r' || *mPos == '\n');
+}
+
+void TextScanner::nextLine()
+{
+	const char* eol = static_cast<const char*>(std::memchr(mPos, '\n', mEnd - mPos));
+	mPos = (eol ? eol+1 : mEnd);
+	++mLine;
+}
+
+bool TextScanner::skip(char c)
+{
+	if (mPos >= mEnd || *mPos != c)
+		return false;
+	++mPos;
+	return true;
+}
+
+bool TextScanner::skipWord(const char* word)
+{
+	skipBlanks();
+	if (!matchesWord(mPos, mEnd, word))
+		return false;
+	mPos += std::strlen(word);
+	return true;
+}
+
+bool TextScanner::parseFloat(float& result)
+{
+	skipBlanks();
+
+	const char* p = mPos;
+
+	bool negative = false;
+	if (p < mEnd && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	bool hasDigits = false;
+
+	for (; p < mEnd && isDigit(*p); ++p) {
+		hasDigits = true;
+		if (mantissa < maxMantissa)
+			mantissa = mantissa*10 + (*p - '0');
+		else
+			++exponent;
+	}
+
+	if (p < mEnd && *p == '.') {
+		for (++p; p < mEnd && isDigit(*p); ++p) {
+			hasDigits = true;
+			if (mantissa < maxMantissa) {
+				mantissa = mantissa*10 + (*p - '0');
+				--exponent;
+			}
+		}
+	}
+
+	if (!hasDigits)
+		return false;
+
+	if (p < mEnd && (*p == 'e' || *p == 'E')) {
+		++p;
+		bool negativeExp = false;
+		if (p < mEnd && (*p == '-' || *p == '+'))
+			negativeExp = (*p++ == '-');
+
+		if (p >= mEnd || !isDigit(*p))
+			return false;
+
+		int exp = 0;
+		for (; p < mEnd && isDigit(*p); ++p) {
+			if (exp < 10000)
+				exp = exp*10 + (*p - '0');
+		}
+		exponent += (negativeExp ? -exp : exp);
+	}
+
+	if (!isDelimiter(p, mEnd))
+		return false;
+
+	// The mantissa and the power of ten are both exact in most cases
+	// (up to 15 significant digits), making the result correctly
+	// rounded to double precision
+	double value = mantissa;
+	if (exponent < 0 && exponent >= -maxExactPower)
+		value /= exactPowersOf10[-exponent];
+	else if (exponent > 0 && exponent <= maxExactPower)
+		value *= exactPowersOf10[exponent];
+	else if (exponent != 0)
+		value *= std::pow(10.0, exponent);
+
+	result = (negative ? -value : value);
+	mPos = p;
+	return true;
+}
+
+bool TextScanner::parseUInt(unsigned int& result)
+{
+	skipBlanks();
+
+	const char* p = mPos;
+	if (p < mEnd && *p == '+')
+		++p;
+
+	if (p >= mEnd || !isDigit(*p))
+		return false;
+
+	uint64_t value = 0;
+	for (; p < mEnd && isDigit(*p); ++p) {
+		value = value*10 + (*p - '0');
+		if (value > 0xFFFFFFFFULL)
+			return false;
+	}
+
+	if (!isDelimiter(p, mEnd))
+		return false;
+
+	result = value;
+	mPos = p;
+	return true;
+}
+
+void TextScanner::countLines(const char* const* prefixes, std::size_t count, std::size_t* result) const
+{
+	std::fill(result, result+count, 0);
+
+	const char* p = mPos;
+	while (p < mEnd) {
+		for (std::size_t i = 0; i < count; ++i) {
+			if (*p == prefixes[i][0] && matchesWord(p, mEnd, prefixes[i])) {
+				++result[i];
+				break;
+			}
+		}
+
+		const char* eol = static_cast<const char*>(std::memchr(p, '\n', mEnd - p));
+		p = (eol ? eol+1 : mEnd);
+	}
+}
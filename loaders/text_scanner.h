@@ -0,0 +1,58 @@
+#ifndef TEXT_SCANNER_H
+#define TEXT_SCANNER_H
+
+#include "global.h"
+
+// Forward-only reader of a text file in memory (typically a
+// File::Mapping), for the text mesh formats. Numbers are parsed in
+// place, without streams, locales or allocations; the buffer doesn't
+// need to be null-terminated.
+//
+// The parse functions skip the leading blanks (spaces and tabs) and
+// return false, without consuming anything, if there is no valid
+// number at the current position. A number must be followed by a
+// blank, '/', a line break or the end of the buffer.
+class TextScanner
+{
+public:
+	TextScanner(const char* begin, const char* end)
+	 : mPos(begin), mEnd(end), mLine(1) {}
+
+	bool atEnd() const { return mPos >= mEnd; }
+
+	// Current character, or '\0' at the end of the buffer
+	char peek() const { return (mPos < mEnd ? *mPos : '\0'); }
+
+	// Line number of the current position (from 1)
+	unsigned int getLine() const { return mLine; }
+
+	void skipBlanks();
+
+	// True if the rest of the current line is empty (blanks only)
+	bool atEndOfLine();
+
+	// Moves to the beginning of the next line
+	void nextLine();
+
+	// Consumes "c" if it's the current character
+	bool skip(char c);
+
+	// Consumes "word" if the current line continues with it followed
+	// by a blank or a line break
+	bool skipWord(const char* word);
+
+	bool parseFloat(float& result);
+	bool parseUInt(unsigned int& result);
+
+	// Counts the lines beginning with each of the "count" prefixes
+	// followed by a blank, in the remainder of the buffer (in a single
+	// pass, without moving)
+	void countLines(const char* const* prefixes, std::size_t count, std::size_t* result) const;
+
+private:
+	const char* mPos;
+	const char* mEnd;
+	unsigned int mLine;
+};
+
+#endif /* TEXT_SCANNER_H */
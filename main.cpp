@@ -2,13 +2,18 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
 #include <unistd.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengles2.h>
 
 #include "fluids_app.h"
+#include "derived_fields.h"
 #include "udp_server.h"
+#include "quality_governor.h"
+#include "util/profiler.h"
+#include "util/task_pool.h"
 
 #include <pthread.h>
 #include <thread>
@@ -26,8 +31,31 @@ int main()
 {
 	
 	bool realFullScreen = false ;
+
+	// LOG_LEVEL=<0..3> hides the messages below that level (see
+	// Log::Level)
+	if (const char* level = std::getenv("LOG_LEVEL"))
+		Log::setLevel(Log::Level(Utility::fromString<int>(level)));
+
 	udp_server server(8500);
 	//server.listen();
+
+	// Session logs: UDP_RECORD=<file> records the received datagrams,
+	// UDP_REPLAY=<file> replays them instead of listening to the
+	// network (UDP_REPLAY_SPEED times faster), then prints the frame
+	// time distribution and quits
+	const char* replayFileName = std::getenv("UDP_REPLAY");
+	try {
+		if (replayFileName) {
+			const char* speed = std::getenv("UDP_REPLAY_SPEED");
+			server.openReplay(replayFileName, speed ? Utility::fromString<float>(speed) : 1.0f);
+		} else if (const char* recordFileName = std::getenv("UDP_RECORD")) {
+			server.startRecording(recordFileName);
+		}
+	} catch (const std::exception& e) {
+		LOGE("%s", e.what());
+		return EXIT_FAILURE;
+	}
 	if (SDL_Init(SDL_INIT_VIDEO) < 0) {
 		LOGE("Unable to initialize SDL: %s", SDL_GetError());
 		SDL_Quit();
@@ -80,7 +108,29 @@ int main()
 	std::unique_ptr<FluidMechanics> app(new FluidMechanics("data"));
 	app->rebind();
 
-	app->loadDataSet("data/head.vti");
+	// Datasets are loaded in the background. Preloading them all
+	// makes switching immediate, at the cost of keeping them all in
+	// memory.
+	// TIME_SERIES=<pattern> shows a time-varying dataset instead
+	// (e.g. "data/run/FTLE%d.vtk", with the optional velocity files
+	// given by TIME_SERIES_VELOCITY the same way), played if
+	// TIME_SERIES_PLAY is set.
+	const bool preloadDataSets = true;
+	if (const char* pattern = std::getenv("TIME_SERIES")) {
+		const char* velocityPattern = std::getenv("TIME_SERIES_VELOCITY");
+		try {
+			app->loadTimeSeries(pattern, velocityPattern ? velocityPattern : "");
+		} catch (const std::exception& e) {
+			LOGE("%s", e.what());
+			SDL_Quit();
+			return EXIT_FAILURE;
+		}
+		app->setTimeSeriesPlaying(std::getenv("TIME_SERIES_PLAY") != nullptr);
+	} else {
+		app->requestDataSet(head);
+		if (preloadDataSets)
+			app->preloadDataSets();
+	}
 	app->setMatrices(Matrix4::makeTransform(Vector3(0, 0, 400), Quaternion(Vector3::unitX(), -M_PI/4)),
 	                 // Matrix4::identity()
 	                 Matrix4::makeTransform(Vector3(0, 0, 400))
@@ -89,14 +139,59 @@ int main()
 	float t = 0;
 	float t2 = 0;
 
-	//Thread creation
-	std::thread th(&udp_server::listen,&server);
-	//th.join();
+	// (stopped by ~udp_server())
+	server.start();
+	std::vector<float> frameTimesMs; // (replay only)
 
 	Matrix4 dataMatrix = Matrix4::makeTransform(Vector3(0, 0, 400), Quaternion(Vector3::unitX(), -M_PI/4)) ;
 	Matrix4 sliceMatrix = Matrix4::makeTransform(Vector3(0, 0, 400)) ;
 	Vector3 seedPoint(-10000.0,-10000.0,-10000.0);
 	Vector3 prevSeedPoint(-10000.0,-10000.0,-10000.0);
+	int prevDataSet = server.getState().dataset;
+
+	// Input latency (from the arrival of a message to the submission
+	// of the first frame using it), reported every few seconds
+	unsigned int prevSerial = 0;
+	long long latencySumNs = 0, latencyMaxNs = 0;
+	unsigned int latencyCount = 0;
+	long long lastReportNs = Utility::currentTimeNs();
+
+#ifdef PROFILING
+	// Profiler stats are printed, and also sent to PROFILER_STATS
+	// ("<ipv4 address>:<port>") if set
+	if (const char* dest = std::getenv("PROFILER_STATS")) {
+		const std::string str(dest);
+		const std::size_t sep = str.find(':');
+		try {
+			Profiler::setStatsDestination(str.substr(0, sep), sep != std::string::npos ? Utility::fromString<int>(str.substr(sep+1)) : 0);
+		} catch (const std::exception& e) {
+			LOGE("%s", e.what());
+		}
+	}
+#endif
+
+	// Poses are extrapolated to the time the frame is expected to be
+	// displayed: the vsync following the next swap
+	bool predictPoses = true;
+	long long lastSwapNs = Utility::currentTimeNs();
+	long long framePeriodNs = 16666667; // (measured below)
+
+	// Sampling quality is lowered when frames take longer than the
+	// budget (60 Hz), and restored when the tracker input is idle
+	QualityGovernor governor(16666667);
+
+	// Size of the volume render target relative to the viewport, at
+	// full quality (1: rendered directly into the framebuffer)
+	float volumeResolution = 0.5f;
+
+	// Frames are only rendered when something may have changed
+	// (input, settings, animations, see FluidMechanics::needsRedraw()):
+	// otherwise the last frame stays on screen and the GPU is left
+	// idle. Disabled while replaying, to measure every frame.
+	bool skipUnchangedFrames = !replayFileName;
+	bool qualityChanged = false;
+	unsigned int renderedFrames = 0, skippedFrames = 0;
+	static const int idlePollMs = 4; // (new messages are polled)
 
 
 	struct sigaction action;
@@ -106,7 +201,9 @@ int main()
 	SDL_Event event;
 	bool quit = false ;
 	while (!quit) {
-		SDL_PollEvent(&event);
+		const bool hasEvent = SDL_PollEvent(&event);
+		if (!hasEvent)
+			event.type = SDL_FIRSTEVENT; // (the previous event is not handled again)
 		switch(event.type)
 	    {
 	        case SDL_WINDOWEVENT: // Événement de la fenêtre
@@ -127,34 +224,78 @@ int main()
 					else
 						SDL_SetWindowBordered(window, SDL_TRUE);
 				}
+				if(event.key.keysym.sym == SDLK_v){
+					// Switch between the slice-based and ray casting volume renderers
+					app->getSettings()->rayCastVolume = !app->getSettings()->rayCastVolume ;
+					LOGD("volume rendering: %s", app->getSettings()->rayCastVolume ? "ray casting" : "slices");
+				}
+				if(event.key.keysym.sym == SDLK_p){
+					// Switch between CPU and GPU particle advection
+					app->getSettings()->gpuParticles = !app->getSettings()->gpuParticles ;
+					LOGD("particle advection: %s", app->getSettings()->gpuParticles ? "GPU" : "CPU");
+				}
+				if(event.key.keysym.sym == SDLK_g){
+					// Switch between CPU reslicing and GPU sampling of the slice
+					app->getSettings()->gpuSlice = !app->getSettings()->gpuSlice ;
+					LOGD("slice sampling: %s", app->getSettings()->gpuSlice ? "GPU" : "CPU");
+				}
+				if(event.key.keysym.sym == SDLK_t){
+					predictPoses = !predictPoses ;
+					LOGD("pose prediction: %s", predictPoses ? "on" : "off");
+				}
+				if(event.key.keysym.sym == SDLK_m){
+					app->reportMemoryUsage();
+				}
+				if(event.key.keysym.sym == SDLK_d){
+					// Cycles between the scalars of the dataset and the
+					// fields derived from its velocity data (if any)
+					const ScalarField next = (app->getScalarField() == SCALAR_Q_CRITERION
+						? SCALAR_DATA_FILE : ScalarField(app->getScalarField() + 1));
+					if (app->setScalarField(next))
+						LOGD("scalar field: %s", (next == SCALAR_DATA_FILE ? "dataset file" : DerivedFields::getName(DerivedFields::Field(next))));
+				}
+				if(event.key.keysym.sym == SDLK_l){
+					app->getSettings()->showStreamlines = !app->getSettings()->showStreamlines ;
+					LOGD("streamlines: %s", app->getSettings()->showStreamlines ? "on" : "off");
+				}
+				if(event.key.keysym.sym == SDLK_q){
+					governor.setEnabled(!governor.isEnabled());
+					LOGD("adaptive quality: %s", governor.isEnabled() ? "on" : "off");
+				}
+				if(event.key.keysym.sym == SDLK_r){
+					// Cycles between full, half and quarter resolution
+					volumeResolution = (volumeResolution > 0.75f ? 0.5f : volumeResolution > 0.375f ? 0.25f : 1.0f);
+					LOGD("volume resolution: %g", volumeResolution);
+				}
+				if(event.key.keysym.sym == SDLK_s){
+					skipUnchangedFrames = !skipUnchangedFrames ;
+					LOGD("skipping unchanged frames: %s", skipUnchangedFrames ? "on" : "off");
+				}
 	            break;
 	    }
 
-		if(server.hasDataSetChanged ){
-			int dataset = server.getDataSet();
-			if(dataset == ftle){
-				app->loadDataSet("data/ftlelog.vtk");
-			}
-			else if(dataset == ironProt){
-				app->loadDataSet("data/ironProt.vtk");
-			}
-			else if(dataset == head){
-				app->loadDataSet("data/head.vti");
-			}
-			else if(dataset == velocity){
-				app->loadDataSet("data/FTLE7.vtk");
-				app->loadVelocityDataSet("data/Velocities7.vtk");
-			}
+		// Everything below comes from the same message
+		const udp_server::TrackerState tracker = server.getState();
+		const bool newInput = (tracker.serial != prevSerial);
+
+		if(tracker.dataset != prevDataSet){
+			// (loaded in the background if needed)
+			prevDataSet = tracker.dataset;
+			app->requestDataSet(tracker.dataset);
+		}
+		if (predictPoses) {
+			tracker.predict(lastSwapNs + framePeriodNs, dataMatrix, sliceMatrix);
+		} else {
+			dataMatrix = tracker.dataMatrix;
+			sliceMatrix = tracker.sliceMatrix;
 		}
-		dataMatrix = server.getDataMatrix();
-		sliceMatrix = server.getSliceMatrix();
 		//LOGD("dataMatrix = %s", Utility::toString(dataMatrix).c_str());
 		//LOGD("sliceMatrix = %s", Utility::toString(sliceMatrix).c_str());
-		//LOGD("server.getZoomFactor() = %f", server.getZoomFactor());
+		//LOGD("tracker.zoomFactor = %f", tracker.zoomFactor);
 
-		app->getSettings()->zoomFactor = server.getZoomFactor();
+		app->getSettings()->zoomFactor = tracker.zoomFactor;
 		//sliceMatrix = dataMatrix * sliceMatrix ;
-		seedPoint = server.getSeedPoint();
+		seedPoint = tracker.seedPoint;
 		app->setMatrices(dataMatrix,sliceMatrix);
 		/*app->setMatrices(Matrix4::makeTransform(Vector3(0, 0, 380), Quaternion(Vector3::unitX(), -M_PI/4)*Quaternion(Vector3::unitZ(), t)),
 		                 // Matrix4::identity()
@@ -166,12 +307,12 @@ int main()
 		app->getSettings()->sliceType = SLICE_STYLUS;
 		//app->getSettings()->sliceType = SLICE_CAMERA;
 		//app->getSettings()->showSlice = true;
-		app->getSettings()->showSlice = server.getShowSlice();
+		app->getSettings()->showSlice = tracker.showSlice;
 		app->getSettings()->clipDist = t2;
 
 		if(prevSeedPoint != seedPoint){
 			if(seedPoint == Vector3(-1000000,-1000000,-1000000) || seedPoint == Vector3(-1,-1,-1)){
-				std::cout << "Reset Particles" << std::endl ;
+				LOGD("reset particles");
 				app->resetParticles();
 			}
 			app->setSeedPoint(seedPoint.x, seedPoint.y, seedPoint.z);
@@ -179,16 +320,84 @@ int main()
 			app->releaseParticles();
 		}
 		
-		app->getSettings()->considerX = server.getConsiderX();
-		app->getSettings()->considerY = server.getConsiderY();
-		app->getSettings()->considerZ = server.getConsiderZ();
+		app->getSettings()->considerX = tracker.considerX;
+		app->getSettings()->considerY = tracker.considerY;
+		app->getSettings()->considerZ = tracker.considerZ;
 		
 		//LOGD("%f", t2);
 
+		// (continuations of the background tasks)
+		const bool ranGlTasks = TaskPool::runGlTasks();
+
+		// (quality is also restored while idle)
+		if (skipUnchangedFrames && !hasEvent && !newInput && !qualityChanged && !ranGlTasks
+		    && governor.getLevel() == 0 && !app->needsRedraw())
+		{
+			SDL_WaitEventTimeout(NULL, idlePollMs);
+			// (the next frame period starts now)
+			lastSwapNs = Utility::currentTimeNs();
+			++skippedFrames;
+			continue;
+		}
+
 		app->render();
+		++renderedFrames;
+
+		if (tracker.serial != prevSerial) {
+			const long long latencyNs = Utility::currentTimeNs() - tracker.receivedTimeNs;
+			latencySumNs += latencyNs;
+			latencyMaxNs = std::max(latencyMaxNs, latencyNs);
+			++latencyCount;
+			prevSerial = tracker.serial;
+		}
+		if (Utility::currentTimeNs() - lastReportNs > 5000000000LL) {
+			const udp_server::Stats stats = server.getStats();
+			LOGD("udp: %u received, %u superseded, %u malformed, %u reordered, %u lost, latency: %.1f ms avg, %.1f ms max",
+			     stats.received, stats.superseded, stats.malformed, stats.reordered, stats.lost,
+			     (latencyCount ? latencySumNs / 1e6 / latencyCount : 0.0), latencyMaxNs / 1e6);
+			latencySumNs = latencyMaxNs = 0;
+			latencyCount = 0;
+			if (skippedFrames) {
+				LOGD("frames: %u rendered, %u skipped (unchanged)", renderedFrames, skippedFrames);
+			}
+			renderedFrames = skippedFrames = 0;
+			lastReportNs = Utility::currentTimeNs();
+		}
 
 		SDL_GL_SwapWindow(window);
+		PROFILE_FRAME();
 		// usleep(16*1000);
+
+		// (the swap returns at vsync)
+		const long long swapNs = Utility::currentTimeNs();
+		const long long periodNs = swapNs - lastSwapNs;
+		if (periodNs > 0 && periodNs < 100000000) // (ignores hiccups)
+			framePeriodNs += (periodNs - framePeriodNs) / 16;
+		lastSwapNs = swapNs;
+
+		qualityChanged = governor.update(periodNs, newInput);
+		const QualityGovernor::Quality& quality = governor.getQuality();
+		app->getSettings()->volumePlaneStep = quality.volumePlaneStep;
+		app->getSettings()->rayStepSize = quality.rayStepSize;
+		app->getSettings()->sliceResolution = quality.sliceResolution;
+		app->getSettings()->volumeResolution = std::max(0.125f, volumeResolution * quality.volumeResolution);
+
+		if (replayFileName) {
+			frameTimesMs.push_back(periodNs / 1e6);
+			if (server.isReplayDone())
+				quit = true;
+		}
+	}
+
+	if (!frameTimesMs.empty()) {
+		std::sort(frameTimesMs.begin(), frameTimesMs.end());
+		double sum = 0;
+		for (float ms : frameTimesMs)
+			sum += ms;
+		const std::size_t n = frameTimesMs.size();
+		LOGI("frame times: %u frames, min %.2f ms, avg %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms",
+		     (unsigned int)n, frameTimesMs.front(), sum / n,
+		     frameTimesMs[n/2], frameTimesMs[n*90/100], frameTimesMs[n*99/100], frameTimesMs.back());
 	}
 
 	SDL_GL_DeleteContext(context);
@@ -0,0 +1,136 @@
+#include "minmax_tree.h"
+
+#include "util/parallel.h"
+
+#include <limits>
+
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+
+namespace {
+	template <typename T>
+	void computeBrickRanges(const T* scalars, int components, const int* dims,
+	                        const int* brickDims, int bz, float* min, float* max)
+	{
+		const int bs = MinMaxTree::brickSize;
+		const int nx = dims[0], ny = dims[1];
+
+		// The last layer of grid points of a brick is shared with
+		// the next brick, since it belongs to the cells of both
+		const int z0 = bz*bs, z1 = std::min(z0+bs, dims[2]-1);
+
+		for (int by = 0; by < brickDims[1]; ++by) {
+			const int y0 = by*bs, y1 = std::min(y0+bs, ny-1);
+
+			for (int bx = 0; bx < brickDims[0]; ++bx) {
+				const int x0 = bx*bs, x1 = std::min(x0+bs, nx-1);
+
+				float lo = std::numeric_limits<float>::max();
+				float hi = std::numeric_limits<float>::lowest();
+
+				for (int k = z0; k <= z1; ++k) {
+					for (int j = y0; j <= y1; ++j) {
+						const T* row = scalars + ((std::size_t(k)*ny + j)*nx)*components;
+						for (int i = x0; i <= x1; ++i) {
+							const float v = float(row[i*components]);
+							lo = std::min(lo, v);
+							hi = std::max(hi, v);
+						}
+					}
+				}
+
+				const int index = (bz*brickDims[1] + by)*brickDims[0] + bx;
+				min[index] = lo;
+				max[index] = hi;
+			}
+		}
+	}
+} // namespace
+
+MinMaxTree::MinMaxTree(vtkSmartPointer<vtkImageData> data)
+{
+	android_assert(data);
+
+	vtkDataArray* scalars = data->GetPointData()->GetScalars();
+	if (!scalars)
+		throw std::runtime_error("MinMaxTree: unsupported data");
+
+	int dims[3];
+	data->GetDimensions(dims);
+
+	Level leaves;
+	for (int d = 0; d < 3; ++d)
+		leaves.dims[d] = std::max(1, (dims[d]-1 + brickSize-1) / brickSize);
+
+	const int leafCount = leaves.dims[0]*leaves.dims[1]*leaves.dims[2];
+	leaves.min.resize(leafCount);
+	leaves.max.resize(leafCount);
+
+	const void* ptr = scalars->GetVoidPointer(0);
+	const int components = scalars->GetNumberOfComponents();
+
+	Parallel::forEach(0, leaves.dims[2], [&](int bz) {
+		switch (scalars->GetDataType()) {
+			vtkTemplateMacro(
+				computeBrickRanges(static_cast<const VTK_TT*>(ptr), components, dims,
+				                   leaves.dims, bz, leaves.min.data(), leaves.max.data())
+			);
+			default:
+				throw std::runtime_error("MinMaxTree: unsupported scalar type");
+		}
+	});
+
+	mLevels.push_back(leaves);
+
+	// Upper levels, until a single node covers the whole field
+	while (mLevels.back().min.size() > 1) {
+		const Level& child = mLevels.back();
+		Level parent;
+		for (int d = 0; d < 3; ++d)
+			parent.dims[d] = (child.dims[d]+1) / 2;
+
+		parent.min.assign(parent.dims[0]*parent.dims[1]*parent.dims[2], std::numeric_limits<float>::max());
+		parent.max.assign(parent.min.size(), std::numeric_limits<float>::lowest());
+
+		for (int z = 0; z < child.dims[2]; ++z) {
+			for (int y = 0; y < child.dims[1]; ++y) {
+				for (int x = 0; x < child.dims[0]; ++x) {
+					const int c = (z*child.dims[1] + y)*child.dims[0] + x;
+					const int p = ((z/2)*parent.dims[1] + y/2)*parent.dims[0] + x/2;
+					parent.min[p] = std::min(parent.min[p], child.min[c]);
+					parent.max[p] = std::max(parent.max[p], child.max[c]);
+				}
+			}
+		}
+
+		mLevels.push_back(parent);
+	}
+
+	LOGD("min/max tree: %d x %d x %d bricks, %d levels",
+	     leaves.dims[0], leaves.dims[1], leaves.dims[2], int(mLevels.size()));
+}
+
+void MinMaxTree::findBricks(float value, std::vector<int>& bricks) const
+{
+	findBricks(value, mLevels.size()-1, 0, 0, 0, bricks);
+}
+
+void MinMaxTree::findBricks(float value, int level, int x, int y, int z, std::vector<int>& bricks) const
+{
+	const Level& l = mLevels[level];
+	const int index = (z*l.dims[1] + y)*l.dims[0] + x;
+
+	if (!(l.min[index] < value && value <= l.max[index]))
+		return;
+
+	if (level == 0) {
+		bricks.push_back(index);
+		return;
+	}
+
+	const Level& child = mLevels[level-1];
+	for (int cz = z*2; cz < std::min(z*2+2, child.dims[2]); ++cz)
+		for (int cy = y*2; cy < std::min(y*2+2, child.dims[1]); ++cy)
+			for (int cx = x*2; cx < std::min(x*2+2, child.dims[0]); ++cx)
+				findBricks(value, level-1, cx, cy, cz, bricks);
+}
@@ -0,0 +1,41 @@
+#ifndef MINMAX_TREE_H
+#define MINMAX_TREE_H
+
+#include "global.h"
+
+#include <vtkSmartPointer.h>
+
+class vtkImageData;
+
+// Min/max tree of a scalar field: the leaves store the range of values
+// of bricks of brickSize^3 cells, and each level above merges 2x2x2
+// nodes of the level below. Used to visit only the bricks that may
+// contain a given isovalue.
+class MinMaxTree
+{
+public:
+	static const int brickSize = 8;
+
+	MinMaxTree(vtkSmartPointer<vtkImageData> data);
+
+	// Number of bricks along each axis
+	const int* getBrickDimensions() const { return mLevels[0].dims; }
+
+	// Appends to "bricks" the linear index (x + y*bx + z*bx*by) of each
+	// leaf brick whose cells may be crossed by the "value" isosurface,
+	// i.e. min < value <= max (cell corners below "value" are "inside")
+	void findBricks(float value, std::vector<int>& bricks) const;
+
+private:
+	struct Level
+	{
+		int dims[3];
+		std::vector<float> min, max;
+	};
+
+	void findBricks(float value, int level, int x, int y, int z, std::vector<int>& bricks) const;
+
+	std::vector<Level> mLevels; // mLevels[0]: leaf bricks
+};
+
+#endif /* MINMAX_TREE_H */
@@ -0,0 +1,347 @@
+#include "particle_engine.h"
+
+#include "util/parallel.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+#include <vtkDataArray.h>
+
+namespace {
+	// Delay between two updates of the particles
+	const int updatePeriodMs = 5;
+
+	// Velocities below this norm stop the particles
+	const float minVelocity = 0.001f;
+
+	template <typename T>
+	void copyVectors(const T* src, int components, std::size_t count, float* dst)
+	{
+		for (std::size_t i = 0; i < count; ++i) {
+			// XXX: workaround for a wrong data orientation
+			dst[i*3+0] = src[i*components+1];
+			dst[i*3+1] = src[i*components+0];
+			dst[i*3+2] = src[i*components+2];
+		}
+	}
+
+	inline float clamp(float value, float max)
+	{
+		return (value > 0 ? std::min(value, max) : 0); // (also catches NaNs)
+	}
+} // namespace
+
+VelocityField::VelocityField(vtkImageData* data)
+{
+	android_assert(data);
+
+	vtkDataArray* vectors = (data->GetPointData() ? data->GetPointData()->GetVectors() : nullptr);
+	if (!vectors || vectors->GetNumberOfComponents() < 3)
+		throw std::runtime_error("VelocityField: no vectors found");
+
+	data->GetDimensions(mDimensions);
+	if (mDimensions[0] < 2 || mDimensions[1] < 2 || mDimensions[2] < 2)
+		throw std::runtime_error("VelocityField: the data is not 3D");
+
+	const std::size_t sliceSize = std::size_t(mDimensions[0]) * mDimensions[1];
+	const void* src = vectors->GetVoidPointer(0);
+	const int components = vectors->GetNumberOfComponents();
+	mVectors.resize(sliceSize * mDimensions[2] * 3);
+	float* dst = mVectors.data();
+
+	// One slice per task
+	Parallel::forEach(0, mDimensions[2], [&](int z) {
+		const std::size_t first = z*sliceSize;
+		switch (vectors->GetDataType()) {
+			vtkTemplateMacro(
+				copyVectors(static_cast<const VTK_TT*>(src) + first*components, components,
+				            sliceSize, dst + first*3)
+			);
+			default:
+				throw std::runtime_error("VelocityField: unsupported vector type");
+		}
+	});
+}
+
+void VelocityField::sample(const float* x, const float* y, const float* z, unsigned int count,
+                           float* vx, float* vy, float* vz) const
+{
+	const int dx = mDimensions[0], dy = mDimensions[1], dz = mDimensions[2];
+	const std::size_t ox = 3, oy = 3*std::size_t(dx), oz = oy*dy; // neighbor offsets
+
+	for (unsigned int i = 0; i < count; ++i) {
+		float fx = clamp(x[i], dx-1), fy = clamp(y[i], dy-1), fz = clamp(z[i], dz-1);
+		const int ix = std::min(int(fx), dx-2), iy = std::min(int(fy), dy-2), iz = std::min(int(fz), dz-2);
+		fx -= ix; fy -= iy; fz -= iz;
+
+		const float* p = &mVectors[iz*oz + iy*oy + ix*ox];
+		float v[3];
+		for (int c = 0; c < 3; ++c, ++p) {
+			const float c00 = p[0]     + (p[ox]       - p[0])    * fx;
+			const float c10 = p[oy]    + (p[oy+ox]    - p[oy])   * fx;
+			const float c01 = p[oz]    + (p[oz+ox]    - p[oz])   * fx;
+			const float c11 = p[oz+oy] + (p[oz+oy+ox] - p[oz+oy])* fx;
+			const float c0 = c00 + (c10 - c00) * fy;
+			const float c1 = c01 + (c11 - c01) * fy;
+			v[c] = c0 + (c1 - c0) * fz;
+		}
+
+		vx[i] = v[0];
+		vy[i] = v[1];
+		vz[i] = v[2];
+	}
+}
+
+ParticleEngine::ParticleEngine(unsigned int count, float speed, int stallMs)
+ : mCount(count), mSpeed(speed), mStallMs(stallMs),
+   mX(count), mY(count), mZ(count),
+   mDelayMs(count, 0), mStallLeftMs(count, 0),
+   mValid(count, false),
+   mValidCount(0),
+   mPaused(false), mStopped(false),
+   mLastTimeNs(Utility::currentTimeNs()),
+   mSnapshotChanged(false), mHasParticles(false),
+   mThread(&run_, static_cast<void*>(this)) // (must be initialized last)
+{}
+
+ParticleEngine::~ParticleEngine()
+{
+	{
+		tthread::lock_guard<tthread::mutex> g(mLock);
+		mStopped = true;
+		mCond.notify_all();
+	}
+	mThread.join();
+}
+
+void ParticleEngine::setVelocityField(VelocityFieldSharedPtr field)
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	mField = field;
+	if (!mField) {
+		std::fill(mValid.begin(), mValid.end(), false);
+		mValidCount = 0;
+		publish();
+	}
+	mCond.notify_all();
+}
+
+void ParticleEngine::release(const Vector3& seed, float jitter, int durationMs)
+{
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	for (unsigned int i = 0; i < mCount; ++i) {
+		mX[i] = seed.x + jitter * float(std::rand()) / RAND_MAX;
+		mY[i] = seed.y + jitter * float(std::rand()) / RAND_MAX;
+		mZ[i] = seed.z + jitter * float(std::rand()) / RAND_MAX;
+		mDelayMs[i] = (long long)i * durationMs / mCount;
+		mStallLeftMs[i] = 0;
+		mValid[i] = true;
+	}
+	mValidCount = mCount;
+	publish();
+	mCond.notify_all();
+}
+
+void ParticleEngine::clear()
+{
+	setVelocityField(nullptr);
+}
+
+void ParticleEngine::setPaused(bool paused)
+{
+	// (doesn't wait for the current update when nothing changes)
+	if (paused == mPaused)
+		return;
+
+	tthread::lock_guard<tthread::mutex> g(mLock);
+	mPaused = paused;
+	mCond.notify_all();
+}
+
+bool ParticleEngine::hasParticles()
+{
+	tthread::lock_guard<tthread::mutex> g(mSnapshotLock);
+	return mHasParticles;
+}
+
+bool ParticleEngine::getSnapshot(std::vector<Vector3>& positions)
+{
+	tthread::lock_guard<tthread::mutex> g(mSnapshotLock);
+	if (!mSnapshotChanged)
+		return false;
+	positions = mSnapshot;
+	mSnapshotChanged = false;
+	return true;
+}
+
+// (mLock must be held)
+void ParticleEngine::publish()
+{
+	tthread::lock_guard<tthread::mutex> g(mSnapshotLock);
+	mSnapshot.clear();
+	for (unsigned int i = 0; i < mCount; ++i) {
+		if (mValid[i] && mDelayMs[i] <= 0)
+			mSnapshot.push_back(Vector3(mX[i], mY[i], mZ[i]));
+	}
+	mHasParticles = (mValidCount > 0);
+	mSnapshotChanged = true;
+}
+
+void ParticleEngine::run()
+{
+	const unsigned int blockCount = (mCount + blockSize-1) / blockSize;
+
+	for (;;) {
+		{
+			tthread::lock_guard<tthread::mutex> g(mLock);
+
+			if (mPaused || !mField || mValidCount == 0) {
+				while (!mStopped && (mPaused || !mField || mValidCount == 0))
+					mCond.wait(mLock);
+				// Time doesn't flow while waiting
+				mLastTimeNs = Utility::currentTimeNs();
+			}
+
+			if (mStopped)
+				break;
+
+			// Only whole time steps are consumed, the remainder is
+			// kept for the next update
+			const long long stepNs = timeStepMs * 1000000LL;
+			const int elapsedMs = (Utility::currentTimeNs() - mLastTimeNs) / stepNs * timeStepMs;
+
+			if (elapsedMs > 0) {
+				mLastTimeNs += elapsedMs * 1000000LL;
+
+				try {
+					Parallel::forEach(0, blockCount, [&](int block) {
+						updateBlock(block, elapsedMs);
+					});
+
+				} catch (const std::exception& e) {
+					LOGE("Exception in particle engine: %s", e.what());
+				}
+
+				mValidCount = std::count(mValid.begin(), mValid.end(), true);
+				publish();
+			}
+		}
+
+		// "mLock" is released here, so that other threads can
+		// release particles between two updates
+		tthread::this_thread::sleep_for(tthread::chrono::milliseconds(updatePeriodMs));
+	}
+}
+
+// (mLock must be held)
+void ParticleEngine::updateBlock(unsigned int block, int elapsedMs)
+{
+	const unsigned int begin = block*blockSize;
+	const unsigned int end = std::min(begin + blockSize, mCount);
+	const VelocityField& field = *mField;
+
+	// Moving particles of the block, packed into "lanes"
+	unsigned int index[blockSize];
+	int steps[blockSize];
+	float px[blockSize], py[blockSize], pz[blockSize];
+	unsigned int n = 0;
+
+	for (unsigned int i = begin; i < end; ++i) {
+		if (!mValid[i])
+			continue;
+
+		int ms = elapsedMs;
+
+		if (mDelayMs[i] > 0) {
+			mDelayMs[i] -= ms;
+			if (mDelayMs[i] > 0)
+				continue;
+			ms = -mDelayMs[i];
+			mDelayMs[i] = 0;
+		}
+
+		if (mStallLeftMs[i] > 0) {
+			mStallLeftMs[i] -= ms;
+			if (mStallLeftMs[i] <= 0)
+				mValid[i] = false;
+			continue;
+		}
+
+		if (ms >= timeStepMs) {
+			index[n] = i;
+			steps[n] = ms / timeStepMs;
+			px[n] = mX[i]; py[n] = mY[i]; pz[n] = mZ[i];
+			++n;
+		}
+	}
+
+	// RK4 stages, all lanes at once
+	float k1x[blockSize], k1y[blockSize], k1z[blockSize];
+	float k2x[blockSize], k2y[blockSize], k2z[blockSize];
+	float k3x[blockSize], k3y[blockSize], k3z[blockSize];
+	float k4x[blockSize], k4y[blockSize], k4z[blockSize];
+	float tx[blockSize], ty[blockSize], tz[blockSize];
+	const float h = mSpeed * timeStepMs;
+
+	while (n > 0) {
+		field.sample(px, py, pz, n, k1x, k1y, k1z);
+
+		// Remove the lanes which are done, have left the grid
+		// (removed), or have stopped (stalled)
+		unsigned int m = 0;
+		for (unsigned int j = 0; j < n; ++j) {
+			const unsigned int i = index[j];
+			bool keep = false;
+			if (steps[j] == 0) {
+				// (done)
+			} else if (!field.contains(px[j], py[j], pz[j])) {
+				mValid[i] = false;
+			} else if (k1x[j]*k1x[j] + k1y[j]*k1y[j] + k1z[j]*k1z[j] <= minVelocity*minVelocity) {
+				mStallLeftMs[i] = mStallMs;
+			} else {
+				keep = true;
+			}
+
+			if (!keep) {
+				mX[i] = px[j]; mY[i] = py[j]; mZ[i] = pz[j];
+				continue;
+			}
+
+			index[m] = i; steps[m] = steps[j];
+			px[m] = px[j]; py[m] = py[j]; pz[m] = pz[j];
+			k1x[m] = k1x[j]; k1y[m] = k1y[j]; k1z[m] = k1z[j];
+			++m;
+		}
+		n = m;
+
+		for (unsigned int j = 0; j < n; ++j) {
+			tx[j] = px[j] + 0.5f*h*k1x[j];
+			ty[j] = py[j] + 0.5f*h*k1y[j];
+			tz[j] = pz[j] + 0.5f*h*k1z[j];
+		}
+		field.sample(tx, ty, tz, n, k2x, k2y, k2z);
+
+		for (unsigned int j = 0; j < n; ++j) {
+			tx[j] = px[j] + 0.5f*h*k2x[j];
+			ty[j] = py[j] + 0.5f*h*k2y[j];
+			tz[j] = pz[j] + 0.5f*h*k2z[j];
+		}
+		field.sample(tx, ty, tz, n, k3x, k3y, k3z);
+
+		for (unsigned int j = 0; j < n; ++j) {
+			tx[j] = px[j] + h*k3x[j];
+			ty[j] = py[j] + h*k3y[j];
+			tz[j] = pz[j] + h*k3z[j];
+		}
+		field.sample(tx, ty, tz, n, k4x, k4y, k4z);
+
+		for (unsigned int j = 0; j < n; ++j) {
+			px[j] += h/6 * (k1x[j] + 2*k2x[j] + 2*k3x[j] + k4x[j]);
+			py[j] += h/6 * (k1y[j] + 2*k2y[j] + 2*k3y[j] + k4y[j]);
+			pz[j] += h/6 * (k1z[j] + 2*k2z[j] + 2*k3z[j] + k4z[j]);
+			--steps[j];
+		}
+	}
+}
@@ -0,0 +1,122 @@
+#ifndef PARTICLE_ENGINE_H
+#define PARTICLE_ENGINE_H
+
+#include "global.h"
+
+#include "thirdparty/tinythread.h"
+
+#include <atomic>
+
+class vtkImageData;
+
+// Copy of the vectors of a vtkImageData as a contiguous float3 grid,
+// sampled with trilinear interpolation (positions are in voxels)
+class VelocityField
+{
+public:
+	VelocityField(vtkImageData* data);
+
+	const int* getDimensions() const { return mDimensions; }
+
+	// (vx, vy, vz) per voxel, x varying fastest
+	const float* getData() const { return mVectors.data(); }
+
+	std::size_t getMemoryUsage() const { return mVectors.capacity() * sizeof(float); }
+
+	// True if (x, y, z) lies within the grid
+	bool contains(float x, float y, float z) const
+	{
+		return x >= 0 && y >= 0 && z >= 0
+			&& x <= mDimensions[0]-1 && y <= mDimensions[1]-1 && z <= mDimensions[2]-1;
+	}
+
+	// Samples "count" positions given as separate coordinate arrays
+	// (positions outside the grid are clamped to it)
+	void sample(const float* x, const float* y, const float* z, unsigned int count,
+	            float* vx, float* vy, float* vz) const;
+
+private:
+	std::vector<float> mVectors; // (vx, vy, vz) per voxel
+	int mDimensions[3];
+};
+
+typedef std::shared_ptr<const VelocityField> VelocityFieldSharedPtr;
+
+// Advects particles in a velocity field on a dedicated thread.
+// Particles are stored as structure of arrays and integrated with
+// RK4 at a fixed time step, in blocks processed in parallel. Other
+// threads only read the positions published after each update.
+class ParticleEngine
+{
+public:
+	// "speed": displacement (in voxels) per unit of velocity and per
+	// millisecond. Stopped particles are removed after "stallMs".
+	ParticleEngine(unsigned int count, float speed, int stallMs);
+	~ParticleEngine();
+
+	// Removes all particles if "field" is null
+	void setVelocityField(VelocityFieldSharedPtr field);
+
+	// Releases all particles at "seed" (in voxels) plus a random
+	// offset in [0,jitter]^3, one after the other over "durationMs"
+	void release(const Vector3& seed, float jitter, int durationMs);
+
+	void clear();
+
+	// Time doesn't flow while paused
+	void setPaused(bool paused);
+
+	// True if some particles are still alive (including the ones
+	// not released yet)
+	bool hasParticles();
+
+	// Copies the positions of the visible particles (in voxels) to
+	// "positions" and returns true if they have changed since the
+	// last call (single reader)
+	bool getSnapshot(std::vector<Vector3>& positions);
+
+	unsigned int getCount() const { return mCount; }
+
+	// Integration time step
+	static const int timeStepMs = 1;
+
+	// Particles per block (one block per parallel task)
+	static const unsigned int blockSize = 256;
+
+private:
+	static void run_(void* this_)
+	{ static_cast<ParticleEngine*>(this_)->run(); }
+
+	void run();
+
+	// Advances the particles of the given block by "elapsedMs"
+	void updateBlock(unsigned int block, int elapsedMs);
+
+	// (mLock must be held)
+	void publish();
+
+	const unsigned int mCount;
+	const float mSpeed;
+	const int mStallMs;
+
+	// Particle state (structure of arrays, protected by mLock)
+	std::vector<float> mX, mY, mZ;
+	std::vector<int> mDelayMs, mStallLeftMs;
+	std::vector<unsigned char> mValid;
+	unsigned int mValidCount;
+
+	VelocityFieldSharedPtr mField;
+	std::atomic<bool> mPaused;
+	bool mStopped;
+	long long mLastTimeNs; // time up to which particles have been advanced
+
+	// Published positions (protected by mSnapshotLock)
+	std::vector<Vector3> mSnapshot;
+	bool mSnapshotChanged, mHasParticles;
+
+	tthread::mutex mLock, mSnapshotLock;
+	tthread::condition_variable mCond;
+	tthread::thread mThread; // (must be initialized last)
+};
+
+#endif /* PARTICLE_ENGINE_H */
@@ -0,0 +1,172 @@
+#include "probe.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+#include <vtkDataArray.h>
+
+namespace {
+	// Lower voxel index, and offset (in elements) to the next voxel,
+	// along an axis of "dim" voxels. "v" is within [0, dim-1].
+	inline int lowerVoxel(float v, int dim, float& frac)
+	{
+		const int i = std::min(int(v), std::max(dim-2, 0));
+		frac = v - i;
+		return i;
+	}
+
+	template <typename T>
+	double trilinear(const T* values, int components, const int* dims, const Vector3& v)
+	{
+		float fx, fy, fz;
+		const int x = lowerVoxel(v.x, dims[0], fx);
+		const int y = lowerVoxel(v.y, dims[1], fy);
+		const int z = lowerVoxel(v.z, dims[2], fz);
+
+		// (no neighbor along the axes of a single voxel)
+		const std::ptrdiff_t sx = (dims[0] > 1 ? components : 0);
+		const std::ptrdiff_t sy = (dims[1] > 1 ? std::ptrdiff_t(dims[0])*components : 0);
+		const std::ptrdiff_t sz = (dims[2] > 1 ? std::ptrdiff_t(dims[0])*dims[1]*components : 0);
+
+		const T* p = values + x*std::ptrdiff_t(components) + y*(std::ptrdiff_t(dims[0])*components)
+			+ z*(std::ptrdiff_t(dims[0])*dims[1]*components);
+
+		const double c00 = p[0]     + fx*(double(p[sx])       - p[0]);
+		const double c10 = p[sy]    + fx*(double(p[sy+sx])    - p[sy]);
+		const double c01 = p[sz]    + fx*(double(p[sz+sx])    - p[sz]);
+		const double c11 = p[sz+sy] + fx*(double(p[sz+sy+sx]) - p[sz+sy]);
+
+		const double c0 = c00 + fy*(c10 - c00);
+		const double c1 = c01 + fy*(c11 - c01);
+		return c0 + fz*(c1 - c0);
+	}
+
+	template <typename T>
+	void range(const T* values, int components, const int* dims, const int* min, const int* max,
+	           double& minValue, double& maxValue)
+	{
+		T lo = values[(min[0] + dims[0]*(min[1] + std::ptrdiff_t(dims[1])*min[2])) * components];
+		T hi = lo;
+
+		for (int z = min[2]; z <= max[2]; ++z) {
+			for (int y = min[1]; y <= max[1]; ++y) {
+				const T* row = values + (dims[0]*(y + std::ptrdiff_t(dims[1])*z)) * components;
+				for (int x = min[0]; x <= max[0]; ++x) {
+					const T value = row[x*components];
+					lo = std::min(lo, value);
+					hi = std::max(hi, value);
+				}
+			}
+		}
+
+		minValue = lo;
+		maxValue = hi;
+	}
+} // namespace
+
+Probe::Probe(vtkSmartPointer<vtkImageData> data, VelocityFieldSharedPtr velocityField)
+ : mData(data), mVelocityField(velocityField)
+{
+	android_assert(data);
+
+	mScalars = data->GetPointData()->GetScalars();
+	if (!mScalars)
+		throw std::runtime_error("Probe: no scalars");
+
+	mValues = mScalars->GetVoidPointer(0);
+	mComponents = mScalars->GetNumberOfComponents();
+	data->GetDimensions(mDimensions);
+
+	double spacing[3];
+	data->GetSpacing(spacing);
+	mSpacing = Vector3(spacing[0], spacing[1], spacing[2]);
+
+	if (mSpacing.x <= 0 || mSpacing.y <= 0 || mSpacing.z <= 0)
+		throw std::runtime_error("Probe: invalid spacing");
+}
+
+bool Probe::containsVoxel(const Vector3& v) const
+{
+	return v.x >= 0 && v.y >= 0 && v.z >= 0
+		&& v.x <= mDimensions[0]-1 && v.y <= mDimensions[1]-1 && v.z <= mDimensions[2]-1;
+}
+
+bool Probe::contains(const Vector3& pos) const
+{
+	return containsVoxel(toVoxels(pos));
+}
+
+double Probe::interpolate(const Vector3& v) const
+{
+	switch (mScalars->GetDataType()) {
+		vtkTemplateMacro(
+			return trilinear(static_cast<const VTK_TT*>(mValues), mComponents, mDimensions, v)
+		);
+		default:
+			android_assert(false);
+			return 0;
+	}
+}
+
+bool Probe::sampleScalar(const Vector3& pos, double& value) const
+{
+	const Vector3 v = toVoxels(pos);
+	if (!containsVoxel(v))
+		return false;
+
+	value = interpolate(v);
+	return true;
+}
+
+bool Probe::sampleVelocity(const Vector3& pos, Vector3& velocity) const
+{
+	if (!mVelocityField)
+		return false;
+
+	// (the velocity field has the dimensions of the scalars)
+	const Vector3 v = toVoxels(pos);
+	if (!mVelocityField->contains(v.x, v.y, v.z))
+		return false;
+
+	mVelocityField->sample(&v.x, &v.y, &v.z, 1, &velocity.x, &velocity.y, &velocity.z);
+	return true;
+}
+
+void Probe::sampleLine(const Vector3& from, const Vector3& to, unsigned int count, float* values) const
+{
+	const Vector3 v0 = toVoxels(from), v1 = toVoxels(to);
+	const Vector3 step = (count > 1 ? (v1 - v0) / float(count-1) : Vector3::zero());
+
+	for (unsigned int i = 0; i < count; ++i) {
+		const Vector3 v = v0 + step*float(i);
+		values[i] = (containsVoxel(v) ? float(interpolate(v)) : std::numeric_limits<float>::quiet_NaN());
+	}
+}
+
+bool Probe::getRange(const Vector3& min, const Vector3& max, double& minValue, double& maxValue) const
+{
+	const Vector3 v0 = toVoxels(min), v1 = toVoxels(max);
+	const float lo[3] = {v0.x, v0.y, v0.z}, hi[3] = {v1.x, v1.y, v1.z};
+
+	int first[3], last[3];
+	for (int i = 0; i < 3; ++i) {
+		first[i] = std::max(int(std::ceil(lo[i])), 0);
+		last[i] = std::min(int(std::floor(hi[i])), mDimensions[i]-1);
+		if (first[i] > last[i])
+			return false;
+	}
+
+	switch (mScalars->GetDataType()) {
+		vtkTemplateMacro(
+			range(static_cast<const VTK_TT*>(mValues), mComponents, mDimensions, first, last, minValue, maxValue)
+		);
+		default:
+			android_assert(false);
+			return false;
+	}
+
+	return true;
+}
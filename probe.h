@@ -0,0 +1,58 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "global.h"
+
+#include "particle_engine.h"
+
+#include <vtkSmartPointer.h>
+
+class vtkImageData;
+class vtkDataArray;
+
+// Reads the scalars (and the optional velocity field) of a dataset at
+// arbitrary positions, straight from the arrays: no VTK pipeline, a
+// few microseconds per query. Positions are in data coordinates, as
+// used by FluidMechanics: relative to the corner of the grid, in the
+// units of the spacing. Values are interpolated trilinearly.
+// Never modified once built: usable from any thread.
+class Probe
+{
+public:
+	// (throws if "data" has no scalars)
+	Probe(vtkSmartPointer<vtkImageData> data, VelocityFieldSharedPtr velocityField);
+
+	// True if "pos" lies within the grid
+	bool contains(const Vector3& pos) const;
+
+	// Return false if "pos" is outside of the grid (or without
+	// velocity field)
+	bool sampleScalar(const Vector3& pos, double& value) const;
+	bool sampleVelocity(const Vector3& pos, Vector3& velocity) const;
+
+	// "count" scalars evenly spaced from "from" to "to" (both
+	// included), NaN for the positions outside of the grid
+	void sampleLine(const Vector3& from, const Vector3& to, unsigned int count, float* values) const;
+
+	// Range of the voxels within the box [min, max], false if there is
+	// none (meant for small regions: every voxel is read)
+	bool getRange(const Vector3& min, const Vector3& max, double& minValue, double& maxValue) const;
+
+private:
+	// (in voxels)
+	Vector3 toVoxels(const Vector3& pos) const { return Vector3(pos.x/mSpacing.x, pos.y/mSpacing.y, pos.z/mSpacing.z); }
+	bool containsVoxel(const Vector3& v) const;
+	double interpolate(const Vector3& v) const;
+
+	vtkSmartPointer<vtkImageData> mData; // (keeps the scalars alive)
+	vtkDataArray* mScalars;
+	const void* mValues;
+	int mComponents;
+	int mDimensions[3];
+	Vector3 mSpacing;
+	VelocityFieldSharedPtr mVelocityField; // (null without velocity data)
+};
+
+typedef std::shared_ptr<const Probe> ProbeSharedPtr;
+
+#endif /* PROBE_H */
@@ -0,0 +1,77 @@
+#include "quality_governor.h"
+
+namespace {
+	const QualityGovernor::Quality levels[QualityGovernor::levelCount] = {
+		// plane step, ray step, slice resolution, volume resolution
+		{ 1, 1.0f, 1.0f,   1.0f },
+		{ 1, 1.5f, 0.75f,  1.0f },
+		{ 2, 2.0f, 0.5f,   0.5f },
+		{ 3, 3.0f, 0.375f, 0.5f },
+		{ 4, 4.0f, 0.25f,  0.5f },
+	};
+} // namespace
+
+QualityGovernor::QualityGovernor(long long budgetNs)
+ : mBudgetNs(budgetNs),
+   mEnabled(true),
+   mLevel(0),
+   mFrameCount(0),
+   mLastInputNs(0), mLastChangeNs(0)
+{}
+
+bool QualityGovernor::update(long long frameNs, bool input)
+{
+	if (!mEnabled)
+		return false;
+
+	const long long now = Utility::currentTimeNs();
+	if (input)
+		mLastInputNs = now;
+
+	mFrames[mFrameCount++ % windowSize] = frameNs;
+
+	if (now - mLastChangeNs < levelDelayNs)
+		return false;
+
+	// Restored progressively when idle
+	if (now - mLastInputNs > idleDelayNs) {
+		if (mLevel == 0)
+			return false;
+		setLevel(mLevel-1, now);
+		return true;
+	}
+
+	if (mFrameCount < windowSize || mLevel+1 >= levelCount)
+		return false;
+
+	long long sum = 0;
+	for (long long ns : mFrames)
+		sum += ns;
+	if (sum / windowSize <= mBudgetNs * overBudgetFactor)
+		return false;
+
+	setLevel(mLevel+1, now);
+	return true;
+}
+
+void QualityGovernor::setEnabled(bool enabled)
+{
+	mEnabled = enabled;
+	if (!enabled)
+		setLevel(0, Utility::currentTimeNs());
+}
+
+const QualityGovernor::Quality& QualityGovernor::getQuality() const
+{
+	return levels[mLevel];
+}
+
+void QualityGovernor::setLevel(unsigned int level, long long timeNs)
+{
+	if (level != mLevel)
+		LOGD("quality level: %u", level);
+	mLevel = level;
+	mLastChangeNs = timeNs;
+	// (only the frames rendered at the new level count)
+	mFrameCount = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef QUALITY_GOVERNOR_H
+#define QUALITY_GOVERNOR_H
+
+#include "global.h"
+
+// Scales the sampling parameters of the renderers to keep frame
+// times under a budget. Quality is lowered one level at a time while
+// the recent frames are over budget, and restored one level at a
+// time once the tracker input has gone idle, so that the image
+// converges to full quality when the user stops moving.
+class QualityGovernor
+{
+public:
+	struct Quality
+	{
+		unsigned int volumePlaneStep; // see Volume::setPlaneStep()
+		float rayStepSize; // see Volume3d::setStepSize()
+		float sliceResolution; // see Slice::setResolution()
+		float volumeResolution; // factor of the volume render target size (see ReducedResolutionPass)
+	};
+
+	// Number of quality levels (0: full quality)
+	static const unsigned int levelCount = 5;
+
+	QualityGovernor(long long budgetNs);
+
+	// To be called once per frame: "frameNs" is the time since the
+	// previous frame, and "input" is true if new tracker input has
+	// been received since then. Returns true if the quality changed.
+	bool update(long long frameNs, bool input);
+
+	// Full quality while disabled
+	void setEnabled(bool enabled);
+	bool isEnabled() const { return mEnabled; }
+
+	unsigned int getLevel() const { return mLevel; }
+	const Quality& getQuality() const;
+
+	// Frames averaged to decide whether quality must be lowered
+	static const int windowSize = 8;
+
+	// The average frame time must exceed the budget by this factor
+	// (frame times being quantized by vsync)
+	static constexpr float overBudgetFactor = 1.2f;
+
+	// Minimum time between two level changes, i.e. the time given to
+	// a change to take effect
+	static const long long levelDelayNs = 250000000;
+
+	// Input idle time before quality is restored
+	static const long long idleDelayNs = 300000000;
+
+private:
+	void setLevel(unsigned int level, long long timeNs);
+
+	const long long mBudgetNs;
+	bool mEnabled;
+	unsigned int mLevel;
+	long long mFrames[windowSize];
+	int mFrameCount;
+	long long mLastInputNs, mLastChangeNs;
+};
+
+#endif /* QUALITY_GOVERNOR_H */
@@ -1,5 +1,6 @@
 #include "cube.h"
 #include "material.h"
+#include "gl_objects.h"
 
 namespace {
 GLfloat vertices[] = { 1, 1, 1,  -1, 1, 1,  -1,-1, 1,      // v0-v1-v2 (front)
@@ -143,16 +144,23 @@ GLfloat normals[]  = { 0, 0, 1,   0, 0, 1,   0, 0, 1,      // v0-v1-v2 (front)
 } // namespace
 
 Cube::Cube(bool wireframe)
- : mMaterial(MaterialSharedPtr(!wireframe ? new Material(vertexShader, fragmentShader) : new Material(wfVertexShader, wfFragmentShader))),
+ : mMaterial(!wireframe ? Material::get(vertexShader, fragmentShader) : Material::get(wfVertexShader, wfFragmentShader)),
    mBound(false),
    mVertexAttrib(-1), mNormalAttrib(-1),
    mProjectionUniform(-1), mModelViewUniform(-1), mNormalMatrixUniform(-1), mColorUniform(-1),
    mColor(Vector3(0.5f)),
    mOpacity(1.0f),
    mWireframe(wireframe),
-   mScale(Vector3::unit())
+   mScale(Vector3::unit()),
+   mVertexBuffer(0), mVertexArray(0)
 {}
 
+Cube::~Cube()
+{
+	GlObjects::deleteVertexArrays({ mVertexArray });
+	GlObjects::deleteBuffers({ mVertexBuffer });
+}
+
 void Cube::setColor(const Vector3& color)
 {
 	mColor = color;
@@ -190,6 +198,33 @@ void Cube::bind()
 		android_assert(mNormalMatrixUniform != -1);
 	}
 
+	// Static geometry: uploaded once, along with the attribute
+	// state (normals after the vertices)
+	if (mVertexArray == 0) {
+		glGenBuffers(1, &mVertexBuffer);
+		glGenVertexArrays(1, &mVertexArray);
+	}
+
+	glBindVertexArray(mVertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+
+	if (!mWireframe) {
+		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices) + sizeof(normals), nullptr, GL_STATIC_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(vertices), sizeof(normals), normals);
+
+		glVertexAttribPointer(mNormalAttrib, 3, GL_FLOAT, false, 0, reinterpret_cast<const GLvoid*>(sizeof(vertices)));
+		glEnableVertexAttribArray(mNormalAttrib);
+	} else {
+		glBufferData(GL_ARRAY_BUFFER, sizeof(wfvertices), wfvertices, GL_STATIC_DRAW);
+	}
+
+	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, nullptr);
+	glEnableVertexAttribArray(mVertexAttrib);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
 	mBound = true;
 }
 
@@ -201,35 +236,18 @@ void Cube::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatri
 
 	glUseProgram(mMaterial->getHandle());
 
-	if (!mWireframe) {
-		// Vertices
-		glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, vertices);
-		glEnableVertexAttribArray(mVertexAttrib);
-
-		// Vertex normals
-		glVertexAttribPointer(mNormalAttrib, 3, GL_FLOAT, false, 0, normals);
-
-		glUniformMatrix3fv(mNormalMatrixUniform, 1, false, modelViewMatrix.inverse().transpose().get3x3Matrix().data_);
-	} else {
-		// Vertices
-		glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, wfvertices);
-		glEnableVertexAttribArray(mVertexAttrib);
-	}
-
 	// Uniforms
+	if (!mWireframe)
+		glUniformMatrix3fv(mNormalMatrixUniform, 1, false, modelViewMatrix.inverse().transpose().get3x3Matrix().data_);
 	glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_);
 	glUniformMatrix4fv(mModelViewUniform, 1, false, (modelViewMatrix * Matrix4(Matrix4::identity()).rescale(mScale)).data_);
 	glUniform4f(mColorUniform, mColor.x, mColor.y, mColor.z, mOpacity);
 
 	// Rendering
-	// glDrawArrays(GL_TRIANGLES, 0, numPoints);
-	if (!mWireframe) {
-		glEnableVertexAttribArray(mNormalAttrib);
+	glBindVertexArray(mVertexArray);
+	if (!mWireframe)
 		glDrawArrays(GL_TRIANGLES, 0, 36);
-		glDisableVertexAttribArray(mNormalAttrib);
-	} else {
+	else
 		glDrawArrays(GL_LINES, 0, 24);
-	}
-
-	glDisableVertexAttribArray(mVertexAttrib);
+	glBindVertexArray(0);
 }
@@ -9,6 +9,7 @@ class Cube : public Renderable
 {
 public:
 	Cube(bool wireframe = false);
+	~Cube();
 
 	// (GL context)
 	void bind();
@@ -30,6 +31,7 @@ private:
 	float mOpacity;
 	bool mWireframe;
 	Vector3 mScale;
+	GLuint mVertexBuffer, mVertexArray;
 };
 
 #endif /* CUBE_H */
@@ -0,0 +1,56 @@
+#include "gl_objects.h"
+
+#include "util/task_pool.h"
+
+#include <algorithm>
+
+namespace {
+	// Removes the null handles, returns false if none is left
+	template <typename T>
+	bool removeNull(std::vector<T>& handles)
+	{
+		handles.erase(std::remove(handles.begin(), handles.end(), T(0)), handles.end());
+		return !handles.empty();
+	}
+} // namespace
+
+void GlObjects::deleteBuffers(std::vector<GLuint> handles)
+{
+	if (!removeNull(handles))
+		return;
+
+	TaskPool::postToGlThread([handles]() {
+		glDeleteBuffers(handles.size(), handles.data());
+	});
+}
+
+void GlObjects::deleteVertexArrays(std::vector<GLuint> handles)
+{
+	if (!removeNull(handles))
+		return;
+
+	TaskPool::postToGlThread([handles]() {
+		glDeleteVertexArrays(handles.size(), handles.data());
+	});
+}
+
+void GlObjects::deleteTextures(std::vector<GLuint> handles)
+{
+	if (!removeNull(handles))
+		return;
+
+	TaskPool::postToGlThread([handles]() {
+		glDeleteTextures(handles.size(), handles.data());
+	});
+}
+
+void GlObjects::deleteSyncs(std::vector<GLsync> fences)
+{
+	if (!removeNull(fences))
+		return;
+
+	TaskPool::postToGlThread([fences]() {
+		for (GLsync fence : fences)
+			glDeleteSync(fence);
+	});
+}
@@ -0,0 +1,20 @@
+#ifndef GL_OBJECTS_H
+#define GL_OBJECTS_H
+
+#include "global.h"
+
+// Deletion of GL objects from code that may run without GL context,
+// typically destructors (the objects of a dataset are destroyed on
+// whichever thread drops the last reference). The deletions are
+// posted to the GL thread (see TaskPool::postToGlThread()) and done
+// by its next runGlTasks(). Null handles are ignored.
+// (any thread)
+namespace GlObjects
+{
+	void deleteBuffers(std::vector<GLuint> handles);
+	void deleteVertexArrays(std::vector<GLuint> handles);
+	void deleteTextures(std::vector<GLuint> handles);
+	void deleteSyncs(std::vector<GLsync> fences);
+}
+
+#endif /* GL_OBJECTS_H */
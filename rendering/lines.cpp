@@ -1,5 +1,6 @@
 #include "lines.h"
 #include "material.h"
+#include "gl_objects.h"
 
 namespace {
 	const char* wfVertexShader =
@@ -32,14 +33,22 @@ namespace {
 } // namespace
 
 Lines::Lines()
- : mMaterial(MaterialSharedPtr(new Material(wfVertexShader, wfFragmentShader))),
+ : mMaterial(Material::get(wfVertexShader, wfFragmentShader)),
    mBound(false),
    mVertexAttrib(-1),
    mProjectionUniform(-1), mModelViewUniform(-1), mColorUniform(-1),
    mColor(Vector3(0.5f)),
-   mOpacity(1.0f)
+   mOpacity(1.0f),
+   mVertexArray(0), mVertexArrayBuffer(0),
+   mFirst(0), mCount(0),
+   mDirty(false)
 {}
 
+Lines::~Lines()
+{
+	GlObjects::deleteVertexArrays({ mVertexArray });
+}
+
 void Lines::setColor(const Vector3& color)
 {
 	mColor = color;
@@ -65,24 +74,52 @@ void Lines::bind()
 	android_assert(mProjectionUniform != -1);
 	android_assert(mColorUniform != -1);
 
+	mVertexBuffer.bind();
+
+	if (mVertexArray == 0)
+		glGenVertexArrays(1, &mVertexArray);
+	mVertexArrayBuffer = 0; // (specified on the next upload)
+
+	// Upload the current lines (if any) again
+	synchronized (mLineData) {
+		mDirty = true;
+	}
+
 	mBound = true;
 }
 
-void Lines::setLines(const std::vector<Vector3>& lines)
+// (GL context)
+void Lines::specifyVertexArray()
 {
-	android_assert(!(lines.size() % 2));
+	glBindVertexArray(mVertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer.getHandle());
+	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 3*sizeof(GLfloat), nullptr);
+	glEnableVertexAttribArray(mVertexAttrib);
+	glBindVertexArray(0);
+	mVertexArrayBuffer = mVertexBuffer.getHandle();
+}
+
+void Lines::setLines(const Vector3* lines, unsigned int count)
+{
+	android_assert(!(count % 2));
 
 	synchronized (mLineData) {
-		mLineData.clear();
-		for (unsigned int i = 0; i < lines.size()/2; ++i) {
-			const Vector3 pt1 = lines.at(i*2+0);
-			const Vector3 pt2 = lines.at(i*2+1);
-			mLineData.push_back(pt1.x);
-			mLineData.push_back(pt1.y);
-			mLineData.push_back(pt1.z);
-			mLineData.push_back(pt2.x);
-			mLineData.push_back(pt2.y);
-			mLineData.push_back(pt2.z);
+		// (the slice outline is set every frame, but rarely changes)
+		bool changed = (mLineData.size() != count*3);
+		for (unsigned int i = 0; i < count && !changed; ++i) {
+			changed = (mLineData[i*3+0] != lines[i].x
+			           || mLineData[i*3+1] != lines[i].y
+			           || mLineData[i*3+2] != lines[i].z);
+		}
+
+		if (changed) {
+			mLineData.resize(count*3);
+			for (unsigned int i = 0; i < count; ++i) {
+				mLineData[i*3+0] = lines[i].x;
+				mLineData[i*3+1] = lines[i].y;
+				mLineData[i*3+2] = lines[i].z;
+			}
+			mDirty = true;
 		}
 	}
 }
@@ -93,14 +130,24 @@ void Lines::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatr
 	if (!mBound)
 		bind();
 
-	if (mLineData.empty())
+	synchronized (mLineData) {
+		if (mDirty) {
+			mCount = mLineData.size()/3;
+			if (mCount > 0) {
+				const std::size_t vertexSize = 3*sizeof(GLfloat);
+				mFirst = mVertexBuffer.write(mLineData.data(), mLineData.size()*sizeof(GLfloat), vertexSize) / vertexSize;
+			}
+			mDirty = false;
+		}
+	}
+
+	if (mCount == 0)
 		return;
 
-	glUseProgram(mMaterial->getHandle());
+	if (mVertexArrayBuffer != mVertexBuffer.getHandle())
+		specifyVertexArray();
 
-	// Vertices
-	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, mLineData.data());
-	glEnableVertexAttribArray(mVertexAttrib);
+	glUseProgram(mMaterial->getHandle());
 
 	// Uniforms
 	glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_);
@@ -108,7 +155,8 @@ void Lines::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatr
 	glUniform4f(mColorUniform, mColor.x, mColor.y, mColor.z, mOpacity);
 
 	// Rendering
-	glDrawArrays(GL_LINES, 0, mLineData.size()/3);
-
-	glDisableVertexAttribArray(mVertexAttrib);
+	glBindVertexArray(mVertexArray);
+	glDrawArrays(GL_LINES, mFirst, mCount);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
@@ -4,11 +4,13 @@
 #include "global.h"
 
 #include "renderable.h"
+#include "stream_buffer.h"
 
 class Lines : public Renderable
 {
 public:
 	Lines();
+	~Lines();
 
 	// (GL context)
 	void bind();
@@ -20,16 +22,33 @@ public:
 	void render(const Matrix4& projectionMatrix,
 	            const Matrix4& modelViewMatrix);
 
-	void setLines(const std::vector<Vector3>& lines);
+	// Replaces the line segments (pairs of points). Uploaded by the
+	// next render() call, unless they didn't change.
+	void setLines(const std::vector<Vector3>& lines)
+	{ setLines(lines.data(), lines.size()); }
+	// (same, from "count" points, e.g. a FrameVector)
+	void setLines(const Vector3* lines, unsigned int count);
 
 private:
+	// (GL context)
+	void specifyVertexArray();
+
 	MaterialSharedPtr mMaterial;
 	bool mBound;
 	GLint mVertexAttrib;
 	GLint mProjectionUniform, mModelViewUniform, mColorUniform;
 	Vector3 mColor;
 	float mOpacity;
+	StreamBuffer mVertexBuffer;
+	GLuint mVertexArray;
+	GLuint mVertexArrayBuffer; // (buffer mVertexArray points to)
+	GLint mFirst; // (first vertex of the last upload in mVertexBuffer)
+	GLsizei mCount;
+
+	// New lines, not uploaded yet if "mDirty" is true (mDirty is
+	// protected by the mLineData lock)
 	Synchronized<std::vector<GLfloat>> mLineData;
+	bool mDirty;
 };
 
 #endif /* LINES_H */
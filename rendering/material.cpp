@@ -1,5 +1,13 @@
 #include "material.h"
 
+#include "util/file.h"
+
+#include <map>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
 namespace {
 	void checkError(const char* msg)
 	{
@@ -11,18 +19,260 @@ namespace {
 	#define CHECK(x) (x); checkError(#x);
 	// #define CHECK(x) (x)
 
+	// Materials by source (the programs live as long as one of
+	// their users)
+	Synchronized<std::map<std::string, std::weak_ptr<Material>>> registry;
+
+	// Incremented each time the GL context is recreated
+	// (GL context)
+	unsigned int contextGeneration = 1;
+
+	std::string makeKey(const std::string& vertexShaderSrc,
+	                    const std::string& fragmentShaderSrc,
+	                    const std::vector<std::string>& feedbackVaryings)
+	{
+		std::string key = vertexShaderSrc + '\0' + fragmentShaderSrc;
+		for (const std::string& name : feedbackVaryings)
+			key += '\0' + name;
+		return key;
+	}
+
+	// Program binary cache (see Material::setBinaryCacheDir())
+	std::string binaryCacheDir;
+
+	const char binaryMagic[4] = { 'F', 'L', 'P', 'B' };
+	const uint32_t binaryVersion = 1;
+
+	struct BinaryHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t format; // (GLenum)
+		uint32_t length;
+	};
+
+	// Driver description, queried once per context (empty if
+	// program binaries are not supported)
+	// (GL context)
+	unsigned int driverGeneration = 0;
+	std::string driverInfo;
+
+	// (GL context)
+	const std::string& getDriverInfo()
+	{
+		if (driverGeneration == contextGeneration)
+			return driverInfo;
+		driverGeneration = contextGeneration;
+		driverInfo.clear();
+
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		while (glGetError() != GL_NO_ERROR) {} // (GL_INVALID_ENUM if unsupported)
+		if (formats <= 0) {
+			LOGI("Program binaries are not supported");
+			return driverInfo;
+		}
+
+		const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+		for (GLenum name : names) {
+			const GLubyte* str = glGetString(name);
+			driverInfo += (str ? reinterpret_cast<const char*>(str) : "?");
+			driverInfo += '\n';
+		}
+		return driverInfo;
+	}
+
+	// 64-bit FNV-1a (stable between runs, unlike std::hash)
+	uint64_t hashString(const std::string& str, uint64_t hash = 14695981039346656037ULL)
+	{
+		for (unsigned char c : str) {
+			hash ^= c;
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
 } // namespace
 
 Material::Material(const std::string& vertexShaderSrc,
                    const std::string& fragmentShaderSrc)
- : mProgramHandle(0),
+ : mProgramHandle(0), mContextGeneration(0),
    mVertexShaderSrc(vertexShaderSrc), mFragmentShaderSrc(fragmentShaderSrc)
 {}
 
+Material::Material(const std::string& vertexShaderSrc,
+                   const std::string& fragmentShaderSrc,
+                   const std::vector<std::string>& feedbackVaryings)
+ : mProgramHandle(0), mContextGeneration(0),
+   mVertexShaderSrc(vertexShaderSrc), mFragmentShaderSrc(fragmentShaderSrc),
+   mFeedbackVaryings(feedbackVaryings)
+{}
+
+MaterialSharedPtr Material::get(const std::string& vertexShaderSrc,
+                                const std::string& fragmentShaderSrc,
+                                const std::vector<std::string>& feedbackVaryings)
+{
+	const std::string key = makeKey(vertexShaderSrc, fragmentShaderSrc, feedbackVaryings);
+
+	MaterialSharedPtr material;
+	synchronized (registry) {
+		std::weak_ptr<Material>& entry = registry[key];
+		material = entry.lock();
+		if (!material) {
+			material = std::make_shared<Material>(vertexShaderSrc, fragmentShaderSrc, feedbackVaryings);
+			entry = material;
+		}
+	}
+	return material;
+}
+
+// (GL context)
+void Material::invalidateAll()
+{
+	++contextGeneration;
+
+	// (also drops the entries of the destroyed materials)
+	synchronized (registry) {
+		for (auto it = registry.begin(); it != registry.end(); ) {
+			if (it->second.expired())
+				it = registry.erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+void Material::setBinaryCacheDir(const std::string& dir)
+{
+	binaryCacheDir = dir;
+}
+
 // (GL context)
 void Material::bind()
 {
-	mProgramHandle = compileProgram(mVertexShaderSrc, mFragmentShaderSrc);
+	if (mProgramHandle != 0 && mContextGeneration == contextGeneration)
+		return;
+
+	const std::string cacheFileName = getBinaryCacheFileName();
+
+	mProgramHandle = (!cacheFileName.empty() ? loadProgramBinary(cacheFileName) : 0);
+	if (mProgramHandle == 0) {
+		mProgramHandle = compileProgram(mVertexShaderSrc, mFragmentShaderSrc, mFeedbackVaryings);
+		if (mProgramHandle != 0 && !cacheFileName.empty())
+			saveProgramBinary(mProgramHandle, cacheFileName);
+	}
+
+	mContextGeneration = contextGeneration;
+}
+
+// (GL context)
+std::string Material::getBinaryCacheFileName() const
+{
+	if (binaryCacheDir.empty())
+		return "";
+
+	const std::string& info = getDriverInfo();
+	if (info.empty())
+		return "";
+
+	const uint64_t hash = hashString(makeKey(mVertexShaderSrc, mFragmentShaderSrc, mFeedbackVaryings), hashString(info));
+	char name[32];
+	std::snprintf(name, sizeof(name), "program_%016llx.cache", static_cast<unsigned long long>(hash));
+	return binaryCacheDir + "/" + name;
+}
+
+// (GL context)
+GLuint Material::loadProgramBinary(const std::string& fileName)
+{
+	if (!File::exists(fileName))
+		return 0;
+
+	File::Buffer buffer;
+	try {
+		buffer = File::read(fileName);
+	} catch (const std::exception& e) {
+		LOGW("%s", e.what());
+		return 0;
+	}
+
+	BinaryHeader header;
+	if (buffer.data.size() < sizeof(header))
+		return 0;
+	std::memcpy(&header, buffer.data.data(), sizeof(header));
+
+	if (std::memcmp(header.magic, binaryMagic, sizeof(binaryMagic)) != 0
+	    || header.version != binaryVersion
+	    || header.length != buffer.data.size() - sizeof(header))
+	{
+		LOGW("Ignoring invalid program binary: %s", fileName.c_str());
+		return 0;
+	}
+
+	GLuint program = CHECK(glCreateProgram());
+	if (program == 0)
+		return 0;
+
+	CHECK(glProgramBinary(program, header.format, buffer.data.data() + sizeof(header), header.length));
+
+	// (binaries are rejected after driver updates, for instance)
+	GLint linkStatus;
+	CHECK(glGetProgramiv(program, GL_LINK_STATUS, &linkStatus));
+	if (linkStatus != GL_TRUE) {
+		LOGI("Program binary rejected by the driver: %s", fileName.c_str());
+		CHECK(glDeleteProgram(program));
+		return 0;
+	}
+
+	return program;
+}
+
+// (GL context)
+void Material::saveProgramBinary(GLuint program, const std::string& fileName)
+{
+	GLint length = 0;
+	CHECK(glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length));
+	if (length <= 0)
+		return;
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	GLsizei written = 0;
+	CHECK(glGetProgramBinary(program, length, &written, &format, binary.data()));
+	if (written <= 0)
+		return;
+
+	BinaryHeader header;
+	std::memcpy(header.magic, binaryMagic, sizeof(binaryMagic));
+	header.version = binaryVersion;
+	header.format = format;
+	header.length = written;
+
+	// Written to a temporary file first, so that an interrupted write
+	// never leaves a truncated binary behind
+	const std::string tmpFileName = fileName + ".tmp";
+
+	{
+		std::ofstream file(tmpFileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			LOGW("Unable to write program binary: %s", tmpFileName.c_str());
+			return;
+		}
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(binary.data(), written);
+
+		if (!file) {
+			LOGW("Unable to write program binary: %s", tmpFileName.c_str());
+			file.close();
+			std::remove(tmpFileName.c_str());
+			return;
+		}
+	}
+
+	if (std::rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+		LOGW("Unable to write program binary: %s", fileName.c_str());
+		std::remove(tmpFileName.c_str());
+	}
 }
 
 // (GL context)
@@ -42,7 +292,8 @@ GLint Material::getUniform(const std::string& name) const
 // (GL context)
 GLuint Material::compileProgram(
 	const std::string& vertexShaderSrc,
-	const std::string& fragmentShaderSrc)
+	const std::string& fragmentShaderSrc,
+	const std::vector<std::string>& feedbackVaryings)
 {
 	GLuint vertexShader = 0, fragmentShader = 0;
 
@@ -58,6 +309,17 @@ GLuint Material::compileProgram(
 	if (program != 0) {
 		CHECK(glAttachShader(program, vertexShader));
 		CHECK(glAttachShader(program, fragmentShader));
+		if (!feedbackVaryings.empty()) {
+			// (must be set before linking)
+			std::vector<const char*> names;
+			for (const std::string& name : feedbackVaryings)
+				names.push_back(name.c_str());
+			CHECK(glTransformFeedbackVaryings(program, names.size(), names.data(), GL_INTERLEAVED_ATTRIBS));
+		}
+		if (!binaryCacheDir.empty() && !getDriverInfo().empty()) {
+			// (see saveProgramBinary())
+			CHECK(glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+		}
 		CHECK(glLinkProgram(program));
 		GLint linkStatus;
 		CHECK(glGetProgramiv(program, GL_LINK_STATUS, &linkStatus));
@@ -9,8 +9,34 @@ public:
 	Material(const std::string& vertexShaderSrc,
 	         const std::string& fragmentShaderSrc);
 
+	// Program whose vertex shader outputs "feedbackVaryings" to a
+	// transform feedback buffer (interleaved, in the given order)
+	Material(const std::string& vertexShaderSrc,
+	         const std::string& fragmentShaderSrc,
+	         const std::vector<std::string>& feedbackVaryings);
+
+	// Returns the material built from the given sources, shared with
+	// every other user of the same sources: each program is only
+	// compiled once per GL context (any thread)
+	static MaterialSharedPtr get(const std::string& vertexShaderSrc,
+	                             const std::string& fragmentShaderSrc,
+	                             const std::vector<std::string>& feedbackVaryings = std::vector<std::string>());
+
+	// Makes the next bind() of every material compile its program
+	// again (to be called when the GL context is recreated)
+	static void invalidateAll();
+
+	// Directory where linked programs are saved, to be reloaded by
+	// later runs instead of being compiled (empty: disabled). Cached
+	// binaries are looked up by a hash of the sources and of the GL
+	// driver strings, and programs are compiled from source when
+	// the driver rejects them.
+	static void setBinaryCacheDir(const std::string& dir);
+
 	GLuint getHandle() const { return mProgramHandle; }
 
+	// Compiles the program, unless it is already compiled in the
+	// current GL context
 	// (GL context)
 	void bind();
 
@@ -23,13 +49,27 @@ private:
 	// (GL context)
 	static GLuint compileProgram(
 		const std::string& vertexShaderSrc,
-		const std::string& fragmentShaderSrc);
+		const std::string& fragmentShaderSrc,
+		const std::vector<std::string>& feedbackVaryings);
 
 	// (GL context)
 	static GLuint compileShader(GLenum type, const std::string& source);
 
+	// Returns 0 if there is no usable binary in "fileName"
+	// (GL context)
+	static GLuint loadProgramBinary(const std::string& fileName);
+
+	// (GL context)
+	static void saveProgramBinary(GLuint program, const std::string& fileName);
+
+	// Empty if the binary cache is disabled or unsupported
+	// (GL context)
+	std::string getBinaryCacheFileName() const;
+
 	GLuint mProgramHandle;
+	unsigned int mContextGeneration; // (see invalidateAll())
 	std::string mVertexShaderSrc, mFragmentShaderSrc;
+	std::vector<std::string> mFeedbackVaryings;
 };
 
 #endif /* MATERIAL_H */
@@ -1,5 +1,6 @@
 #include "mesh.h"
 #include "material.h"
+#include "gl_objects.h"
 
 #define NEW_SHADOWS
 
@@ -248,17 +249,56 @@ namespace {
 		;
 }
 
+MeshBuffer MeshBuffer::build(const MeshData& data, bool textured)
+{
+	MeshBuffer result;
+	result.textured = textured;
+	result.colored = !data.colors.empty();
+	result.data.reserve(data.indices.size() * result.getStride());
+
+	for (const MeshData::Index idx : data.indices) {
+		const Vector3& pos = data.vertices[idx.v];
+		result.data.push_back(pos.x);
+		result.data.push_back(pos.y);
+		result.data.push_back(pos.z);
+
+		if (textured) {
+			const Vector2& texCoords = data.texCoords[idx.t];
+			result.data.push_back(texCoords.x);
+			result.data.push_back(texCoords.y);
+		}
+
+		const Vector3& normal = data.normals[idx.n];
+		result.data.push_back(normal.x);
+		result.data.push_back(normal.y);
+		result.data.push_back(normal.z);
+
+		if (result.colored) {
+			const Vector3& color = data.colors[idx.c];
+			result.data.push_back(color.x);
+			result.data.push_back(color.y);
+			result.data.push_back(color.z);
+		}
+	}
+
+	return result;
+}
+
 Mesh::Mesh(const MeshData& data, TexturePtr texture)
- : mMaterial(MaterialSharedPtr(
+ : Mesh(MeshBuffer::build(data, bool(texture)), texture)
+{}
+
+Mesh::Mesh(MeshBuffer buffer, TexturePtr texture)
+ : mMaterial(
 	             texture
-				 ? new Material("#define TEXTURE\n" + std::string(vertexShader), "#define TEXTURE\n" + std::string(fragmentShader))
-				 : data.colors.empty()
-	             ? new Material(vertexShader, fragmentShader)
-	             : new Material("#define COLORS\n" + std::string(vertexShader), "#define COLORS\n" + std::string(fragmentShader))
-             )),
-   mShadelessMaterial(MaterialSharedPtr(new Material(vertexShaderShadeless, fragmentShaderShadeless))),
-   mShadowMaterial(MaterialSharedPtr(new Material(vertexShaderShadow, fragmentShaderShadow))),
-   mOnlyShadowMaterial(MaterialSharedPtr(new Material(vertexShaderShadow, fragmentShaderOnlyShadow))),
+				 ? Material::get("#define TEXTURE\n" + std::string(vertexShader), "#define TEXTURE\n" + std::string(fragmentShader))
+				 : !buffer.colored
+	             ? Material::get(vertexShader, fragmentShader)
+	             : Material::get("#define COLORS\n" + std::string(vertexShader), "#define COLORS\n" + std::string(fragmentShader))
+             ),
+   mShadelessMaterial(Material::get(vertexShaderShadeless, fragmentShaderShadeless)),
+   mShadowMaterial(Material::get(vertexShaderShadow, fragmentShaderShadow)),
+   mOnlyShadowMaterial(Material::get(vertexShaderShadow, fragmentShaderOnlyShadow)),
    mBound(false), mRebindShadowShader(true),
    mColor(Vector3(1.0f)),
    mOpacity(1.0f),
@@ -267,39 +307,24 @@ Mesh::Mesh(const MeshData& data, TexturePtr texture)
    mProjectionUniform(-1), mModelViewUniform(-1), mNormalMatrixUniform(-1), mColorUniform(-1),
    mProjectionUniformShadow(-1), mModelViewUniformShadow(-1), mNormalMatrixUniformShadow(-1), mColorUniformShadow(-1), mLightMatrixUniformShadow(-1),
    mVertexAttribShadeless(-1), mProjectionUniformShadeless(-1), mModelViewUniformShadeless(-1), mColorUniformShadeless(-1),
-   mNumFaces(0),
+   mVertexBuffer(0), mVertexArray(0), mShadelessVertexArray(0), mShadowVertexArray(0),
+   mNumFaces(buffer.getVertexCount()),
+   mTextured(buffer.textured), mColored(buffer.colored),
    mTexture(texture),
    mShadeless(false), mShadelessColor(Vector3(1.0f)),
    mOnlyShadow(false)
 {
-	android_assert(!data.indices.empty());
-
-	for (const MeshData::Index idx : data.indices) {
-		const Vector3& pos = data.vertices[idx.v];
-		mMeshBuffer.push_back(pos.x);
-		mMeshBuffer.push_back(pos.y);
-		mMeshBuffer.push_back(pos.z);
-
-		if (mTexture) {
-			const Vector2& texCoords = data.texCoords[idx.t];
-			mMeshBuffer.push_back(texCoords.x);
-			mMeshBuffer.push_back(texCoords.y);
-		}
-
-		const Vector3& normal = data.normals[idx.n];
-		mMeshBuffer.push_back(normal.x);
-		mMeshBuffer.push_back(normal.y);
-		mMeshBuffer.push_back(normal.z);
+	android_assert(!buffer.data.empty());
+	android_assert(buffer.textured == bool(texture));
+	android_assert(buffer.data.size() % buffer.getStride() == 0);
 
-		if (!data.colors.empty()) {
-			const Vector3& color = data.colors[idx.c];
-			mMeshBuffer.push_back(color.x);
-			mMeshBuffer.push_back(color.y);
-			mMeshBuffer.push_back(color.z);
-		}
+	mMeshBuffer.swap(buffer.data);
+}
 
-		++mNumFaces;
-	}
+Mesh::~Mesh()
+{
+	GlObjects::deleteVertexArrays({ mVertexArray, mShadelessVertexArray, mShadowVertexArray });
+	GlObjects::deleteBuffers({ mVertexBuffer });
 }
 
 void Mesh::setColor(const Vector3& color)
@@ -358,9 +383,71 @@ void Mesh::bind()
 	if (mTexture)
 	    mTexture->bind();
 
+	// The buffer is uploaded once; the attributes are recorded in one
+	// vertex array per program (mMeshBuffer is kept, to be uploaded
+	// again if the context is recreated)
+	if (mVertexBuffer == 0) {
+		glGenBuffers(1, &mVertexBuffer);
+		GLuint vaos[3];
+		glGenVertexArrays(3, vaos);
+		mVertexArray = vaos[0];
+		mShadelessVertexArray = vaos[1];
+		mShadowVertexArray = vaos[2];
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, mMeshBuffer.size()*sizeof(GLfloat), mMeshBuffer.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	specifyVertexArray(mVertexArray, mVertexAttrib, mTexCoordAttrib, mNormalAttrib, mVertexColorAttrib);
+	specifyVertexArray(mShadelessVertexArray, mVertexAttribShadeless, -1, -1, -1);
+	mRebindShadowShader = true; // (specifies mShadowVertexArray)
+
 	mBound = true;
 }
 
+// (GL context)
+void Mesh::specifyVertexArray(GLuint vertexArray, GLint vertexAttrib, GLint texCoordAttrib,
+                              GLint normalAttrib, GLint vertexColorAttrib)
+{
+	const GLsizei stride = (6 + (mTextured ? 2 : 0) + (mColored ? 3 : 0)) * sizeof(GLfloat);
+
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+
+	unsigned int idx = 0;
+
+	// Vertices
+	glVertexAttribPointer(vertexAttrib, 3, GL_FLOAT, false, stride, reinterpret_cast<const GLvoid*>(idx*sizeof(GLfloat)));
+	glEnableVertexAttribArray(vertexAttrib);
+	idx += 3;
+
+	if (mTextured) {
+		// Texcoords
+		if (texCoordAttrib != -1) {
+			glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, false, stride, reinterpret_cast<const GLvoid*>(idx*sizeof(GLfloat)));
+			glEnableVertexAttribArray(texCoordAttrib);
+		}
+		idx += 2;
+	}
+
+	// Normals
+	if (normalAttrib != -1) {
+		glVertexAttribPointer(normalAttrib, 3, GL_FLOAT, false, stride, reinterpret_cast<const GLvoid*>(idx*sizeof(GLfloat)));
+		glEnableVertexAttribArray(normalAttrib);
+	}
+	idx += 3;
+
+	if (mColored && vertexColorAttrib != -1) {
+		// Vertex colors
+		glVertexAttribPointer(vertexColorAttrib, 3, GL_FLOAT, false, stride, reinterpret_cast<const GLvoid*>(idx*sizeof(GLfloat)));
+		glEnableVertexAttribArray(vertexColorAttrib);
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 void Mesh::setShadeless(bool shadeless)
 {
 	mShadeless = shadeless;
@@ -394,38 +481,6 @@ void Mesh::renderShaded(const Matrix4& projectionMatrix, const Matrix4& modelVie
 {
 	glUseProgram(mMaterial->getHandle());
 
-	unsigned int stride = 6;
-	if (mTexCoordAttrib != -1)
-		stride += 2;
-	if (mVertexColorAttrib != -1)
-		stride += 3;
-
-	unsigned int idx = 0;
-
-	// Vertices
-	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-	glEnableVertexAttribArray(mVertexAttrib);
-	idx += 3;
-
-	if (mTexCoordAttrib != -1) {
-		// Texcoords
-		glVertexAttribPointer(mTexCoordAttrib, 2, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-		glEnableVertexAttribArray(mTexCoordAttrib);
-		idx += 2;
-	}
-
-	// Normals
-	glVertexAttribPointer(mNormalAttrib, 3, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-	glEnableVertexAttribArray(mNormalAttrib);
-	idx += 3;
-
-	if (mVertexColorAttrib != -1) {
-		// Vertex colors
-		glVertexAttribPointer(mVertexColorAttrib, 3, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-		glEnableVertexAttribArray(mVertexColorAttrib);
-		idx += 3;
-	}
-
 	// Uniforms
 	glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_);
 	glUniformMatrix4fv(mModelViewUniform, 1, false, modelViewMatrix.data_);
@@ -440,16 +495,9 @@ void Mesh::renderShaded(const Matrix4& projectionMatrix, const Matrix4& modelVie
 	}
 
 	// Rendering
+	glBindVertexArray(mVertexArray);
 	glDrawArrays(GL_TRIANGLES, 0, mNumFaces);
-
-	glDisableVertexAttribArray(mVertexAttrib);
-	glDisableVertexAttribArray(mNormalAttrib);
-
-	if (mTexCoordAttrib != -1)
-		glDisableVertexAttribArray(mTexCoordAttrib);
-
-	if (mVertexColorAttrib != -1)
-		glDisableVertexAttribArray(mVertexColorAttrib);
+	glBindVertexArray(0);
 }
 
 // (GL context)
@@ -460,32 +508,6 @@ void Mesh::renderShadeless(const Matrix4& projectionMatrix, const Matrix4& model
 
 	glUseProgram(mShadelessMaterial->getHandle());
 
-	unsigned int stride = 6;
-	if (mTexCoordAttrib != -1)
-		stride += 2;
-	if (mVertexColorAttrib != -1)
-		stride += 3;
-
-	unsigned int idx = 0;
-
-	// Vertices
-	glVertexAttribPointer(mVertexAttribShadeless, 3, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-	glEnableVertexAttribArray(mVertexAttribShadeless);
-	idx += 3;
-
-	if (mTexCoordAttrib != -1) {
-		// Texcoords: ignored
-		idx += 2;
-	}
-
-	// Normals: ignored
-	idx += 3;
-
-	if (mVertexColorAttrib != -1) {
-		// Vertex colors: ignored
-		idx += 3;
-	}
-
 	// Uniforms
 	glUniformMatrix4fv(mProjectionUniformShadeless, 1, false, projectionMatrix.data_);
 	glUniformMatrix4fv(mModelViewUniformShadeless, 1, false, modelViewMatrix.data_);
@@ -493,15 +515,18 @@ void Mesh::renderShadeless(const Matrix4& projectionMatrix, const Matrix4& model
 	glUniform4f(mColorUniformShadeless, mShadelessColor.x, mShadelessColor.y, mShadelessColor.z, 1.0f);
 
 	// Rendering
+	glBindVertexArray(mShadelessVertexArray);
 	glDrawArrays(GL_TRIANGLES, 0, mNumFaces);
-
-	glDisableVertexAttribArray(mVertexAttribShadeless);
+	glBindVertexArray(0);
 }
 
 // (GL context)
 void Mesh::renderShadowed(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix,
 	const Matrix4& modelMatrix, const Matrix4& lightMatrix, GLuint shadowTexture, const Vector3& shadowLightPos /* in screen space */)
 {
+	if (!mBound)
+		bind();
+
 	if (mRebindShadowShader) {
 		if (!mOnlyShadow) {
 			mVertexAttribShadow = mShadowMaterial->getAttribute("vertex");
@@ -539,48 +564,15 @@ void Mesh::renderShadowed(const Matrix4& projectionMatrix, const Matrix4& modelV
 		// mColorUniformShadow may be -1
 		android_assert(mLightMatrixUniformShadow != -1);
 
+		specifyVertexArray(mShadowVertexArray, mVertexAttribShadow, mTexCoordAttribShadow,
+		                   mNormalAttribShadow, mVertexColorAttribShadow);
+
 		mRebindShadowShader = false;
 	}
 
 	// glUseProgram(mShadowMaterial->getHandle());
 	glUseProgram(!mOnlyShadow ? mShadowMaterial->getHandle() : mOnlyShadowMaterial->getHandle());
 
-	unsigned int stride = 6;
-	if (mTexCoordAttrib != -1)
-		stride += 2;
-	if (mVertexColorAttrib != -1)
-		stride += 3;
-
-	unsigned int idx = 0;
-
-	// Vertices
-	glVertexAttribPointer(mVertexAttribShadow, 3, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-	glEnableVertexAttribArray(mVertexAttribShadow);
-	idx += 3;
-
-	// if (mTexCoordAttribShadow != -1) { // FIXME
-	// 	// Texcoords
-	// 	glVertexAttribPointer(mTexCoordAttribShadow, 2, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-	// 	glEnableVertexAttribArray(mTexCoordAttribShadow);
-	// 	idx += 2;
-	// }
-	if (mTexCoordAttrib != -1)
-		idx += 2;
-
-	// Normals
-	glVertexAttribPointer(mNormalAttribShadow, 3, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-	glEnableVertexAttribArray(mNormalAttribShadow);
-	idx += 3;
-
-	// if (mVertexColorAttribShadow != -1) { // FIXME
-	// 	// Vertex colors
-	// 	glVertexAttribPointer(mVertexColorAttribShadow, 3, GL_FLOAT, false, stride*sizeof(GLfloat), &mMeshBuffer[idx]);
-	// 	glEnableVertexAttribArray(mVertexColorAttribShadow);
-	// 	idx += 3;
-	// }
-	if (mVertexColorAttrib != -1)
-		idx += 3;
-
 	// Uniforms
 	glUniformMatrix4fv(mProjectionUniformShadow, 1, false, projectionMatrix.data_);
 	glUniformMatrix4fv(mModelViewUniformShadow, 1, false, modelViewMatrix.data_);
@@ -610,14 +602,7 @@ void Mesh::renderShadowed(const Matrix4& projectionMatrix, const Matrix4& modelV
 	glUniform1i(mShadowMaterial->getUniform("shadowMapTex"), 0);
 
 	// Rendering
+	glBindVertexArray(mShadowVertexArray);
 	glDrawArrays(GL_TRIANGLES, 0, mNumFaces);
-
-	glDisableVertexAttribArray(mVertexAttribShadow);
-	glDisableVertexAttribArray(mNormalAttribShadow);
-
-	// FIXME
-	// if (mTexCoordAttrib != -1)
-	// 	glDisableVertexAttribArray(mTexCoordAttribShadow);
-	// if (mVertexColorAttrib != -1)
-	// 	glDisableVertexAttribArray(mVertexColorAttribShadow);
+	glBindVertexArray(0);
 }
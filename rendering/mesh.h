@@ -19,11 +19,32 @@ struct MeshData
 	std::vector<Index> indices;
 };
 
+// Interleaved vertex attributes, as rendered by Mesh: one vertex per
+// MeshData index, made of a position, texture coordinates (if
+// "textured"), a normal and a color (if "colored")
+struct MeshBuffer
+{
+	MeshBuffer() : textured(false), colored(false) {}
+
+	static MeshBuffer build(const MeshData& data, bool textured);
+
+	unsigned int getStride() const { return 6 + (textured ? 2 : 0) + (colored ? 3 : 0); }
+	unsigned int getVertexCount() const { return data.size() / getStride(); }
+
+	std::vector<GLfloat> data;
+	bool textured, colored;
+};
+
 class Mesh : public Renderable
 {
 public:
 	Mesh(const MeshData& data, TexturePtr texture = TexturePtr());
 
+	// "buffer" is used as is (e.g. read from a MeshCache). It must be
+	// textured if and only if "texture" is set.
+	Mesh(MeshBuffer buffer, TexturePtr texture = TexturePtr());
+	~Mesh();
+
 	// (GL context)
 	void bind();
 
@@ -52,6 +73,12 @@ private:
 	// (GL context)
 	void renderShadeless(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix);
 
+	// Records the layout of mVertexBuffer for the given attributes
+	// (ignored if -1) in "vertexArray"
+	// (GL context)
+	void specifyVertexArray(GLuint vertexArray, GLint vertexAttrib, GLint texCoordAttrib,
+	                        GLint normalAttrib, GLint vertexColorAttrib);
+
 	MaterialSharedPtr mMaterial, mShadelessMaterial, mShadowMaterial, mOnlyShadowMaterial;
 	bool mBound, mRebindShadowShader;
 	Vector3 mColor;
@@ -63,8 +90,10 @@ private:
 	GLint mVertexAttribShadeless;
 	GLint mProjectionUniformShadeless, mModelViewUniformShadeless, mColorUniformShadeless;
 	std::vector<GLfloat> mMeshBuffer;
+	GLuint mVertexBuffer;
+	GLuint mVertexArray, mShadelessVertexArray, mShadowVertexArray;
 	unsigned int mNumFaces;
-	bool mTextured;
+	bool mTextured, mColored;
 	TexturePtr mTexture;
 	bool mShadeless;
 	Vector3 mShadelessColor;
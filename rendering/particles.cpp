@@ -0,0 +1,230 @@
+#include "particles.h"
+#include "material.h"
+#include "gl_objects.h"
+
+namespace {
+	const char* vertexShader =
+		// "#version 100\n"
+		"#ifndef GL_ES\n"
+		"#define highp\n"
+		"#define mediump\n"
+		"#define lowp\n"
+		"#endif\n"
+
+		"uniform highp mat4 projection;\n"
+		"uniform highp mat4 modelView;\n"
+		"uniform highp float radius;\n"
+		"uniform highp float viewportHeight;\n"
+		"attribute highp vec4 vertex;\n" // (w: visibility, 1 if not given)
+
+		"void main() {\n"
+		"  highp vec4 viewSpacePos = modelView * vec4(vertex.xyz, 1.0);\n"
+		// Hidden particles are moved outside of the clip volume
+		"  gl_Position = (vertex.w > 0.0 ? projection * viewSpacePos : vec4(2.0, 2.0, 2.0, 1.0));\n"
+		// Projected diameter (modelView may contain a uniform scale)
+		"  highp float viewRadius = radius * length(modelView[0].xyz);\n"
+		"  gl_PointSize = viewRadius * projection[1][1] * viewportHeight / gl_Position.w;\n"
+		"}";
+
+	const char* fragmentShader =
+		// "#version 100\n"
+		"#ifndef GL_ES\n"
+		"#define highp\n"
+		"#define mediump\n"
+		"#define lowp\n"
+		"#endif\n"
+
+		"uniform lowp vec4 color;\n"
+
+		"void main() {\n"
+		"  mediump vec2 coord = gl_PointCoord*2.0 - 1.0;\n"
+		"  mediump float dist2 = dot(coord, coord);\n"
+		"  if (dist2 > 1.0) discard;\n"
+		// Same lighting as Mesh (light along -z): N.L is the z
+		// component of the sphere normal
+		"  lowp float NdotL = sqrt(1.0 - dist2);\n"
+		"  gl_FragColor = vec4(color.xyz*NdotL, color.a);\n"
+		"}";
+} // namespace
+
+Particles::Particles()
+ : mMaterial(Material::get(vertexShader, fragmentShader)),
+   mBound(false),
+   mVertexAttrib(-1),
+   mProjectionUniform(-1), mModelViewUniform(-1), mColorUniform(-1), mRadiusUniform(-1), mViewportHeightUniform(-1),
+   mColor(Vector3(1.0f)),
+   mOpacity(1.0f), mRadius(1.0f), mViewportHeight(SCREEN_HEIGHT),
+   mFirst(0), mCount(0),
+   mVertexArray(0), mVertexArrayBuffer(0),
+   mExternalVertexArray(0), mExternalBuffer(0), mExternalStride(0),
+   mDirty(false)
+{}
+
+Particles::~Particles()
+{
+	GlObjects::deleteVertexArrays({ mVertexArray, mExternalVertexArray });
+}
+
+void Particles::setColor(const Vector3& color)
+{
+	mColor = color;
+}
+
+void Particles::setOpacity(float opacity)
+{
+	mOpacity = opacity;
+}
+
+void Particles::setRadius(float radius)
+{
+	mRadius = radius;
+}
+
+void Particles::setViewportHeight(float height)
+{
+	mViewportHeight = height;
+}
+
+// (GL context)
+void Particles::bind()
+{
+	mMaterial->bind();
+
+	mVertexAttrib = mMaterial->getAttribute("vertex");
+	mModelViewUniform = mMaterial->getUniform("modelView");
+	mProjectionUniform = mMaterial->getUniform("projection");
+	mColorUniform = mMaterial->getUniform("color");
+	mRadiusUniform = mMaterial->getUniform("radius");
+	mViewportHeightUniform = mMaterial->getUniform("viewportHeight");
+
+	android_assert(mVertexAttrib != -1);
+	android_assert(mModelViewUniform != -1);
+	android_assert(mProjectionUniform != -1);
+	android_assert(mColorUniform != -1);
+	android_assert(mRadiusUniform != -1);
+	android_assert(mViewportHeightUniform != -1);
+
+	mVertexBuffer.bind();
+
+	if (mVertexArray == 0) {
+		GLuint vaos[2];
+		glGenVertexArrays(2, vaos);
+		mVertexArray = vaos[0];
+		mExternalVertexArray = vaos[1];
+	}
+	// (specified on the next render())
+	mVertexArrayBuffer = mExternalBuffer = 0;
+
+	// Upload the current positions (if any) again
+	synchronized (mPositions) {
+		mDirty = true;
+	}
+
+	mBound = true;
+}
+
+void Particles::setPositions(const std::vector<Vector3>& positions)
+{
+	synchronized (mPositions) {
+		mPositions.resize(positions.size()*3);
+		for (unsigned int i = 0; i < positions.size(); ++i) {
+			mPositions[i*3+0] = positions[i].x;
+			mPositions[i*3+1] = positions[i].y;
+			mPositions[i*3+2] = positions[i].z;
+		}
+		mDirty = true;
+	}
+}
+
+// (GL context)
+void Particles::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix)
+{
+	if (!mBound)
+		bind();
+
+	synchronized (mPositions) {
+		if (mDirty) {
+			mCount = mPositions.size()/3;
+			if (mCount > 0) {
+				const std::size_t vertexSize = 3*sizeof(GLfloat);
+				mFirst = mVertexBuffer.write(mPositions.data(), mPositions.size()*sizeof(GLfloat), vertexSize) / vertexSize;
+			}
+			mDirty = false;
+		}
+	}
+
+	if (mCount == 0)
+		return;
+
+	if (mVertexArrayBuffer != mVertexBuffer.getHandle()) {
+		specifyVertexArray(mVertexArray, mVertexBuffer.getHandle(), 3, 0);
+		mVertexArrayBuffer = mVertexBuffer.getHandle();
+	}
+
+	draw(projectionMatrix, modelViewMatrix, mVertexArray, mFirst, mCount);
+}
+
+// (GL context)
+void Particles::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix,
+                       GLuint buffer, GLsizei count, GLsizei stride)
+{
+	if (!mBound)
+		bind();
+
+	// (GpuParticles alternates between two buffers)
+	if (buffer != mExternalBuffer || stride != mExternalStride) {
+		specifyVertexArray(mExternalVertexArray, buffer, 4, stride);
+		mExternalBuffer = buffer;
+		mExternalStride = stride;
+	}
+
+	draw(projectionMatrix, modelViewMatrix, mExternalVertexArray, 0, count);
+}
+
+// (GL context)
+void Particles::specifyVertexArray(GLuint vertexArray, GLuint buffer, GLint size, GLsizei stride)
+{
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glVertexAttribPointer(mVertexAttrib, size, GL_FLOAT, false, stride, nullptr);
+	glEnableVertexAttribArray(mVertexAttrib);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// (GL context)
+void Particles::draw(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix,
+                     GLuint vertexArray, GLint first, GLsizei count)
+{
+	if (count == 0)
+		return;
+
+	glUseProgram(mMaterial->getHandle());
+
+	// Point sprites are always enabled on OpenGL ES 2.0
+#ifdef GL_PROGRAM_POINT_SIZE
+	glEnable(GL_PROGRAM_POINT_SIZE);
+#endif
+#ifdef GL_POINT_SPRITE
+	glEnable(GL_POINT_SPRITE);
+#endif
+
+	// Uniforms
+	glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_);
+	glUniformMatrix4fv(mModelViewUniform, 1, false, modelViewMatrix.data_);
+	glUniform4f(mColorUniform, mColor.x, mColor.y, mColor.z, mOpacity);
+	glUniform1f(mRadiusUniform, mRadius);
+	glUniform1f(mViewportHeightUniform, mViewportHeight);
+
+	// Rendering
+	glBindVertexArray(vertexArray);
+	glDrawArrays(GL_POINTS, first, count);
+	glBindVertexArray(0);
+
+#ifdef GL_POINT_SPRITE
+	glDisable(GL_POINT_SPRITE);
+#endif
+#ifdef GL_PROGRAM_POINT_SIZE
+	glDisable(GL_PROGRAM_POINT_SIZE);
+#endif
+}
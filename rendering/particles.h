@@ -0,0 +1,79 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include "global.h"
+
+#include "renderable.h"
+#include "stream_buffer.h"
+
+// Set of identical spheres drawn with a single call, as point
+// sprites shaded like spheres
+class Particles : public Renderable
+{
+public:
+	Particles();
+	~Particles();
+
+	// (GL context)
+	void bind();
+
+	void setColor(const Vector3& color);
+	void setOpacity(float opacity);
+
+	// Sphere radius, in model coordinates
+	void setRadius(float radius);
+
+	// Height of the viewport in pixels, needed to compute the size
+	// of the sprites
+	void setViewportHeight(float height);
+
+	// Replaces the sphere centers (model coordinates). The new
+	// positions are uploaded by the next render() call (to a
+	// StreamBuffer).
+	void setPositions(const std::vector<Vector3>& positions);
+
+	// (GL context)
+	void render(const Matrix4& projectionMatrix,
+	            const Matrix4& modelViewMatrix);
+
+	// Same as render(), but the positions are read from "buffer":
+	// "count" vec4 positions (x, y, z, visible), "stride" bytes
+	// apart. Particles with visible == 0 are not drawn.
+	// (GL context)
+	void render(const Matrix4& projectionMatrix,
+	            const Matrix4& modelViewMatrix,
+	            GLuint buffer, GLsizei count, GLsizei stride);
+
+private:
+	// Points "vertexArray" to "size" floats per vertex, "stride"
+	// bytes apart in "buffer"
+	// (GL context)
+	void specifyVertexArray(GLuint vertexArray, GLuint buffer, GLint size, GLsizei stride);
+
+	// (GL context)
+	void draw(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix,
+	          GLuint vertexArray, GLint first, GLsizei count);
+
+	MaterialSharedPtr mMaterial;
+	bool mBound;
+	GLint mVertexAttrib;
+	GLint mProjectionUniform, mModelViewUniform, mColorUniform, mRadiusUniform, mViewportHeightUniform;
+	Vector3 mColor;
+	float mOpacity, mRadius, mViewportHeight;
+	StreamBuffer mVertexBuffer;
+	GLint mFirst; // (first position of the last upload in mVertexBuffer)
+	GLsizei mCount;
+	GLuint mVertexArray, mVertexArrayBuffer; // (buffer mVertexArray points to)
+
+	// (vertex array for the buffers given to render(), specified
+	// again when the buffer or the stride change)
+	GLuint mExternalVertexArray, mExternalBuffer;
+	GLsizei mExternalStride;
+
+	// New positions, not uploaded yet if "mDirty" is true (mDirty is
+	// protected by the mPositions lock)
+	Synchronized<std::vector<GLfloat>> mPositions;
+	bool mDirty;
+};
+
+#endif /* PARTICLES_H */
@@ -0,0 +1,312 @@
+#include "reduced_resolution_pass.h"
+#include "material.h"
+
+namespace {
+	const char* vertexShader =
+		// "#version 100\n"
+		"#ifndef GL_ES\n"
+		"#define highp\n"
+		"#define mediump\n"
+		"#define lowp\n"
+		"#endif\n"
+
+		"attribute highp vec2 vertex;\n" // (clip space)
+		"varying highp vec2 texCoord;\n"
+
+		"void main() {\n"
+		"  texCoord = vertex*0.5 + 0.5;\n"
+		"  gl_Position = vec4(vertex, 0.0, 1.0);\n"
+		"}";
+
+	// Point-sampled copy of the full resolution depth
+	const char* downsampleFragmentShader =
+		// "#version 100\n"
+		"#ifndef GL_ES\n"
+		"#define highp\n"
+		"#define mediump\n"
+		"#define lowp\n"
+		"#endif\n"
+
+		"uniform highp sampler2D depthTexture;\n"
+		"varying highp vec2 texCoord;\n"
+
+		"void main() {\n"
+		"  gl_FragDepth = texture2D(depthTexture, texCoord).r;\n"
+		"}";
+
+	// Bilateral upsampling: the 4 nearest low resolution texels are
+	// weighted by their bilinear weight, divided by the relative
+	// difference between their depth and the depth of the fragment
+	const char* compositeFragmentShader =
+		// "#version 100\n"
+		"#ifndef GL_ES\n"
+		"#define highp\n"
+		"#define mediump\n"
+		"#define lowp\n"
+		"#endif\n"
+
+		"uniform lowp sampler2D colorTexture;\n" // (premultiplied alpha)
+		"uniform highp sampler2D lowDepthTexture;\n"
+		"uniform highp sampler2D depthTexture;\n"
+		"uniform highp vec2 lowSize;\n"
+		"uniform highp float near;\n"
+		"uniform highp float far;\n"
+		"varying highp vec2 texCoord;\n"
+
+		"highp float linearDepth(highp float depth) {\n"
+		"  highp float z = depth*2.0 - 1.0;\n"
+		"  return 2.0*near*far / (far + near - z*(far - near));\n"
+		"}\n"
+
+		"void tap(highp vec2 texel, highp float bilinear, highp float depth,\n"
+		"         inout mediump vec4 sum, inout highp float weightSum) {\n"
+		"  highp vec2 coord = (texel + 0.5) / lowSize;\n"
+		"  highp float lowDepth = linearDepth(texture2D(lowDepthTexture, coord).r);\n"
+		"  highp float weight = bilinear / (0.01 + abs(lowDepth - depth) / depth);\n"
+		"  sum += weight * texture2D(colorTexture, coord);\n"
+		"  weightSum += weight;\n"
+		"}\n"
+
+		"void main() {\n"
+		"  highp float depth = linearDepth(texture2D(depthTexture, texCoord).r);\n"
+		"  highp vec2 pos = texCoord*lowSize - 0.5;\n"
+		"  highp vec2 base = floor(pos);\n"
+		"  highp vec2 f = pos - base;\n"
+		"  mediump vec4 sum = vec4(0.0);\n"
+		"  highp float weightSum = 0.0;\n"
+		"  tap(base,                  (1.0-f.x)*(1.0-f.y), depth, sum, weightSum);\n"
+		"  tap(base + vec2(1.0, 0.0), f.x*(1.0-f.y),       depth, sum, weightSum);\n"
+		"  tap(base + vec2(0.0, 1.0), (1.0-f.x)*f.y,       depth, sum, weightSum);\n"
+		"  tap(base + vec2(1.0, 1.0), f.x*f.y,             depth, sum, weightSum);\n"
+		"  gl_FragColor = sum / weightSum;\n"
+		"}";
+
+	const GLfloat quad[] = {
+		-1, -1,
+		 1, -1,
+		-1,  1,
+		 1,  1
+	};
+
+	// (GL context)
+	void setTextureImage(GLuint texture, GLint internalFormat, GLenum format, GLenum type,
+	                     int width, int height)
+	{
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+	}
+} // namespace
+
+ReducedResolutionPass::ReducedResolutionPass()
+ : mDownsampleMaterial(Material::get(vertexShader, downsampleFragmentShader)),
+   mCompositeMaterial(Material::get(vertexShader, compositeFragmentShader)),
+   mBound(false),
+   mDownsampleVertexAttrib(-1), mDownsampleDepthUniform(-1),
+   mCompositeVertexAttrib(-1), mCompositeColorUniform(-1), mCompositeLowDepthUniform(-1), mCompositeDepthUniform(-1),
+   mCompositeLowSizeUniform(-1), mCompositeNearUniform(-1), mCompositeFarUniform(-1),
+   mQuadBuffer(0), mDownsampleVertexArray(0), mCompositeVertexArray(0),
+   mFramebuffer(0), mDepthTexture(0), mLowColorTexture(0), mLowDepthTexture(0),
+   mWidth(0), mHeight(0), mLowWidth(0), mLowHeight(0),
+   mFailed(false),
+   mNearClip(1), mFarClip(2)
+{
+	std::fill(mViewport, mViewport+4, 0);
+}
+
+// (GL context)
+void ReducedResolutionPass::bind()
+{
+	mDownsampleMaterial->bind();
+	mCompositeMaterial->bind();
+
+	mDownsampleVertexAttrib = mDownsampleMaterial->getAttribute("vertex");
+	mDownsampleDepthUniform = mDownsampleMaterial->getUniform("depthTexture");
+	mCompositeVertexAttrib = mCompositeMaterial->getAttribute("vertex");
+	mCompositeColorUniform = mCompositeMaterial->getUniform("colorTexture");
+	mCompositeLowDepthUniform = mCompositeMaterial->getUniform("lowDepthTexture");
+	mCompositeDepthUniform = mCompositeMaterial->getUniform("depthTexture");
+	mCompositeLowSizeUniform = mCompositeMaterial->getUniform("lowSize");
+	mCompositeNearUniform = mCompositeMaterial->getUniform("near");
+	mCompositeFarUniform = mCompositeMaterial->getUniform("far");
+
+	android_assert(mDownsampleVertexAttrib != -1);
+	android_assert(mDownsampleDepthUniform != -1);
+	android_assert(mCompositeVertexAttrib != -1);
+	android_assert(mCompositeColorUniform != -1);
+	android_assert(mCompositeLowDepthUniform != -1);
+	android_assert(mCompositeDepthUniform != -1);
+	android_assert(mCompositeLowSizeUniform != -1);
+	android_assert(mCompositeNearUniform != -1);
+	android_assert(mCompositeFarUniform != -1);
+
+	glGenBuffers(1, &mQuadBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, mQuadBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+	glGenVertexArrays(1, &mDownsampleVertexArray);
+	glBindVertexArray(mDownsampleVertexArray);
+	glVertexAttribPointer(mDownsampleVertexAttrib, 2, GL_FLOAT, false, 0, nullptr);
+	glEnableVertexAttribArray(mDownsampleVertexAttrib);
+
+	glGenVertexArrays(1, &mCompositeVertexArray);
+	glBindVertexArray(mCompositeVertexArray);
+	glVertexAttribPointer(mCompositeVertexAttrib, 2, GL_FLOAT, false, 0, nullptr);
+	glEnableVertexAttribArray(mCompositeVertexAttrib);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// The target is created again on the next begin() (the previous
+	// one belongs to the previous context, if any)
+	mFramebuffer = mDepthTexture = mLowColorTexture = mLowDepthTexture = 0;
+	mWidth = mHeight = mLowWidth = mLowHeight = 0;
+	mFailed = false;
+
+	mBound = true;
+}
+
+void ReducedResolutionPass::blendFunc()
+{
+	// Colors are accumulated premultiplied by alpha over a transparent
+	// target, which end() composites with (ONE, ONE_MINUS_SRC_ALPHA):
+	// same result as blending each object over the framebuffer
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+// (GL context)
+bool ReducedResolutionPass::resize(int width, int height, int lowWidth, int lowHeight)
+{
+	if (!mFramebuffer) {
+		glGenFramebuffers(1, &mFramebuffer);
+		glGenTextures(1, &mDepthTexture);
+		glGenTextures(1, &mLowColorTexture);
+		glGenTextures(1, &mLowDepthTexture);
+	}
+
+	if (width != mWidth || height != mHeight) {
+		setTextureImage(mDepthTexture, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, width, height);
+		mWidth = width;
+		mHeight = height;
+	}
+
+	if (lowWidth != mLowWidth || lowHeight != mLowHeight) {
+		setTextureImage(mLowColorTexture, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, lowWidth, lowHeight);
+		setTextureImage(mLowDepthTexture, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, lowWidth, lowHeight);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, mFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mLowColorTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, mLowDepthTexture, 0);
+		const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			LOGE("Reduced resolution target is not supported (status 0x%x), rendering at full resolution", status);
+			mFailed = true;
+			return false;
+		}
+
+		mLowWidth = lowWidth;
+		mLowHeight = lowHeight;
+	}
+
+	return true;
+}
+
+// (GL context)
+void ReducedResolutionPass::drawQuad(GLuint vertexArray)
+{
+	glBindVertexArray(vertexArray);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glBindVertexArray(0);
+}
+
+// (GL context)
+bool ReducedResolutionPass::begin(float scale, float nearClip, float farClip)
+{
+	if (!mBound)
+		bind();
+
+	if (mFailed)
+		return false;
+
+	glGetIntegerv(GL_VIEWPORT, mViewport);
+	const int width = mViewport[2], height = mViewport[3];
+	const int lowWidth = std::max(1, int(std::ceil(width * scale)));
+	const int lowHeight = std::max(1, int(std::ceil(height * scale)));
+
+	if (!resize(width, height, lowWidth, lowHeight))
+		return false;
+
+	mNearClip = nearClip;
+	mFarClip = farClip;
+
+	// Depth of the opaque objects
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, mDepthTexture);
+	glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mViewport[0], mViewport[1], width, height);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, mFramebuffer);
+	glViewport(0, 0, lowWidth, lowHeight);
+
+	// Downsampled into the depth buffer of the target (which is
+	// entirely overwritten, no need to clear it)
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_ALWAYS);
+	glDepthMask(true);
+	glColorMask(false, false, false, false);
+	glUseProgram(mDownsampleMaterial->getHandle());
+	glUniform1i(mDownsampleDepthUniform, 0);
+	drawQuad(mDownsampleVertexArray);
+	glColorMask(true, true, true, true);
+	glDepthFunc(GL_LESS);
+
+	GLfloat clearColor[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+	// (the depth buffer must keep the depth of the opaque objects,
+	// see end())
+	glDepthMask(false);
+	glEnable(GL_BLEND);
+	blendFunc();
+
+	return true;
+}
+
+// (GL context)
+void ReducedResolutionPass::end()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(mViewport[0], mViewport[1], mViewport[2], mViewport[3]);
+
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, mLowColorTexture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, mLowDepthTexture);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, mDepthTexture);
+	glActiveTexture(GL_TEXTURE0);
+
+	glUseProgram(mCompositeMaterial->getHandle());
+	glUniform1i(mCompositeColorUniform, 0);
+	glUniform1i(mCompositeLowDepthUniform, 1);
+	glUniform1i(mCompositeDepthUniform, 2);
+	glUniform2f(mCompositeLowSizeUniform, mLowWidth, mLowHeight);
+	glUniform1f(mCompositeNearUniform, mNearClip);
+	glUniform1f(mCompositeFarUniform, mFarClip);
+	drawQuad(mCompositeVertexArray);
+
+	glEnable(GL_DEPTH_TEST);
+	glDepthMask(true);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
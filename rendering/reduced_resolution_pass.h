@@ -0,0 +1,70 @@
+#ifndef REDUCED_RESOLUTION_PASS_H
+#define REDUCED_RESOLUTION_PASS_H
+
+#include "global.h"
+
+// Renders translucent objects (the volume) into an off-screen buffer
+// smaller than the viewport, then composites it over the framebuffer.
+//
+// begin() copies the depth of the opaque objects already rendered,
+// and downsamples it into the depth buffer of the off-screen target
+// so that the translucent objects are still occluded. end() upsamples
+// the result with a bilateral filter: each low-resolution texel is
+// weighted by how close its depth is to the full-resolution depth,
+// which keeps the edges of the opaque objects sharp.
+//
+// Between begin() and end(), objects must be rendered with
+// premultiplied alpha blending (see blendFunc()) and without depth
+// writes.
+class ReducedResolutionPass
+{
+public:
+	ReducedResolutionPass();
+
+	// (GL context)
+	void bind();
+
+	// Redirects the rendering to a target of "scale" times the size
+	// of the current viewport. "nearClip" and "farClip" are the
+	// distances of the clip planes of the projection, used to
+	// linearize depth. Returns false if the target could not be
+	// created, in which case the rendering is left unchanged
+	// (to be rendered at full resolution).
+	// (GL context)
+	bool begin(float scale, float nearClip, float farClip);
+
+	// Composites the target over the previous viewport of the
+	// default framebuffer
+	// (GL context)
+	void end();
+
+	// Sets the blending function to be used between begin() and end()
+	// (GL context)
+	static void blendFunc();
+
+private:
+	// (GL context)
+	bool resize(int width, int height, int lowWidth, int lowHeight);
+
+	// (GL context)
+	void drawQuad(GLuint vertexArray);
+
+	MaterialSharedPtr mDownsampleMaterial, mCompositeMaterial;
+	bool mBound;
+	GLint mDownsampleVertexAttrib, mDownsampleDepthUniform;
+	GLint mCompositeVertexAttrib, mCompositeColorUniform, mCompositeLowDepthUniform, mCompositeDepthUniform;
+	GLint mCompositeLowSizeUniform, mCompositeNearUniform, mCompositeFarUniform;
+	GLuint mQuadBuffer; // (full screen quad)
+	GLuint mDownsampleVertexArray, mCompositeVertexArray;
+
+	GLuint mFramebuffer;
+	GLuint mDepthTexture; // full resolution copy of the framebuffer depth
+	GLuint mLowColorTexture, mLowDepthTexture;
+	int mWidth, mHeight, mLowWidth, mLowHeight;
+	bool mFailed; // (the target is not supported, see begin())
+
+	GLint mViewport[4]; // (saved by begin())
+	float mNearClip, mFarClip;
+};
+
+#endif /* REDUCED_RESOLUTION_PASS_H */
@@ -0,0 +1,195 @@
+#include "stream_buffer.h"
+#include "gl_objects.h"
+
+#include <cstring>
+
+namespace {
+	// (GL context)
+	bool hasVersion(GLint major, GLint minor)
+	{
+		GLint currentMajor = 0, currentMinor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &currentMajor);
+		glGetIntegerv(GL_MINOR_VERSION, &currentMinor);
+		while (glGetError() != GL_NO_ERROR) {} // (GL_INVALID_ENUM before GL 3.0)
+		return (currentMajor > major || (currentMajor == major && currentMinor >= minor));
+	}
+
+	// (GL context)
+	bool hasExtension(const char* name)
+	{
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		while (glGetError() != GL_NO_ERROR) {}
+		for (GLint i = 0; i < count; ++i) {
+			const GLubyte* str = glGetStringi(GL_EXTENSIONS, i);
+			if (str && std::strcmp(reinterpret_cast<const char*>(str), name) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	// (waiting that long means that something is wrong, but the
+	// data is written anyway)
+	const GLuint64 fenceTimeoutNs = 1000000000;
+} // namespace
+
+StreamBuffer::StreamBuffer(std::size_t capacity)
+ : mBound(false),
+   mPersistent(false), mHasSync(false),
+   mHandle(0),
+   mCapacity(capacity), mOffset(0),
+   mSegment(0),
+   mMapped(nullptr)
+{
+	android_assert(capacity >= segmentCount);
+	for (GLsync& fence : mFences)
+		fence = nullptr;
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	// (deleting the buffer also unmaps it)
+	GlObjects::deleteSyncs(std::vector<GLsync>(mFences, mFences+segmentCount));
+	GlObjects::deleteBuffers({ mHandle });
+}
+
+// (GL context)
+void StreamBuffer::bind()
+{
+	if (mHandle == 0) {
+		mHasSync = hasVersion(3, 2) || hasExtension("GL_ARB_sync");
+		mPersistent = mHasSync && (hasVersion(4, 4) || hasExtension("GL_ARB_buffer_storage"));
+		create(mCapacity);
+	}
+
+	mBound = true;
+}
+
+// (GL context)
+void StreamBuffer::create(std::size_t capacity)
+{
+	glGenBuffers(1, &mHandle);
+	glBindBuffer(GL_ARRAY_BUFFER, mHandle);
+
+	if (mPersistent) {
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, capacity, nullptr, flags);
+		mMapped = static_cast<char*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, capacity, flags));
+
+		if (!mMapped) {
+			LOGW("Unable to map a persistent vertex buffer, falling back to unsynchronized mappings");
+			// (the storage of the buffer is immutable)
+			glDeleteBuffers(1, &mHandle);
+			glGenBuffers(1, &mHandle);
+			glBindBuffer(GL_ARRAY_BUFFER, mHandle);
+			mPersistent = false;
+		}
+	}
+
+	if (!mPersistent)
+		glBufferData(GL_ARRAY_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+
+	mCapacity = capacity;
+	mOffset = 0;
+	mSegment = 0;
+}
+
+// (GL context)
+void StreamBuffer::destroy()
+{
+	for (GLsync& fence : mFences) {
+		if (fence)
+			glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	if (mMapped) {
+		glBindBuffer(GL_ARRAY_BUFFER, mHandle);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		mMapped = nullptr;
+	}
+
+	// (the draw calls still using the buffer are not affected)
+	glDeleteBuffers(1, &mHandle);
+	mHandle = 0;
+}
+
+// (GL context)
+void StreamBuffer::enterSegment(unsigned int segment)
+{
+	if (segment == mSegment)
+		return;
+
+	if (mHasSync) {
+		if (mFences[mSegment])
+			glDeleteSync(mFences[mSegment]);
+		mFences[mSegment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+		if (GLsync fence = mFences[segment]) {
+			if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, fenceTimeoutNs) == GL_TIMEOUT_EXPIRED)
+				LOGW("Timeout waiting for a stream buffer fence");
+			glDeleteSync(fence);
+			mFences[segment] = nullptr;
+		}
+	}
+
+	mSegment = segment;
+}
+
+// (GL context)
+std::size_t StreamBuffer::write(const void* data, std::size_t size, std::size_t alignment)
+{
+	if (!mBound)
+		bind();
+
+	android_assert(size > 0 && alignment > 0);
+
+	// A write may span at most half of the ring, so that the ring
+	// always holds a few frames (the segments in use are never
+	// overwritten anyway)
+	if (size*2 > mCapacity) {
+		std::size_t capacity = mCapacity*2;
+		while (size*2 > capacity)
+			capacity *= 2;
+		LOGD("growing stream buffer: %zu -> %zu bytes", mCapacity, capacity);
+		destroy();
+		create(capacity);
+	} else {
+		glBindBuffer(GL_ARRAY_BUFFER, mHandle);
+	}
+
+	std::size_t offset = (mOffset + alignment-1) / alignment * alignment;
+
+	if (offset + size > mCapacity) {
+		offset = 0;
+		// (no fences: the data still in use stays in the previous
+		// storage of the buffer)
+		if (!mHasSync)
+			glBufferData(GL_ARRAY_BUFFER, mCapacity, nullptr, GL_STREAM_DRAW);
+	}
+
+	// Wait for each segment about to be written (in practice, only
+	// the first write in a segment can wait)
+	const std::size_t segmentSize = mCapacity / segmentCount;
+	const unsigned int first = offset / segmentSize;
+	const unsigned int end = (offset + size-1) / segmentSize;
+	const unsigned int last = (end < segmentCount ? end : segmentCount-1);
+	for (unsigned int segment = first; segment <= last; ++segment)
+		enterSegment(segment);
+
+	if (mMapped) {
+		std::memcpy(mMapped + offset, data, size);
+	} else {
+		void* ptr = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (ptr) {
+			std::memcpy(ptr, data, size);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		} else {
+			glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+		}
+	}
+
+	mOffset = offset + size;
+	return offset;
+}
@@ -0,0 +1,66 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include "global.h"
+
+// Vertex buffer for geometry written by the CPU every frame (or on
+// every change), used as a ring: each write goes after the previous
+// one, so that it never has to wait for the draw calls still reading
+// the previous data.
+//
+// The ring is split into segments. A fence is inserted when the
+// writes leave a segment, and writing into a segment again waits for
+// its fence (normally long signaled, since the ring holds several
+// frames). With GL 4.4 or ARB_buffer_storage, the buffer is mapped
+// once and for all (persistent, coherent mapping); otherwise every
+// write maps its own range, unsynchronized. Without sync objects
+// (before GL 3.2), the buffer is orphaned when the ring wraps
+// around instead.
+class StreamBuffer
+{
+public:
+	StreamBuffer(std::size_t capacity = 256*1024);
+	~StreamBuffer();
+
+	// (GL context)
+	void bind();
+
+	// Copies "size" bytes into the buffer and returns their offset,
+	// a multiple of "alignment" (e.g. the vertex size, so that the
+	// data can be drawn with glDrawArrays(offset/alignment, ...)
+	// from a vertex array pointing at offset 0). The buffer is left
+	// bound to GL_ARRAY_BUFFER.
+	// If "size" doesn't fit in the ring, the buffer is replaced by a
+	// bigger one: getHandle() changes, and the vertex arrays pointing
+	// to the previous buffer must be specified again.
+	// (GL context)
+	std::size_t write(const void* data, std::size_t size, std::size_t alignment = sizeof(GLfloat));
+
+	GLuint getHandle() const { return mHandle; }
+
+private:
+	StreamBuffer(const StreamBuffer&); // not implemented
+	void operator=(const StreamBuffer&); // not implemented
+
+	// (GL context)
+	void create(std::size_t capacity);
+	// (GL context)
+	void destroy();
+
+	// Fences the current segment and waits until "segment" is no
+	// longer used by the GPU
+	// (GL context)
+	void enterSegment(unsigned int segment);
+
+	static const unsigned int segmentCount = 4;
+
+	bool mBound;
+	bool mPersistent, mHasSync; // (see bind())
+	GLuint mHandle;
+	std::size_t mCapacity, mOffset;
+	unsigned int mSegment;
+	GLsync mFences[segmentCount];
+	char* mMapped; // (persistent mapping)
+};
+
+#endif /* STREAM_BUFFER_H */
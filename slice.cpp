@@ -1,9 +1,14 @@
 #include "slice.h"
 
 #include "rendering/material.h"
+#include "gpu_resources.h"
+#include "util/parallel.h"
+#include "util/profiler.h"
 
 #include <limits>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 
 #include <vtkImageData.h>
 #include <vtkImageReslice.h>
@@ -29,6 +34,27 @@ namespace {
 	const unsigned int horizSize = 256*4, vertSize = 256*4;
 	// const unsigned int horizSize = 1280, vertSize = 736; // screenWidth/screenHeight
 
+	// Rows converted by each task
+	const unsigned int rowsPerTask = 64;
+
+	// Converts resliced values to normalized values (0 for the pixels
+	// outside of the data, see GpuResources::getScalarTexture()) and
+	// returns true if at least one pixel lies within the data
+	template <typename T>
+	bool convertPixels(const T* src, int components, unsigned int first, unsigned int count,
+	                   double min, double scale, unsigned char* dst)
+	{
+		bool notEmpty = false;
+		for (unsigned int i = first; i < first+count; ++i) {
+			const double value = src[i*components];
+			// FIXME: hardcoded constant (signed int16 max, see head.vti)
+			const bool isinf = (std::isinf(value) || value == 32767 || value == 255);
+			dst[i] = (isinf ? 0 : std::max(1.0, std::min((value-min)*scale + 0.5, 255.0)));
+			notEmpty |= !isinf;
+		}
+		return notEmpty;
+	}
+
 	const char* vertexShader =
 		// "#version 100\n"
 		"#ifndef GL_ES\n"
@@ -70,8 +96,8 @@ namespace {
 		"  return clamp(vec3(min(a,b), min(c,d), min(e,f)), 0.0, 1.0);\n"
 		"}\n"
 		"void main() {\n"
-		"  lowp vec4 values = texture2D(texture, v_texCoord);\n"
-		"  if (values.a > 0.0) gl_FragColor = vec4(colormap(values.r), 1.0); else discard;\n"
+		"  lowp float value = texture2D(texture, v_texCoord).r;\n"
+		"  if (value > 0.0) gl_FragColor = vec4(colormap(value), 1.0); else discard;\n"
 		"}";
 
 	const char* fragmentShader2 =
@@ -97,46 +123,131 @@ namespace {
 		"  return clamp(vec3(min(a,b), min(c,d), min(e,f)), 0.0, 1.0);\n"
 		"}\n"
 		"void main() {\n"
-		"  lowp vec4 values = texture2D(texture, v_texCoord);\n"
-		// "  if (values.a > 0.0) gl_FragColor = vec4(colormap(values.r), 1.0); else discard;\n"
-		"  if (values.a > 0.0) gl_FragColor = vec4(colormap(values.r), 1.0); else gl_FragColor = vec4(vec3(0.5), 0.5);\n" // XXX: debug
+		"  lowp float value = texture2D(texture, v_texCoord).r;\n"
+		// "  if (value > 0.0) gl_FragColor = vec4(colormap(value), 1.0); else discard;\n"
+		"  if (value > 0.0) gl_FragColor = vec4(colormap(value), 1.0); else gl_FragColor = vec4(vec3(0.5), 0.5);\n" // XXX: debug
+		"}";
+	// GPU sampling: the texture coordinates of the quad are computed
+	// from "textureMatrix", which maps the quad to the 3D texture
+	const char* gpuVertexShader =
+		// "#version 100\n"
+		"#ifndef GL_ES\n"
+		"#define highp\n"
+		"#define mediump\n"
+		"#define lowp\n"
+		"#endif\n"
+
+		"uniform highp mat4 projection;\n"
+		"uniform highp mat4 modelView;\n"
+		"uniform highp mat4 textureMatrix;\n"
+		"attribute highp vec3 vertex;\n"
+		"varying highp vec3 v_texCoord;\n"
+		"void main() {\n"
+		"  v_texCoord = (textureMatrix * vec4(vertex, 1.0)).xyz;\n"
+		"  gl_Position = projection * modelView * vec4(vertex, 1.0);\n"
+		"}";
+
+	const char* gpuFragmentShader =
+		// "#version 100\n"
+		"#ifndef GL_ES\n"
+		"#define highp\n"
+		"#define mediump\n"
+		"#define lowp\n"
+		"#endif\n"
+
+		"varying highp vec3 v_texCoord;\n"
+		"uniform lowp sampler3D texture;\n"
+		// "Jet" color map (http://www.metastine.com/?p=7)
+		// FIXME: duplicated code (see isosurface.cpp and volume.cpp)
+		"lowp vec3 colormap(lowp float value) {\n"
+		"  lowp float value4 = 4.0 * value;\n"
+		"  lowp float a =  value4 - 1.5;\n"
+		"  lowp float b = -value4 + 4.5;\n"
+		"  lowp float c =  value4 - 0.5;\n"
+		"  lowp float d = -value4 + 3.5;\n"
+		"  lowp float e =  value4 + 0.5;\n"
+		"  lowp float f = -value4 + 2.5;\n"
+		"  return clamp(vec3(min(a,b), min(c,d), min(e,f)), 0.0, 1.0);\n"
+		"}\n"
+		"void main() {\n"
+		"  lowp float value = texture3D(texture, v_texCoord).r;\n"
+		"  if (any(lessThan(v_texCoord, vec3(0.0))) || any(greaterThan(v_texCoord, vec3(1.0)))) value = 0.0;\n"
+		"  if (value > 0.0) gl_FragColor = vec4(colormap(value), 1.0); else discard;\n"
 		"}";
+
+	// True if the plane of the quad mapped by "planeMatrix" crosses
+	// the box [0,boxMax] (the quad itself is assumed to be large
+	// enough to cover the data)
+	bool planeIntersectsBox(const Matrix4& planeMatrix, const Vector3& boxMax)
+	{
+		const Vector3 origin = planeMatrix * Vector3::zero();
+		const Vector3 normal = (planeMatrix * Vector3::unitX() - origin).cross(planeMatrix * Vector3::unitY() - origin);
+
+		bool below = false, above = false;
+		for (int i = 0; i < 8; ++i) {
+			const Vector3 corner((i & 1) ? boxMax.x : 0, (i & 2) ? boxMax.y : 0, (i & 4) ? boxMax.z : 0);
+			const float side = normal.dot(corner - origin);
+			below |= (side <= 0);
+			above |= (side >= 0);
+		}
+		return below && above;
+	}
 } // namespace
 
-Slice::Slice(vtkSmartPointer<vtkImageData> data)
- : mDefaultMaterial(MaterialSharedPtr(new Material(vertexShader, fragmentShader))),
-   mOpaqueMaterial(MaterialSharedPtr(new Material(vertexShader, fragmentShader2))),
+Slice::Slice(GpuResourcesSharedPtr resources)
+ : mDefaultMaterial(Material::get(vertexShader, fragmentShader)),
+   mOpaqueMaterial(Material::get(vertexShader, fragmentShader2)),
+   mGpuMaterial(Material::get(gpuVertexShader, gpuFragmentShader)),
    mTextureHandle(0),
-   mData(data),
+   mPixelBufferIndex(0),
+   mVertexBuffer(0), mVertexArray(0),
+   mResources(resources),
+   mData(resources->getData()),
    mSliceFilter(vtkSmartPointer<vtkImageReslice>::New()),
    mTransformMatrix(vtkMatrix4x4::New()),
-   mBound(false), mEmpty(true), mDirty(false), mOpaque(false),
+   mBound(false), mOpaque(false), mEmpty(true),
    mVertexAttrib(-1), mTexCoordAttrib(-1),
-   mProjectionUniform(-1), mModelViewUniform(-1)
+   mProjectionUniform(-1), mModelViewUniform(-1), mTextureMatrixUniform(-1),
+   mGpuSampling(false), mHasPlane(false),
+   mDirty(false),
+   mResolution(1.0f),
+   mHasRequest(false)
 {
 	android_assert(mData);
 	android_assert(mSliceFilter);
 
+	mTextureSize[0] = mTextureSize[1] = 0;
+	mImageSize[0] = horizSize;
+	mImageSize[1] = vertSize;
+
+	for (GLuint& buffer : mPixelBuffers)
+		buffer = 0;
+
 	mData->GetPointData()->GetScalars()->GetRange(mRange);
 	LOGD("range min=%f max=%f", mRange[0], mRange[1]);
 
+	// (vtkImageReslice splits each update between all the cores)
 	mSliceFilter->SetInputData(mData);
 	mSliceFilter->SetInterpolationModeToLinear();
 	mSliceFilter->SetOutputDimensionality(2);
 	mSliceFilter->BorderOn();
 
-	// Set the slice viewport to a horizSize x vertSize area.
-	// mSliceFilter->SetResliceAxes() will then transform this
-	// viewport according to the given transformation matrix, and
-	// slice through the volume along the transformed viewport.
-	mSliceFilter->SetOutputExtent(0, horizSize-1, 0, vertSize-1, 0, 0);
-
+	// The slice viewport is set to a width x height area for each
+	// request (see reslice()). mSliceFilter->SetResliceAxes() will
+	// then transform this viewport according to the given
+	// transformation matrix, and slice through the volume along the
+	// transformed viewport.
 	mSliceFilter->TransformInputSamplingOff(); // NOTE: important!!!!
 
 	// Mask for pixels outside of the data slice
 	mSliceFilter->SetBackgroundLevel(std::numeric_limits<double>::infinity());
 
-	mTextureData.resize(2*horizSize*vertSize);
+	mTextureData.resize(horizSize*vertSize);
+	mReslicedData.resize(horizSize*vertSize);
+
+	mWorker.reset(new WorkerThread<Request>([this](Request request) {
+		reslice(request);
+	}));
 }
 
 // (GL context)
@@ -146,6 +257,16 @@ void Slice::switchMaterial(MaterialSharedPtr newMaterial)
 		return;
 
 	android_assert(newMaterial);
+
+	// (the attributes of the previous material may be elsewhere)
+	if (mMaterial && mVertexArray != 0) {
+		glBindVertexArray(mVertexArray);
+		glDisableVertexAttribArray(mVertexAttrib);
+		if (mTexCoordAttrib != -1)
+			glDisableVertexAttribArray(mTexCoordAttrib);
+		glBindVertexArray(0);
+	}
+
 	mMaterial = newMaterial;
 
 	mMaterial->bind();
@@ -154,11 +275,43 @@ void Slice::switchMaterial(MaterialSharedPtr newMaterial)
 	mTexCoordAttrib = mMaterial->getAttribute("texCoord");
 	mProjectionUniform = mMaterial->getUniform("projection");
 	mModelViewUniform = mMaterial->getUniform("modelView");
+	mTextureMatrixUniform = mMaterial->getUniform("textureMatrix");
 
+	// (texCoord is only used by the CPU reslice materials, and
+	// textureMatrix by the GPU sampling ones)
 	android_assert(mVertexAttrib != -1);
-	android_assert(mTexCoordAttrib != -1);
+	android_assert(mTexCoordAttrib != -1 || mTextureMatrixUniform != -1);
 	android_assert(mProjectionUniform != -1);
 	android_assert(mModelViewUniform != -1);
+
+	specifyVertexArray();
+}
+
+// (GL context)
+void Slice::specifyVertexArray()
+{
+	if (mVertexArray == 0)
+		glGenVertexArrays(1, &mVertexArray);
+
+	glBindVertexArray(mVertexArray);
+
+	// Vertices
+	android_assert(mVertexBuffer != 0);
+	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false,
+		bufferStride, nullptr);
+	glEnableVertexAttribArray(mVertexAttrib);
+
+	// Texture coordinates (the GPU sampling materials compute them
+	// from the vertices)
+	if (mTexCoordAttrib != -1) {
+		glVertexAttribPointer(mTexCoordAttrib, 2, GL_FLOAT, false,
+			bufferStride, reinterpret_cast<const GLvoid*>(3*bufferTypeSize));
+		glEnableVertexAttribArray(mTexCoordAttrib);
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 // (GL context)
@@ -183,13 +336,35 @@ void Slice::bind()
 	glTexImage2D(
 		GL_TEXTURE_2D,
 		0,
-		GL_LUMINANCE_ALPHA,
+		GL_R8,
 		horizSize, vertSize,
 		0,
-		GL_LUMINANCE_ALPHA,
+		GL_RED,
 		GL_UNSIGNED_BYTE,
 		nullptr
 	);
+	mTextureSize[0] = horizSize;
+	mTextureSize[1] = vertSize;
+
+	glGenBuffers(pixelBufferCount, mPixelBuffers);
+
+	// (static quad)
+	glGenBuffers(1, &mVertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(texturedQuadBuffer), texturedQuadBuffer, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	mVertexArray = 0;
+	if (mMaterial)
+		specifyVertexArray();
+
+	// (3D texture for GPU sampling)
+	mResources->bind();
+
+	// (the last published image is uploaded again)
+	synchronized(mTextureData) {
+		mDirty = true;
+	}
 
 	mBound = true;
 }
@@ -198,70 +373,118 @@ void Slice::setSlice(const Matrix4& mat, float clipDist, float zoomFactor)
 {
 	// TODO: an early test to check if the slice would be empty
 
-	synchronized(mSliceFilter) {
-		double m[16];
-		for (int i = 0; i < 16; ++i)
-			m[i] = mat.data_[i];
-		mTransformMatrix->DeepCopy(m);
+	mHasPlane = false;
+
+	const Request request { mat, clipDist, zoomFactor,
+	                        std::max(1u, (unsigned int)(horizSize*mResolution)),
+	                        std::max(1u, (unsigned int)(vertSize*mResolution)),
+	                        mResources->getData() };
+	if (mHasRequest && request == mLastRequest)
+		return;
+
+	mWorker->process(request);
+	mLastRequest = request;
+	mHasRequest = true;
+}
+
+void Slice::setSlice(const Matrix4& mat, float clipDist, float zoomFactor, const Matrix4& planeMatrix)
+{
+	// Data coordinates to texture coordinates (texel centers)
+	const int* dims = mResources->getDimensions();
+	const Vector3 size = Vector3(dims[0], dims[1], dims[2]) * mResources->getSpacing();
+	const Vector3 offset = Vector3(0.5f/dims[0], 0.5f/dims[1], 0.5f/dims[2]);
+	mTextureMatrix = Matrix4::makeTransform(offset, Quaternion::identity(), 1.0f/size) * planeMatrix;
+	mHasPlane = true;
+
+	if (mGpuSampling) {
+		// (no image to wait for)
+		mEmpty = !planeIntersectsBox(planeMatrix, Vector3(dims[0]-1, dims[1]-1, dims[2]-1) * mResources->getSpacing());
+		return;
+	}
 
-		// "mat" is column-major, but vtkMatrix4x4 is row-major
-		mTransformMatrix->Transpose();
+	setSlice(mat, clipDist, zoomFactor);
+	mHasPlane = true;
+}
 
-		mSliceFilter->SetResliceAxes(mTransformMatrix);
+void Slice::setGpuSampling(bool enabled)
+{
+	mGpuSampling = enabled;
+}
 
-		// FIXME: why *0.5 ?
-		mSliceFilter->SetOutputSpacing(clipDist/(horizSize*zoomFactor*0.5), clipDist/(vertSize*zoomFactor*0.5), 1);
+// (worker thread)
+void Slice::reslice(const Request& request)
+{
+	if (request.data != mData) {
+		mData = request.data;
+		mData->GetPointData()->GetScalars()->GetRange(mRange);
+		mSliceFilter->SetInputData(mData);
+	}
 
-		mSliceFilter->Update();
+	double m[16];
+	for (int i = 0; i < 16; ++i)
+		m[i] = request.matrix.data_[i];
+	mTransformMatrix->DeepCopy(m);
 
-		vtkImageData* image = mSliceFilter->GetOutput();
-		android_assert(image);
+	// "mat" is column-major, but vtkMatrix4x4 is row-major
+	mTransformMatrix->Transpose();
 
-#ifndef NDEBUG
-		int dimensions[3];
-		image->GetDimensions(dimensions);
-		android_assert(dimensions[0] == static_cast<signed>(horizSize));
-		android_assert(dimensions[1] == static_cast<signed>(vertSize));
-		android_assert(dimensions[2] == 1);
-#endif
+	mSliceFilter->SetResliceAxes(mTransformMatrix);
 
-		// unsigned char* data = static_cast<unsigned char*>(image->GetScalarPointer());
-		// android_assert(data);
+	const unsigned int width = request.width, height = request.height;
+	mSliceFilter->SetOutputExtent(0, width-1, 0, height-1, 0, 0);
 
-		vtkDataArray* scalars = image->GetPointData()->GetScalars();
-		android_assert(scalars);
+	// FIXME: why *0.5 ?
+	mSliceFilter->SetOutputSpacing(request.clipDist/(width*request.zoomFactor*0.5), request.clipDist/(height*request.zoomFactor*0.5), 1);
 
-		unsigned int num = scalars->GetNumberOfTuples();
-		android_assert(num == static_cast<unsigned>(dimensions[0]*dimensions[1]));
+	mSliceFilter->Update();
 
-		// vtkFloatArray* arr = vtkFloatArray::SafeDownCast(scalars);
-		// android_assert(arr);
+	vtkImageData* image = mSliceFilter->GetOutput();
+	android_assert(image);
 
-		// const float* ptr = arr->GetPointer(0);
-		// const std::size_t N = scalars->GetNumberOfComponents();
+#ifndef NDEBUG
+	int dimensions[3];
+	image->GetDimensions(dimensions);
+	android_assert(dimensions[0] == static_cast<signed>(width));
+	android_assert(dimensions[1] == static_cast<signed>(height));
+	android_assert(dimensions[2] == 1);
+#endif
 
-		bool notEmpty = false;
-		synchronized(mTextureData) {
-			for (unsigned int i = 0; i < num; ++i) {
-				double value = scalars->GetComponent(i, 0);
-				// float value = *ptr;
-				// ptr += N;
-				// FIXME: hardcoded constant (signed int16 max, see head.vti)
-				bool isinf = (__isinf(value) || value == 32767 || value == 255);
-				mTextureData[i*2+1] = (isinf ? 0 : 255);
-				if (!isinf) {
-					notEmpty = true;
-					double norm = (value-mRange[0]) / (mRange[1]-mRange[0]);
-					mTextureData[i*2+0] = norm*255;
-				}
-				// if (!mInitialized) LOGD("%d => %f", i, value);
-			}
+	vtkDataArray* scalars = image->GetPointData()->GetScalars();
+	android_assert(scalars);
+
+	const unsigned int num = scalars->GetNumberOfTuples();
+	android_assert(num == width*height);
+
+	const double scale = 255 / (mRange[1]-mRange[0]);
+	const void* src = scalars->GetVoidPointer(0);
+	const int components = scalars->GetNumberOfComponents();
+	mReslicedData.resize(num); // (never reallocated, see the constructor)
+	unsigned char* dst = mReslicedData.data();
+
+	// One flag per task (no shared writes)
+	const unsigned int taskCount = (height + rowsPerTask-1) / rowsPerTask;
+	std::vector<unsigned char> notEmpty(taskCount, false);
+
+	Parallel::forEach(0, taskCount, [&](int task) {
+		const unsigned int first = task*rowsPerTask*width;
+		const unsigned int count = std::min(rowsPerTask*width, num - first);
+		switch (scalars->GetDataType()) {
+			vtkTemplateMacro(
+				notEmpty[task] = convertPixels(static_cast<const VTK_TT*>(src), components,
+				                               first, count, mRange[0], scale, dst)
+			);
+			default:
+				throw std::runtime_error("Slice: unsupported scalar type");
 		}
-		mEmpty = !notEmpty;
-	}
+	});
 
-	mDirty = true;
-	// mInitialized = true;
+	synchronized(mTextureData) {
+		mTextureData.swap(mReslicedData);
+		mImageSize[0] = width;
+		mImageSize[1] = height;
+		mEmpty = (std::find(notEmpty.begin(), notEmpty.end(), true) == notEmpty.end());
+		mDirty = true;
+	}
 }
 
 void Slice::setOpaque(bool opaque)
@@ -269,70 +492,168 @@ void Slice::setOpaque(bool opaque)
 	mOpaque = opaque;
 }
 
+void Slice::setResolution(float fraction)
+{
+	mResolution = std::max(0.0f, std::min(fraction, 1.0f));
+}
+
 // (GL context)
 void Slice::updateTexture()
 {
+	PROFILE_SCOPE("slice texture");
+
 	android_assert(mTextureHandle != 0);
 
+	// (room for a full resolution image)
+	const GLsizeiptr size = horizSize*vertSize;
+
+	// The image goes through the next pixel buffer of the ring:
+	// glTexSubImage2D() then returns without waiting for the
+	// transfer, and a buffer is only written again pixelBufferCount
+	// updates later (its storage is also orphaned, in case the
+	// driver still uses it)
+	mPixelBufferIndex = (mPixelBufferIndex + 1) % pixelBufferCount;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mPixelBuffers[mPixelBufferIndex]);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+
+	void* pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!pixels) {
+		LOGE("Slice: unable to map the pixel buffer");
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return;
+	}
+
+	unsigned int width, height;
+	synchronized(mTextureData) {
+		std::memcpy(pixels, mTextureData.data(), mTextureData.size());
+		width = mImageSize[0];
+		height = mImageSize[1];
+		mDirty = false;
+	}
+
+	if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)) {
+		// (the buffer contents were lost, try again next frame)
+		synchronized(mTextureData) {
+			mDirty = true;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return;
+	}
+
 	glBindTexture(GL_TEXTURE_2D, mTextureHandle);
 
 	// Required because input is not RGBA (i.e. not aligned to a 4-byte boundary)
 	// http://www.opengl.org/wiki/Common_Mistakes#Texture_upload_and_pixel_reads
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
-	synchronized(mTextureData) {
-		// Update the texture contents
-		glTexSubImage2D(
-			GL_TEXTURE_2D,
-			0,
-			0, 0,
-			horizSize, vertSize,
-			GL_LUMINANCE_ALPHA,
-			GL_UNSIGNED_BYTE,
-			mTextureData.data()
-		);
+	// (reallocated when the resolution changes)
+	if (width != mTextureSize[0] || height != mTextureSize[1]) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0,
+		             GL_RED, GL_UNSIGNED_BYTE, nullptr);
+		mTextureSize[0] = width;
+		mTextureSize[1] = height;
 	}
+
+	// Update the texture contents (from the bound pixel buffer)
+	glTexSubImage2D(
+		GL_TEXTURE_2D,
+		0,
+		0, 0,
+		width, height,
+		GL_RED,
+		GL_UNSIGNED_BYTE,
+		nullptr
+	);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 // (GL context)
-void Slice::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix)
+bool Slice::beginRender()
 {
 	if (mEmpty && !mOpaque)
-		return;
+		return false;
 
 	if (!mBound)
 		bind();
 
-	if (mDirty) {
-		updateTexture();
-		mDirty = false;
+	if (useGpuSampling()) {
+		// (no grey fill in opaque mode: the fragments outside of the
+		// data are discarded)
+		switchMaterial(mGpuMaterial);
+		android_assert(mMaterial);
+
+		// Vertices (the texture coordinates come from the vertices)
+		glBindVertexArray(mVertexArray);
+
+		// Texture
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_3D, mResources->getScalarTexture());
+
+		glUseProgram(mMaterial->getHandle());
+		glUniformMatrix4fv(mTextureMatrixUniform, 1, false, mTextureMatrix.data_);
+		return true;
+	}
+
+	bool dirty;
+	synchronized(mTextureData) {
+		dirty = mDirty;
 	}
+	if (dirty)
+		updateTexture();
 
 	switchMaterial(mOpaque ? mOpaqueMaterial : mDefaultMaterial);
 	android_assert(mMaterial);
 
-	// Vertices
-	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false,
-		bufferStride, texturedQuadBuffer);
-	glEnableVertexAttribArray(mVertexAttrib);
-
-	// Texture coordinates
-	glVertexAttribPointer(mTexCoordAttrib, 2, GL_FLOAT, false,
-		bufferStride, &texturedQuadBuffer[3]);
-	glEnableVertexAttribArray(mTexCoordAttrib);
+	// Vertices and texture coordinates
+	glBindVertexArray(mVertexArray);
 
 	// Texture
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, mTextureHandle);
 
-	// Uniforms
 	glUseProgram(mMaterial->getHandle());
+	return true;
+}
+
+// (GL context)
+void Slice::draw(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix)
+{
+	// Uniforms
 	glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_);
 	glUniformMatrix4fv(mModelViewUniform, 1, false, modelViewMatrix.data_);
 
 	// Rendering
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, numPoints);
+}
+
+// (GL context)
+void Slice::endRender()
+{
+	glBindVertexArray(0);
+}
+
+// (GL context)
+void Slice::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix)
+{
+	if (!beginRender())
+		return;
+
+	draw(projectionMatrix, modelViewMatrix);
+	endRender();
+}
+
+// (GL context)
+void Slice::render(const Matrix4* projectionMatrices, const Matrix4* modelViewMatrices,
+                   const GLint (*viewports)[4], unsigned int count)
+{
+	if (!beginRender())
+		return;
+
+	for (unsigned int i = 0; i < count; ++i) {
+		glViewport(viewports[i][0], viewports[i][1], viewports[i][2], viewports[i][3]);
+		draw(projectionMatrices[i], modelViewMatrices[i]);
+	}
 
-	glDisableVertexAttribArray(mVertexAttrib);
-	glDisableVertexAttribArray(mTexCoordAttrib);
+	endRender();
 }
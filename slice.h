@@ -4,47 +4,150 @@
 #include "global.h"
 
 #include "rendering/renderable.h"
+#include "util/worker_thread.h"
 
 #include <vtkSmartPointer.h>
 #include <vtkMatrix4x4.h>
 
+#include <atomic>
+
 class vtkImageData;
 class vtkImageReslice;
 
 class Slice : public Renderable
 {
 public:
-	Slice(vtkSmartPointer<vtkImageData> data);
+	// The GPU sampling texture is shared with the other users of
+	// "resources"
+	Slice(GpuResourcesSharedPtr resources);
 
 	// (GL context)
 	void bind();
 
+	// The data is resliced by a background thread: the previous
+	// image keeps being displayed until the new one is ready, and
+	// only the most recent pending request is actually computed
 	void setSlice(const Matrix4& mat, float clipDist, float zoomFactor);
+
+	// Same as above, "planeMatrix" also mapping the slice quad
+	// ([-1,1]^2) to data coordinates. With GPU sampling, the quad is
+	// then textured directly from a 3D texture of the scalars, and
+	// the data isn't resliced at all.
+	void setSlice(const Matrix4& mat, float clipDist, float zoomFactor, const Matrix4& planeMatrix);
+
+	// Only applies to slices given with a plane matrix (the CPU
+	// reslice remains the reference, e.g. for camera slices)
+	void setGpuSampling(bool enabled);
+	bool isGpuSampling() const { return mGpuSampling; }
+
+	// True if the last resliced image (or, with GPU sampling, the
+	// slice plane) doesn't intersect the data
 	bool isEmpty() const { return mEmpty; }
 
+	// True if no reslice is pending or running
+	bool isIdle() { return mWorker->isWaiting(); }
+
 	void setOpaque(bool opaque);
 
+	// Size of the resliced images, as a fraction (0 to 1] of the
+	// full resolution (applies from the next setSlice())
+	void setResolution(float fraction);
+
 	// (GL context)
 	void render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix);
 
+	// Draws the slice once per viewport (x, y, width, height), the
+	// texture, material and vertex attributes being only set up
+	// once (the viewport is not restored).
+	// (GL context)
+	void render(const Matrix4* projectionMatrices, const Matrix4* modelViewMatrices,
+	            const GLint (*viewports)[4], unsigned int count);
+
+	// Number of pixel buffers the texture updates go through
+	static const int pixelBufferCount = 3;
+
 private:
+	struct Request
+	{
+		Matrix4 matrix;
+		float clipDist, zoomFactor;
+		unsigned int width, height; // (image size)
+		vtkSmartPointer<vtkImageData> data; // (current timestep, see GpuResources::replaceData())
+
+		bool operator==(const Request& other) const
+		{
+			return std::equal(matrix.data_, matrix.data_+16, other.matrix.data_)
+				&& clipDist == other.clipDist && zoomFactor == other.zoomFactor
+				&& width == other.width && height == other.height
+				&& data == other.data;
+		}
+	};
+
+	// Reslices the data and publishes the resulting image
+	// (worker thread)
+	void reslice(const Request& request);
+
+	// Returns false if there is nothing to draw
+	// (GL context)
+	bool beginRender();
+
+	// (GL context)
+	void draw(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix);
+
+	// (GL context)
+	void endRender();
+
+	// Uploads the last published image if it has changed
 	// (GL context)
 	void updateTexture();
 
+	// True if the GPU path is used for the next renders
+	bool useGpuSampling() const { return mGpuSampling && mHasPlane; }
+
 	// (GL context)
 	void switchMaterial(MaterialSharedPtr newMaterial);
+	// (GL context)
+	void specifyVertexArray();
 
 	MaterialSharedPtr mMaterial;
 	MaterialSharedPtr mDefaultMaterial, mOpaqueMaterial;
+	MaterialSharedPtr mGpuMaterial;
 	GLuint mTextureHandle;
-	vtkSmartPointer<vtkImageData> mData;
-	Synchronized<vtkSmartPointer<vtkImageReslice>> mSliceFilter;
-	vtkSmartPointer<vtkMatrix4x4> mTransformMatrix;
-	bool mBound, mEmpty, mDirty, mOpaque;
+	unsigned int mTextureSize[2]; // (allocated size of mTextureHandle)
+	GLuint mPixelBuffers[pixelBufferCount];
+	unsigned int mPixelBufferIndex;
+	GLuint mVertexBuffer, mVertexArray; // (static quad)
+	GpuResourcesSharedPtr mResources;
+	vtkSmartPointer<vtkImageData> mData; // (from the last request, worker thread only)
+	vtkSmartPointer<vtkImageReslice> mSliceFilter; // (worker thread only)
+	vtkSmartPointer<vtkMatrix4x4> mTransformMatrix; // (worker thread only)
+	bool mBound, mOpaque;
+	std::atomic<bool> mEmpty;
 	GLint mVertexAttrib, mTexCoordAttrib;
-	GLint mProjectionUniform, mModelViewUniform;
-	Synchronized<std::vector<unsigned char>> mTextureData;
+	GLint mProjectionUniform, mModelViewUniform, mTextureMatrixUniform;
 	double mRange[2];
+
+	// GPU sampling: quad to texture coordinates transform of the
+	// last plane ("mHasPlane")
+	bool mGpuSampling, mHasPlane;
+	Matrix4 mTextureMatrix;
+
+	// Last published image, not uploaded yet if "mDirty" is true
+	// (mDirty and mImageSize are protected by the mTextureData lock).
+	// The worker reslices into mReslicedData, then swaps it with
+	// mTextureData.
+	Synchronized<std::vector<unsigned char>> mTextureData;
+	std::vector<unsigned char> mReslicedData;
+	bool mDirty;
+	unsigned int mImageSize[2];
+	float mResolution;
+
+	// Last request given to the worker (identical requests are not
+	// resliced again)
+	Request mLastRequest;
+	bool mHasRequest;
+
+	std::unique_ptr<WorkerThread<Request> > mWorker;
 };
 
 #endif /* SLICE_H */
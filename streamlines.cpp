@@ -0,0 +1,189 @@
+#include "streamlines.h"
+
+#include "util/parallel.h"
+
+#include <cmath>
+
+namespace {
+	// One point is kept every "decimation" integration steps
+	const int decimation = 4;
+
+	// Velocities below this norm end the lines (same as ParticleEngine)
+	const float minVelocity = 0.001f;
+} // namespace
+
+Streamlines::Streamlines(VelocityFieldSharedPtr field, float speed)
+ : mField(field), mGeneration(0),
+   mSpeed(speed),
+   mChanged(false),
+   mSerial(0),
+   mCacheHits(0), mCacheMisses(0)
+{
+	android_assert(mField);
+
+	const int* dims = mField->getDimensions();
+	for (int i = 0; i < 3; ++i)
+		mCells[i] = std::ceil(dims[i] / cellSize);
+
+	mWorker.reset(new WorkerThread<Request>([this](Request request) {
+		LinesPtr lines = integrate(request.key, *request.field);
+		addToCache(request.key, request.generation, lines);
+		publish(lines, request.serial);
+	}));
+}
+
+Streamlines::~Streamlines()
+{
+	// Stop the worker before the members it uses are destroyed
+	mWorker.reset();
+}
+
+long long Streamlines::cellKey(const Vector3& seed) const
+{
+	int cell[3];
+	const float pos[3] = { seed.x, seed.y, seed.z };
+	for (int i = 0; i < 3; ++i)
+		cell[i] = std::min(std::max(int(std::floor(pos[i] / cellSize)), 0), mCells[i]-1);
+	return ((long long)cell[2]*mCells[1] + cell[1])*mCells[0] + cell[0];
+}
+
+void Streamlines::request(const Vector3& seed)
+{
+	const Request request = { cellKey(seed), ++mSerial, mField, mGeneration };
+
+	// Cached lines are published right away
+	if (LinesPtr lines = findCached(request.key, mGeneration))
+		publish(lines, request.serial);
+	else
+		mWorker->process(request);
+}
+
+void Streamlines::clear()
+{
+	publish(LinesPtr(), ++mSerial);
+}
+
+void Streamlines::setVelocityField(VelocityFieldSharedPtr field)
+{
+	android_assert(field);
+	const int* dims = field->getDimensions();
+	android_assert(std::equal(dims, dims+3, mField->getDimensions()));
+	mField = field;
+	++mGeneration;
+
+	// (the lines still being integrated are added with the previous
+	// generation, and never found)
+	synchronized (mCache) {
+		mCache.clear();
+	}
+	clear();
+}
+
+bool Streamlines::getLines(std::vector<Vector3>& lines)
+{
+	synchronized (mPublished) {
+		if (!mChanged)
+			return false;
+		if (mPublished)
+			lines = *mPublished;
+		else
+			lines.clear();
+		mChanged = false;
+	}
+	return true;
+}
+
+void Streamlines::getCacheStats(unsigned int& hits, unsigned int& misses)
+{
+	synchronized (mCache) {
+		hits = mCacheHits;
+		misses = mCacheMisses;
+	}
+}
+
+void Streamlines::publish(LinesPtr lines, unsigned int serial)
+{
+	synchronized (mPublished) {
+		if (serial != mSerial)
+			return;
+		mPublished = lines;
+		mChanged = true;
+	}
+}
+
+Streamlines::LinesPtr Streamlines::findCached(long long key, unsigned int generation)
+{
+	synchronized (mCache) {
+		for (auto it = mCache.begin(); it != mCache.end(); ++it) {
+			if (it->key == key && it->generation == generation) {
+				mCache.splice(mCache.begin(), mCache, it);
+				++mCacheHits;
+				return mCache.front().lines;
+			}
+		}
+		++mCacheMisses;
+	}
+	return LinesPtr();
+}
+
+void Streamlines::addToCache(long long key, unsigned int generation, LinesPtr lines)
+{
+	synchronized (mCache) {
+		for (const Entry& entry : mCache) {
+			if (entry.key == key && entry.generation == generation)
+				return;
+		}
+		mCache.push_front(Entry { key, generation, lines });
+		if (mCache.size() > cacheCapacity)
+			mCache.pop_back();
+	}
+}
+
+Streamlines::LinesPtr Streamlines::integrate(long long key, const VelocityField& field) const
+{
+	const long long cell[3] = {
+		key % mCells[0],
+		(key / mCells[0]) % mCells[1],
+		key / ((long long)mCells[0]*mCells[1])
+	};
+	const float h = mSpeed * ParticleEngine::timeStepMs;
+	const int lineCount = linesPerAxis*linesPerAxis*linesPerAxis;
+
+	// Same RK4 integration as ParticleEngine, one line per task
+	std::vector<std::vector<Vector3> > lines(lineCount);
+	Parallel::forEach(0, lineCount, [&](int line) {
+		const int i[3] = { line % linesPerAxis, (line / linesPerAxis) % linesPerAxis, line / (linesPerAxis*linesPerAxis) };
+		float p[3];
+		for (int c = 0; c < 3; ++c)
+			p[c] = (cell[c] + (i[c] + 0.5f) / linesPerAxis) * cellSize;
+
+		std::vector<Vector3>& segments = lines[line];
+		Vector3 prev(p[0], p[1], p[2]);
+
+		for (int step = 1; step <= maxSteps && field.contains(p[0], p[1], p[2]); ++step) {
+			float k1[3], k2[3], k3[3], k4[3], t[3];
+			field.sample(p+0, p+1, p+2, 1, k1+0, k1+1, k1+2);
+			if (k1[0]*k1[0] + k1[1]*k1[1] + k1[2]*k1[2] <= minVelocity*minVelocity)
+				break;
+			for (int c = 0; c < 3; ++c) t[c] = p[c] + 0.5f*h*k1[c];
+			field.sample(t+0, t+1, t+2, 1, k2+0, k2+1, k2+2);
+			for (int c = 0; c < 3; ++c) t[c] = p[c] + 0.5f*h*k2[c];
+			field.sample(t+0, t+1, t+2, 1, k3+0, k3+1, k3+2);
+			for (int c = 0; c < 3; ++c) t[c] = p[c] + h*k3[c];
+			field.sample(t+0, t+1, t+2, 1, k4+0, k4+1, k4+2);
+			for (int c = 0; c < 3; ++c) p[c] += h/6 * (k1[c] + 2*k2[c] + 2*k3[c] + k4[c]);
+
+			if (step % decimation == 0) {
+				const Vector3 pos(p[0], p[1], p[2]);
+				segments.push_back(prev);
+				segments.push_back(pos);
+				prev = pos;
+			}
+		}
+	});
+
+	std::shared_ptr<std::vector<Vector3> > result = std::make_shared<std::vector<Vector3> >();
+	for (const std::vector<Vector3>& segments : lines)
+		result->insert(result->end(), segments.begin(), segments.end());
+	return result;
+}
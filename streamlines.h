@@ -0,0 +1,108 @@
+#ifndef STREAMLINES_H
+#define STREAMLINES_H
+
+#include "global.h"
+
+#include "particle_engine.h"
+#include "util/worker_thread.h"
+
+#include <list>
+#include <atomic>
+
+// Streamlines integrated in the background from seed points, and
+// cached by seed region: seeds falling in the same cell of a regular
+// grid (cellSize voxels wide) share the same lines, so seeding again
+// in a region already visited is only a lookup.
+class Streamlines
+{
+public:
+	// "speed": same as ParticleEngine (the lines follow particles
+	// released in the cell)
+	Streamlines(VelocityFieldSharedPtr field, float speed);
+	~Streamlines();
+
+	// Computes (or looks up) the lines for "seed" (in voxels). Only
+	// the most recent pending request is computed.
+	void request(const Vector3& seed);
+
+	void clear();
+
+	// Replaces the velocity field by another timestep of the same
+	// grid: the cached lines are dropped, and so are the current ones
+	// (render thread, same as request())
+	void setVelocityField(VelocityFieldSharedPtr field);
+
+	// Copies the line segments (pairs of points, in voxels) of the
+	// last completed request to "lines" and returns true if they
+	// have changed since the last call (single reader)
+	bool getLines(std::vector<Vector3>& lines);
+
+	// True if no request is pending or being integrated
+	bool isIdle() { return mWorker->isWaiting(); }
+
+	// Number of requests served from the cache (hits) or integrated
+	// (misses)
+	void getCacheStats(unsigned int& hits, unsigned int& misses);
+
+	static constexpr float cellSize = 2.0f; // voxels
+
+	// Lines per cell (seeds on a linesPerAxis^3 lattice spanning the
+	// cell)
+	static const int linesPerAxis = 3;
+
+	// Maximum number of steps per line, and of cached cells
+	static const int maxSteps = 4000;
+	static const unsigned int cacheCapacity = 64;
+
+private:
+	typedef std::shared_ptr<const std::vector<Vector3> > LinesPtr;
+
+	struct Entry
+	{
+		long long key;
+		unsigned int generation; // (of the field the lines belong to)
+		LinesPtr lines;
+	};
+
+	struct Request
+	{
+		long long key;
+		unsigned int serial;
+		VelocityFieldSharedPtr field;
+		unsigned int generation;
+	};
+
+	long long cellKey(const Vector3& seed) const;
+
+	// Integrates the lines of the cell "key" (any thread)
+	LinesPtr integrate(long long key, const VelocityField& field) const;
+
+	// Returns the lines from the cache or null, and marks them as
+	// the most recently used
+	LinesPtr findCached(long long key, unsigned int generation);
+	void addToCache(long long key, unsigned int generation, LinesPtr lines);
+
+	// Ignores the lines of requests older than the last request or
+	// clear() call (any thread)
+	void publish(LinesPtr lines, unsigned int serial);
+
+	VelocityFieldSharedPtr mField; // (render thread, see Request)
+	unsigned int mGeneration; // (incremented by setVelocityField())
+	const float mSpeed;
+	int mCells[3]; // number of cells per axis
+
+	// Last published lines (mChanged is protected by the mPublished
+	// lock)
+	Synchronized<LinesPtr> mPublished;
+	bool mChanged;
+	std::atomic<unsigned int> mSerial;
+
+	// Most recently used cells first (mCacheHits and mCacheMisses are
+	// protected by the mCache lock)
+	Synchronized<std::list<Entry> > mCache;
+	unsigned int mCacheHits, mCacheMisses;
+
+	std::unique_ptr<WorkerThread<Request> > mWorker;
+};
+
+#endif /* STREAMLINES_H */
@@ -5,34 +5,213 @@
 //
 //
 #include "yuv2rgb.h"
-// #include <arm_neon.h>
 
-// Disable warnings about signed/unsigend type conversions, since this
-// code is known to work
-#pragma GCC optimize("lax-vector-conversions")
+#include "util/parallel.h"
 
+#include <algorithm>
+
+// 16 pixels of two rows per iteration with SSE2 (x86-64 baseline) or
+// NEON (AArch64), giving the same bytes as the scalar code
+#if !defined(YUV2RGB_NO_SIMD) && defined(__SSE2__)
+	#define YUV2RGB_SSE2
+	#include <emmintrin.h>
+#elif !defined(YUV2RGB_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+	#define YUV2RGB_NEON
+	#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Rows converted by each task of the parallel versions (an even number)
+const int bandHeight = 32;
+
+#if defined(YUV2RGB_SSE2)
 //------------------------------------------------------------------------------
-template<typename trait>
-bool decode_yuv(unsigned char* out, unsigned char const* yuv, int width, int height, unsigned char alpha=0xff)
+typedef __m128i Block; // (16 bytes)
+typedef __m128i Lanes; // (4 32-bit values)
+
+// 298*max(Y'-16, 0) of 16 pixels, as 4x4 32-bit values (the products
+// don't fit in 16 bits)
+inline void load_luma(unsigned char const* y, Lanes out[4])
 {
-	// pre-condition : width and height must be even
-	if (0!=(width&1) || width<2 || 0!=(height&1) || height<2 || !out || !yuv)
-		return false;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c298 = _mm_set1_epi16(298);
+	const __m128i v = _mm_subs_epu8(_mm_loadu_si128((const __m128i*)y), _mm_set1_epi8(16));
+
+	const __m128i lo = _mm_unpacklo_epi8(v, zero);
+	const __m128i hi = _mm_unpackhi_epi8(v, zero);
+	__m128i l = _mm_mullo_epi16(lo, c298), h = _mm_mulhi_epu16(lo, c298);
+	out[0] = _mm_unpacklo_epi16(l, h);
+	out[1] = _mm_unpackhi_epi16(l, h);
+	l = _mm_mullo_epi16(hi, c298); h = _mm_mulhi_epu16(hi, c298);
+	out[2] = _mm_unpacklo_epi16(l, h);
+	out[3] = _mm_unpackhi_epi16(l, h);
+}
+
+// tR, tG, tB of the 8 V/U pairs at "vu", each one repeated for the 2
+// pixels it covers (4x4 32-bit values per channel)
+inline void load_chroma(unsigned char const* vu, Lanes tR[4], Lanes tG[4], Lanes tB[4])
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i rounding = _mm_set1_epi32(128);
+	// (V, U coefficients of each pair)
+	const __m128i cR = _mm_setr_epi16(409, 0, 409, 0, 409, 0, 409, 0);
+	const __m128i cG = _mm_setr_epi16(-208, -100, -208, -100, -208, -100, -208, -100);
+	const __m128i cB = _mm_setr_epi16(0, 516, 0, 516, 0, 516, 0, 516);
+
+	const __m128i v = _mm_loadu_si128((const __m128i*)vu);
+	const __m128i pairs[2] = {
+		_mm_sub_epi16(_mm_unpacklo_epi8(v, zero), half), // v0 u0 v1 u1 v2 u2 v3 u3
+		_mm_sub_epi16(_mm_unpackhi_epi8(v, zero), half)  // v4 u4 ... v7 u7
+	};
+
+	for (int i = 0; i < 2; ++i) {
+		const __m128i r = _mm_add_epi32(_mm_madd_epi16(pairs[i], cR), rounding);
+		const __m128i g = _mm_add_epi32(_mm_madd_epi16(pairs[i], cG), rounding);
+		const __m128i b = _mm_add_epi32(_mm_madd_epi16(pairs[i], cB), rounding);
+		tR[2*i] = _mm_unpacklo_epi32(r, r); tR[2*i+1] = _mm_unpackhi_epi32(r, r);
+		tG[2*i] = _mm_unpacklo_epi32(g, g); tG[2*i+1] = _mm_unpackhi_epi32(g, g);
+		tB[2*i] = _mm_unpacklo_epi32(b, b); tB[2*i+1] = _mm_unpackhi_epi32(b, b);
+	}
+}
+
+// (Y + t) >> 8 clamped to [0, 255] (as store_pixel()), 16 bytes
+inline Block pack_channel(const Lanes y[4], const Lanes t[4])
+{
+	__m128i v[4];
+	for (int i = 0; i < 4; ++i)
+		v[i] = _mm_srai_epi32(_mm_add_epi32(y[i], t[i]), 8);
+	return _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+}
+
+inline void store_rgba_block(unsigned char* dst, Block r, Block g, Block b, unsigned char alpha)
+{
+	const __m128i a = _mm_set1_epi8(alpha);
+	const __m128i rgLo = _mm_unpacklo_epi8(r, g), rgHi = _mm_unpackhi_epi8(r, g);
+	const __m128i baLo = _mm_unpacklo_epi8(b, a), baHi = _mm_unpackhi_epi8(b, a);
+	_mm_storeu_si128((__m128i*)dst,      _mm_unpacklo_epi16(rgLo, baLo));
+	_mm_storeu_si128((__m128i*)dst + 1,  _mm_unpackhi_epi16(rgLo, baLo));
+	_mm_storeu_si128((__m128i*)dst + 2,  _mm_unpacklo_epi16(rgHi, baHi));
+	_mm_storeu_si128((__m128i*)dst + 3,  _mm_unpackhi_epi16(rgHi, baHi));
+}
 
-    unsigned char* dst0 = out;
+inline void store_rgb_block(unsigned char* dst, Block r, Block g, Block b)
+{
+	// (SSE2 has no byte shuffle: interleaved as RGBA, then packed)
+	__m128i rgba[4];
+	store_rgba_block((unsigned char*)rgba, r, g, b, 0);
+	const unsigned char* src = (const unsigned char*)rgba;
+	for (int i = 0; i < 16; ++i, src += 4, dst += 3) {
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+	}
+}
+
+#elif defined(YUV2RGB_NEON)
+//------------------------------------------------------------------------------
+typedef uint8x16_t Block;
+typedef int32x4_t Lanes;
+
+inline void load_luma(unsigned char const* y, Lanes out[4])
+{
+	const uint8x16_t v = vqsubq_u8(vld1q_u8(y), vdupq_n_u8(16));
+	const uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+	const uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+	out[0] = vreinterpretq_s32_u32(vmull_n_u16(vget_low_u16(lo), 298));
+	out[1] = vreinterpretq_s32_u32(vmull_n_u16(vget_high_u16(lo), 298));
+	out[2] = vreinterpretq_s32_u32(vmull_n_u16(vget_low_u16(hi), 298));
+	out[3] = vreinterpretq_s32_u32(vmull_n_u16(vget_high_u16(hi), 298));
+}
+
+inline void load_chroma(unsigned char const* vu, Lanes tR[4], Lanes tG[4], Lanes tB[4])
+{
+	const int16x8_t half = vdupq_n_s16(128);
+	const int32x4_t rounding = vdupq_n_s32(128);
+
+	// (val[0]: v0..v7, val[1]: u0..u7)
+	const uint8x8x2_t v = vld2_u8(vu);
+	const int16x8_t V = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v.val[0])), half);
+	const int16x8_t U = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v.val[1])), half);
+
+	const int16x4_t Vs[2] = { vget_low_s16(V), vget_high_s16(V) };
+	const int16x4_t Us[2] = { vget_low_s16(U), vget_high_s16(U) };
 
-    unsigned char const* y0 = yuv;
-    unsigned char const* uv = yuv + (width*height);
-    int const halfHeight = height>>1;
+	for (int i = 0; i < 2; ++i) {
+		const int32x4_t r = vmlal_n_s16(rounding, Vs[i], 409);
+		const int32x4_t g = vmlal_n_s16(vmlal_n_s16(rounding, Us[i], -100), Vs[i], -208);
+		const int32x4_t b = vmlal_n_s16(rounding, Us[i], 516);
+		const int32x4x2_t R = vzipq_s32(r, r), G = vzipq_s32(g, g), B = vzipq_s32(b, b);
+		tR[2*i] = R.val[0]; tR[2*i+1] = R.val[1];
+		tG[2*i] = G.val[0]; tG[2*i+1] = G.val[1];
+		tB[2*i] = B.val[0]; tB[2*i+1] = B.val[1];
+	}
+}
+
+inline Block pack_channel(const Lanes y[4], const Lanes t[4])
+{
+	uint16x4_t v[4];
+	for (int i = 0; i < 4; ++i)
+		v[i] = vqshrun_n_s32(vaddq_s32(y[i], t[i]), 8);
+	return vcombine_u8(vqmovn_u16(vcombine_u16(v[0], v[1])), vqmovn_u16(vcombine_u16(v[2], v[3])));
+}
+
+inline void store_rgba_block(unsigned char* dst, Block r, Block g, Block b, unsigned char alpha)
+{
+	uint8x16x4_t pixels;
+	pixels.val[0] = r;
+	pixels.val[1] = g;
+	pixels.val[2] = b;
+	pixels.val[3] = vdupq_n_u8(alpha);
+	vst4q_u8(dst, pixels);
+}
+
+inline void store_rgb_block(unsigned char* dst, Block r, Block g, Block b)
+{
+	uint8x16x3_t pixels;
+	pixels.val[0] = r;
+	pixels.val[1] = g;
+	pixels.val[2] = b;
+	vst3q_u8(dst, pixels);
+}
+#endif
+
+} // namespace
+
+//------------------------------------------------------------------------------
+// Converts the row pairs [firstPair, endPair)
+template<typename trait>
+void decode_yuv_rows(unsigned char* out, unsigned char const* yuv, int width, int height,
+                     int firstPair, int endPair, unsigned char alpha)
+{
+    unsigned char* dst0 = out + 2*firstPair*width*trait::bytes_per_pixel;
+
+    unsigned char const* y0 = yuv + 2*firstPair*width;
+    unsigned char const* uv = yuv + (width*height) + firstPair*width;
     int const halfWidth = width>>1;
 
     int Y00, Y01, Y10, Y11;
     int V, U;
     int tR, tG, tB;
-    for (int h=0; h<halfHeight; ++h) {
+    for (int h=firstPair; h<endPair; ++h) {
         unsigned char const* y1 = y0+width;
         unsigned char* dst1 = dst0 + width*trait::bytes_per_pixel;
-        for (int w=0; w<halfWidth; ++w) {
+        int w=0;
+#if defined(YUV2RGB_SSE2) || defined(YUV2RGB_NEON)
+        for (; w+8<=halfWidth; w+=8) {
+            Lanes Y0[4], Y1[4], R[4], G[4], B[4];
+            load_luma(y0, Y0);
+            load_luma(y1, Y1);
+            load_chroma(uv, R, G, B);
+            trait::store_block(dst0, pack_channel(Y0, R), pack_channel(Y0, G), pack_channel(Y0, B), alpha);
+            trait::store_block(dst1, pack_channel(Y1, R), pack_channel(Y1, G), pack_channel(Y1, B), alpha);
+            y0 += 16; y1 += 16; uv += 16;
+            dst0 += 16*trait::bytes_per_pixel;
+            dst1 += 16*trait::bytes_per_pixel;
+        }
+#endif
+        for (; w<halfWidth; ++w) {
             // shift
             Y00 = (*y0++) - 16;  Y01 = (*y0++) - 16;
             Y10 = (*y1++) - 16;  Y11 = (*y1++) - 16;
@@ -58,93 +237,46 @@ bool decode_yuv(unsigned char* out, unsigned char const* yuv, int width, int hei
         y0 = y1;
         dst0 = dst1;
     }
+}
+
+bool check_yuv(unsigned char* out, unsigned char const* yuv, int width, int height)
+{
+	// pre-condition : width and height must be even
+	return !(0!=(width&1) || width<2 || 0!=(height&1) || height<2 || !out || !yuv);
+}
+
+template<typename trait>
+bool decode_yuv(unsigned char* out, unsigned char const* yuv, int width, int height, unsigned char alpha=0xff)
+{
+	if (!check_yuv(out, yuv, width, height))
+		return false;
+
+	// Bands of rows on the task pool
+	const int pairs = height>>1, bandPairs = bandHeight>>1;
+	Parallel::forEach(0, (pairs + bandPairs-1) / bandPairs, [=](int band) {
+		decode_yuv_rows<trait>(out, yuv, width, height,
+		                       band*bandPairs, std::min(pairs, (band+1)*bandPairs), alpha);
+	});
 	return true;
 }
 
-#if 0
-//-----------------------------------------------------------------------------
 template<typename trait>
-bool decode_yuv_neon(unsigned char* out, unsigned char const* yuv, int width, int height, unsigned char fill_alpha=0xff)
+bool decode_yuv_band(unsigned char* out, unsigned char const* yuv, int width, int height,
+                     int firstRow, int rowCount, unsigned char alpha=0xff)
 {
-	// pre-condition : width must be multiple of 8, height must be even
-	if (0!=(width&7) || width<8 || 0!=(height&1) || height<2 || !out || !yuv)
+	if (!check_yuv(out, yuv, width, height)
+	    || 0!=(firstRow&1) || 0!=(rowCount&1) || firstRow<0 || rowCount<0 || firstRow+rowCount>height)
 		return false;
 
-	// Y' and UV pointers
-	unsigned char const* y  = yuv;
-    unsigned char const* uv = yuv + (width*height);
-
-	// iteration counts
-    int const itHeight = height>>1;
-    int const itWidth = width>>3;
-    
-    // stride of each line
-    int const stride = width*trait::bytes_per_pixel;
-    
-    // total bytes of each write
-    int const dst_pblock_stride = 8*trait::bytes_per_pixel;
-
-	// a block temporary stores consecutively 8 pixels
-	typename trait::PixelBlock pblock = trait::init_pixelblock(fill_alpha);
-
-    // simd constants
-    uint8x8_t const Yshift = vdup_n_u8(16);
-    int16x8_t const half = vdupq_n_u16(128);
-    int32x4_t const rounding = vdupq_n_s32(128);
-    
-    // tmp variable to load y and uv
-	uint16x8_t t;
-
-    for (int j=0; j<itHeight; ++j, y+=width, out+=stride) {
-        for (int i=0; i<itWidth; ++i, y+=8, uv+=8, out+=dst_pblock_stride) {
-            t = vmovl_u8(vqsub_u8(vld1_u8(y), Yshift));
-            int32x4_t const Y00 = vmulq_n_u32(vmovl_u16(vget_low_u16(t)), 298);
-            int32x4_t const Y01 = vmulq_n_u32(vmovl_u16(vget_high_u16(t)), 298);
-
-            t = vmovl_u8(vqsub_u8(vld1_u8(y+width), Yshift));
-            int32x4_t const Y10 = vmulq_n_u32(vmovl_u16(vget_low_u16(t)), 298);
-            int32x4_t const Y11 = vmulq_n_u32(vmovl_u16(vget_high_u16(t)), 298);
-
-			//	trait::loadvu pack 4 sets of uv into a uint8x8_t, layout : { v0,u0, v1,u1, v2,u2, v3,u3 }
-            t = vsubq_s16((int16x8_t)vmovl_u8(trait::loadvu(uv)), half);
-
-            // UV.val[0] : v0, v1, v2, v3
-            // UV.val[1] : u0, u1, u2, u3
-            int16x4x2_t const UV = vuzp_s16(vget_low_s16(t), vget_high_s16(t));
-
-			// tR : 128+409V
-			// tG : 128-100U-208V
-			// tB : 128+516U
-            int32x4_t const tR = vmlal_n_s16(rounding, UV.val[0], 409);
-            int32x4_t const tG = vmlal_n_s16(vmlal_n_s16(rounding, UV.val[1], -100), UV.val[0], -208);
-            int32x4_t const tB = vmlal_n_s16(rounding, UV.val[1], 516);
-
-            int32x4x2_t const R = vzipq_s32(tR, tR); // [tR0, tR0, tR1, tR1] [tR2, tR2, tR3, tR3]
-            int32x4x2_t const G = vzipq_s32(tG, tG); // [tG0, tG0, tG1, tG1] [tG2, tG2, tG3, tG3]
-            int32x4x2_t const B = vzipq_s32(tB, tB); // [tB0, tB0, tB1, tB1] [tB2, tB2, tB3, tB3]
-
-            // upper 8 pixels
-			trait::store_pixel_block(out, pblock,
-							vshrn_n_u16(vcombine_u16(vqmovun_s32(vaddq_s32(R.val[0], Y00)), vqmovun_s32(vaddq_s32(R.val[1], Y01))), 8),
-							vshrn_n_u16(vcombine_u16(vqmovun_s32(vaddq_s32(G.val[0], Y00)), vqmovun_s32(vaddq_s32(G.val[1], Y01))), 8),
-							vshrn_n_u16(vcombine_u16(vqmovun_s32(vaddq_s32(B.val[0], Y00)), vqmovun_s32(vaddq_s32(B.val[1], Y01))), 8));
-
-			// lower 8 pixels
-			trait::store_pixel_block(out+stride, pblock,
-							vshrn_n_u16(vcombine_u16(vqmovun_s32(vaddq_s32(R.val[0], Y10)), vqmovun_s32(vaddq_s32(R.val[1], Y11))), 8),
-							vshrn_n_u16(vcombine_u16(vqmovun_s32(vaddq_s32(G.val[0], Y10)), vqmovun_s32(vaddq_s32(G.val[1], Y11))), 8),
-							vshrn_n_u16(vcombine_u16(vqmovun_s32(vaddq_s32(B.val[0], Y10)), vqmovun_s32(vaddq_s32(B.val[1], Y11))), 8));
-        }
-    }
+	decode_yuv_rows<trait>(out, yuv, width, height, firstRow>>1, (firstRow+rowCount)>>1, alpha);
 	return true;
 }
-#endif
 
 //------------------------------------------------------------------------------
 class NV21toRGB {
 public:
 	enum { bytes_per_pixel = 3 };
-	
+
 	static void loadvu(int& U, int& V, unsigned char const* &uv) {
 		V = (*uv++) - 128;
         U = (*uv++) - 128;
@@ -154,16 +286,24 @@ public:
         *dst++ = (iG>0) ? (iG<65535 ? (iG>>8):0xff):0;
         *dst++ = (iB>0) ? (iB<65535 ? (iB>>8):0xff):0;
 	}
+#if defined(YUV2RGB_SSE2) || defined(YUV2RGB_NEON)
+	static void store_block(unsigned char* dst, Block r, Block g, Block b, unsigned char/*alpha*/) {
+		store_rgb_block(dst, r, g, b);
+	}
+#endif
 };
 bool nv21_to_rgb(unsigned char* rgb, unsigned char const* nv21, int width, int height) {
 	return decode_yuv<NV21toRGB>(rgb, nv21, width, height);
 }
+bool nv21_to_rgb_rows(unsigned char* rgb, unsigned char const* nv21, int width, int height, int firstRow, int rowCount) {
+	return decode_yuv_band<NV21toRGB>(rgb, nv21, width, height, firstRow, rowCount);
+}
 
 //------------------------------------------------------------------------------
 class NV21toRGBA {
 public:
 	enum { bytes_per_pixel = 4 };
-	
+
 	static void loadvu(int& U, int& V, unsigned char const* &uv) {
 		V = (*uv++) - 128;
         U = (*uv++) - 128;
@@ -174,55 +314,15 @@ public:
         *dst++ = (iB>0) ? (iB<65535 ? (iB>>8):0xff):0;
 		*dst++ = alpha;
 	}
+#if defined(YUV2RGB_SSE2) || defined(YUV2RGB_NEON)
+	static void store_block(unsigned char* dst, Block r, Block g, Block b, unsigned char alpha) {
+		store_rgba_block(dst, r, g, b, alpha);
+	}
+#endif
 };
 bool nv21_to_rgba(unsigned char* rgba, unsigned char alpha, unsigned char const* nv21, int width, int height) {
 	return decode_yuv<NV21toRGBA>(rgba, nv21, width, height, alpha);
 }
-
-#if 0
-//------------------------------------------------------------------------------
-class NV21toRGB_neon {
-public:
-	enum { bytes_per_pixel = 3 };
-	typedef uint8x8x3_t PixelBlock;
-	static PixelBlock const init_pixelblock(unsigned char /*fill_alpha*/) {
-		return uint8x8x3_t();
-	}
-	static uint8x8_t const loadvu(unsigned char const* uv) {
-		return vld1_u8(uv);
-	}
-	static void store_pixel_block(unsigned char* dst, PixelBlock& pblock, uint8x8_t const& r, uint8x8_t const& g, uint8x8_t const& b) {
-		pblock.val[0] = r;
-		pblock.val[1] = g;
-		pblock.val[2] = b;
-		vst3_u8(dst, pblock);
-	}
-};
-bool nv21_to_rgb_neon(unsigned char* rgb, unsigned char const* nv21, int width, int height) {
-	return decode_yuv_neon<NV21toRGB_neon>(rgb, nv21, width, height);
+bool nv21_to_rgba_rows(unsigned char* rgba, unsigned char alpha, unsigned char const* nv21, int width, int height, int firstRow, int rowCount) {
+	return decode_yuv_band<NV21toRGBA>(rgba, nv21, width, height, firstRow, rowCount, alpha);
 }
-
-//------------------------------------------------------------------------------
-class NV21toRGBA_neon {
-public:
-	enum { bytes_per_pixel = 4 };
-	typedef uint8x8x4_t PixelBlock;
-	static PixelBlock const init_pixelblock(unsigned char fill_alpha) {
-		PixelBlock pblock;
-		pblock.val[3] = vdup_n_u8(fill_alpha); // alpha channel in the last
-		return pblock;
-	}
-	static uint8x8_t const loadvu(unsigned char const* uv) {
-		return vld1_u8(uv);
-	}
-	static void store_pixel_block(unsigned char* dst, PixelBlock& pblock, uint8x8_t const& r, uint8x8_t const& g, uint8x8_t const& b) {
-		pblock.val[0] = r;
-		pblock.val[1] = g;
-		pblock.val[2] = b;
-		vst4_u8(dst, pblock);
-	}
-};
-bool nv21_to_rgba_neon(unsigned char* rgba, unsigned char alpha, unsigned char const* nv21, int width, int height) {
-	return decode_yuv_neon<NV21toRGBA_neon>(rgba, nv21, width, height, alpha);
-}
-#endif
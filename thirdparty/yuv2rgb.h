@@ -48,7 +48,6 @@ To convert Y'UV to RGB :
  */
 
 //
-// pure C implements...
 // [in]
 //		alpha : alpha value if rgba
 //		yuv : nv21 image(size=width*height*3/2)
@@ -57,40 +56,19 @@ To convert Y'UV to RGB :
 // [out]
 //      rgb : rgb buffer(size>=width*height*3) byte order : R0 G0 B0  R1 G1 B1  R2 G2 B2
 //		rgba : rgba buffer(size>=width*height*4) byte order : R0 G0 B0 A0  R1 G1 B1 A1  R2 G2 B2 A2
+//             (where A0, A1, A2... assigns alpha)
+//
+// 16 pixels of two rows are converted at a time with SSE2 or NEON (AArch64), unless
+// YUV2RGB_NO_SIMD is defined (same results as the scalar code), and the image is split
+// in bands of rows converted in parallel on the task pool (see util/parallel.h).
 bool nv21_to_rgb(unsigned char* rgb, unsigned char const* yuv, int width, int height);
 bool nv21_to_rgba(unsigned char* rgba, unsigned char alpha, unsigned char const* yuv, int width, int height);
 
 //
-// neon implements...
-// [in] 
-//		alpha : alpha value if rgba
-//		yuv : nv21 image(size=width*height*3/2)
-//      width : !!!must be multiple of 8!!! (NOTE:android graphics buffer ensure this)
-//      height : must be even
-// [out]
-//      rgb : rgb buffer(size>=width*height*3) byte order : R0 G0 B0  R1 G1 B1  R2 G2 B2
-//		rgba : rgba buffer(size>=width*height*4) byte order : R0 G0 B0 A0  R1 G1 B1 A1  R2 G2 B2 A2
-//             (where A0, A1, A2... assigns alpha)
-bool nv21_to_rgb_neon(unsigned char* rgb, unsigned char const* yuv, int width, int height);
-bool nv21_to_rgba_neon(unsigned char* rgba, unsigned char alpha, unsigned char const* yuv, int width, int height);
-
-//
-// to make the buile in android(activate neon), either...
-// method 1)
-//       ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
-//			LOCAL_CFLAGS += -DARM_NEON_ENABLE -mfpu=neon -flax-vector-conversions
-//       endif
-//       LOCAL_SRC_FILES += yuv2rgb.cpp
-//
-// (note ARM_NEON_ENABLE is defined, in case you'd like to exclude neon stuff from the build)
-//
-// method 2) (use funny suffix as NDK suggestted)
-//		ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
-//			LOCAL_CFLAGS += -DARM_NEON_ENABLE -flax-vector-conversions
-//			LOCAL_SRC_FILES += yuv2rgb.cpp.neon
-//		else
-//			LOCAL_SRC_FILES += yuv2rgb.cpp
-//		endif
-//
-// this compiles on GCC(android), Xcode(iOS).
+// same as above for the rows [firstRow, firstRow+rowCount) only, on the calling thread
+// (e.g. to convert a frame from several tasks, or as it arrives)
+// [in]
+//      firstRow, rowCount : must be even
+bool nv21_to_rgb_rows(unsigned char* rgb, unsigned char const* yuv, int width, int height, int firstRow, int rowCount);
+bool nv21_to_rgba_rows(unsigned char* rgba, unsigned char alpha, unsigned char const* yuv, int width, int height, int firstRow, int rowCount);
 #endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include "time_series.h"
+
+#include "dataset_manager.h"
+#include "gpu_resources.h"
+#include "util/file.h"
+
+#include <vtkImageData.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+	// Splits "pattern" around its "%d"
+	void splitPattern(const std::string& pattern, std::string& dir, std::string& prefix, std::string& suffix)
+	{
+		const std::size_t slash = pattern.rfind('/');
+		dir = (slash != std::string::npos ? pattern.substr(0, slash) : ".");
+		const std::string name = (slash != std::string::npos ? pattern.substr(slash+1) : pattern);
+
+		const std::size_t pos = name.find("%d");
+		if (pos == std::string::npos || name.find("%d", pos+2) != std::string::npos)
+			throw std::runtime_error("Invalid time series pattern (exactly one %d expected): " + pattern);
+
+		prefix = name.substr(0, pos);
+		suffix = name.substr(pos+2);
+	}
+
+	// ("digits" as in the matched file name, zero padding included)
+	std::string format(const std::string& pattern, const std::string& digits)
+	{
+		const std::size_t pos = pattern.find("%d");
+		android_assert(pos != std::string::npos);
+		return pattern.substr(0, pos) + digits + pattern.substr(pos+2);
+	}
+} // namespace
+
+TimeSeries::TimeSeries(const std::string& pattern, const std::string& velocityPattern, unsigned int ringSize)
+ : mRingSize(std::max(1u, ringSize)),
+   mRing(std::make_shared<Ring>())
+{
+	std::string dir, prefix, suffix;
+	splitPattern(pattern, dir, prefix, suffix);
+
+	for (const std::string& name : File::listDirectory(dir)) {
+		if (name.size() <= prefix.size() + suffix.size()
+		    || name.compare(0, prefix.size(), prefix) != 0
+		    || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+		{
+			continue;
+		}
+
+		const std::string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+		if (digits.find_first_not_of("0123456789") != std::string::npos)
+			continue;
+
+		Files files;
+		files.number = std::atoi(digits.c_str());
+		files.fileName = dir + "/" + name;
+		if (!velocityPattern.empty()) {
+			files.velocityFileName = format(velocityPattern, digits);
+			if (!File::exists(files.velocityFileName))
+				throw std::runtime_error("Missing velocity file: " + files.velocityFileName);
+		}
+		mFiles.push_back(files);
+	}
+
+	if (mFiles.empty())
+		throw std::runtime_error("No timestep found: " + pattern);
+
+	std::sort(mFiles.begin(), mFiles.end(), [](const Files& a, const Files& b) {
+		return a.number < b.number;
+	});
+
+	LOGD("time series: %u steps (%d to %d)", getStepCount(), mFiles.front().number, mFiles.back().number);
+}
+
+TimeSeries::~TimeSeries()
+{
+	// (the steps being decoded finish anyway, then are dropped with
+	// the ring)
+	tthread::lock_guard<tthread::mutex> g(mRing->lock);
+	for (auto& entry : mRing->slots)
+		entry.second.token.cancel();
+}
+
+TimeSeries::StepPtr TimeSeries::decode(unsigned int index, const std::string& fileName,
+                                       const std::string& velocityFileName)
+{
+	StepPtr step = std::make_shared<Step>();
+	step->index = index;
+	step->resources = std::make_shared<GpuResources>(DataSetManager::loadDataFile(fileName));
+	if (!velocityFileName.empty())
+		step->velocityField = std::make_shared<VelocityField>(DataSetManager::loadDataFile(velocityFileName));
+	return step;
+}
+
+void TimeSeries::seek(unsigned int index)
+{
+	android_assert(index < getStepCount());
+
+	const unsigned int count = std::min<unsigned int>(mRingSize, getStepCount());
+
+	tthread::lock_guard<tthread::mutex> g(mRing->lock);
+
+	// Drops the steps outside of the ring (the ones not decoded yet
+	// are cancelled)
+	for (auto it = mRing->slots.begin(); it != mRing->slots.end(); ) {
+		const unsigned int offset = (it->first + getStepCount() - index) % getStepCount();
+		if (offset < count) {
+			++it;
+		} else {
+			it->second.token.cancel();
+			mRing->slots.erase(it++);
+		}
+	}
+
+	for (unsigned int i = 0; i < count; ++i) {
+		const unsigned int step = (index + i) % getStepCount();
+		if (mRing->slots.count(step))
+			continue;
+
+		Slot& slot = mRing->slots[step];
+		slot.ready = false;
+
+		const std::shared_ptr<Ring> ring = mRing;
+		const Files files = mFiles[step];
+		const TaskPool::CancellationToken token = slot.token;
+
+		// (the current step is waited for, the next ones are prefetched)
+		TaskPool::submit([ring, step, files, token]() {
+			StepPtr result;
+			try {
+				result = decode(step, files.fileName, files.velocityFileName);
+			} catch (const std::exception& e) {
+				LOGE("Error decoding timestep %d: %s", files.number, e.what());
+			}
+
+			tthread::lock_guard<tthread::mutex> g(ring->lock);
+			auto it = ring->slots.find(step);
+			if (it == ring->slots.end() || token.isCancelled())
+				return; // (dropped meanwhile)
+			it->second.ready = true;
+			it->second.step = result;
+		}, (i == 0 ? TaskPool::INTERACTIVE : TaskPool::BACKGROUND), token);
+	}
+}
+
+bool TimeSeries::get(unsigned int index, StepPtr& step)
+{
+	tthread::lock_guard<tthread::mutex> g(mRing->lock);
+	auto it = mRing->slots.find(index);
+	if (it == mRing->slots.end() || !it->second.ready)
+		return false;
+	step = it->second.step;
+	return true;
+}
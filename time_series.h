@@ -0,0 +1,93 @@
+#ifndef TIME_SERIES_H
+#define TIME_SERIES_H
+
+#include "global.h"
+
+#include "particle_engine.h"
+#include "util/task_pool.h"
+
+#include "thirdparty/tinythread.h"
+
+#include <map>
+
+// Timesteps of a simulation run, one dataset file per step (and an
+// optional velocity file with the same step number). The steps around
+// the current one are decoded in the background (read, converted into
+// GpuResources and VelocityField) and kept in a bounded ring, so that
+// playing the run only costs one texture update per step (see
+// GpuResources::replaceData()).
+class TimeSeries
+{
+public:
+	struct Step
+	{
+		unsigned int index;
+		GpuResourcesSharedPtr resources; // (never bound, only handed to replaceData())
+		VelocityFieldSharedPtr velocityField; // (null without velocity files)
+	};
+
+	typedef std::shared_ptr<Step> StepPtr;
+
+	// "pattern" is the path of the scalar files, "%d" standing for
+	// the step number (e.g. "data/run/FTLE%d.vtk"): every matching
+	// file of the directory is a step, by increasing number. The
+	// optional "velocityPattern" gives the velocity file of each
+	// step the same way, with the digits of the scalar file name
+	// (e.g. "0001": zero padding is kept). Throws if there is no
+	// step, or if a velocity file is missing.
+	// At most "ringSize" decoded steps are kept in memory.
+	TimeSeries(const std::string& pattern, const std::string& velocityPattern = "",
+	           unsigned int ringSize = 8);
+	~TimeSeries();
+
+	unsigned int getStepCount() const { return mFiles.size(); }
+	int getStepNumber(unsigned int index) const { return mFiles.at(index).number; }
+	const std::string& getFileName(unsigned int index) const { return mFiles.at(index).fileName; }
+	const std::string& getVelocityFileName(unsigned int index) const { return mFiles.at(index).velocityFileName; }
+
+	// Makes "index" the current step: the ring then holds the next
+	// ringSize steps from "index" (looping at the end of the run).
+	// The other steps are dropped, and the missing ones are decoded
+	// in the background, the current one first.
+	// (render thread)
+	void seek(unsigned int index);
+
+	// Returns true when "index" has been decoded, "step" being null
+	// if it couldn't be (render thread)
+	bool get(unsigned int index, StepPtr& step);
+
+	// Decodes the given files (any thread, throws on error)
+	static StepPtr decode(unsigned int index, const std::string& fileName,
+	                      const std::string& velocityFileName);
+
+private:
+	TimeSeries(const TimeSeries&); // not implemented
+	void operator=(const TimeSeries&); // not implemented
+
+	struct Files
+	{
+		int number;
+		std::string fileName, velocityFileName;
+	};
+
+	struct Slot
+	{
+		bool ready;
+		StepPtr step; // (null if not ready, or if the step couldn't be decoded)
+		TaskPool::CancellationToken token;
+	};
+
+	// Slots of the steps in the ring, shared with the decoding tasks
+	// (which may finish after the destruction of the series)
+	struct Ring
+	{
+		tthread::mutex lock;
+		std::map<unsigned int, Slot> slots;
+	};
+
+	std::vector<Files> mFiles;
+	const unsigned int mRingSize;
+	std::shared_ptr<Ring> mRing;
+};
+
+#endif /* TIME_SERIES_H */
@@ -0,0 +1,76 @@
+#include "transfer_function.h"
+
+#include "util/parallel.h"
+
+#include <vtkDataArray.h>
+
+namespace {
+	// Values mapped by each task
+	const std::size_t taskSize = 1 << 16;
+
+	template <typename T>
+	void applyLut(const T* src, int components, std::size_t count, float min, float scale,
+	              const uint32_t* lut, uint32_t* dst)
+	{
+		const float maxIndex = TransferFunction::lutSize-1;
+		for (std::size_t i = 0; i < count; ++i) {
+			float f = (float(src[i*components]) - min) * scale;
+			f = (f > 0.0f ? std::min(f, maxIndex) : 0.0f); // (also catches NaNs)
+			dst[i] = lut[int(f + 0.5f)];
+		}
+	}
+} // namespace
+
+TransferFunction::TransferFunction(float alphaOffset, float alphaScale)
+ : mLut(lutSize)
+{
+	for (int i = 0; i < lutSize; ++i) {
+		double norm = double(i) / (lutSize-1);
+		float r, g, b;
+		colormap(norm, r, g, b);
+		unsigned char* rgba = reinterpret_cast<unsigned char*>(&mLut[i]);
+		rgba[0] = r*255;
+		rgba[1] = g*255;
+		rgba[2] = b*255;
+		rgba[3] = (alphaOffset + alphaScale*norm)*255;
+	}
+}
+
+void TransferFunction::apply(vtkDataArray* scalars, const double range[2], unsigned char* rgba) const
+{
+	android_assert(scalars);
+
+	const std::size_t count = scalars->GetNumberOfTuples();
+	const float min = range[0];
+	const float scale = (range[1] > range[0] ? (lutSize-1) / (range[1]-range[0]) : 0);
+	const void* src = scalars->GetVoidPointer(0);
+	const int components = scalars->GetNumberOfComponents();
+	uint32_t* dst = reinterpret_cast<uint32_t*>(rgba);
+
+	Parallel::forEach(0, (count + taskSize-1) / taskSize, [&](int task) {
+		const std::size_t first = task*taskSize;
+		const std::size_t n = std::min(taskSize, count - first);
+		switch (scalars->GetDataType()) {
+			vtkTemplateMacro(
+				applyLut(static_cast<const VTK_TT*>(src) + first*components, components,
+				         n, min, scale, mLut.data(), dst + first)
+			);
+			default:
+				throw std::runtime_error("TransferFunction: unsupported scalar type");
+		}
+	});
+}
+
+void TransferFunction::colormap(double value, float& r, float& g, float& b_)
+{
+	float value4 = 4.0f * value;
+	float a =  value4 - 1.5f;
+	float b = -value4 + 4.5f;
+	float c =  value4 - 0.5f;
+	float d = -value4 + 3.5f;
+	float e =  value4 + 0.5f;
+	float f = -value4 + 2.5f;
+	r  = std::min(std::max(std::min(a,b), 0.0f), 1.0f);
+	g  = std::min(std::max(std::min(c,d), 0.0f), 1.0f);
+	b_ = std::min(std::max(std::min(e,f), 0.0f), 1.0f);
+}
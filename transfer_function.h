@@ -0,0 +1,40 @@
+#ifndef TRANSFER_FUNCTION_H
+#define TRANSFER_FUNCTION_H
+
+#include "global.h"
+
+#include <cstdint>
+#include <algorithm>
+
+class vtkDataArray;
+
+// "Jet" color map with a linear opacity ramp, tabulated as RGBA
+// colors over the normalized [0,1] value range
+class TransferFunction
+{
+public:
+	static const int lutSize = 4096;
+
+	// alpha = alphaOffset + alphaScale*value
+	TransferFunction(float alphaOffset, float alphaScale);
+
+	// Maps the first component of "scalars" to RGBA colors ("rgba"
+	// must hold 4 bytes per tuple), "range" being the scalar range
+	// mapped to [0,1] (multithreaded)
+	void apply(vtkDataArray* scalars, const double range[2], unsigned char* rgba) const;
+
+	// RGBA colors of lutSize values evenly spread over [0,1]
+	const uint32_t* getLut() const { return mLut.data(); }
+
+	// Alpha (0..255) of the given normalized value
+	unsigned char getAlpha(float value) const
+	{ return reinterpret_cast<const unsigned char*>(&mLut[int(std::min(std::max(value, 0.0f), 1.0f)*(lutSize-1) + 0.5f)])[3]; }
+
+	// "Jet" color map (http://www.metastine.com/?p=7)
+	static void colormap(double value, float& r, float& g, float& b);
+
+private:
+	std::vector<uint32_t> mLut; // (RGBA bytes packed in memory order)
+};
+
+#endif /* TRANSFER_FUNCTION_H */
@@ -8,117 +8,151 @@
 #include <stdio.h>
 #include <string>
 #include <stdlib.h>
-
-
-udp_server::udp_server(){
-	int i ;
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstddef>
+#include <cerrno>
+#include <climits>
+#include "util/pose_prediction.h"
+#include "util/profiler.h"
+
+
+namespace {
+	udp_server::TrackerState initialState()
+	{
+		udp_server::TrackerState s;
+		//s.dataMatrix = Matrix4::makeTransform(Vector3(0, 0, 380));
+		s.dataMatrix = Matrix4::makeTransform(Vector3(0, 0, 400), Quaternion(Vector3::unitX(), -M_PI/4)*Quaternion(Vector3::unitZ(), 0));//,Matrix4::makeTransform(Vector3(0, 0, 400)));
+		s.sliceMatrix = Matrix4::makeTransform(Vector3(0, 0, 400));
+		s.seedPoint = Vector3(-1,-1,-1);
+		s.dataset = 1;
+		s.zoomFactor = 1;
+		s.showVolume = s.showSurface = s.showStylus = s.showSlice = s.showOutline = true;
+		s.considerX = s.considerY = s.considerZ = 1;
+		s.serial = 0;
+		s.receivedTimeNs = 0;
+		s.historyCount = 0;
+		return s;
+	}
+} // namespace
+
+udp_server::udp_server()
+ : offsetCount(0),
+   messageCount(0), historyCount(0),
+   receivedCount(0), supersededCount(0), malformedCount(0), reorderedCount(0), lostCount(0),
+   hasHighestSequence(false), highestSequence(0),
+   hasLastSequence(false), lastSequence(0), lastOrder(0),
+   current(initialState()),
+   state(initialState()),
+   recordFile(nullptr), lastRecordNs(0),
+   replayFile(nullptr), replaySpeed(1.0f), replayDone(false),
+   stopping(false)
+{
 	port = 8888 ;
+	sock = -1 ;
 	slen = sizeof(si_other) ;
-	initSocket();
-	previousMessage = "" ;
-	hasDataChanged = false ;
-	//dataMatrix = Matrix4::makeTransform(Vector3(0, 0, 380));
-	dataMatrix = Matrix4::makeTransform(Vector3(0, 0, 400), Quaternion(Vector3::unitX(), -M_PI/4)*Quaternion(Vector3::unitZ(), 0));//,Matrix4::makeTransform(Vector3(0, 0, 400)));
-	sliceMatrix = Matrix4::makeTransform(Vector3(0, 0, 400));
-	seedPoint = Vector3(-1,-1,-1);
-	zoomingFactor = 1 ;
+	std::fill(changeOrder, changeOrder + fieldCount, LLONG_MIN);
 }
 
-udp_server::udp_server(int p){
-	int i ;
+udp_server::udp_server(int p)
+ : offsetCount(0),
+   messageCount(0), historyCount(0),
+   receivedCount(0), supersededCount(0), malformedCount(0), reorderedCount(0), lostCount(0),
+   hasHighestSequence(false), highestSequence(0),
+   hasLastSequence(false), lastSequence(0), lastOrder(0),
+   current(initialState()),
+   state(initialState()),
+   recordFile(nullptr), lastRecordNs(0),
+   replayFile(nullptr), replaySpeed(1.0f), replayDone(false),
+   stopping(false)
+{
 	port = p ;
+	sock = -1 ;
 	slen = sizeof(si_other) ;
-	initSocket();
-	previousMessage = "" ;
-	hasDataChanged = false ;
-	//dataMatrix = Matrix4::makeTransform(Vector3(0, 0, 380));
-	dataMatrix = Matrix4::makeTransform(Vector3(0, 0, 400), Quaternion(Vector3::unitX(), -M_PI/4)*Quaternion(Vector3::unitZ(), 0));//,Matrix4::makeTransform(Vector3(0, 0, 400)));
-	sliceMatrix = Matrix4::makeTransform(Vector3(0, 0, 400));
-	seedPoint = Vector3(-1,-1,-1);
-	zoomingFactor = 1 ;
+	std::fill(changeOrder, changeOrder + fieldCount, LLONG_MIN);
 }
 
 udp_server::~udp_server(){
-	//close(sock);
+	// (the thread writes to recordFile)
+	stop();
+
+	if (sock != -1)
+		close(sock);
+	if (recordFile)
+		std::fclose(recordFile);
+	if (replayFile)
+		std::fclose(replayFile);
 }
 
-Matrix4 udp_server::getDataMatrix(){
-	//std::cout << "Get Data Matrix " << std::endl ;
-
-	hasDataChanged = false ;
-	
-	Matrix4 m ;
-	synchronized(dataMatrix){
-		m = dataMatrix ;
-	}
-	return m ;
+udp_server::TrackerState udp_server::getState(){
+	state.update();
+	return state.front();
 }
 
-Matrix4 udp_server::getSliceMatrix(){
-	Matrix4 m ;
-	synchronized(sliceMatrix){
-		m = sliceMatrix ;
-	}
-	return sliceMatrix;
-}
-
-Vector3 udp_server::getSeedPoint(){
-	Vector3 v ;
-	synchronized(seedPoint){
-		v = seedPoint ;
+void udp_server::TrackerState::predict(long long targetNs, Matrix4& dataMatrix, Matrix4& sliceMatrix) const{
+	dataMatrix = this->dataMatrix;
+	sliceMatrix = this->sliceMatrix;
+
+	if (historyCount < 2 || targetNs - history[0].timeNs > maxPoseAgeNs)
+		return;
+
+	// Velocities are computed over a long enough interval to limit
+	// the effect of tracking noise
+	const PoseSample& newer = history[0];
+	const PoseSample* older = &history[historyCount-1];
+	for (int i = 1; i < historyCount; ++i) {
+		if (newer.timeNs - history[i].timeNs >= minVelocityIntervalNs) {
+			older = &history[i];
+			break;
+		}
 	}
-	return udp_server::seedPoint ;
-}
 
-int udp_server::getDataSet(){
-	hasDataSetChanged = false ;
-	return dataset ;
-}
+	const long long t = std::min(targetNs, newer.timeNs + maxPredictionNs);
+	if (t <= newer.timeNs)
+		return;
 
-float udp_server::getZoomFactor(){
-	return zoomingFactor ;
+	dataMatrix = PosePrediction::extrapolate(older->dataMatrix, older->timeNs, newer.dataMatrix, newer.timeNs, t);
+	sliceMatrix = PosePrediction::extrapolate(older->sliceMatrix, older->timeNs, newer.sliceMatrix, newer.timeNs, t);
 }
 
-bool udp_server::getShowVolume(){
-	return this->showVolume ;
+udp_server::Stats udp_server::getStats(){
+	Stats stats;
+	stats.received = receivedCount;
+	stats.superseded = supersededCount;
+	stats.malformed = malformedCount;
+	stats.reordered = reorderedCount;
+	stats.lost = lostCount;
+	return stats;
 }
 
-bool udp_server::getShowSurface(){
-	return this->showSurface ;
-}
 
-bool udp_server::getShowStylus(){
-	return this->showStylus ;
+void udp_server::start(){
+	android_assert(!thread.joinable());
+	stopping = false;
+	thread = std::thread(replayFile ? &udp_server::replay : &udp_server::listen, this);
 }
 
-bool udp_server::getShowSlice(){
-	return this->showSlice ;
+void udp_server::stop(){
+	stopping = true;
+	if (thread.joinable())
+		thread.join();
 }
 
-bool udp_server::getShowOutline(){
-	return this->showOutline ;
-}
-
-short udp_server::getConsiderX(){
-	return this->considerX;
-}
-
-short udp_server::getConsiderY(){
-	return this->considerY;
-}
-
-short udp_server::getConsiderZ(){
-	return this->considerZ;
-}
-
-
-void udp_server::initSocket(){
+bool udp_server::initSocket(){
 	//create a UDP socket
 	if ((sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
 	{
-		std::cerr << "Socket" << std::endl ;
+		LOGE("Unable to create the UDP socket: %s", std::strerror(errno));
+		return false;
 	}
 
+	//wake up regularly to check "stopping"
+	timeval timeout;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = receiveTimeoutMs * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
 
 	//To make non-blocking ;) 
 	//int flags = fcntl(sock, F_GETFL);
@@ -135,136 +169,439 @@ void udp_server::initSocket(){
 	//bind socket to port
 	if( bind(sock , (struct sockaddr*)&si_me, sizeof(si_me) ) == -1)
 	{
-		std::cerr << "Bind" << std::endl ;
+		LOGE("Unable to bind the UDP socket to port %d: %s", port, std::strerror(errno));
+		close(sock);
+		sock = -1;
+		return false;
 	}
+
+	return true;
 }
 
 /*void* udp_server::launch_listen(void* args){
 	listen((udp_server) args);
 }*/
 
+namespace {
+	const char logMagic[4] = { 'F', 'L', 'U', 'R' };
+	const uint32_t logVersion = 1;
+
+	struct LogHeader
+	{
+		char magic[4];
+		uint32_t version;
+	};
+
+	static_assert(sizeof(LogHeader) == 8, "unexpected log header size");
+
+	static_assert(offsetof(udp_server::Packet, sequence) == udp_server::packetSizeV1, "udp_server::Packet must not be padded");
+	static_assert(sizeof(udp_server::Packet) == 176, "udp_server::Packet must not be padded");
+
+	// Reads the next ';'-separated number, in place
+	bool nextNumber(const char*& p, double& value)
+	{
+		char* end;
+		value = std::strtod(p, &end);
+		if (end == p)
+			return false;
+		p = (*end == ';' ? end+1 : end);
+		return true;
+	}
+
+	// Sets a discrete field, unless the message is stale and a newer
+	// one has changed it. Returns true if the field changed.
+	template <typename T>
+	bool updateField(T& field, T value, bool stale, long long order, long long& changeOrder)
+	{
+		if (field == value || (stale && order <= changeOrder))
+			return false;
+		field = value;
+		changeOrder = order;
+		return true;
+	}
+
+	bool nextNumbers(const char*& p, float* values, int count)
+	{
+		double value;
+		for (int i = 0; i < count; ++i) {
+			if (!nextNumber(p, value))
+				return false;
+			values[i] = value;
+		}
+		return true;
+	}
+} // namespace
+
+bool udp_server::decodeBinary(const char* data, int len, Message& msg){
+	if (len < int(packetSizeV1))
+		return false;
+
+	// (copied since "data" is not necessarily aligned)
+	Packet packet;
+	std::memset(&packet, 0, sizeof(Packet));
+	std::memcpy(&packet, data, std::min<std::size_t>(len, sizeof(Packet)));
+	if (packet.magic != packetMagic || packet.version < 1 || packet.version > packetVersion)
+		return false;
+	if (packet.version >= 2 && len < int(sizeof(Packet)))
+		return false;
+
+	msg.dataset = packet.dataset;
+	msg.zoomFactor = packet.zoomFactor;
+	msg.showVolume  = (packet.flags & ShowVolume);
+	msg.showSurface = (packet.flags & ShowSurface);
+	msg.showStylus  = (packet.flags & ShowStylus);
+	msg.showSlice   = (packet.flags & ShowSlice);
+	msg.showOutline = (packet.flags & ShowOutline);
+	std::memcpy(msg.dataMatrix, packet.dataMatrix, sizeof(msg.dataMatrix));
+	std::memcpy(msg.sliceMatrix, packet.sliceMatrix, sizeof(msg.sliceMatrix));
+	std::memcpy(msg.seedPoint, packet.seedPoint, sizeof(msg.seedPoint));
+	msg.considerX = ((packet.considerAxes & ConsiderX) ? 1 : 0);
+	msg.considerY = ((packet.considerAxes & ConsiderY) ? 1 : 0);
+	msg.considerZ = ((packet.considerAxes & ConsiderZ) ? 1 : 0);
+	msg.hasTimestamp = (packet.version >= 2);
+	msg.timestampNs = packet.timestampUs * 1000;
+	msg.hasSequence = (packet.version >= 2);
+	msg.sequence = packet.sequence;
+	return true;
+}
+
+bool udp_server::decodeText(const char* data, Message& msg){
+	const char* p = data;
+	double value;
+	bool* const flags[5] = { &msg.showVolume, &msg.showSurface, &msg.showStylus, &msg.showSlice, &msg.showOutline };
+	short* const axes[3] = { &msg.considerX, &msg.considerY, &msg.considerZ };
+
+	//First we set the dataset, then the zooming Factor
+	if (!nextNumber(p, value))
+		return false;
+	msg.dataset = value;
+	if (!nextNumber(p, value))
+		return false;
+	msg.zoomFactor = value;
+
+	//Get the booleans
+	for (bool* flag : flags) {
+		if (!nextNumber(p, value))
+			return false;
+		*flag = (value != 0);
+	}
+
+	//Then the matrices and seeding point
+	if (!nextNumbers(p, msg.dataMatrix, 16)
+	    || !nextNumbers(p, msg.sliceMatrix, 16)
+	    || !nextNumbers(p, msg.seedPoint, 3))
+		return false;
+
+	//Finally the constrains on axis
+	for (short* axis : axes) {
+		if (!nextNumber(p, value))
+			return false;
+		*axis = value;
+	}
+
+	//And the optional timestamp
+	msg.hasTimestamp = nextNumber(p, value);
+	msg.timestampNs = (msg.hasTimestamp ? (long long)(value * 1e9) : 0);
+	msg.hasSequence = false;
+	msg.sequence = 0;
+
+	return true;
+}
+
+long long udp_server::toLocalTime(long long senderNs, long long arrivalNs){
+	offsets[offsetCount++ % offsetWindow] = arrivalNs - senderNs;
+	const long long offset = *std::min_element(offsets, offsets + (offsetCount < offsetWindow ? offsetCount : offsetWindow));
+	if (offsetCount >= 2*offsetWindow)
+		offsetCount -= offsetWindow; // (avoids overflows)
+	return senderNs + offset;
+}
+
+void udp_server::apply(const Message& msg, long long receivedTimeNs){
+	const long long timeNs = (msg.hasTimestamp ? toLocalTime(msg.timestampNs, receivedTimeNs) : receivedTimeNs);
+
+	long long order;
+	bool stale;
+	if (msg.hasSequence && hasLastSequence) {
+		// (wraps around)
+		const int32_t delta = int32_t(msg.sequence - lastSequence);
+		order = lastOrder + delta;
+		stale = (delta <= 0);
+	} else {
+		order = timeNs;
+		stale = (historyCount > 0 && timeNs <= history[0].timeNs);
+	}
+
+	TrackerState& s = current;
+	bool changed = false;
+	changed |= updateField(s.dataset, msg.dataset, stale, order, changeOrder[DatasetField]);
+	changed |= updateField(s.showVolume, msg.showVolume, stale, order, changeOrder[ShowVolumeField]);
+	changed |= updateField(s.showSurface, msg.showSurface, stale, order, changeOrder[ShowSurfaceField]);
+	changed |= updateField(s.showStylus, msg.showStylus, stale, order, changeOrder[ShowStylusField]);
+	changed |= updateField(s.showSlice, msg.showSlice, stale, order, changeOrder[ShowSliceField]);
+	changed |= updateField(s.showOutline, msg.showOutline, stale, order, changeOrder[ShowOutlineField]);
+	changed |= updateField(s.considerX, msg.considerX, stale, order, changeOrder[ConsiderXField]);
+	changed |= updateField(s.considerY, msg.considerY, stale, order, changeOrder[ConsiderYField]);
+	changed |= updateField(s.considerZ, msg.considerZ, stale, order, changeOrder[ConsiderZField]);
+
+	if (stale) {
+		// (the pose is older than the last one)
+		++supersededCount;
+		if (!changed)
+			return;
+
+	} else {
+		hasLastSequence = msg.hasSequence;
+		lastSequence = msg.sequence;
+		lastOrder = order;
+
+		std::copy_backward(history, history + std::min(historyCount, TrackerState::historySize-1),
+		                   history + std::min(historyCount+1, int(TrackerState::historySize)));
+		history[0].dataMatrix = Matrix4(msg.dataMatrix);
+		history[0].sliceMatrix = Matrix4(msg.sliceMatrix);
+		history[0].timeNs = timeNs;
+		historyCount = std::min(historyCount+1, int(TrackerState::historySize));
+
+		s.dataMatrix = Matrix4(msg.dataMatrix) ;
+		s.sliceMatrix = Matrix4(msg.sliceMatrix) ;
+		s.seedPoint = Vector3(msg.seedPoint) ;
+		s.zoomFactor = msg.zoomFactor;
+		std::copy(history, history + historyCount, s.history);
+		s.historyCount = historyCount;
+	}
+
+	s.serial = ++messageCount;
+	s.receivedTimeNs = receivedTimeNs;
+	state.back() = s;
+	state.publish();
+}
+
 void udp_server::listen(){
-	std::cout << "--> Server Start Listening" << std::endl ;
-	while(1)
-    	{
-		//rintf("Waiting for data...");
-		fflush(stdout);
-		memset(buf,'\0', BUFLEN);
-
-		//try to receive some data, this is a blocking call
-		if ((recv_len = recvfrom(sock, buf, BUFLEN, 0, (struct sockaddr *) &si_other, &slen)) == -1)
-		{
-			//std::cerr << "Received" << std::endl ;
+	if (!initSocket())
+		return;
+	LOGI("UDP server listening");
+
+	mmsghdr msgs[BATCHSIZE];
+	iovec iovecs[BATCHSIZE];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < BATCHSIZE; ++i) {
+		// (one byte is kept for the terminating null of text messages)
+		iovecs[i].iov_base = buf[i];
+		iovecs[i].iov_len = BUFLEN-1;
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	Message msg, candidate;
+	while(!stopping)
+	{
+		//wait for at least one datagram, then drain the socket without
+		//blocking: only the newest valid message is applied, so that
+		//queued poses don't add up to the input latency
+		bool valid = false;
+		long long receivedTimeNs = 0;
+		int flags = MSG_WAITFORONE;
+		int count;
+		while ((count = recvmmsg(sock, msgs, BATCHSIZE, flags, nullptr)) > 0) {
+			receivedTimeNs = Utility::currentTimeNs();
+			receivedCount += count;
+
+			int lengths[BATCHSIZE];
+			for (int i = 0; i < count; ++i)
+				lengths[i] = msgs[i].msg_len;
+			if (recordFile)
+				record(lengths, count, receivedTimeNs);
+
+			if (decodeNewest(lengths, count, candidate)) {
+				// (the previous batch, unless it has a higher sequence
+				// number)
+				if (valid)
+					++supersededCount;
+				if (!valid || !msg.hasSequence || !candidate.hasSequence
+				    || int32_t(candidate.sequence - msg.sequence) > 0)
+					msg = candidate;
+				valid = true;
+			}
+
+			if (count < BATCHSIZE)
+				break;
+			flags = MSG_DONTWAIT;
+		}
+
+		//EAGAIN: timeout (or socket drained), see initSocket()
+		if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			LOGE("UDP receive failed: %s", std::strerror(errno));
+			return;
 		}
-		 
-		//print details of the client/peer and the data received
-		std::string msg = buf ;
-		std::stringstream ss(msg);
-		
-		std::string tok;
-		int nbOfElementsToParseFirst = 7 ;
-		int i = nbOfElementsToParseFirst ;	
-		//double allvalues[NUMBEROFITEMSINMESSAGE];
-		float oMatrix[16];
-		float pMatrix[16];
-		float seed[3];
-		int datast = -1 ;
-
-		int tmpbool = -1 ;
-		
-		std::cout << "Message = " << msg << std::endl ;
-		
-		//First we set the dataset
-		getline(ss, tok, ';');
-		datast = std::stoi(tok.c_str());
-
-		//Then the zooming Factor
-		getline(ss, tok, ';');
-		zoomingFactor = std::stod(tok.c_str());
-
-		//Get the booleans
-		getline(ss, tok, ';');
-		tmpbool = std::stoi(tok.c_str());
-		showVolume = (tmpbool == 0 )? false : true ;
-		getline(ss, tok, ';');
-		tmpbool = std::stoi(tok.c_str());
-		showSurface = (tmpbool == 0 )? false : true ;
-		getline(ss, tok, ';');
-		tmpbool = std::stoi(tok.c_str());
-		showStylus = (tmpbool == 0 )? false : true ;
-		getline(ss, tok, ';');
-		tmpbool = std::stoi(tok.c_str());
-		showSlice = (tmpbool == 0 )? false : true ;
-		getline(ss, tok, ';');
-		tmpbool = std::stoi(tok.c_str());
-		showOutline = (tmpbool == 0 )? false : true ;
-
-		//Finally the matrices and seeding point
-		getline(ss, tok, ';');
-		do{
-			//std::cout << "i = " << i << " -> " << tok << std::endl ;
-			oMatrix[i-nbOfElementsToParseFirst] = std::stod(tok.c_str());
-			i++ ;
-		}while(getline(ss, tok, ';') && i < 16+nbOfElementsToParseFirst );
-		//std::cout << "Object Matrix Constructed " << std::endl ;
-		//std::cout << "Remaining Line = " << ss << std::endl ;
-		//sleep(2);
-
-
-		do{
-		//	std::cout << "i = " << i << " -> " << tok << std::endl ;
-			pMatrix[i-nbOfElementsToParseFirst-16] = std::stod(tok.c_str());
-			i++ ;
-		}while(getline(ss, tok, ';') && i < 32+nbOfElementsToParseFirst );
-		//std::cout << "Plane Matrix Constructed " << std::endl ;
-		//sleep(2);
-		
-
-		do{
-			//std::cout << "i = " << i << " -> " << tok << std::endl ;
-			seed[i-32-nbOfElementsToParseFirst] = std::stod(tok.c_str());
-			i++ ;
-		}while(getline(ss, tok, ';') && i < 35+nbOfElementsToParseFirst );
-		//sleep(2);
-		//std::cout << "Seed Point Constructed " << std::endl ;
-
-
-		synchronized(dataMatrix){
-			dataMatrix = Matrix4(oMatrix) ;
-			//printAny(dataMatrix, "dataMatrix = ");
+
+		if (valid)
+			apply(msg, receivedTimeNs);
+	}
+}
+
+bool udp_server::decodeNewest(const int* lengths, int count, Message& msg){
+	PROFILE_SCOPE("udp parse");
+	Message other;
+	bool found = false;
+	for (int i = count-1; i >= 0; --i) {
+		if (found && !msg.hasSequence) {
+			// (the older messages of this batch)
+			supersededCount += i+1;
+			break;
+		}
+
+		buf[i][lengths[i]] = '\0';
+		Message& m = (found ? other : msg);
+		if (!decodeBinary(buf[i], lengths[i], m) && !decodeText(buf[i], m)) {
+			++malformedCount;
+			continue;
+		}
+
+		if (!found) {
+			found = true;
+			continue;
+		}
+
+		// Datagrams reordered within the batch: the highest sequence
+		// number wins
+		++supersededCount;
+		if (other.hasSequence && int32_t(other.sequence - msg.sequence) > 0)
+			msg = other;
+	}
+
+	// (arrival order)
+	for (int i = 0; i < count; ++i) {
+		Packet packet;
+		if (lengths[i] >= int(sizeof(Packet))) {
+			std::memcpy(&packet, buf[i], sizeof(Packet));
+			if (packet.magic == packetMagic && packet.version >= 2 && packet.version <= packetVersion)
+				countSequence(packet.sequence);
+		}
+	}
+
+	return found;
+}
+
+void udp_server::countSequence(uint32_t sequence){
+	if (hasHighestSequence) {
+		const int32_t delta = int32_t(sequence - highestSequence);
+		if (delta <= 0) {
+			// (late: fills a gap counted before)
+			++reorderedCount;
+			if (delta < 0 && lostCount > 0)
+				--lostCount;
+			return;
 		}
-		synchronized(sliceMatrix){
-			sliceMatrix = Matrix4(pMatrix) ;
-			//printAny(sliceMatrix, "sliceMatrix = ");
+		lostCount += delta-1;
+	}
+
+	hasHighestSequence = true;
+	highestSequence = sequence;
+}
+
+void udp_server::startRecording(const std::string& fileName){
+	android_assert(!recordFile);
+
+	recordFile = std::fopen(fileName.c_str(), "wb");
+	if (!recordFile)
+		throw std::runtime_error("Unable to create session log: " + fileName);
+
+	LogHeader header;
+	std::memcpy(header.magic, logMagic, sizeof(logMagic));
+	header.version = logVersion;
+	if (std::fwrite(&header, sizeof(header), 1, recordFile) != 1)
+		throw std::runtime_error("Unable to write session log: " + fileName);
+
+	lastRecordNs = Utility::currentTimeNs();
+	LOGI("Recording session to %s", fileName.c_str());
+}
+
+void udp_server::record(const int* lengths, int count, long long receivedTimeNs){
+	const long long deltaUs = std::max(0LL, (receivedTimeNs - lastRecordNs) / 1000);
+	lastRecordNs = receivedTimeNs;
+
+	for (int i = 0; i < count; ++i) {
+		// (all the datagrams of a batch arrived at the same time)
+		const uint32_t delay = (i == 0 ? uint32_t(std::min<long long>(deltaUs, UINT32_MAX)) : 0);
+		const uint16_t length = lengths[i];
+		std::fwrite(&delay, sizeof(delay), 1, recordFile);
+		std::fwrite(&length, sizeof(length), 1, recordFile);
+		std::fwrite(buf[i], 1, length, recordFile);
+	}
+	// (the log is complete even if the app is killed)
+	std::fflush(recordFile);
+}
+
+void udp_server::openReplay(const std::string& fileName, float speed){
+	android_assert(!replayFile && speed > 0);
+
+	replayFile = std::fopen(fileName.c_str(), "rb");
+	if (!replayFile)
+		throw std::runtime_error("Unable to open session log: " + fileName);
+
+	LogHeader header;
+	if (std::fread(&header, sizeof(header), 1, replayFile) != 1
+	    || std::memcmp(header.magic, logMagic, sizeof(logMagic)) != 0
+	    || header.version != logVersion)
+	{
+		std::fclose(replayFile);
+		replayFile = nullptr;
+		throw std::runtime_error("Invalid session log: " + fileName);
+	}
+
+	replaySpeed = speed;
+	LOGI("Replaying session from %s (x%.1f)", fileName.c_str(), speed);
+}
+
+void udp_server::replay(){
+	android_assert(replayFile);
+
+	// Datagrams due at the same time are decoded as one batch, as if
+	// they had been queued in the socket
+	const long long startNs = Utility::currentTimeNs();
+	long long logTimeUs = 0;
+	int lengths[BATCHSIZE];
+	int count = 0;
+	Message msg;
+
+	auto flush = [&]() {
+		if (count == 0)
+			return;
+		const long long receivedTimeNs = Utility::currentTimeNs();
+		receivedCount += count;
+		if (decodeNewest(lengths, count, msg))
+			apply(msg, receivedTimeNs);
+		count = 0;
+	};
+
+	while (!stopping) {
+		uint32_t delay;
+		uint16_t length;
+		if (std::fread(&delay, sizeof(delay), 1, replayFile) != 1
+		    || std::fread(&length, sizeof(length), 1, replayFile) != 1)
+			break;
+		if (length > BUFLEN-1) {
+			LOGE("Invalid session log record (%u bytes)", length);
+			break;
 		}
-		synchronized(seedPoint){
-			seedPoint = Vector3(seed) ;
+
+		logTimeUs += delay;
+		const long long dueNs = startNs + (long long)(logTimeUs * 1000 / replaySpeed);
+		const long long waitNs = dueNs - Utility::currentTimeNs();
+		if (waitNs > 0 || count == BATCHSIZE) {
+			flush();
+			// (in steps, so that stop() doesn't wait for long pauses)
+			for (long long remainingNs = waitNs; remainingNs > 0 && !stopping; remainingNs = dueNs - Utility::currentTimeNs())
+				tthread::this_thread::sleep_for(tthread::chrono::microseconds(std::min(remainingNs, receiveTimeoutMs * 1000000LL) / 1000));
 		}
-		if(dataset!= datast){
-			dataset = datast ;
-			hasDataSetChanged = true ;
+
+		if (std::fread(buf[count], 1, length, replayFile) != length) {
+			LOGE("Truncated session log");
+			break;
 		}
-		
-		//Now for the display only part: constrains on axis + what to show
-		int consider = -1 ;
-		//We don't need to use getline again, it was stored in the last do-while loop		getline(ss, tok, ';');
-		std::cout << "SS ======" << tok.c_str() << std::endl ;
-		consider = std::stoi(tok.c_str());
-		this->considerX = consider ;
-		getline(ss, tok, ';');
-		std::cout << "SS ======" << tok.c_str() << std::endl ;
-		consider = std::stoi(tok.c_str());
-		this->considerY = consider ;
-		getline(ss, tok, ';');
-		std::cout << "SS ======" << tok.c_str() << std::endl ;
-		consider = std::stoi(tok.c_str());
-		this->considerZ = consider ;
-		
-		
-		hasDataChanged = true ;
-		
-
-    	}
-	return NULL ;
-	
+		lengths[count++] = length;
+	}
+	flush();
+
+	LOGI("Session replay done (%u datagrams)", (unsigned int)receivedCount);
+	replayDone = true;
 }
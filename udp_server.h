@@ -11,74 +11,251 @@
 #include <sstream>
 #include "util/linear_math.h"
 #include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <thread>
 #include "global.h"
+#include "util/triple_buffer.h"
 
 #define BUFLEN 512
+#define BATCHSIZE 16 // datagrams received at once
 #define NUMBEROFITEMSINMESSAGE 35
 
 class udp_server{
 	
 public:
+
+	// Binary message (little-endian, no padding). Datagrams which
+	// don't start with packetMagic are parsed as the legacy text
+	// format: "dataset;zoom;volume;surface;stylus;slice;outline;
+	// dataMatrix[16];sliceMatrix[16];seed[3];considerX;considerY;considerZ"
+	// optionally followed by ";timestamp" (sender clock, in seconds).
+	// Version 1 packets end after "considerAxes".
+	struct Packet
+	{
+		uint32_t magic; // packetMagic
+		uint16_t version; // packetVersion
+		uint16_t reserved;
+		int32_t dataset;
+		float zoomFactor;
+		uint32_t flags; // Show* bits
+		float dataMatrix[16];
+		float sliceMatrix[16];
+		float seedPoint[3];
+		uint32_t considerAxes; // Consider* bits
+		// Version 2
+		uint32_t sequence; // incremented for each packet (wraps around)
+		uint64_t timestampUs; // sender clock, in microseconds (any origin)
+	};
+
+	static const uint32_t packetMagic = 0x49554c46; // "FLUI"
+	static const uint16_t packetVersion = 2;
+	static const std::size_t packetSizeV1 = 164;
+
+	enum {
+		ShowVolume  = 1 << 0,
+		ShowSurface = 1 << 1,
+		ShowStylus  = 1 << 2,
+		ShowSlice   = 1 << 3,
+		ShowOutline = 1 << 4
+	};
+
+	enum {
+		ConsiderX = 1 << 0,
+		ConsiderY = 1 << 1,
+		ConsiderZ = 1 << 2
+	};
 	
 	int port ;
 	struct sockaddr_in si_me, si_other ;
 	int sock ;
 	socklen_t slen ;
-	int recv_len ;
-	char buf[BUFLEN] ;
-	bool hasDataChanged 	= false ;
-	bool hasDataSetChanged 	= false ;
-	
+	char buf[BATCHSIZE][BUFLEN] ;
 
-	
+	// Pose at a given time (local monotonic clock, i.e.
+	// Utility::currentTimeNs(), the sender timestamps being converted
+	// when available)
+	struct PoseSample
+	{
+		Matrix4 dataMatrix;
+		Matrix4 sliceMatrix;
+		long long timeNs;
+	};
+
+	// Everything received in a message (all the fields of a state
+	// come from the same message)
+	struct TrackerState
+	{
+		Matrix4 dataMatrix;
+		Matrix4 sliceMatrix;
+		Vector3 seedPoint;
+		int dataset;
+		float zoomFactor;
+		bool showVolume, showSurface, showStylus, showSlice, showOutline;
+		short considerX, considerY, considerZ;
+		unsigned int serial; // number of messages applied so far
+		long long receivedTimeNs; // arrival time (Utility::currentTimeNs())
 
-	std::string previousMessage ;
+		// Last poses received, most recent first (history[0] matches
+		// dataMatrix and sliceMatrix)
+		static const int historySize = 8;
+		PoseSample history[historySize];
+		int historyCount;
 
+		// Extrapolates the poses at "targetNs" from the history
+		// (constant velocities). Returns the last poses if there is
+		// not enough history, if they are too old, and never predicts
+		// more than maxPredictionNs ahead of the last pose.
+		void predict(long long targetNs, Matrix4& dataMatrix, Matrix4& sliceMatrix) const;
 
+		static const long long maxPredictionNs = 50000000; // 50 ms
+		static const long long maxPoseAgeNs = 150000000; // older poses are not extrapolated
+		static const long long minVelocityIntervalNs = 15000000; // between the poses used to compute velocities
+	};
+
+	// Message counters, since the server started
+	struct Stats
+	{
+		unsigned int received; // datagrams
+		unsigned int superseded; // not parsed, a newer message being queued
+		unsigned int malformed;
+		unsigned int reordered; // received after a higher sequence number (or duplicated)
+		unsigned int lost; // sequence numbers never received so far
+	};
+
+
+	// (the socket is only created by listen())
 	udp_server();
 	udp_server(int p);
-	~udp_server();
+	~udp_server(); // (stops the thread started by start())
+
+	// Runs replay() if a log has been opened by openReplay(),
+	// otherwise listen(), on a thread of its own
+	void start();
+	// Makes listen() or replay() return, and waits for the thread
+	// started by start() (if any)
+	void stop();
 
-	//static void* launch_listen(void* args);
+	// Receives datagrams until stop() is called. Returns immediately
+	// if the socket cannot be created or bound, and on receive errors
+	// (reported once).
 	void listen(void);
-	Matrix4 getDataMatrix();
-	Matrix4 getSliceMatrix();
-	Vector3 getSeedPoint();
-
-	int getDataSet();
-	float getZoomFactor();
-
-	bool getShowVolume();
-	bool getShowSurface();
-	bool getShowStylus();
-	bool getShowSlice();
-	bool getShowOutline();
-	
-	short getConsiderX();
-	short getConsiderY();
-	short getConsiderZ();
+
+	// Session logs: a header ("FLUR", version) followed by one record
+	// per datagram (uint32 microseconds since the previous record,
+	// uint16 length, then the datagram itself), little-endian.
+
+	// Appends every datagram received by listen() to a new log (must
+	// be called before listen(), throws on error)
+	void startRecording(const std::string& fileName);
+
+	// Opens a log for replay() (throws if it is not a valid log).
+	// "speed": time factor, e.g. 2 to replay twice as fast.
+	void openReplay(const std::string& fileName, float speed = 1.0f);
+
+	// Feeds the datagrams of the log opened by openReplay() through
+	// the same decoding path as listen() instead of listening to the
+	// network, at the recorded pace, then returns (or on stop())
+	void replay();
+
+	// True once replay() has reached the end of the log (any thread)
+	bool isReplayDone() const { return replayDone; }
+
+	// Latest state received, never blocks (render thread only)
+	TrackerState getState();
+
+	// (any thread)
+	Stats getStats();
 
 
 private:
 
-	void initSocket();
-	Synchronized<Matrix4> dataMatrix ;
-	Synchronized<Matrix4> sliceMatrix ;
-	Synchronized<Vector3> seedPoint ;
-	int dataset 		= 1 ;
-	float zoomingFactor 	= 1 ;
+	// Returns false on errors (logged)
+	bool initSocket();
+	static const int receiveTimeoutMs = 100; // (how often listen() checks "stopping")
+
+	// Decoded message, in either format
+	struct Message
+	{
+		int dataset;
+		float zoomFactor;
+		bool showVolume, showSurface, showStylus, showSlice, showOutline;
+		float dataMatrix[16];
+		float sliceMatrix[16];
+		float seedPoint[3];
+		short considerX, considerY, considerZ;
+		bool hasTimestamp;
+		long long timestampNs; // sender clock
+		bool hasSequence; // (version 2)
+		uint32_t sequence;
+	};
+
+	// Both return false if the message is malformed (no allocation)
+	static bool decodeBinary(const char* data, int len, Message& msg);
+	static bool decodeText(const char* data, Message& msg); // ("data" is null-terminated)
+
+	// Messages older than the last one applied, according to their
+	// sequence numbers (or to their timestamps without sequence) are
+	// stale: their pose is dropped, but their discrete state (dataset,
+	// Show* flags and Consider* axes) is still applied to the fields
+	// that no newer message has changed
+	void apply(const Message& msg, long long receivedTimeNs);
+
+	// Decodes the newest valid datagram of buf[0..count) into "msg":
+	// the last one in arrival order, or the one with the highest
+	// sequence number. Returns false if none of them is valid.
+	bool decodeNewest(const int* lengths, int count, Message& msg);
+
+	// Counts the gaps and the reordered datagrams, in arrival order
+	// (listen() thread)
+	void countSequence(uint32_t sequence);
+
+	// (listen() thread)
+	void record(const int* lengths, int count, long long receivedTimeNs);
+
+	// Converts a sender timestamp to the local clock. The offset is
+	// the smallest (arrival - sender) difference seen recently, which
+	// is the least affected by network delays. (listen() thread)
+	long long toLocalTime(long long senderNs, long long arrivalNs);
+	static const int offsetWindow = 64;
+	long long offsets[offsetWindow];
+	int offsetCount;
+
+	unsigned int messageCount; // (listen() thread)
+	PoseSample history[TrackerState::historySize]; // (listen() thread)
+	int historyCount;
+	std::atomic<unsigned int> receivedCount, supersededCount, malformedCount, reorderedCount, lostCount;
+
+	// Highest sequence number received (listen() thread)
+	bool hasHighestSequence;
+	uint32_t highestSequence;
 
-	bool showVolume 	= true ;
-	bool showSurface 	= true ;
-	bool showStylus 	= true ;
-	bool showSlice 		= true ;
-	bool showOutline 	= true ;
+	// Order of the last message applied: its sequence number (made
+	// monotonic), or its time without sequence, and the order of the
+	// message which last changed each discrete field (listen() thread)
+	enum {
+		DatasetField,
+		ShowVolumeField, ShowSurfaceField, ShowStylusField, ShowSliceField, ShowOutlineField,
+		ConsiderXField, ConsiderYField, ConsiderZField,
+		fieldCount
+	};
+	bool hasLastSequence;
+	uint32_t lastSequence;
+	long long lastOrder;
+	long long changeOrder[fieldCount];
+	TrackerState current; // (copied to "state" by apply())
 
-	short considerX = 1 ;
-	short considerY = 1 ;
-	short considerZ = 1 ;
+	// Written by the listen() thread, read by getState()
+	TripleBuffer<TrackerState> state;
 
+	FILE* recordFile;
+	long long lastRecordNs;
+	FILE* replayFile;
+	float replaySpeed;
+	std::atomic<bool> replayDone;
 
+	std::thread thread; // (see start())
+	std::atomic<bool> stopping;
 };
 
 #endif
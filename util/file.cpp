@@ -1,6 +1,42 @@
 #include "file.h"
 
 #include <fstream>
+#include <cstring>
+#include <cerrno>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+File::Mapping::Mapping(const std::string& fileName)
+ : mData(nullptr), mSize(0)
+{
+	const int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Unable to open file: " + fileName + ": " + std::strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		throw std::runtime_error("Unable to map empty or unreadable file: " + fileName);
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd); // (the mapping keeps the file open)
+
+	if (data == MAP_FAILED)
+		throw std::runtime_error("Unable to map file: " + fileName + ": " + std::strerror(errno));
+
+	mData = static_cast<char*>(data);
+	mSize = st.st_size;
+}
+
+File::Mapping::~Mapping()
+{
+	munmap(mData, mSize);
+}
 
 bool File::exists(const std::string& fileName)
 {
@@ -25,3 +61,29 @@ File::Buffer File::read(const std::string& fileName)
 
 	return buf;
 }
+
+bool File::getInfo(const std::string& fileName, long long& mtimeNs, long long& size)
+{
+	struct stat st;
+	if (stat(fileName.c_str(), &st) != 0)
+		return false;
+	mtimeNs = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	size = st.st_size;
+	return true;
+}
+
+std::vector<std::string> File::listDirectory(const std::string& dirName)
+{
+	DIR* dir = opendir(dirName.c_str());
+	if (!dir)
+		throw std::runtime_error("Unable to open directory: " + dirName + ": " + std::strerror(errno));
+
+	std::vector<std::string> result;
+	while (const dirent* entry = readdir(dir)) {
+		if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0)
+			result.push_back(entry->d_name);
+	}
+
+	closedir(dir);
+	return result;
+}
@@ -11,8 +11,37 @@ namespace File
 		std::vector<char> data;
 	};
 
+	// Read-only view of a whole file. Pages are copy-on-write: the
+	// memory can be modified, but changes never reach the file.
+	class Mapping
+	{
+	public:
+		Mapping(const std::string& fileName); // (throws on error)
+		~Mapping();
+
+		char* getData() const { return mData; }
+		std::size_t getSize() const { return mSize; }
+
+	private:
+		Mapping(const Mapping&); // not implemented
+		void operator=(const Mapping&); // not implemented
+
+		char* mData;
+		std::size_t mSize;
+	};
+
+	typedef std::shared_ptr<Mapping> MappingSharedPtr;
+
 	bool exists(const std::string& fileName);
 	Buffer read(const std::string& fileName);
+
+	// Returns false if the file doesn't exist ("mtimeNs": last
+	// modification time since the epoch)
+	bool getInfo(const std::string& fileName, long long& mtimeNs, long long& size);
+
+	// Names of the entries of "dirName" (without "." and "..", in no
+	// particular order, throws on error)
+	std::vector<std::string> listDirectory(const std::string& dirName);
 }
 
 #endif /* FILE_H */
@@ -0,0 +1,76 @@
+#include "frame_arena.h"
+
+#include <cstdint>
+
+FrameArena::FrameArena(std::size_t capacity)
+ : mOffset(0), mUsed(0)
+{
+	android_assert(capacity > 0);
+	addBlock(capacity);
+}
+
+FrameArena::~FrameArena()
+{
+	for (const Block& block : mBlocks)
+		::operator delete(block.data);
+}
+
+void FrameArena::addBlock(std::size_t size)
+{
+	const Block block = { static_cast<char*>(::operator new(size)), size };
+	mBlocks.push_back(block);
+	mOffset = 0;
+}
+
+void* FrameArena::allocate(std::size_t size, std::size_t alignment)
+{
+	android_assert(alignment > 0 && !(alignment & (alignment-1)));
+
+	if (size == 0)
+		size = 1; // (distinct pointers)
+
+	Block* block = &mBlocks.back();
+	std::uintptr_t address = reinterpret_cast<std::uintptr_t>(block->data) + mOffset;
+	std::uintptr_t aligned = (address + alignment-1) & ~std::uintptr_t(alignment-1);
+
+	if (aligned - reinterpret_cast<std::uintptr_t>(block->data) + size > block->size) {
+		// (doubling, so that a frame needs only a few blocks)
+		std::size_t blockSize = block->size*2;
+		while (blockSize < size + alignment)
+			blockSize *= 2;
+		addBlock(blockSize);
+
+		block = &mBlocks.back();
+		address = reinterpret_cast<std::uintptr_t>(block->data);
+		aligned = (address + alignment-1) & ~std::uintptr_t(alignment-1);
+	}
+
+	const std::size_t padding = aligned - address;
+	mOffset += padding + size;
+	mUsed += padding + size;
+	return reinterpret_cast<void*>(aligned);
+}
+
+void FrameArena::reset()
+{
+	if (mBlocks.size() > 1) {
+		// Merges the blocks so that the next frames fit in one block
+		const std::size_t capacity = getCapacity();
+		LOGD("growing frame arena: %zu bytes", capacity);
+		for (const Block& block : mBlocks)
+			::operator delete(block.data);
+		mBlocks.clear();
+		addBlock(capacity);
+	}
+
+	mOffset = 0;
+	mUsed = 0;
+}
+
+std::size_t FrameArena::getCapacity() const
+{
+	std::size_t result = 0;
+	for (const Block& block : mBlocks)
+		result += block.size;
+	return result;
+}
@@ -0,0 +1,94 @@
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include "global.h"
+
+#include <cstddef>
+
+// Bump allocator for data that only lives during one frame (rendering
+// thread). allocate() never frees anything: all the memory is released
+// at once by reset(), at the end of the frame.
+//
+// The arena grows by adding blocks when a frame needs more than the
+// current capacity. reset() then merges them into a single block big
+// enough for that frame, so that in steady state a frame does no heap
+// allocation at all.
+class FrameArena
+{
+public:
+	FrameArena(std::size_t capacity = 64*1024);
+	~FrameArena();
+
+	void* allocate(std::size_t size, std::size_t alignment);
+
+	// Invalidates everything allocated since the last reset()
+	void reset();
+
+	std::size_t getCapacity() const;
+	std::size_t getUsed() const { return mUsed; }
+
+private:
+	FrameArena(const FrameArena&); // not implemented
+	void operator=(const FrameArena&); // not implemented
+
+	struct Block
+	{
+		char* data;
+		std::size_t size;
+	};
+
+	void addBlock(std::size_t size);
+
+	std::vector<Block> mBlocks; // (the last one is the current one)
+	std::size_t mOffset; // (in the current block)
+	std::size_t mUsed; // (all blocks, this frame)
+};
+
+// STL allocator on top of a FrameArena: deallocate() does nothing, and
+// the containers must not outlive the frame (containers using the same
+// arena compare equal, so they can be swapped)
+template <typename T>
+class FrameAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind { typedef FrameAllocator<U> other; };
+
+	FrameAllocator(FrameArena& arena) : mArena(&arena) {}
+
+	template <typename U>
+	FrameAllocator(const FrameAllocator<U>& other) : mArena(other.getArena()) {}
+
+	T* allocate(std::size_t n)
+	{ return static_cast<T*>(mArena->allocate(n*sizeof(T), alignof(T))); }
+
+	void deallocate(T*, std::size_t) {}
+
+	std::size_t max_size() const { return std::size_t(-1) / sizeof(T); }
+
+	FrameArena* getArena() const { return mArena; }
+
+private:
+	FrameArena* mArena;
+};
+
+template <typename T, typename U>
+inline bool operator==(const FrameAllocator<T>& a, const FrameAllocator<U>& b)
+{ return a.getArena() == b.getArena(); }
+
+template <typename T, typename U>
+inline bool operator!=(const FrameAllocator<T>& a, const FrameAllocator<U>& b)
+{ return a.getArena() != b.getArena(); }
+
+template <typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+#endif /* FRAME_ARENA_H */
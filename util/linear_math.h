@@ -33,6 +33,11 @@ struct Vector2
 	 : x(x_), y(y_)
 	{}
 
+	// (declared along with operator=())
+	Vector2(const Vector2& other)
+	 : x(other.x), y(other.y)
+	{}
+
 	explicit Vector2(T scale)
 	 : x(scale), y(scale)
 	{}
@@ -282,6 +287,11 @@ struct Vector3
 	 : x(x_), y(y_), z(z_)
 	{}
 
+	// (declared along with operator=())
+	Vector3(const Vector3& other)
+	 : x(other.x), y(other.y), z(other.z)
+	{}
+
 	explicit Vector3(T scale)
 	 : x(scale), y(scale), z(scale)
 	{}
@@ -1053,6 +1063,15 @@ struct Matrix4
 		return result;
 	}
 
+	// Same as transformPos() for "count" points ("result" may be
+	// "points")
+	void transformPoints(const Vector3<T>* points, std::size_t count,
+	                     Vector3<T>* result, bool dividew = true) const
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			result[i] = transformPos(points[i], dividew);
+	}
+
 	Vector3<T> operator*(const Vector3<T>& v) const
 	{
 		return transformPos(v);
@@ -1145,6 +1164,38 @@ struct Quaternion
 		w = std::cos(angle);
 	}
 
+	// From a rotation matrix (Shoemake's method)
+	explicit Quaternion(const Matrix3<T>& m)
+	{
+		// (m[column][row])
+		const T trace = m[0][0] + m[1][1] + m[2][2];
+		if (trace > 0) {
+			T s = 0.5 / std::sqrt(trace + 1);
+			w = 0.25 / s;
+			x = (m[1][2] - m[2][1]) * s;
+			y = (m[2][0] - m[0][2]) * s;
+			z = (m[0][1] - m[1][0]) * s;
+		} else if (m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+			T s = 2 * std::sqrt(1 + m[0][0] - m[1][1] - m[2][2]);
+			w = (m[1][2] - m[2][1]) / s;
+			x = 0.25 * s;
+			y = (m[1][0] + m[0][1]) / s;
+			z = (m[2][0] + m[0][2]) / s;
+		} else if (m[1][1] > m[2][2]) {
+			T s = 2 * std::sqrt(1 + m[1][1] - m[0][0] - m[2][2]);
+			w = (m[2][0] - m[0][2]) / s;
+			x = (m[1][0] + m[0][1]) / s;
+			y = 0.25 * s;
+			z = (m[2][1] + m[1][2]) / s;
+		} else {
+			T s = 2 * std::sqrt(1 + m[2][2] - m[0][0] - m[1][1]);
+			w = (m[0][1] - m[1][0]) / s;
+			x = (m[2][0] + m[0][2]) / s;
+			y = (m[2][1] + m[1][2]) / s;
+			z = 0.25 * s;
+		}
+	}
+
 	static const Quaternion& zero()
 	{
 		static const Quaternion zero(0, 0, 0, 0);
@@ -1204,6 +1255,26 @@ struct Quaternion
 		return Quaternion(-x, -y, -z, w);
 	}
 
+	// Spherical linear interpolation along the shortest arc ("t"
+	// outside of [0,1] extrapolates along the same arc)
+	Quaternion slerp(const Quaternion& other, T t) const
+	{
+		Quaternion to = other;
+		T d = dot(other);
+		if (d < 0) {
+			to = other * T(-1);
+			d = -d;
+		}
+
+		// Nearly identical: linear interpolation is accurate enough
+		if (d > T(0.9995))
+			return (*this + (to - *this) * t).normalized();
+
+		const T theta = std::acos(d);
+		const T sinTheta = std::sin(theta);
+		return (*this * (std::sin((1-t)*theta) / sinTheta) + to * (std::sin(t*theta) / sinTheta)).normalized();
+	}
+
 	bool operator==(const Quaternion& other) const
 	{
 		return (x == other.x && y == other.y
@@ -1304,17 +1375,28 @@ inline Quaternion<T> Vector3<T>::rotationTo(const Vector3& other) const
 	return Quaternion<T>(cross(other), angle(other));
 }
 
-// Highly unoptimized implementation...
+// Same result as:
+//   rotation.rotationMatrix() * Matrix4::identity().setScale(scale)
+// with the position set, without the matrix product. Each coefficient
+// of that product has a single non-zero term, the others adding +0
+// (hence the "+ 0" below: -0 terms give +0 in the product).
 template <typename T>
 inline Matrix4<T> Matrix4<T>::makeTransform(
 	const Vector3<T>& position,
 	const Quaternion<T>& rotation = Quaternion<T>::identity(),
 	const Vector3<T>& scale = Vector3<T>::unit())
 {
-	Matrix4 result = Matrix4::identity();
+	const Matrix3<T> rot = rotation.rotationMatrix3();
+	const T scales[3] = { scale.x, scale.y, scale.z };
 
-	result.setScale(scale);
-	result = rotation.rotationMatrix() * result;
+	Matrix4 result;
+	for (std::size_t col = 0; col < 3; ++col)
+	{
+		for (std::size_t row = 0; row < 3; ++row)
+			result.data[col][row] = rot.data[col][row] * scales[col] + T(0);
+		result.data[col][3] = 0;
+	}
+	result.data[3][3] = 1;
 	result.setPosition(position);
 
 	return result;
@@ -1322,6 +1404,8 @@ inline Matrix4<T> Matrix4<T>::makeTransform(
 
 } // namespace LinearMath
 
+#include "linear_math_simd.h"
+
 typedef LinearMath::Vector2<float> Vector2_f;
 typedef LinearMath::Vector3<float> Vector3_f;
 typedef LinearMath::Matrix3<float> Matrix3_f;
@@ -0,0 +1,204 @@
+#ifndef LINEAR_MATH_SIMD_H
+#define LINEAR_MATH_SIMD_H
+
+// SSE and NEON (AArch64) versions of the Matrix4<float> product,
+// inverse and point/direction transforms, included by linear_math.h.
+// Define LINEAR_MATH_NO_SIMD to use the generic versions instead.
+//
+// Every lane performs the same operations, in the same order, as
+// the generic code (no fused multiply-add, no reciprocal
+// approximation), so that the results are identical to the last bit
+// as long as the compiler doesn't contract the generic code either
+// (-ffp-contract=off, or no FMA in the target).
+
+#if !defined(LINEAR_MATH_NO_SIMD) && defined(__SSE__) && defined(__SSE_MATH__)
+#define LINEAR_MATH_SSE
+#include <xmmintrin.h>
+#elif !defined(LINEAR_MATH_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#define LINEAR_MATH_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(LINEAR_MATH_SSE) || defined(LINEAR_MATH_NEON)
+#define LINEAR_MATH_SIMD
+
+namespace LinearMath
+{
+
+namespace Simd
+{
+#ifdef LINEAR_MATH_SSE
+	typedef __m128 Float4;
+
+	inline Float4 load(const float* p) { return _mm_loadu_ps(p); }
+	inline void store(float* p, Float4 v) { _mm_storeu_ps(p, v); }
+	inline Float4 splat(float f) { return _mm_set1_ps(f); }
+	inline Float4 set(float a, float b, float c, float d) { return _mm_setr_ps(a, b, c, d); }
+	inline Float4 add(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+	inline Float4 sub(Float4 a, Float4 b) { return _mm_sub_ps(a, b); }
+	inline Float4 mul(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+	inline Float4 div(Float4 a, Float4 b) { return _mm_div_ps(a, b); }
+	inline float first(Float4 v) { return _mm_cvtss_f32(v); }
+
+	// Lanes (v[a], v[b], v[c], v[d])
+	template <int a, int b, int c, int d>
+	inline Float4 shuffle(Float4 v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(d, c, b, a)); }
+
+	inline void transpose(Float4& r0, Float4& r1, Float4& r2, Float4& r3) { _MM_TRANSPOSE4_PS(r0, r1, r2, r3); }
+#else
+	typedef float32x4_t Float4;
+
+	inline Float4 load(const float* p) { return vld1q_f32(p); }
+	inline void store(float* p, Float4 v) { vst1q_f32(p, v); }
+	inline Float4 splat(float f) { return vdupq_n_f32(f); }
+	inline Float4 set(float a, float b, float c, float d) { const float v[4] = { a, b, c, d }; return vld1q_f32(v); }
+	inline Float4 add(Float4 a, Float4 b) { return vaddq_f32(a, b); }
+	inline Float4 sub(Float4 a, Float4 b) { return vsubq_f32(a, b); }
+	inline Float4 mul(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+	inline Float4 div(Float4 a, Float4 b) { return vdivq_f32(a, b); }
+	inline float first(Float4 v) { return vgetq_lane_f32(v, 0); }
+
+	// Lanes (v[a], v[b], v[c], v[d])
+	template <int a, int b, int c, int d>
+	inline Float4 shuffle(Float4 v)
+	{
+		float f[4];
+		vst1q_f32(f, v);
+		return set(f[a], f[b], f[c], f[d]);
+	}
+
+	inline void transpose(Float4& r0, Float4& r1, Float4& r2, Float4& r3)
+	{
+		const float32x4x2_t t01 = vtrnq_f32(r0, r1);
+		const float32x4x2_t t23 = vtrnq_f32(r2, r3);
+		r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+		r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+		r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+		r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+	}
+#endif
+
+	// Lane j: minor of the (column "i", row j) coefficient, i.e. the
+	// determinant of the 3x3 matrix without column "i" and row j,
+	// "a", "b" and "c" being the other columns (ascending); same
+	// terms as Matrix4::minor_() and Matrix3::determinant()
+	inline Float4 minors(Float4 a, Float4 b, Float4 c)
+	{
+		// Rows of the 3x3 matrices, per lane: (1,2,3), (0,2,3),
+		// (0,1,3) and (0,1,2)
+		const Float4 m00 = shuffle<1,0,0,0>(a), m01 = shuffle<2,2,1,1>(a), m02 = shuffle<3,3,3,2>(a);
+		const Float4 m10 = shuffle<1,0,0,0>(b), m11 = shuffle<2,2,1,1>(b), m12 = shuffle<3,3,3,2>(b);
+		const Float4 m20 = shuffle<1,0,0,0>(c), m21 = shuffle<2,2,1,1>(c), m22 = shuffle<3,3,3,2>(c);
+
+		return add(sub(mul(m00, sub(mul(m11, m22), mul(m12, m21))),
+		               mul(m10, sub(mul(m01, m22), mul(m02, m21)))),
+		           mul(m20, sub(mul(m01, m12), mul(m02, m11))));
+	}
+
+	// Lanes: (x, y, z, w) of (v.x, v.y, v.z, 1) transformed by the
+	// columns c0..c3 (c3 being ignored if !withTranslation)
+	inline Float4 transform(Float4 c0, Float4 c1, Float4 c2, Float4 c3,
+	                        const Vector3<float>& v, bool withTranslation)
+	{
+		const Float4 r = add(add(mul(c0, splat(v.x)), mul(c1, splat(v.y))), mul(c2, splat(v.z)));
+		return (withTranslation ? add(r, c3) : r);
+	}
+
+	inline Vector3<float> toVector3(Float4 v, bool dividew)
+	{
+		float f[4];
+		store(f, v);
+		Vector3<float> result(f[0], f[1], f[2]);
+		if (dividew)
+			result /= f[3];
+		return result;
+	}
+} // namespace Simd
+
+template <>
+inline Matrix4<float> Matrix4<float>::operator*(const Matrix4<float>& other) const
+{
+	using namespace Simd;
+
+	const Float4 c0 = load(data[0]), c1 = load(data[1]), c2 = load(data[2]), c3 = load(data[3]);
+
+	Matrix4<float> result;
+	for (std::size_t j = 0; j < 4; ++j)
+	{
+		// (accumulated from +0, as in the generic version)
+		Float4 r = add(splat(0), mul(c0, splat(other.data[j][0])));
+		r = add(r, mul(c1, splat(other.data[j][1])));
+		r = add(r, mul(c2, splat(other.data[j][2])));
+		r = add(r, mul(c3, splat(other.data[j][3])));
+		store(result.data[j], r);
+	}
+
+	return result;
+}
+
+template <>
+inline Matrix4<float> Matrix4<float>::inverse() const
+{
+	using namespace Simd;
+
+	const Float4 c0 = load(data[0]), c1 = load(data[1]), c2 = load(data[2]), c3 = load(data[3]);
+
+	// Cofactors of each column (lane: row), with the (-1)^(i+j) signs
+	const Float4 even = set(1, -1, 1, -1), odd = set(-1, 1, -1, 1);
+	Float4 k0 = mul(even, minors(c1, c2, c3));
+	Float4 k1 = mul(odd,  minors(c0, c2, c3));
+	Float4 k2 = mul(even, minors(c0, c1, c3));
+	Float4 k3 = mul(odd,  minors(c0, c1, c2));
+
+	// Same expansion along the first row as determinant()
+	float det = 0;
+	det += data[0][0] * first(k0);
+	det += data[1][0] * first(k1);
+	det += data[2][0] * first(k2);
+	det += data[3][0] * first(k3);
+	assert(det != 0);
+
+	// result.data[j][i] = cofactor(i, j) / det
+	Simd::transpose(k0, k1, k2, k3);
+	const Float4 d = splat(det);
+
+	Matrix4<float> result;
+	store(result.data[0], div(k0, d));
+	store(result.data[1], div(k1, d));
+	store(result.data[2], div(k2, d));
+	store(result.data[3], div(k3, d));
+
+	return result;
+}
+
+template <>
+inline Vector3<float> Matrix4<float>::transformPos(const Vector3<float>& v, bool dividew) const
+{
+	using namespace Simd;
+	return toVector3(transform(load(data[0]), load(data[1]), load(data[2]), load(data[3]), v, true), dividew);
+}
+
+template <>
+inline Vector3<float> Matrix4<float>::transformDir(const Vector3<float>& v) const
+{
+	using namespace Simd;
+	return toVector3(transform(load(data[0]), load(data[1]), load(data[2]), load(data[3]), v, false), false);
+}
+
+template <>
+inline void Matrix4<float>::transformPoints(const Vector3<float>* points, std::size_t count,
+                                           Vector3<float>* result, bool dividew) const
+{
+	using namespace Simd;
+
+	// (the columns are only loaded once)
+	const Float4 c0 = load(data[0]), c1 = load(data[1]), c2 = load(data[2]), c3 = load(data[3]);
+	for (std::size_t i = 0; i < count; ++i)
+		result[i] = toVector3(transform(c0, c1, c2, c3, points[i], true), dividew);
+}
+
+} // namespace LinearMath
+
+#endif /* LINEAR_MATH_SSE || LINEAR_MATH_NEON */
+
+#endif /* LINEAR_MATH_SIMD_H */
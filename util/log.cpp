@@ -0,0 +1,298 @@
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Log { namespace detail {
+	std::atomic<int> level(LOG_MIN_LEVEL);
+} }
+
+namespace {
+	const std::size_t ringSize = 64 * 1024; // (bytes per thread)
+	const std::size_t alignment = 8;
+	const std::uint32_t paddingLevel = ~0u;
+	const int flushIntervalMs = 10;
+
+	struct Header
+	{
+		std::uint32_t size; // (including the header, aligned)
+		std::uint32_t level; // (paddingLevel: the rest of the buffer is unused)
+		std::uint64_t serial;
+		const char* format;
+		Log::detail::FormatFunc func;
+		// (followed by the encoded arguments)
+	};
+
+	// Messages of one thread: written by that thread only, and read by
+	// the one holding Logger::mFlushLock
+	struct Ring
+	{
+		Ring() : head(0), tail(0), orphaned(false), dropped(0), reserved(nullptr), next(0) {}
+
+		char* at(std::size_t pos) { return reinterpret_cast<char*>(data) + pos % ringSize; }
+
+		std::uint64_t data[ringSize / sizeof(std::uint64_t)];
+		std::atomic<std::size_t> head; // (bytes written)
+		std::atomic<std::size_t> tail; // (bytes read)
+		std::atomic<bool> orphaned; // (set when the thread exits)
+		std::atomic<unsigned int> dropped;
+
+		// (owner thread only, between reserve() and commit())
+		Header* reserved;
+		std::size_t next;
+	};
+
+	// (marks the ring of an exiting thread, freed once read: the
+	// messages logged afterwards by the thread are printed right away)
+	struct Owner
+	{
+		Owner() : ring(nullptr), exited(false) {}
+		~Owner() { if (ring) ring->orphaned = true; ring = nullptr; exited = true; }
+		Ring* ring;
+		bool exited;
+	};
+
+	// (size of a record, including the header)
+	inline std::size_t recordSize(std::size_t size)
+	{
+		return (sizeof(Header) + size + alignment-1) / alignment * alignment;
+	}
+
+	thread_local Owner owner;
+	std::atomic<std::uint64_t> nextSerial(0);
+
+	class Logger
+	{
+	public:
+		// (never destroyed: static destructors may still log, the
+		// remaining messages are printed by an atexit() handler)
+		static Logger& instance()
+		{
+			static Logger* logger = new Logger;
+			return *logger;
+		}
+
+		Ring* createRing()
+		{
+			Ring* ring = new Ring;
+			std::lock_guard<std::mutex> g(mRingsLock);
+			mRings.push_back(ring);
+			return ring;
+		}
+
+		void flush()
+		{
+			std::lock_guard<std::mutex> g(mFlushLock);
+			drain();
+		}
+
+		void print(Log::Level level, const char* format, Log::detail::FormatFunc func, const char* args)
+		{
+			std::lock_guard<std::mutex> g(mFlushLock);
+			drain();
+
+			const int length = formatText(format, func, args);
+			std::FILE* file = output(level);
+			std::fwrite(mBuffer.data(), 1, std::max(length, 0), file);
+			std::fputc('\n', file);
+			std::fflush(file);
+		}
+
+	private:
+		struct Entry
+		{
+			std::uint64_t serial;
+			std::uint32_t level;
+			std::string text;
+
+			bool operator<(const Entry& other) const { return serial < other.serial; }
+		};
+
+		Logger()
+		 : mBuffer(256)
+		{
+			std::atexit([]() { instance().flush(); });
+			std::thread(&Logger::run, this).detach();
+		}
+
+		void run()
+		{
+			for (;;) {
+				flush();
+				std::this_thread::sleep_for(std::chrono::milliseconds(flushIntervalMs));
+			}
+		}
+
+		// Formats the messages of all the rings, then prints them in the
+		// order of the calls (mFlushLock held)
+		void drain()
+		{
+			std::vector<Ring*> rings;
+			{
+				std::lock_guard<std::mutex> g(mRingsLock);
+				rings = mRings;
+			}
+
+			unsigned int dropped = 0;
+			for (Ring* ring : rings) {
+				// (read before head: a ring is freed once empty after its
+				// last message)
+				const bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+				const std::size_t head = ring->head.load(std::memory_order_acquire);
+				std::size_t tail = ring->tail.load(std::memory_order_relaxed);
+
+				while (tail != head) {
+					const Header* header = reinterpret_cast<const Header*>(ring->at(tail));
+					if (header->level != paddingLevel)
+						mEntries.push_back(format(*header));
+					tail += header->size;
+				}
+
+				ring->tail.store(tail, std::memory_order_release);
+				dropped += ring->dropped.exchange(0);
+
+				if (orphaned) {
+					std::lock_guard<std::mutex> g(mRingsLock);
+					mRings.erase(std::find(mRings.begin(), mRings.end(), ring));
+					delete ring;
+				}
+			}
+
+			if (mEntries.empty() && dropped == 0)
+				return;
+
+			std::sort(mEntries.begin(), mEntries.end());
+			for (const Entry& entry : mEntries) {
+				std::FILE* file = output(entry.level);
+				std::fwrite(entry.text.data(), 1, entry.text.size(), file);
+				std::fputc('\n', file);
+			}
+			mEntries.clear();
+
+			if (dropped > 0)
+				std::fprintf(stderr, "(%u log messages dropped)\n", dropped);
+
+			std::fflush(stdout);
+			std::fflush(stderr);
+		}
+
+		static std::FILE* output(std::uint32_t level)
+		{
+			return (level >= Log::LEVEL_WARNING ? stderr : stdout);
+		}
+
+		// Formats a message into mBuffer, returns its length
+		int formatText(const char* format, Log::detail::FormatFunc func, const char* args)
+		{
+			int length = func(mBuffer.data(), mBuffer.size(), format, args);
+			if (length >= int(mBuffer.size())) {
+				mBuffer.resize(length + 1);
+				length = func(mBuffer.data(), mBuffer.size(), format, args);
+			}
+			return length;
+		}
+
+		Entry format(const Header& header)
+		{
+			const char* args = reinterpret_cast<const char*>(&header + 1);
+			const int length = formatText(header.format, header.func, args);
+
+			Entry entry;
+			entry.serial = header.serial;
+			entry.level = header.level;
+			entry.text.assign(mBuffer.data(), std::max(length, 0));
+			return entry;
+		}
+
+		std::mutex mRingsLock;
+		std::vector<Ring*> mRings; // (protected by mRingsLock)
+
+		std::mutex mFlushLock; // (held while reading the rings)
+		std::vector<Entry> mEntries; // (reused between flushes)
+		std::vector<char> mBuffer;
+	};
+} // namespace
+
+void Log::setLevel(Level level)
+{
+	detail::level = level;
+}
+
+Log::Level Log::getLevel()
+{
+	return Level(detail::level.load());
+}
+
+void Log::flush()
+{
+	Logger::instance().flush();
+}
+
+int Log::detail::print(char* out, std::size_t size, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	const int result = std::vsnprintf(out, size, format, args);
+	va_end(args);
+	return result;
+}
+
+bool Log::detail::isDeferred(Level level, std::size_t size)
+{
+	return level < LEVEL_ERROR && !owner.exited && recordSize(size) <= ringSize/2;
+}
+
+char* Log::detail::reserve(std::size_t size)
+{
+	// (isDeferred() was true: the thread has not exited, and the
+	// record fits)
+	if (!owner.ring)
+		owner.ring = Logger::instance().createRing();
+	Ring& ring = *owner.ring;
+
+	const std::size_t total = recordSize(size);
+
+	// Records are contiguous: the end of the buffer is skipped if too
+	// small (8 bytes at least, enough for size and level)
+	const std::size_t head = ring.head.load(std::memory_order_relaxed);
+	const std::size_t offset = head % ringSize;
+	const std::size_t padding = (offset + total > ringSize ? ringSize - offset : 0);
+
+	if (head + padding + total - ring.tail.load(std::memory_order_acquire) > ringSize) {
+		++ring.dropped;
+		return nullptr;
+	}
+
+	if (padding > 0) {
+		Header* pad = reinterpret_cast<Header*>(ring.at(head));
+		pad->size = padding;
+		pad->level = paddingLevel;
+	}
+
+	ring.reserved = reinterpret_cast<Header*>(ring.at(head + padding));
+	ring.reserved->size = total;
+	ring.next = head + padding + total;
+	return reinterpret_cast<char*>(ring.reserved + 1);
+}
+
+void Log::detail::commit(Level level, const char* format, FormatFunc func)
+{
+	Ring& ring = *owner.ring;
+	Header* header = ring.reserved;
+	header->level = level;
+	header->serial = nextSerial.fetch_add(1, std::memory_order_relaxed);
+	header->format = format;
+	header->func = func;
+	ring.head.store(ring.next, std::memory_order_release);
+}
+
+void Log::detail::printNow(Level level, const char* format, FormatFunc func, const char* args)
+{
+	Logger::instance().print(level, format, func, args);
+}
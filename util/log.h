@@ -0,0 +1,202 @@
+#ifndef LOG_H
+#define LOG_H
+
+// (included by global.h, which defines LOGD/LOGI/LOGW/LOGE on top of
+// LOG_AT)
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Asynchronous logging. LOG_AT(level, format, args...) copies the
+// format pointer and the arguments to a ring buffer of the calling
+// thread (no lock, no allocation, no formatting), and a background
+// thread formats and prints the messages in their original order:
+// debug and info messages to stdout, warnings and errors to stderr.
+//
+// Levels below LOG_MIN_LEVEL (see the Makefile) are compiled out, and
+// those below the runtime level (see setLevel()) cost one relaxed
+// load. Messages that don't fit in a full buffer are dropped (and
+// counted), so that logging never blocks.
+//
+// Errors, messages too large for the ring buffer and those logged by
+// an exiting thread (after its ring buffer has been released) are
+// formatted by the calling thread and printed before LOG_AT returns,
+// after the messages queued before them, so that they are not lost if
+// an assertion follows.
+//
+// "format" must be a string literal (it is read after LOG_AT has
+// returned). The strings passed as arguments are copied whole.
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0 // (see Log::Level)
+#endif
+
+namespace Log
+{
+	enum Level {
+		LEVEL_DEBUG,
+		LEVEL_INFO,
+		LEVEL_WARNING,
+		LEVEL_ERROR
+	};
+
+	// Messages below "level" are dropped (default: LOG_MIN_LEVEL)
+	void setLevel(Level level);
+	Level getLevel();
+
+	// Prints the messages queued so far, and waits for them (any thread)
+	void flush();
+
+	namespace detail
+	{
+		extern std::atomic<int> level;
+
+		// Formats the arguments encoded at "args"; returns the length
+		// of the message, as snprintf()
+		typedef int (*FormatFunc)(char* out, std::size_t size, const char* format, const char* args);
+
+		// True if a message of "size" bytes of arguments goes through
+		// the ring buffer of the calling thread (otherwise see
+		// printNow())
+		bool isDeferred(Level level, std::size_t size);
+
+		// Reserves "size" bytes for the arguments of a message in the
+		// ring buffer of the calling thread (null if full). commit()
+		// must follow a successful reserve(), on the same thread.
+		char* reserve(std::size_t size);
+		void commit(Level level, const char* format, FormatFunc func);
+
+		// Formats and prints a message after the queued ones (any
+		// thread)
+		void printNow(Level level, const char* format, FormatFunc func, const char* args);
+
+		// vsnprintf() (the format has been checked by checkFormat(),
+		// including for the messages without arguments)
+		int print(char* out, std::size_t size, const char* format, ...);
+
+		// Encoding of an argument: copied as is, except strings
+		template <typename T>
+		struct Codec
+		{
+			static std::size_t size(T) { return sizeof(T); }
+			static char* write(char* p, T value) { std::memcpy(p, &value, sizeof(T)); return p + sizeof(T); }
+			static const char* read(const char* p, T& value) { std::memcpy(&value, p, sizeof(T)); return p + sizeof(T); }
+		};
+
+		struct StringCodec
+		{
+			static std::size_t length(const char* s) { return (s ? std::strlen(s) : 6); }
+			static std::size_t size(const char* s) { return length(s) + 1; }
+
+			static char* write(char* p, const char* s)
+			{
+				const std::size_t n = length(s);
+				std::memcpy(p, (s ? s : "(null)"), n);
+				p[n] = '\0';
+				return p + n + 1;
+			}
+
+			static const char* read(const char* p, const char*& value) { value = p; return p + std::strlen(p) + 1; }
+		};
+
+		template <> struct Codec<const char*> : StringCodec {};
+		template <> struct Codec<char*> : StringCodec
+		{
+			static const char* read(const char* p, char*& value) { value = const_cast<char*>(p); return p + std::strlen(p) + 1; }
+		};
+
+		template <typename T>
+		struct Stored { typedef typename std::decay<T>::type type; };
+
+		inline std::size_t size() { return 0; }
+
+		template <typename T, typename... Rest>
+		std::size_t size(const T& value, const Rest&... rest)
+		{
+			return Codec<typename Stored<T>::type>::size(value) + size(rest...);
+		}
+
+		inline char* write(char* p) { return p; }
+
+		template <typename T, typename... Rest>
+		char* write(char* p, const T& value, const Rest&... rest)
+		{
+			return write(Codec<typename Stored<T>::type>::write(p, value), rest...);
+		}
+
+		// Decodes the arguments one type at a time, then calls snprintf()
+		// (flusher thread)
+		template <typename... Args>
+		struct Formatter;
+
+		template <>
+		struct Formatter<>
+		{
+			template <typename... Values>
+			static int format(char* out, std::size_t size, const char* format, const char*, Values... values)
+			{
+				return print(out, size, format, values...);
+			}
+		};
+
+		template <typename T, typename... Rest>
+		struct Formatter<T, Rest...>
+		{
+			template <typename... Values>
+			static int format(char* out, std::size_t size, const char* format, const char* p, Values... values)
+			{
+				T value;
+				p = Codec<T>::read(p, value);
+				return Formatter<Rest...>::format(out, size, format, p, values..., value);
+			}
+		};
+
+		template <typename... Args>
+		int format(char* out, std::size_t size, const char* format, const char* args)
+		{
+			return Formatter<Args...>::format(out, size, format, args);
+		}
+	} // namespace detail
+
+	inline bool isEnabled(Level level)
+	{
+		return level >= detail::level.load(std::memory_order_relaxed);
+	}
+
+	template <typename... Args>
+	void write(Level level, const char* format, const Args&... args)
+	{
+		const detail::FormatFunc func = &detail::format<typename detail::Stored<Args>::type...>;
+		const std::size_t size = detail::size(args...);
+
+		if (!detail::isDeferred(level, size)) {
+			std::vector<char> buffer(size);
+			detail::write(buffer.data(), args...);
+			detail::printNow(level, format, func, buffer.data());
+			return;
+		}
+
+		char* p = detail::reserve(size);
+		if (!p)
+			return;
+
+		detail::write(p, args...);
+		detail::commit(level, format, func);
+	}
+
+	// (never called: lets the compiler check the format of LOG_AT)
+	inline void checkFormat(const char*, ...) __attribute__((format(printf, 1, 2)));
+	inline void checkFormat(const char*, ...) {}
+} // namespace Log
+
+#define LOG_AT(level, ...) \
+	((level) >= LOG_MIN_LEVEL && Log::isEnabled(level) \
+		? (false ? Log::checkFormat(__VA_ARGS__) : Log::write(level, "" __VA_ARGS__)) \
+		: (void)0)
+
+#endif /* LOG_H */
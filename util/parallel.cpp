@@ -0,0 +1,90 @@
+#include "parallel.h"
+
+#include "util/task_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <exception>
+
+namespace {
+	// Shared with the helper tasks, which may start after forEach()
+	// has returned (they find no index left, and never call "func")
+	struct State
+	{
+		State(int begin, int end, const std::function<void (int)>& func)
+		 : next(begin), end(end), func(&func), active(0) {}
+
+		std::atomic<int> next;
+		const int end;
+		const std::function<void (int)>* func; // (only used while next < end)
+
+		std::exception_ptr error;
+		int active; // (helpers running, protected by lock)
+		std::mutex lock;
+		std::condition_variable cond;
+	};
+
+	void work(State& s)
+	{
+		for (int i; (i = s.next++) < s.end; ) {
+			try {
+				(*s.func)(i);
+			} catch (...) {
+				std::lock_guard<std::mutex> g(s.lock);
+				if (!s.error) s.error = std::current_exception();
+				s.next = s.end; // skip remaining indices
+			}
+		}
+	}
+} // namespace
+
+unsigned int Parallel::threadCount()
+{
+	return TaskPool::threadCount();
+}
+
+void Parallel::forEach(int begin, int end, const std::function<void (int)>& func)
+{
+	if (end <= begin)
+		return;
+
+	const unsigned int numThreads = std::min<unsigned int>(threadCount(), end - begin);
+
+	if (numThreads == 1) {
+		for (int i = begin; i < end; ++i)
+			func(i);
+		return;
+	}
+
+	const std::shared_ptr<State> state = std::make_shared<State>(begin, end, func);
+
+	// Helpers at the priority of the caller (the pool workers are
+	// shared: nested calls don't create more threads, and the helpers
+	// still queued when all the indices are handed out are cancelled)
+	TaskPool::CancellationToken token;
+	for (unsigned int t = 1; t < numThreads; ++t) {
+		TaskPool::submit([state]() {
+			{
+				std::lock_guard<std::mutex> g(state->lock);
+				++state->active;
+			}
+			work(*state);
+			std::lock_guard<std::mutex> g(state->lock);
+			if (--state->active == 0)
+				state->cond.notify_all();
+		}, TaskPool::currentPriority(), token);
+	}
+
+	// The calling thread takes part in the work too
+	work(*state);
+	token.cancel();
+
+	// (waits for the indices being processed by the helpers)
+	std::unique_lock<std::mutex> l(state->lock);
+	while (state->active > 0)
+		state->cond.wait(l);
+
+	if (state->error)
+		std::rethrow_exception(state->error);
+}
@@ -0,0 +1,20 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "global.h"
+
+#include <functional>
+
+namespace Parallel
+{
+	// Number of threads used by forEach() (at least 1)
+	unsigned int threadCount();
+
+	// Calls func(i) for each i in [begin, end), in parallel. Indices
+	// are handed out dynamically, so each call should do a reasonable
+	// amount of work (e.g. one slab of a volume). The first exception
+	// thrown by "func" is rethrown once all threads are done.
+	void forEach(int begin, int end, const std::function<void (int)>& func);
+}
+
+#endif /* PARALLEL_H */
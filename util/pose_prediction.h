@@ -0,0 +1,52 @@
+#ifndef POSE_PREDICTION_H
+#define POSE_PREDICTION_H
+
+#include "global.h"
+
+namespace PosePrediction
+{
+	// Splits a rigid transform with a scale into its components
+	inline void decompose(const Matrix4& m, Vector3& position, Quaternion& rotation, Vector3& scale)
+	{
+		const Matrix3 m3 = m.get3x3Matrix();
+		const Vector3 columns[3] = {
+			Vector3(m3[0][0], m3[0][1], m3[0][2]),
+			Vector3(m3[1][0], m3[1][1], m3[1][2]),
+			Vector3(m3[2][0], m3[2][1], m3[2][2])
+		};
+		const float lengths[3] = { columns[0].length(), columns[1].length(), columns[2].length() };
+		scale = Vector3(lengths[0], lengths[1], lengths[2]);
+
+		Matrix3 rot;
+		for (int c = 0; c < 3; ++c) {
+			const float s = (lengths[c] > 0 ? 1/lengths[c] : 0);
+			rot[c][0] = columns[c].x * s;
+			rot[c][1] = columns[c].y * s;
+			rot[c][2] = columns[c].z * s;
+		}
+
+		position = m.position();
+		rotation = Quaternion(rot).normalized();
+	}
+
+	// Extrapolates the pose at "targetNs" from two samples, assuming
+	// constant linear and angular velocities. The scale of "newer"
+	// is kept.
+	inline Matrix4 extrapolate(const Matrix4& older, long long olderNs,
+	                           const Matrix4& newer, long long newerNs,
+	                           long long targetNs)
+	{
+		if (newerNs <= olderNs)
+			return newer;
+
+		Vector3 p0, p1, s0, s1;
+		Quaternion q0, q1;
+		decompose(older, p0, q0, s0);
+		decompose(newer, p1, q1, s1);
+
+		const float t = double(targetNs - olderNs) / (newerNs - olderNs);
+		return Matrix4::makeTransform(p0 + (p1 - p0) * t, q0.slerp(q1, t), s1);
+	}
+}
+
+#endif /* POSE_PREDICTION_H */
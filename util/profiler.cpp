@@ -0,0 +1,313 @@
+#include "profiler.h"
+
+#ifdef PROFILING
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+	const int maxStages = 64;
+	const unsigned int windowSize = 512; // (samples kept per stage)
+	const unsigned int queryRingSize = 4; // (frames before a GPU result is read)
+
+	// Rolling window of durations, in milliseconds.
+	// NOTE: uses a plain mutex rather than synchronized(), which
+	// reports its own contention here.
+	struct Samples
+	{
+		Samples() : next(0) {}
+
+		void add(float ms)
+		{
+			tthread::lock_guard<tthread::mutex> g(lock);
+			if (values.size() < windowSize) {
+				values.push_back(ms);
+			} else {
+				values[next] = ms;
+				next = (next + 1) % windowSize;
+			}
+		}
+
+		std::vector<float> get()
+		{
+			tthread::lock_guard<tthread::mutex> g(lock);
+			return values;
+		}
+
+		tthread::mutex lock;
+		std::vector<float> values;
+		unsigned int next;
+	};
+
+	struct Stage
+	{
+		Stage() : name(nullptr)
+		{
+			std::fill(queries, queries+queryRingSize, 0);
+			std::fill(queryFrames, queryFrames+queryRingSize, -1);
+		}
+
+		const char* name;
+		Samples cpu, gpu;
+
+		// (GL thread only)
+		GLuint queries[queryRingSize];
+		long long queryFrames[queryRingSize]; // (frame of the pending result, or -1)
+	};
+
+	Stage stages[maxStages];
+	std::atomic<int> stageCount(0);
+	tthread::mutex registryLock;
+
+	// (GL thread only)
+	long long frame = 0;
+	long long lastReportNs = 0;
+	int activeGpuStage = -1;
+	unsigned int droppedGpuResults = 0;
+	long long lastAllocationCount = 0;
+	Samples allocations; // (per frame)
+
+	// (see operator new below)
+	thread_local long long allocationCount = 0;
+
+	struct Destination
+	{
+		Destination() : sock(-1) {}
+		int sock;
+		sockaddr_in addr;
+	};
+	Synchronized<Destination> destination;
+
+	struct Stats
+	{
+		Stats() : count(0), min(0), avg(0), p99(0) {}
+		unsigned int count;
+		float min, avg, p99;
+	};
+
+	Stats computeStats(std::vector<float> values)
+	{
+		Stats result;
+		if (values.empty())
+			return result;
+
+		std::sort(values.begin(), values.end());
+		result.count = values.size();
+		result.min = values.front();
+		double sum = 0;
+		for (float v : values)
+			sum += v;
+		result.avg = sum / values.size();
+		result.p99 = values[std::min<std::size_t>(values.size()-1, values.size()*99/100)];
+		return result;
+	}
+
+	// (GL context)
+	void collectGpuResults()
+	{
+		const int count = stageCount;
+		for (int i = 0; i < count; ++i) {
+			Stage& s = stages[i];
+			for (unsigned int slot = 0; slot < queryRingSize; ++slot) {
+				if (s.queryFrames[slot] < 0 || s.queryFrames[slot] == frame)
+					continue;
+
+				GLint available = 0;
+				glGetQueryObjectiv(s.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available)
+					continue;
+
+				GLuint64 ns = 0;
+				glGetQueryObjectui64v(s.queries[slot], GL_QUERY_RESULT, &ns);
+				s.gpu.add(ns / 1e6);
+				s.queryFrames[slot] = -1;
+			}
+		}
+	}
+
+	void report()
+	{
+		std::vector<std::string> lines;
+		const int count = stageCount;
+		for (int i = 0; i < count; ++i) {
+			Stage& s = stages[i];
+			const Stats cpu = computeStats(s.cpu.get());
+			const Stats gpu = computeStats(s.gpu.get());
+			if (!cpu.count && !gpu.count)
+				continue;
+
+			char line[256];
+			if (gpu.count) {
+				std::snprintf(line, sizeof(line),
+				              "profile: %-16s cpu %7.3f/%7.3f/%7.3f ms, gpu %7.3f/%7.3f/%7.3f ms (min/avg/p99, n=%u)",
+				              s.name, cpu.min, cpu.avg, cpu.p99, gpu.min, gpu.avg, gpu.p99, cpu.count);
+			} else {
+				std::snprintf(line, sizeof(line),
+				              "profile: %-16s cpu %7.3f/%7.3f/%7.3f ms (min/avg/p99, n=%u)",
+				              s.name, cpu.min, cpu.avg, cpu.p99, cpu.count);
+			}
+			lines.push_back(line);
+		}
+
+		const Stats allocs = computeStats(allocations.get());
+		if (allocs.count) {
+			char line[256];
+			std::snprintf(line, sizeof(line),
+			              "profile: %-16s %7.0f/%7.1f/%7.0f per frame (min/avg/p99, n=%u)",
+			              "heap allocs", allocs.min, allocs.avg, allocs.p99, allocs.count);
+			lines.push_back(line);
+		}
+
+		if (droppedGpuResults) {
+			lines.push_back("profile: " + Utility::toString(droppedGpuResults) + " GPU results dropped (not ready after "
+			                + Utility::toString(queryRingSize) + " frames)");
+			droppedGpuResults = 0;
+		}
+
+		for (const std::string& line : lines)
+			LOGD("%s", line.c_str());
+
+		synchronized(destination) {
+			for (unsigned int i = 0; destination.sock >= 0 && i < lines.size(); ++i) {
+				sendto(destination.sock, lines[i].c_str(), lines[i].size(), 0,
+				       reinterpret_cast<const sockaddr*>(&destination.addr), sizeof(destination.addr));
+			}
+		}
+	}
+} // namespace
+
+int Profiler::getStage(const char* name)
+{
+	tthread::lock_guard<tthread::mutex> g(registryLock);
+
+	const int count = stageCount;
+	for (int i = 0; i < count; ++i) {
+		if (std::strcmp(stages[i].name, name) == 0)
+			return i;
+	}
+
+	android_assert(count < maxStages);
+	stages[count].name = name;
+	stageCount = count + 1; // (published once the name is set)
+	return count;
+}
+
+void Profiler::addCpuSample(int stage, long long ns)
+{
+	stages[stage].cpu.add(ns / 1e6);
+}
+
+void Profiler::beginGpuQuery(int stage)
+{
+	if (activeGpuStage >= 0)
+		return; // (nested, only the outer scope is timed)
+
+	Stage& s = stages[stage];
+	if (!s.queries[0])
+		glGenQueries(queryRingSize, s.queries);
+
+	const unsigned int slot = frame % queryRingSize;
+	if (s.queryFrames[slot] == frame)
+		return; // (only the first scope of a frame is timed)
+	if (s.queryFrames[slot] >= 0)
+		++droppedGpuResults;
+
+	glBeginQuery(GL_TIME_ELAPSED, s.queries[slot]);
+	s.queryFrames[slot] = frame;
+	activeGpuStage = stage;
+}
+
+void Profiler::endGpuQuery(int stage)
+{
+	if (activeGpuStage != stage)
+		return;
+
+	glEndQuery(GL_TIME_ELAPSED);
+	activeGpuStage = -1;
+}
+
+void Profiler::endFrame()
+{
+	collectGpuResults();
+	++frame;
+
+	if (frame > 1)
+		allocations.add(getAllocationCount() - lastAllocationCount);
+
+	const long long now = Utility::currentTimeNs();
+	if (!lastReportNs) {
+		lastReportNs = now;
+	} else if (now - lastReportNs > reportIntervalNs) {
+		report();
+		lastReportNs = now;
+	}
+
+	// (the allocations of the profiler itself are not counted)
+	lastAllocationCount = getAllocationCount();
+}
+
+void Profiler::setStatsDestination(const std::string& host, int port)
+{
+	synchronized(destination) {
+		if (destination.sock >= 0) {
+			close(destination.sock);
+			destination.sock = -1;
+		}
+
+		if (host.empty())
+			return;
+
+		std::memset(&destination.addr, 0, sizeof(destination.addr));
+		destination.addr.sin_family = AF_INET;
+		destination.addr.sin_port = htons(port);
+		if (inet_pton(AF_INET, host.c_str(), &destination.addr.sin_addr) != 1)
+			throw std::runtime_error("Invalid profiler stats address: " + host);
+
+		destination.sock = socket(AF_INET, SOCK_DGRAM, 0);
+		if (destination.sock < 0)
+			throw std::runtime_error("Unable to create the profiler stats socket");
+
+		LOGI("Sending profiler stats to %s:%d", host.c_str(), port);
+	}
+}
+
+void Profiler::lockContended(tthread::mutex& mutex)
+{
+	static const int stage = getStage("lock wait");
+
+	const long long startNs = Utility::currentTimeNs();
+	mutex.lock();
+	addCpuSample(stage, Utility::currentTimeNs() - startNs);
+}
+
+long long Profiler::getAllocationCount()
+{
+	return allocationCount;
+}
+
+// Counting replacements of the global allocation functions (operator
+// new[] and delete[] call these ones). Allocations made from C code
+// (malloc) are not counted.
+void* operator new(std::size_t size)
+{
+	++allocationCount;
+	void* result = std::malloc(size ? size : 1);
+	if (!result)
+		throw std::bad_alloc();
+	return result;
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+#endif /* PROFILING */
@@ -0,0 +1,109 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "global.h"
+
+// Per-stage timing of the render loop, compiled in with PROFILING=1
+// (see the Makefile). Otherwise the macros below expand to nothing.
+//
+// PROFILE_SCOPE(name) times the rest of the enclosing block on the
+// CPU (any thread). PROFILE_GPU_SCOPE(name) also times the GL commands
+// submitted in the block with GL_TIME_ELAPSED queries, which are only
+// read back a few frames later so that the pipeline never stalls.
+// GL_TIME_ELAPSED queries cannot be nested: GPU scopes must not
+// overlap (CPU scopes can).
+//
+// Each stage keeps its last samples, and PROFILE_FRAME() periodically
+// prints their min/avg/p99 (and optionally sends them over UDP, see
+// setStatsDestination()). Contended synchronized() locks are reported
+// as the "lock wait" stage, and the heap allocations (operator new)
+// made by the rendering thread during each frame as "heap allocs".
+//
+// "name" must be a string literal (the stage is looked up once per
+// call site).
+
+#ifdef PROFILING
+
+namespace Profiler
+{
+	// Returns the index of the stage named "name", registering it on
+	// first call (thread-safe)
+	int getStage(const char* name);
+
+	// Records a CPU duration for "stage"
+	void addCpuSample(int stage, long long ns);
+
+	// (GL context)
+	void beginGpuQuery(int stage);
+	void endGpuQuery(int stage);
+
+	// Collects the available GPU results, and reports the statistics
+	// of all stages every "reportIntervalNs"
+	// (GL context)
+	void endFrame();
+
+	// Also sends the reports as UDP datagrams (one line per stage) to
+	// host:port (IPv4 address). An empty host disables UDP reports.
+	void setStatsDestination(const std::string& host, int port);
+
+	// Called by synchronized() when the lock is already held: waits
+	// for it and records the waiting time
+	void lockContended(tthread::mutex& mutex);
+
+	// Number of operator new calls made by the calling thread so far
+	long long getAllocationCount();
+
+	static const long long reportIntervalNs = 5000000000LL;
+
+	class CpuScope
+	{
+	public:
+		CpuScope(int stage) : mStage(stage), mStartNs(Utility::currentTimeNs()) {}
+		~CpuScope() { addCpuSample(mStage, Utility::currentTimeNs() - mStartNs); }
+
+	private:
+		CpuScope(const CpuScope&); // not implemented
+		void operator=(const CpuScope&); // not implemented
+
+		int mStage;
+		long long mStartNs;
+	};
+
+	// (GL context)
+	class GpuScope
+	{
+	public:
+		GpuScope(int stage) : mCpu(stage), mStage(stage) { beginGpuQuery(stage); }
+		~GpuScope() { endGpuQuery(mStage); }
+
+	private:
+		GpuScope(const GpuScope&); // not implemented
+		void operator=(const GpuScope&); // not implemented
+
+		CpuScope mCpu; // (stopped after the GPU query)
+		int mStage;
+	};
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#define PROFILE_SCOPE(name) \
+	static const int PROFILE_CONCAT(profileStage_, __LINE__) = Profiler::getStage(name); \
+	Profiler::CpuScope PROFILE_CONCAT(profileScope_, __LINE__)(PROFILE_CONCAT(profileStage_, __LINE__))
+
+#define PROFILE_GPU_SCOPE(name) \
+	static const int PROFILE_CONCAT(profileStage_, __LINE__) = Profiler::getStage(name); \
+	Profiler::GpuScope PROFILE_CONCAT(profileScope_, __LINE__)(PROFILE_CONCAT(profileStage_, __LINE__))
+
+#define PROFILE_FRAME() Profiler::endFrame()
+
+#else /* PROFILING */
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#define PROFILE_FRAME()
+
+#endif /* PROFILING */
+
+#endif /* PROFILER_H */
@@ -5,6 +5,10 @@
 
 #include "thirdparty/tinythread.h"
 
+#ifdef PROFILING
+namespace Profiler { void lockContended(tthread::mutex& mutex); } // (see util/profiler.h)
+#endif
+
 template <class T>
 struct Synchronized : public T
 {
@@ -33,7 +37,14 @@ struct SynchronizationLock
 	template <typename T>
 	SynchronizationLock(const Synchronized<T>& t)
 	 : mutex(const_cast<tthread::mutex&>(t.mutex))
-	{ mutex.lock(); }
+	{
+#ifdef PROFILING
+		if (!mutex.try_lock())
+			Profiler::lockContended(mutex);
+#else
+		mutex.lock();
+#endif
+	}
 
 	~SynchronizationLock() { mutex.unlock(); }
 
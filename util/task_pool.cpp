@@ -0,0 +1,214 @@
+#include "task_pool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace {
+	struct Entry
+	{
+		TaskPool::Task task;
+		TaskPool::CancellationToken token;
+	};
+
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<Entry> queues[TaskPool::priorityCount];
+	};
+
+	// (tasks submitted without token)
+	const TaskPool::CancellationToken neverCancelled;
+
+	// State of the calling thread
+	thread_local int currentWorker = -1; // (-1 outside of the pool)
+	thread_local TaskPool::Priority currentPriority = TaskPool::INTERACTIVE;
+	thread_local const TaskPool::CancellationToken* currentToken = nullptr;
+
+	class Pool
+	{
+	public:
+		Pool()
+		 : mWorkers(TaskPool::threadCount()),
+		   mPending(0), mNextWorker(0),
+		   mStopped(false)
+		{
+			for (unsigned int i = 0; i < mWorkers.size(); ++i)
+				mThreads.push_back(std::thread(&Pool::run, this, i));
+		}
+
+		~Pool()
+		{
+			{
+				std::lock_guard<std::mutex> g(mSleepLock);
+				mStopped = true;
+				mSleepCond.notify_all();
+			}
+			// (the tasks still queued are dropped)
+			for (std::thread& t : mThreads)
+				t.join();
+		}
+
+		void push(Entry entry, TaskPool::Priority priority)
+		{
+			const unsigned int index = (currentWorker >= 0
+				? currentWorker : mNextWorker++ % mWorkers.size());
+
+			{
+				Worker& w = mWorkers[index];
+				std::lock_guard<std::mutex> g(w.lock);
+				w.queues[priority].push_back(std::move(entry));
+			}
+
+			std::lock_guard<std::mutex> g(mSleepLock);
+			++mPending;
+			mSleepCond.notify_one();
+		}
+
+	private:
+		// Takes the most urgent task: from the own queue first (newest),
+		// then from the other workers (oldest)
+		bool pop(unsigned int self, Entry& entry, TaskPool::Priority& priority)
+		{
+			const unsigned int count = mWorkers.size();
+
+			for (int p = 0; p < TaskPool::priorityCount; ++p) {
+				for (unsigned int k = 0; k < count; ++k) {
+					Worker& w = mWorkers[(self + k) % count];
+					std::lock_guard<std::mutex> g(w.lock);
+					std::deque<Entry>& queue = w.queues[p];
+					if (queue.empty())
+						continue;
+
+					if (k == 0) {
+						entry = std::move(queue.back());
+						queue.pop_back();
+					} else {
+						entry = std::move(queue.front());
+						queue.pop_front();
+					}
+					priority = TaskPool::Priority(p);
+					--mPending;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void run(unsigned int self)
+		{
+			currentWorker = self;
+
+			for (;;) {
+				Entry entry;
+				TaskPool::Priority priority;
+
+				if (!pop(self, entry, priority)) {
+					std::unique_lock<std::mutex> l(mSleepLock);
+					// (another worker may be taking the pending task)
+					while (mPending <= 0 && !mStopped)
+						mSleepCond.wait(l);
+					if (mStopped)
+						return;
+					continue;
+				}
+
+				if (entry.token.isCancelled())
+					continue;
+
+				currentPriority = priority;
+				currentToken = &entry.token;
+
+				try {
+					entry.task();
+
+				} catch (const std::exception& e) {
+					LOGE("Exception in task pool: %s", e.what());
+
+				} catch (...) {
+					LOGE("Unknown exception in task pool");
+				}
+
+				currentPriority = TaskPool::INTERACTIVE;
+				currentToken = nullptr;
+			}
+		}
+
+		std::vector<Worker> mWorkers;
+		std::vector<std::thread> mThreads;
+		std::atomic<int> mPending; // (tasks in the queues)
+		std::atomic<unsigned int> mNextWorker; // (round robin for external threads)
+		bool mStopped;
+		std::mutex mSleepLock;
+		std::condition_variable mSleepCond;
+	};
+
+	Pool& getPool()
+	{
+		static Pool pool; // (started on first use)
+		return pool;
+	}
+
+	std::mutex glTasksLock;
+	std::vector<TaskPool::Task> glTasks;
+} // namespace
+
+unsigned int TaskPool::threadCount()
+{
+	static const unsigned int count = std::max(1u, std::thread::hardware_concurrency());
+	return count;
+}
+
+void TaskPool::submit(Task task, Priority priority)
+{
+	submit(std::move(task), priority, neverCancelled);
+}
+
+void TaskPool::submit(Task task, Priority priority, const CancellationToken& token)
+{
+	android_assert(task);
+	android_assert(priority >= 0 && priority < priorityCount);
+	getPool().push(Entry { std::move(task), token }, priority);
+}
+
+TaskPool::Priority TaskPool::currentPriority()
+{
+	return ::currentPriority;
+}
+
+bool TaskPool::isCancelled()
+{
+	return currentToken && currentToken->isCancelled();
+}
+
+void TaskPool::postToGlThread(Task task)
+{
+	android_assert(task);
+	std::lock_guard<std::mutex> g(glTasksLock);
+	glTasks.push_back(std::move(task));
+}
+
+bool TaskPool::runGlTasks()
+{
+	std::vector<Task> tasks;
+	{
+		std::lock_guard<std::mutex> g(glTasksLock);
+		if (glTasks.empty())
+			return false;
+		tasks.swap(glTasks);
+	}
+
+	// (the tasks posted by these tasks run on the next call)
+	for (const Task& task : tasks) {
+		try {
+			task();
+		} catch (const std::exception& e) {
+			LOGE("Exception in GL thread task: %s", e.what());
+		}
+	}
+
+	return true;
+}
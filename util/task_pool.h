@@ -0,0 +1,69 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include "global.h"
+
+#include <atomic>
+#include <functional>
+
+// Process-wide pool of worker threads (one per core) shared by all
+// the background work: reslicing, isosurface extraction, streamlines,
+// dataset loading, and the Parallel::forEach() tasks they spawn.
+//
+// Each worker has its own queues: tasks submitted from a worker go to
+// its queue, which it runs newest first, and idle workers steal the
+// oldest tasks of the others. INTERACTIVE tasks always run before
+// BACKGROUND ones (no preemption though: a running background task is
+// never interrupted).
+namespace TaskPool
+{
+	enum Priority {
+		INTERACTIVE, // (results shown on the next frames)
+		BACKGROUND,  // (e.g. preloading)
+		priorityCount
+	};
+
+	// Shared flag: the tasks submitted with a cancelled token are
+	// skipped if they haven't started yet, and running ones may poll
+	// isCancelled(). Copies share the same flag.
+	class CancellationToken
+	{
+	public:
+		CancellationToken() : mFlag(std::make_shared<std::atomic<bool>>(false)) {}
+
+		void cancel() { *mFlag = true; }
+		bool isCancelled() const { return *mFlag; }
+
+	private:
+		std::shared_ptr<std::atomic<bool>> mFlag;
+	};
+
+	typedef std::function<void ()> Task;
+
+	// Number of worker threads (at least 1)
+	unsigned int threadCount();
+
+	// Queues "task" (any thread). The exceptions thrown by the task
+	// are logged and discarded.
+	void submit(Task task, Priority priority = BACKGROUND);
+	void submit(Task task, Priority priority, const CancellationToken& token);
+
+	// Priority of the task running on the calling thread
+	// (INTERACTIVE outside of the pool)
+	Priority currentPriority();
+
+	// True if the token of the task running on the calling thread
+	// has been cancelled
+	bool isCancelled();
+
+	// Queues "task" to be run on the GL thread by the next
+	// runGlTasks() call (any thread), e.g. to upload a result
+	void postToGlThread(Task task);
+
+	// Runs the tasks posted so far (once per frame), and returns
+	// true if there were some (so that the frame is rendered)
+	// (GL context)
+	bool runGlTasks();
+}
+
+#endif /* TASK_POOL_H */
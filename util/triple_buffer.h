@@ -0,0 +1,56 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include "global.h"
+
+#include <atomic>
+
+// Latest-value mailbox between one writer thread and one reader
+// thread. The writer fills back() then calls publish(); the reader
+// calls update() then reads front(). Neither side ever waits for the
+// other, and the reader always sees a complete value: the three
+// buffers are only swapped, never shared.
+template <typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer(const T& initial = T())
+	 : mBack(0), mMiddle(1), mFront(2)
+	{
+		for (T& buffer : mBuffers)
+			buffer = initial;
+	}
+
+	// (writer thread)
+	T& back() { return mBuffers[mBack]; }
+
+	// Makes back() the latest value (writer thread)
+	void publish()
+	{
+		mBack = mMiddle.exchange(mBack | freshBit) & indexMask;
+	}
+
+	// Makes the latest published value available as front(), and
+	// returns false if there was nothing new (reader thread)
+	bool update()
+	{
+		if (!(mMiddle.load() & freshBit))
+			return false;
+		mFront = mMiddle.exchange(mFront) & indexMask;
+		return true;
+	}
+
+	// (reader thread)
+	const T& front() const { return mBuffers[mFront]; }
+
+private:
+	static const unsigned int indexMask = 3;
+	static const unsigned int freshBit = 4; // set in mMiddle when published and not read yet
+
+	T mBuffers[3];
+	unsigned int mBack; // (writer thread)
+	std::atomic<unsigned int> mMiddle; // index of the buffer in between, plus freshBit
+	unsigned int mFront; // (reader thread)
+};
+
+#endif /* TRIPLE_BUFFER_H */
@@ -6,6 +6,7 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <time.h>
 
 namespace Utility {
 	template <typename T>
@@ -54,6 +55,14 @@ namespace Utility {
 		return result;
 	}
 
+	// Monotonic clock, in nanoseconds
+	inline long long currentTimeNs()
+	{
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+	}
+
 } // namespace
 
 #endif /* UTILITY_H */
@@ -6,79 +6,103 @@
 #include <functional>
 
 #include "thirdparty/tinythread.h"
+#include "util/task_pool.h"
 
+// Serial job processing the latest value given to process(), on the
+// shared TaskPool (no thread of its own). Values submitted while a
+// previous one is being processed are coalesced: only the most recent
+// one is handed to "func", and "func" never runs concurrently with
+// itself.
 template <typename T>
-class WorkerThread : public tthread::thread
+class WorkerThread
 {
 public:
-	// WorkerThread()
-	//  : mStopped(true), mNewData(false)
-	// {}
-
-	WorkerThread(typename std::function<void (T)> func)
-	 : tthread::thread(&run_, static_cast<void*>(this)),
-	   mFunc(func)
+	WorkerThread(typename std::function<void (T)> func,
+	             TaskPool::Priority priority = TaskPool::INTERACTIVE)
+	 : mFunc(func), mPriority(priority),
+	   mStopped(false), mNewData(false), mBusy(false)
 	{}
 
+	~WorkerThread()
+	{
+		stop();
+
+		// (waits for "func" to return, or for the queued task to see
+		// mStopped)
+		tthread::lock_guard<tthread::mutex> g(mLock);
+		while (mBusy)
+			mCond.wait(mLock);
+	}
+
 	void process(const T& data)
 	{
+		tthread::lock_guard<tthread::mutex> g(mLock);
 		android_assert(!mStopped);
-		android_assert(joinable());
-		tthread::lock_guard<tthread::mutex> g(mDataLock);
 		mData = data;
 		mNewData = true;
-		mCond.notify_one();
+
+		// (a running task picks up the new data when "func" returns)
+		if (!mBusy) {
+			mBusy = true;
+			TaskPool::submit([this]() { run(); }, mPriority);
+		}
 	}
 
 	void stop()
 	{
+		tthread::lock_guard<tthread::mutex> g(mLock);
 		mStopped = true;
 	}
 
+	// True when there is no pending data and "func" is not running
 	bool isWaiting()
 	{
-		return !mNewData;
+		tthread::lock_guard<tthread::mutex> g(mLock);
+		return !mNewData && !mBusy;
 	}
 
 private:
-	static void run_(void* this_)
-	{ static_cast<WorkerThread*>(this_)->run(); }
+	WorkerThread(const WorkerThread&); // not implemented
+	void operator=(const WorkerThread&); // not implemented
 
+	// (pool thread)
 	void run()
 	{
-		try {
-			mStopped = false;
-			mNewData = false;
-			mData = T();
-
-			while (!mStopped) {
-				while (!mNewData) {
-					mCond.wait(mLock);
+		for (;;) {
+			T data;
+
+			{
+				tthread::lock_guard<tthread::mutex> g(mLock);
+				if (!mNewData || mStopped) {
+					mBusy = false;
+					mCond.notify_all();
+					return;
 				}
 
-				tthread::lock_guard<tthread::mutex> g(mDataLock);
-				mFunc(mData);
+				data = mData;
 				mNewData = false;
 			}
 
-		} catch (const std::exception& e) {
-			LOGE("Exception in worker thread: %s", e.what());
+			// "mLock" is released here, so that process() never blocks
+			// while "func" is running
+			try {
+				mFunc(data);
 
-		} catch (...) {
-			LOGE("Unknown exception in worker thread");
-		}
+			} catch (const std::exception& e) {
+				LOGE("Exception in worker thread: %s", e.what());
 
-		// Unblock the parent thread in case it is still waiting for
-		// isWaiting() == true
-		mNewData = false;
+			} catch (...) {
+				LOGE("Unknown exception in worker thread");
+			}
+		}
 	}
 
 	typename std::function<void (T)> mFunc;
-	bool mStopped, mNewData;
+	const TaskPool::Priority mPriority;
+	bool mStopped, mNewData, mBusy;
+	T mData;
 	tthread::mutex mLock;
 	tthread::condition_variable mCond;
-	T mData;
-	tthread::mutex mDataLock;
 };
 
 #endif /* WORKER_THREAD_H */
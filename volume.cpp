@@ -2,8 +2,11 @@
 
 #include "rendering/material.h"
 #include "getprocaddress.h"
+#include "gpu_resources.h"
+#include "rendering/gl_objects.h"
 
 #include <limits>
+#include <algorithm>
 
 #include <vtkNew.h>
 #include <vtkDataSetReader.h>
@@ -46,9 +49,6 @@ namespace {
 		"attribute mediump vec3 texCoord;\n"
 		"varying mediump vec3 v_texCoord;\n"
 
-		"uniform highp vec4 clipPlane;\n"
-		"varying highp float v_clipDist;\n"
-
 		"void main() {\n"
 		// "  if (invert == 0)\n"
 		// "    v_texCoord = texCoord;\n"
@@ -59,9 +59,6 @@ namespace {
 		"  mediump vec3 scale = vec3(float(dimensions.x), float(dimensions.y), float(dimensions.z)) * spacing;\n"
 		"  highp vec4 viewSpacePos = modelView * vec4(scale * (vertex * vec3(1.0, 1.0, -1.0)), 1.0);\n"
 		"  gl_Position = projection * viewSpacePos;\n"
-
-		"  v_clipDist = dot(viewSpacePos.xyz, clipPlane.xyz) + clipPlane.w;\n"
-
 		"}";
 
 	// // #ifndef GL_TEXTURE_2D_ARRAY_EXT
@@ -88,10 +85,14 @@ namespace {
 		"//#extension GL_OES_texture_3D : require\n"
 		"varying mediump vec3 v_texCoord;\n"
 		// "uniform lowp sampler2DArray texture;\n"
-		"uniform lowp sampler3D texture;\n"
+		"uniform highp sampler3D texture;\n" // (0 for invalid voxels, 8 or 16-bit, see GpuResources)
+		"uniform lowp sampler2D transferFunction;\n"
 		"uniform lowp float opacity;\n"
+		"uniform mediump float planeStep;\n" // (planes drawn, see Volume::setPlaneStep())
 
-		"varying highp float v_clipDist;\n"
+		// The transfer function texture holds TransferFunction::lutSize
+		// colors, sampled at texel centers
+		"const highp float lutSize = 4096.0;\n"
 
 		// // "Jet" color map (http://www.metastine.com/?p=7)
 		// // FIXME: duplicated code (see isosurface.cpp)
@@ -105,99 +106,61 @@ namespace {
 		// "  lowp float f = -value4 + 2.5;\n"
 		// "  return clamp(vec3(min(a,b), min(c,d), min(e,f)), 0.0, 1.0);\n"
 		// "}\n"
+		// (no discard: the planes are clipped on the CPU, see
+		// Volume::clipPlanes())
 		"void main() {\n"
 
-		"#ifndef FAST\n"
-		"if (v_clipDist > 0.0) discard;\n"
-		"#endif\n"
-
 		// "  lowp float value = texture2DArray(texture, v_texCoord).a;\n"
 		// "  gl_FragColor = vec4(colormap(value), 0.03+0.3*value);\n"
 		// "  gl_FragColor = vec4(vec3(value), 0.03+0.3*value);\n"
 		// "  gl_FragColor = vec4(colormap(value), 1.0);\n"
 
 		// "  gl_FragColor = texture2DArray(texture, v_texCoord);\n"
-		"  gl_FragColor = texture3D(texture, v_texCoord) * vec4(1.0, 1.0, 1.0, opacity);\n"
+		"  highp float value = texture3D(texture, v_texCoord).r;\n"
+		"  lowp vec4 color = texture2D(transferFunction, vec2((value*(lutSize-1.0) + 0.5) / lutSize, 0.5));\n"
+		// (opacity corrected for the plane spacing)
+		"  color.a = 1.0 - pow(1.0 - color.a*opacity, planeStep);\n"
+		"  gl_FragColor = color;\n"
 
 		"}";
 
-	void colormap(double value, float& r, float& g, float& b_) {
-		float value4 = 4.0f * value;
-		float a =  value4 - 1.5f;
-		float b = -value4 + 4.5f;
-		float c =  value4 - 0.5f;
-		float d = -value4 + 3.5f;
-		float e =  value4 + 0.5f;
-		float f = -value4 + 2.5f;
-		r  = std::min(std::max(std::min(a,b), 0.0f), 1.0f);
-		g  = std::min(std::max(std::min(c,d), 0.0f), 1.0f);
-		b_ = std::min(std::max(std::min(e,f), 0.0f), 1.0f);
-	}
-
-	Synchronized<std::list<GLuint>> staleTexturesList;
-
 } // namespace
 
-Volume::Volume(vtkSmartPointer<vtkImageData> data)
- : mMaterialClip(MaterialSharedPtr(new Material(vertexShader, /*"#version 100\n" +*/ std::string(fragmentShader)))),
-   mMaterialFast(MaterialSharedPtr(new Material(vertexShader, /*"#version 100\n*/"#define FAST\n" + std::string(fragmentShader)))),
+Volume::Volume(GpuResourcesSharedPtr resources)
+ : mResources(resources),
+   mMaterialFast(Material::get(vertexShader, fragmentShader)),
    mBound(false),
    mVertexAttrib(-1), mTexCoordAttrib(-1),
-   mProjectionUniform(-1), mModelViewUniform(-1), mDimensionsUniform(-1), mInvertUniform(-1), mClipPlaneUniform(-1), mSpacingUniform(-1), mOpacityUniform(-1),
+   mProjectionUniform(-1), mModelViewUniform(-1), mDimensionsUniform(-1), mInvertUniform(-1), mSpacingUniform(-1), mOpacityUniform(-1),
+   mTextureUniform(-1), mTransferFunctionUniform(-1), mPlaneStepUniform(-1),
+   mVertexBuffer(0), mTexCoordBuffer(0),
+   mVertexArray(0),
+   mClippedVertexArray(0), mClippedVertexArrayBuffer(0),
+   mIndexBufferX(0), mIndexBufferY(0), mIndexBufferZ(0),
    // mTextureXHandle(0), mTextureYHandle(0), mTextureZHandle(0)
-   mTextureHandle(0),
-   mOpacity(1.0f)
+   mOpacity(1.0f),
+   mPlaneStep(1)
 {
-	android_assert(data);
-
-	clearClipPlane();
+	android_assert(mResources);
 
-	// Check if the data dimension is 3
-	int dim = data->GetDataDimension();
-	LOGD("dimension = %d", dim);
-	if (dim != 3) {
-		throw std::runtime_error(
-			"Volume: data is not 3D (dimension = " + Utility::toString(dim) + ")"
-		);
+	for (int axis = 0; axis < 3; ++axis) {
+		std::fill(mSteppedIndexBuffers[axis], mSteppedIndexBuffers[axis]+maxPlaneStep, 0);
+		std::fill(mSteppedIndexCounts[axis], mSteppedIndexCounts[axis]+maxPlaneStep, 0);
 	}
 
-	if (!data->GetPointData() || !data->GetPointData()->GetScalars())
-		throw std::runtime_error("IsoSurface: unsupported data");
+	clearClipPlane();
 
-	data->GetDimensions(mDimensions);
+	// (the data itself is checked by GpuResources)
+	std::copy(mResources->getDimensions(), mResources->getDimensions()+3, mDimensions);
 	LOGD("dimensions %d %d %d", mDimensions[0], mDimensions[1], mDimensions[2]);
 
-	double spacing[3];
-	data->GetSpacing(spacing);
-	LOGD("spacing %f %f %f", spacing[0], spacing[1], spacing[2]);
-	mSpacing = Vector3(spacing[0], spacing[1], spacing[2]);//.normalized();
+	mSpacing = mResources->getSpacing();
+	LOGD("spacing %f %f %f", mSpacing.x, mSpacing.y, mSpacing.z);
 
-	data->GetPointData()->GetScalars()->GetRange(mRange);
+	mRange[0] = mResources->getRange()[0];
+	mRange[1] = mResources->getRange()[1];
 	LOGD("range min=%f max=%f", mRange[0], mRange[1]);
 
-	vtkDataArray* scalars = data->GetPointData()->GetScalars();
-	android_assert(scalars);
-
-	unsigned int num = scalars->GetNumberOfTuples();
-	android_assert(num == static_cast<unsigned>(mDimensions[0]*mDimensions[1]*mDimensions[2]));
-	mTexture.resize(num*4);
-
-	for (unsigned int i = 0; i < num; ++i) {
-		double value = scalars->GetComponent(i, 0);
-		double norm = (value-mRange[0]) / (mRange[1]-mRange[0]);
-		float r, g, b;
-		colormap(norm, r, g, b);
-		mTexture[i*4+0] = r*255;
-		mTexture[i*4+1] = g*255;
-		mTexture[i*4+2] = b*255;
-		// mTexture[i*4+3] = (0.03+0.3*norm)*255;
-		mTexture[i*4+3] = (0.03+0.97*norm)*255; // alpha
-		// mTexture[i*4+3] = 0.3*norm*255;
-		// mTexture[i*4+3] = (0.3+0.7*norm)*255;
-		// mTexture[i*4+3] = (0.1+0.7*norm)*255;
-		// mTexture[i*4+3] = norm*255;
-	}
-
 	// vtkNew<vtkExtractVOI> sliceFilter;
 	// sliceFilter->SetInputData(data);
 
@@ -297,14 +260,24 @@ Volume::Volume(vtkSmartPointer<vtkImageData> data)
 	LOGD("loading finished");
 }
 
+std::size_t Volume::getMemoryUsage() const
+{
+	return (mVertices.capacity() + mTexCoords.capacity() + mClippedVertices.capacity()) * sizeof(GLfloat)
+		+ (mIndicesX.capacity() + mIndicesY.capacity() + mIndicesZ.capacity()) * sizeof(GLushort);
+}
+
 Volume::~Volume()
 {
-	// Schedule texture to be cleared
-	if (mTextureHandle != 0) {
-		synchronized (staleTexturesList) {
-			staleTexturesList.emplace_back(mTextureHandle);
-		}
-	}
+	GlObjects::deleteBuffers(getBuffers());
+	GlObjects::deleteVertexArrays({ mVertexArray, mClippedVertexArray });
+}
+
+std::vector<GLuint> Volume::getBuffers() const
+{
+	std::vector<GLuint> result = { mVertexBuffer, mTexCoordBuffer, mIndexBufferX, mIndexBufferY, mIndexBufferZ };
+	for (int axis = 0; axis < 3; ++axis)
+		result.insert(result.end(), mSteppedIndexBuffers[axis], mSteppedIndexBuffers[axis]+maxPlaneStep);
+	return result;
 }
 
 
@@ -322,6 +295,12 @@ void Volume::setClipPlane(float a, float b, float c, float d)
 	mClipEq[3] = d;
 }
 
+void Volume::setPlaneStep(unsigned int step)
+{
+	// (not std::min(), which would need a definition of maxPlaneStep)
+	mPlaneStep = (step < 1 ? 1 : step > maxPlaneStep ? maxPlaneStep : step);
+}
+
 void Volume::clearClipPlane()
 {
 	mClipEq[0] = mClipEq[1] = mClipEq[2] = 0;
@@ -336,8 +315,17 @@ void Volume::switchMaterial(MaterialSharedPtr newMaterial)
 		return;
 
 	android_assert(newMaterial);
+
+	// (the attributes of the previous material may be elsewhere)
+	if (mMaterial && mVertexArray != 0) {
+		glBindVertexArray(mVertexArray);
+		glDisableVertexAttribArray(mVertexAttrib);
+		glDisableVertexAttribArray(mTexCoordAttrib);
+		glBindVertexArray(0);
+	}
+	mClippedVertexArrayBuffer = 0; // (specified again on next use)
+
 	mMaterial = newMaterial;
-	// LOGD("switching to volume material: %s", (newMaterial == mMaterialFast ? "fast" : "clip"));
 
 	mMaterial->bind();
 
@@ -347,9 +335,11 @@ void Volume::switchMaterial(MaterialSharedPtr newMaterial)
 	mProjectionUniform = mMaterial->getUniform("projection");
 	mDimensionsUniform = mMaterial->getUniform("dimensions");
 	mInvertUniform = mMaterial->getUniform("invert");
-	mClipPlaneUniform = mMaterial->getUniform("clipPlane");
 	mSpacingUniform = mMaterial->getUniform("spacing");
 	mOpacityUniform = mMaterial->getUniform("opacity");
+	mTextureUniform = mMaterial->getUniform("texture");
+	mTransferFunctionUniform = mMaterial->getUniform("transferFunction");
+	mPlaneStepUniform = mMaterial->getUniform("planeStep");
 
 	android_assert(mVertexAttrib != -1);
 	android_assert(mTexCoordAttrib != -1);
@@ -357,9 +347,63 @@ void Volume::switchMaterial(MaterialSharedPtr newMaterial)
 	android_assert(mProjectionUniform != -1);
 	android_assert(mDimensionsUniform != -1);
 	android_assert(mInvertUniform != -1);
-	if (hasClipPlane()) android_assert(mClipPlaneUniform != -1);
 	android_assert(mSpacingUniform != -1);
 	android_assert(mOpacityUniform != -1);
+	android_assert(mTextureUniform != -1);
+	android_assert(mTransferFunctionUniform != -1);
+	android_assert(mPlaneStepUniform != -1);
+
+	specifyVertexArray();
+}
+
+// (GL context)
+void Volume::specifyVertexArray()
+{
+	if (mVertexArray == 0)
+		glGenVertexArrays(1, &mVertexArray);
+
+	glBindVertexArray(mVertexArray);
+
+	// Vertices
+	android_assert(mVertexBuffer != 0);
+	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, nullptr);
+	glEnableVertexAttribArray(mVertexAttrib);
+
+	// Texture coordinates
+	android_assert(mTexCoordBuffer != 0);
+	glBindBuffer(GL_ARRAY_BUFFER, mTexCoordBuffer);
+	glVertexAttribPointer(mTexCoordAttrib, 3, GL_FLOAT, false, 0, nullptr);
+	glEnableVertexAttribArray(mTexCoordAttrib);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// (GL context)
+GLuint Volume::getIndexBuffer(int axis, const std::vector<GLushort>& indices, GLuint fullBuffer, GLsizei& count)
+{
+	if (mPlaneStep <= 1) {
+		count = indices.size();
+		return fullBuffer;
+	}
+
+	GLuint& buffer = mSteppedIndexBuffers[axis][mPlaneStep-1];
+	if (!buffer) {
+		// (6 indices per plane)
+		std::vector<GLushort> stepped;
+		for (std::size_t i = 0; i+6 <= indices.size(); i += 6*mPlaneStep)
+			stepped.insert(stepped.end(), indices.begin()+i, indices.begin()+i+6);
+
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, stepped.size()*sizeof(GLushort),
+		             stepped.data(), GL_STATIC_DRAW);
+		mSteppedIndexCounts[axis][mPlaneStep-1] = stepped.size();
+	}
+
+	count = mSteppedIndexCounts[axis][mPlaneStep-1];
+	return buffer;
 }
 
 // (GL context)
@@ -368,33 +412,21 @@ void Volume::bind()
 	if (mMaterial)
 		mMaterial->bind();
 
-	// Required because input is not RGBA (i.e. not aligned to a 4-byte boundary)
-	// http://www.opengl.org/wiki/Common_Mistakes#Texture_upload_and_pixel_reads
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	mResources->bind();
 
-	glGenTextures(1, &mTextureHandle);
-	glBindTexture(GL_TEXTURE_3D/*_OES*/, mTextureHandle);
-	glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_WRAP_R/*_OES*/, GL_CLAMP_TO_EDGE);
+	// (all created again below, and the stepped buffers on first use)
+	const std::vector<GLuint> buffers = getBuffers();
+	for (GLuint buffer : buffers) {
+		if (buffer != 0)
+			glDeleteBuffers(1, &buffer);
+	}
+	for (int axis = 0; axis < 3; ++axis)
+		std::fill(mSteppedIndexBuffers[axis], mSteppedIndexBuffers[axis]+maxPlaneStep, 0);
 
-	// PFNGLTEXIMAGE3DOESPROC glTexImage3DOES = nullptr;
-	// glTexImage3DOES = GetProcAddress<PFNGLTEXIMAGE3DOESPROC>("glTexImage3DOES");
-
-	// Initialize the texture
-	// glTexImage3DOES(
-	glTexImage3D(
-		GL_TEXTURE_3D/*_OES*/,
-		0,
-		GL_RGBA,
-		mDimensions[0], mDimensions[1], mDimensions[2],
-		0,
-		GL_RGBA,
-		GL_UNSIGNED_BYTE,
-		mTexture.data()
-	);
+	mClippedBuffer.bind();
+	if (mClippedVertexArray == 0)
+		glGenVertexArrays(1, &mClippedVertexArray);
+	mClippedVertexArrayBuffer = 0; // (specified on first use)
 
 	unsigned int baseIndex = 0;
 	initXPlanes(baseIndex);
@@ -440,6 +472,10 @@ void Volume::bind()
 	             mIndicesZ.data(), GL_STATIC_DRAW);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+	// (the buffers changed)
+	if (mMaterial)
+		specifyVertexArray();
+
 	mBound = true;
 }
 
@@ -685,50 +721,32 @@ void Volume::initZPlanes(unsigned int& baseIndex)
 // (GL context)
 void Volume::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix)
 {
-	synchronized (staleTexturesList) {
-		if (!staleTexturesList.empty()) {
-			LOGD("freeing %ld texture(s)", staleTexturesList.size());
-			for (GLuint texture : staleTexturesList)
-				glDeleteTextures(1, &texture);
-			staleTexturesList.clear();
-		}
-	}
-
 	if (!mBound)
 		bind();
 
-	switchMaterial(hasClipPlane() ? mMaterialClip : mMaterialFast);
+	switchMaterial(mMaterialFast);
 	android_assert(mMaterial);
 
-	// Vertices
-	android_assert(mVertexBuffer != 0);
-	glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
-	android_assert(mVertexAttrib != -1);
-	glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, nullptr);
-	glEnableVertexAttribArray(mVertexAttrib);
-
-	// Texture coordinates
-	android_assert(mTexCoordBuffer != 0);
-	glBindBuffer(GL_ARRAY_BUFFER, mTexCoordBuffer);
-	android_assert(mTexCoordAttrib != -1);
-	glVertexAttribPointer(mTexCoordAttrib, 3, GL_FLOAT, false, 0, nullptr);
-	glEnableVertexAttribArray(mTexCoordAttrib);
-
 	// Uniforms
 	glUseProgram(mMaterial->getHandle());
 	glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_);
-	glUniform4fv(mClipPlaneUniform, 1, mClipEq);
 	glUniform3f(mSpacingUniform, mSpacing.x, mSpacing.y, mSpacing.z);
 	glUniform1f(mOpacityUniform, mOpacity);
+	glUniform1f(mPlaneStepUniform, mPlaneStep);
 
 	int dimVec[3];
 	dimVec[0] = mDimensions[0];
 	dimVec[1] = mDimensions[1];
 	dimVec[2] = mDimensions[2];
+	glUniform3iv(mDimensionsUniform, 1, dimVec);
 
-	// glActiveTexture(GL_TEXTURE0);
+	// Textures (shared scalars, then the transfer function)
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, mResources->getTransferFunctionTexture(0.03, 0.97));
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_3D/*_OES*/, mTextureHandle);
+	glBindTexture(GL_TEXTURE_3D/*_OES*/, mResources->getScalarTexture());
+	glUniform1i(mTextureUniform, 0);
+	glUniform1i(mTransferFunctionUniform, 1);
 
 	Matrix3 normalMatrix = modelViewMatrix.inverse().transpose().get3x3Matrix();
 
@@ -746,73 +764,140 @@ void Volume::render(const Matrix4& projectionMatrix, const Matrix4& modelViewMat
 
 	// Display the planes whose normal is closest to the screen normal
 	// http://prosjekt.ffi.no/unik-4660/lectures04/chapters/Voxel1.html
+	int axis;
+	float dot;
 	if (std::abs(xDot) > std::abs(yDot) && std::abs(xDot) > std::abs(zDot)) {
 		// LOGD("largest: xDot (%f)", xDot);
-		// dimVec[3] = mTexturesX.size();
-		// dimVec[3] = mDimensions[0];
-		glUniform3iv(mDimensionsUniform, 1, dimVec);
-		if (xDot < 0) {
-			glUniformMatrix4fv(mModelViewUniform, 1, false, modelViewMatrix.data_);
-			// glUniform1i(mInvertUniform, 0);
-			glUniform3f(mInvertUniform, 0, 0, 0);
-		} else {
-			glUniformMatrix4fv(mModelViewUniform, 1, false, (modelViewMatrix * xInv).data_);
-			// glUniform1i(mInvertUniform, 1);
-			glUniform3f(mInvertUniform, 1, 0, 0);
-		}
-		// X planes
-		android_assert(mIndexBufferX != 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBufferX);
-		// android_assert(mTextureXHandle != 0);
-		// glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, mTextureXHandle);
-		glDrawElements(GL_TRIANGLES, mIndicesX.size(), GL_UNSIGNED_SHORT, nullptr);
-
+		axis = 0;
+		dot = xDot;
 	} else if (std::abs(yDot) > std::abs(xDot) && std::abs(yDot) > std::abs(zDot)) {
 		// LOGD("largest: yDot (%f)", yDot);
-		// dimVec[3] = mTexturesY.size();
-		// dimVec[3] = mDimensions[1];
-		glUniform3iv(mDimensionsUniform, 1, dimVec);
-		if (yDot < 0) {
-			glUniformMatrix4fv(mModelViewUniform, 1, false, modelViewMatrix.data_);
-			// glUniform1i(mInvertUniform, 0);
-			glUniform3f(mInvertUniform, 0, 0, 0);
-		} else {
-			glUniformMatrix4fv(mModelViewUniform, 1, false, (modelViewMatrix * yInv).data_);
-			// glUniform1i(mInvertUniform, 1);
-			glUniform3f(mInvertUniform, 0, 1, 0);
-		}
-		// Y planes
-		android_assert(mIndexBufferY != 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBufferY);
-		// android_assert(mTextureYHandle != 0);
-		// glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, mTextureYHandle);
-		glDrawElements(GL_TRIANGLES, mIndicesY.size(), GL_UNSIGNED_SHORT, nullptr);
-
+		axis = 1;
+		dot = yDot;
 	} else {
 		// LOGD("largest: zDot (%f)", zDot);
-		// dimVec[3] = mTexturesZ.size();
-		// dimVec[3] = mDimensions[2];
-		glUniform3iv(mDimensionsUniform, 1, dimVec);
-		if (zDot < 0) {
-			glUniformMatrix4fv(mModelViewUniform, 1, false, modelViewMatrix.data_);
-			// glUniform1i(mInvertUniform, 0);
-			glUniform3f(mInvertUniform, 0, 0, 0);
-		} else {
-			glUniformMatrix4fv(mModelViewUniform, 1, false, (modelViewMatrix * zInv).data_);
-			// glUniform1i(mInvertUniform, 1);
-			glUniform3f(mInvertUniform, 0, 0, 1);
+		axis = 2;
+		dot = zDot;
+	}
+
+	static const Matrix4* const inversions[3] = { &xInv, &yInv, &zInv };
+	const Matrix4 mv = (dot < 0 ? modelViewMatrix : modelViewMatrix * *inversions[axis]);
+	glUniformMatrix4fv(mModelViewUniform, 1, false, mv.data_);
+	glUniform3f(mInvertUniform, (dot >= 0 && axis == 0), (dot >= 0 && axis == 1), (dot >= 0 && axis == 2));
+
+	const std::vector<GLushort>* const indices[3] = { &mIndicesX, &mIndicesY, &mIndicesZ };
+	const GLuint fullBuffers[3] = { mIndexBufferX, mIndexBufferY, mIndexBufferZ };
+	android_assert(fullBuffers[axis] != 0);
+
+	if (hasClipPlane()) {
+		// Clip plane in vertex coordinates (same transform as the
+		// vertex shader)
+		const Vector3 scale = Vector3(mDimensions[0], mDimensions[1], mDimensions[2]) * mSpacing;
+		const Matrix4 boxToEye = mv * Matrix4::makeTransform(Vector3::zero(), Quaternion::identity(), Vector3(scale.x, scale.y, -scale.z));
+		float clipEq[4];
+		for (int j = 0; j < 4; ++j)
+			clipEq[j] = mClipEq[0]*boxToEye[j][0] + mClipEq[1]*boxToEye[j][1] + mClipEq[2]*boxToEye[j][2] + mClipEq[3]*boxToEye[j][3];
+
+		// (the static buffers are drawn if nothing is clipped)
+		unsigned int clippedCorners = 0;
+		for (int i = 0; i < 8; ++i) {
+			const float x = (i & 1 ? 0.5f : -0.5f), y = (i & 2 ? 0.5f : -0.5f), z = (i & 4 ? 0.5f : -0.5f);
+			if (clipEq[0]*x + clipEq[1]*y + clipEq[2]*z + clipEq[3] > 0)
+				++clippedCorners;
+		}
+
+		if (clippedCorners == 8) {
+			glBindVertexArray(0);
+			return;
+		}
+
+		if (clippedCorners > 0) {
+			renderClipped(*indices[axis], clipEq);
+			return;
 		}
-		// Z planes
-		android_assert(mIndexBufferZ != 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBufferZ);
-		// android_assert(mTextureZHandle != 0);
-		// glBindTexture(GL_TEXTURE_2D_ARRAY_EXT, mTextureZHandle);
-		glDrawElements(GL_TRIANGLES, mIndicesZ.size(), GL_UNSIGNED_SHORT, nullptr);
 	}
 
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	// Vertices and texture coordinates, and the planes of the axis
+	glBindVertexArray(mVertexArray);
+	GLsizei count;
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, getIndexBuffer(axis, *indices[axis], fullBuffers[axis], count));
+	glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, nullptr);
+	glBindVertexArray(0);
+}
+
+void Volume::clipPlanes(const std::vector<GLushort>& indices, const float* clipEq, std::vector<GLfloat>& result) const
+{
+	result.clear();
+
+	// (6 indices per plane, the 4 vertices of the plane first)
+	for (std::size_t i = 0; i+6 <= indices.size(); i += 6*mPlaneStep) {
+		const unsigned int first = indices[i];
+		const GLfloat* v = &mVertices[first*3];
+		const GLfloat* t = &mTexCoords[first*3];
+
+		float dist[4];
+		bool clipped = true;
+		for (int k = 0; k < 4; ++k) {
+			dist[k] = clipEq[0]*v[k*3+0] + clipEq[1]*v[k*3+1] + clipEq[2]*v[k*3+2] + clipEq[3];
+			clipped = clipped && (dist[k] > 0);
+		}
+		if (clipped)
+			continue;
+
+		// Part of the quad where dist <= 0 (convex, at most 5
+		// vertices), each vertex being (x, y, z, s, t, r)
+		GLfloat polygon[5][6];
+		int n = 0;
+		for (int k = 0; k < 4; ++k) {
+			const int k1 = (k+1) % 4;
+			if (dist[k] <= 0) {
+				std::copy(v + k*3, v + k*3+3, polygon[n]);
+				std::copy(t + k*3, t + k*3+3, polygon[n]+3);
+				++n;
+			}
+			if ((dist[k] <= 0) != (dist[k1] <= 0)) {
+				const float f = dist[k] / (dist[k] - dist[k1]);
+				for (int c = 0; c < 3; ++c) {
+					polygon[n][c] = v[k*3+c] + (v[k1*3+c] - v[k*3+c]) * f;
+					polygon[n][c+3] = t[k*3+c] + (t[k1*3+c] - t[k*3+c]) * f;
+				}
+				++n;
+			}
+		}
+
+		// Triangle fan
+		for (int k = 1; k+1 < n; ++k) {
+			result.insert(result.end(), polygon[0], polygon[0]+6);
+			result.insert(result.end(), polygon[k], polygon[k]+6);
+			result.insert(result.end(), polygon[k+1], polygon[k+1]+6);
+		}
+	}
+}
+
+// (GL context)
+void Volume::renderClipped(const std::vector<GLushort>& indices, const float* clipEq)
+{
+	clipPlanes(indices, clipEq, mClippedVertices);
+	if (mClippedVertices.empty()) {
+		glBindVertexArray(0);
+		return;
+	}
+
+	const std::size_t vertexSize = 6*sizeof(GLfloat);
+	const std::size_t first = mClippedBuffer.write(mClippedVertices.data(), mClippedVertices.size()*sizeof(GLfloat), vertexSize) / vertexSize;
+
+	if (mClippedVertexArrayBuffer != mClippedBuffer.getHandle()) {
+		glBindVertexArray(mClippedVertexArray);
+		glBindBuffer(GL_ARRAY_BUFFER, mClippedBuffer.getHandle());
+		glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, vertexSize, nullptr);
+		glEnableVertexAttribArray(mVertexAttrib);
+		glVertexAttribPointer(mTexCoordAttrib, 3, GL_FLOAT, false, vertexSize, reinterpret_cast<const void*>(3*sizeof(GLfloat)));
+		glEnableVertexAttribArray(mTexCoordAttrib);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		mClippedVertexArrayBuffer = mClippedBuffer.getHandle();
+	}
 
-	glDisableVertexAttribArray(mVertexAttrib);
-	glDisableVertexAttribArray(mTexCoordAttrib);
+	glBindVertexArray(mClippedVertexArray);
+	glDrawArrays(GL_TRIANGLES, first, mClippedVertices.size()/6);
+	glBindVertexArray(0);
 }
@@ -3,16 +3,16 @@
 
 #include "global.h"
 
-#include <vtkSmartPointer.h>
+#include "rendering/stream_buffer.h"
 
 #include <list>
 
-class vtkImageData;
-
 class Volume
 {
 public:
-	Volume(vtkSmartPointer<vtkImageData> data);
+	// The scalar texture is shared with the other users of
+	// "resources"
+	Volume(GpuResourcesSharedPtr resources);
 	~Volume();
 
 	// (GL context)
@@ -21,6 +21,9 @@ public:
 	// (GL context)
 	void render(const Matrix4& projectionMatrix, const Matrix4& modelViewMatrix);
 
+	// The points where ax+by+cz+d > 0 (eye coordinates) are not drawn:
+	// the planes are clipped before being drawn, and the ones clipped
+	// entirely are skipped
 	void setClipPlane(float a, float b, float c, float d); // plane equation: ax+by+cz+d=0
 	void clearClipPlane();
 
@@ -29,6 +32,15 @@ public:
 
 	void setOpacity(float opacity) { mOpacity = opacity; }
 
+	// Only every "step"-th plane is drawn (1 to maxPlaneStep), the
+	// opacities being corrected for the plane spacing
+	void setPlaneStep(unsigned int step);
+	static const unsigned int maxPlaneStep = 4;
+
+	// CPU-side memory held by the volume, in bytes (not including
+	// the shared resources)
+	std::size_t getMemoryUsage() const;
+
 private:
 	bool hasClipPlane();
 
@@ -40,24 +52,53 @@ private:
 	// (GL context)
 	void switchMaterial(MaterialSharedPtr newMaterial);
 
+	// Points mVertexArray to the vertex buffers, for the attributes
+	// of the current material
+	// (GL context)
+	void specifyVertexArray();
+
+	// The vertex and index buffers (0 if not created)
+	std::vector<GLuint> getBuffers() const;
+
+	// Index buffer of every mPlaneStep-th plane of an axis ("indices"
+	// and "fullBuffer" holding all of them), built on first use
+	// (GL context)
+	GLuint getIndexBuffer(int axis, const std::vector<GLushort>& indices, GLuint fullBuffer, GLsizei& count);
+
+	// Triangles (x, y, z, s, t, r per vertex) of the part of every
+	// mPlaneStep-th plane of "indices" where the clip distance is <= 0
+	// ("clipEq" being the clip plane in vertex coordinates)
+	void clipPlanes(const std::vector<GLushort>& indices, const float* clipEq, std::vector<GLfloat>& result) const;
+
+	// Draws the clipPlanes() triangles (the uniforms being set)
+	// (GL context)
+	void renderClipped(const std::vector<GLushort>& indices, const float* clipEq);
+
+	GpuResourcesSharedPtr mResources;
 	MaterialSharedPtr mMaterial;
-	MaterialSharedPtr mMaterialClip, mMaterialFast;
+	MaterialSharedPtr mMaterialFast;
 	bool mBound;
 	GLint mVertexAttrib, mTexCoordAttrib, mSliceAttrib;
-	GLint mProjectionUniform, mModelViewUniform, mDimensionsUniform, mInvertUniform, mClipPlaneUniform, mSpacingUniform, mOpacityUniform;
+	GLint mProjectionUniform, mModelViewUniform, mDimensionsUniform, mInvertUniform, mSpacingUniform, mOpacityUniform;
+	GLint mTextureUniform, mTransferFunctionUniform, mPlaneStepUniform;
 	GLuint mVertexBuffer, mTexCoordBuffer;
+	GLuint mVertexArray;
+	StreamBuffer mClippedBuffer; // (clipped planes, written every frame)
+	GLuint mClippedVertexArray, mClippedVertexArrayBuffer; // (buffer the array points to)
+	std::vector<GLfloat> mClippedVertices; // (reused between frames)
 	GLuint mIndexBufferX, mIndexBufferY, mIndexBufferZ;
+	GLuint mSteppedIndexBuffers[3][maxPlaneStep]; // (by axis and step-1, 0 if not built)
+	GLsizei mSteppedIndexCounts[3][maxPlaneStep];
 	std::vector<GLfloat> mVertices, mTexCoords;
 	std::vector<GLushort> mIndicesX, mIndicesY, mIndicesZ;
 	// std::list<std::vector<unsigned char>> mTexturesX, mTexturesY, mTexturesZ;
-	std::vector<unsigned char> mTexture;
 	int mDimensions[3];
 	double mRange[2];
 	Vector3 mSpacing;
 	// GLuint mTextureXHandle, mTextureYHandle, mTextureZHandle;
-	GLuint mTextureHandle;
 	float mClipEq[4];
 	float mOpacity;
+	unsigned int mPlaneStep;
 };
 
 #endif /* VOLUME_H */
@@ -2,6 +2,10 @@
 
 #include "rendering/material.h"
 #include "getprocaddress.h"
+#include "transfer_function.h"
+#include "gpu_resources.h"
+#include "brick_pager.h"
+#include "util/parallel.h"
 
 #include <limits>
 
@@ -13,42 +17,10 @@
 #include <vtkDataArray.h>
 
 namespace {
-	const char* backFaceVertexShader =
-		// "#version 100\n"
-		"#ifndef GL_ES\n"
-		"#define highp\n"
-		"#define mediump\n"
-		"#define lowp\n"
-		"#endif\n"
-
-		"uniform highp mat4 projection;\n"
-		"uniform highp mat4 modelView;\n"
-		"uniform lowp ivec3 dimensions;\n" // (dimX,dimY,dimZ)
-		"uniform lowp vec3 spacing;\n"
-		"attribute highp vec3 vertex;\n"
-		"varying highp vec3 v_color;\n" // output color = vertex position (interpolated)
-
-		"void main() {\n"
-		"  mediump vec3 scale = vec3(float(dimensions.x), float(dimensions.y), float(dimensions.z)) * spacing;\n"
-		"  highp vec4 viewSpacePos = modelView * vec4(scale * (vertex * vec3(1.0, 1.0, -1.0)), 1.0);\n"
-		"  gl_Position = projection * viewSpacePos;\n"
-		"  v_color = vertex;\n"
-		"}";
-
-	const char* backFaceFragmentShader =
-		// "#version 100\n"
-		"#ifndef GL_ES\n"
-		"#define highp\n"
-		"#define mediump\n"
-		"#define lowp\n"
-		"#endif\n"
-
-		"varying highp vec3 v_color;\n"
-
-		"void main() {\n"
-		"  gl_FragColor = vec4(v_color, 1.0);\n"
-		"}";
-
+	// The bounding box is drawn in "box coordinates" ([0,1]^3), and
+	// the back faces give the exit point of each ray. The entry point
+	// is computed analytically from the eye position, so no back-face
+	// pass (nor any screen-sized buffer) is needed.
 	const char* vertexShader =
 		// "#version 100\n"
 		"#ifndef GL_ES\n"
@@ -62,26 +34,13 @@ namespace {
 		"uniform lowp ivec3 dimensions;\n" // (dimX,dimY,dimZ)
 		"uniform lowp vec3 spacing;\n"
 		"attribute highp vec3 vertex;\n"
-
-		// FIXME
-		"uniform highp vec4 clipPlane;\n"
-		"varying highp float v_clipDist;\n"
-
-		"varying highp vec3 v_entryPoint;\n"
-		// "varying highp vec4 v_exitPoint;\n"
-		"varying highp vec4 v_pos;\n"
+		"varying highp vec3 v_pos;\n" // box coordinates
 
 		"void main() {\n"
 		"  mediump vec3 scale = vec3(float(dimensions.x), float(dimensions.y), float(dimensions.z)) * spacing;\n"
 		"  highp vec4 viewSpacePos = modelView * vec4(scale * (vertex * vec3(1.0, 1.0, -1.0)), 1.0);\n"
 		"  gl_Position = projection * viewSpacePos;\n"
-
-		"  v_clipDist = dot(viewSpacePos.xyz, clipPlane.xyz) + clipPlane.w;\n"
-
-		"  v_entryPoint = vertex;\n"
-		"  v_pos = gl_Position;\n"
-		// "  v_exitPoint = gl_Position;\n"
-
+		"  v_pos = vertex;\n"
 		"}";
 
 	// #ifndef GL_TEXTURE_3D_OES
@@ -92,13 +51,6 @@ namespace {
 	// 	#define GL_TEXTURE_WRAP_R_OES 0x8072
 	// #endif
 
-	// FIXME: hardcoded values
-	// See also: glGetRenderbufferParameteriv(GL_RENDERBUFFER, GL_RENDERBUFFER_{WIDTH/HEIGHT}, ...)
-	// static const unsigned int screenWidth = 1920;
-	// static const unsigned int screenHeight = 1104;
-	static const unsigned int screenWidth = 800;
-	static const unsigned int screenHeight = 460;
-
 	const char* fragmentShader =
 		// "#version 100\n"
 		"#ifndef GL_ES\n"
@@ -107,104 +59,115 @@ namespace {
 		"#define lowp\n"
 		"#endif\n"
 
-		"#extension GL_OES_texture_3D : require\n"
-		"uniform lowp sampler3D texture;\n"
-		"uniform lowp sampler2D backFaceTexture;\n"
-		// "uniform lowp vec2 screenSize;\n"
+		"//#extension GL_OES_texture_3D : require\n"
+		"uniform highp sampler3D texture;\n" // (0 for invalid voxels, 8 or 16-bit, see GpuResources)
+		"uniform lowp sampler3D occupancy;\n" // max opacity per brick
+		"uniform lowp sampler2D transferFunction;\n"
+		"uniform highp vec3 eyePos;\n" // box coordinates
+		"uniform highp vec4 clipPlane;\n" // box coordinates
+		"uniform highp vec3 voxelDims;\n"
+		"uniform highp vec3 brickDims;\n"
+		"uniform mediump float stepSize;\n" // in voxels
+		"uniform lowp float opacity;\n"
+
+		"varying highp vec3 v_pos;\n" // exit point
+
+		"const int maxSteps = 2048;\n"
+		"const highp float brickSize = 8.0;\n" // see Volume3d::brickSize
+		"const highp float lutSize = 4096.0;\n" // see TransferFunction::lutSize
+
+		// Paged datasets: "texture" is the brick atlas, and the page
+		// table gives the atlas slot (rgb) and the level (a) of the
+		// finest resident brick covering each level 0 brick (see
+		// BrickPager)
+		"#ifdef PAGED\n"
+		"uniform lowp sampler3D pageTable;\n"
+		"uniform highp vec3 pageDims;\n"
+		"uniform highp vec3 atlasDims;\n"
+		"const highp float pageBrickSize = 64.0;\n" // see BrickPager::brickSize
+		"const highp float paddedBrickSize = 66.0;\n"
+
+		"highp float pagedValue(highp vec3 voxel) {\n"
+		"  highp vec3 v = clamp(voxel, vec3(0.0), voxelDims - 1.0);\n"
+		"  highp vec3 cell = floor(v / pageBrickSize);\n"
+		"  highp vec4 entry = floor(texture3D(pageTable, (cell + 0.5) / pageDims) * 255.0 + 0.5);\n"
+		// (level "l" bricks take every 2^l-th voxel)
+		"  highp float stride = exp2(entry.a);\n"
+		"  highp vec3 origin = floor(cell / stride) * pageBrickSize * stride;\n"
+		"  highp vec3 local = (v - origin) / stride;\n"
+		"  return texture3D(texture, (entry.rgb*paddedBrickSize + 1.0 + local + 0.5) / atlasDims).r;\n"
+		"}\n"
+		"#endif\n"
 
-		"varying highp float v_clipDist;\n" // FIXME
+		"void main() {\n"
+		"  highp vec3 dir = v_pos - eyePos;\n"
+		"  dir = mix(vec3(1e-6), dir, step(1e-6, abs(dir)));\n" // (avoids divisions by zero)
+
+		// Ray/box intersection: entry point (v_pos is at t = 1)
+		"  highp vec3 tMin = min(-eyePos / dir, (1.0 - eyePos) / dir);\n"
+		"  highp float tEntry = max(max(tMin.x, tMin.y), max(tMin.z, 0.0));\n"
+		"  highp float tExit = 1.0;\n"
+
+		// Only keep the part of the ray behind the clip plane
+		"  highp float clipStart = dot(clipPlane.xyz, eyePos) + clipPlane.w;\n"
+		"  highp float clipSlope = dot(clipPlane.xyz, dir);\n"
+		"  if (clipSlope > 0.0) tExit = min(tExit, -clipStart / clipSlope);\n"
+		"  else if (clipSlope < 0.0) tEntry = max(tEntry, -clipStart / clipSlope);\n"
+		"  else if (clipStart > 0.0) discard;\n"
+
+		"  if (tEntry >= tExit) discard;\n"
+
+		// The ray is marched in voxel units, "s" being the distance
+		// from the entry point. "voxel" coordinates are texel-centered
+		// (and the z axis is flipped, see the vertex shader).
+		"  highp float voxelLength = length(dir * voxelDims);\n"
+		"  highp float rayLength = (tExit - tEntry) * voxelLength;\n"
+		"  highp vec3 start = eyePos + dir*tEntry;\n"
+		"  highp vec3 voxelStart = vec3(start.x, start.y, 1.0-start.z) * voxelDims - 0.5;\n"
+		"  highp vec3 voxelDelta = vec3(dir.x, dir.y, -dir.z) * voxelDims / voxelLength;\n"
+		"  highp vec3 voxelSide = step(0.0, voxelDelta);\n"
+
+		"  lowp vec4 accum = vec4(0.0);\n"
+		"  highp float s = 0.0;\n"
+
+		"  for (int i = 0; i < maxSteps; ++i) {\n"
+		"    if (s >= rayLength) break;\n"
+
+		"    highp vec3 voxel = voxelStart + voxelDelta*s;\n"
+		"    highp vec3 brick = floor(voxel / brickSize);\n"
+
+		// Empty space skipping: jump to the next brick
+		"    if (texture3D(occupancy, (brick + 0.5) / brickDims).r == 0.0) {\n"
+		"      highp vec3 toSide = ((brick + voxelSide)*brickSize - voxel) / voxelDelta;\n"
+		"      s += min(min(toSide.x, toSide.y), toSide.z) + 0.01;\n"
+		"      continue;\n"
+		"    }\n"
+
+		"#ifdef PAGED\n"
+		"    highp float value = pagedValue(voxel);\n"
+		"#else\n"
+		"    highp float value = texture3D(texture, (voxel + 0.5) / voxelDims).r;\n"
+		"#endif\n"
+		"    lowp vec4 color = texture2D(transferFunction, vec2((value*(lutSize-1.0) + 0.5) / lutSize, 0.5));\n"
 
-		"varying highp vec3 v_entryPoint;\n"
-		// "varying highp vec4 v_exitPoint;\n"
-		"varying highp vec4 v_pos;\n"
+		// Adaptive sampling: samples contribute less and less as the
+		// ray gets opaque, so the step grows with the accumulated
+		// opacity. Opacities are corrected for the step length.
+		"    mediump float stepLength = stepSize * (1.0 + 3.0*accum.a);\n"
+		"    lowp float alpha = 1.0 - pow(1.0 - color.a*opacity, stepLength);\n"
+		"    accum.rgb += (1.0 - accum.a) * alpha * color.rgb;\n"
+		"    accum.a += (1.0 - accum.a) * alpha;\n"
 
-		"void main() {\n"
+		// Early ray termination
+		"    if (accum.a > 0.98) break;\n"
 
-		"  if (v_clipDist > 0.0) discard;\n" // FIXME
-
-		// "  highp vec3 exitPoint = texture2D(backFaceTexture, gl_FragCoord.st/screenSize).xyz;\n"
-		"  highp vec3 exitPoint = texture2D(backFaceTexture, ((v_pos.xy/v_pos.w)+1.0)/2.0).xyz;\n"
-		// "  if (v_entryPoint == exitPoint) discard;\n" // background need no raycasting
-
-		// "  highp vec3 dir = exitPoint - v_entryPoint;\n"
-		// "  highp float len = length(dir);\n"
-		// // "  lowp float stepSize = 0.001;\n"
-		// "  lowp float stepSize = 0.1;\n"
-		// "  highp vec3 deltaDir = normalize(dir) * stepSize;\n"
-		// "  highp float deltaDirLen = length(deltaDir);\n"
-		// "  highp vec3 voxelCoord = v_entryPoint;\n"
-		// "  lowp vec4 colorAccum = vec4(0.0);\n"
-		// "  lowp float alphaAccum = 0.0;\n"
-		// "  highp float lengthAccum = 0.0;\n"
-		// "  lowp vec4 bgColor = vec4(1.0, 1.0, 1.0, 0.0);\n"
-
-		// // "  for (int i = 0; i < 450; i++) {\n"
-		// "  for (int i = 0; i < 20; i++) {\n"
-		// "    lowp vec4 colorSample = texture3D(texture, voxelCoord);\n"
-		// "    lowp float alphaSample = colorSample.a * stepSize;\n"
-		// "    colorAccum += (1.0 - alphaAccum) * colorSample * alphaSample*3.0;\n"
-		// "    alphaAccum += alphaSample;\n"
-		// "    voxelCoord += deltaDir;\n"
-		// "    lengthAccum += deltaDirLen;\n"
-		// "    if (lengthAccum >= len || alphaAccum > 1.0) break;\n" // terminate if opacity > 1 or the ray is outside the volume
-	    // "  }\n"
-
-		// "  highp vec3 dir = exitPoint - v_entryPoint;\n"
-		"  highp vec3 dir = v_entryPoint - exitPoint;\n" // FIXME: entry/exit points are inverted for some reason
-		// "  highp vec3 deltaDir = dir / 15.0;\n" // 15 = num steps
-		"  highp vec3 deltaDir = normalize(dir) * 0.01;\n" // 0.01: step size
-		// "  highp vec3 deltaDir = normalize(dir) * 0.05;\n" // 0.05: step size
-		"  highp float len = length(dir);\n"
-		"  highp float deltaLen = length(deltaDir);\n"
-		// "  highp vec3 pos = v_entryPoint;\n"
-		"  highp vec3 pos = exitPoint;\n"
-		"  lowp vec4 colorAccum = vec4(0.0);\n"
-		"  highp float lengthAcc = 0.0;\n"
-		// "  for (int i = 0; i < 15; i++) {\n"
-		"  for (int i = 0; i < 100; i++) {\n"
-		// "    lowp vec4 colorSample = texture3D(texture, pos);\n"
-		"    lowp vec4 colorSample = texture3D(texture, vec3(pos.x, pos.y, 1.0-pos.z));\n"
-		// "    colorAccum += (1.0 - colorAccum.a) * colorAccum + colorSample * colorSample.a;\n"
-		// "    colorAccum += vec4(colorSample.xyz * colorSample.a, colorSample.a);\n"
-		// "    colorAccum.a = 1.0 - pow(1.0 - colorSample.a, 0.01*200.0);\n"
-		// "    colorAccum.rgb += (1.0 - colorAccum.a) * colorSample.rgb * colorSample.a;\n"
-		// "    colorAccum.a += (1.0 - colorAccum.a) * colorSample.a;\n"
-		// "    colorAccum.xyz += colorSample.xyz/15.0;\n" // 15 = num steps
-		// "    colorAccum.xyz += colorSample.xyz * 0.1;\n"
-		// "   lowp float alpha = pow(colorSample.a, 2.0);\n"
-		// "    lowp float alpha = pow(colorSample.a, 0.9);\n" // for step size = 0.05
-		"    lowp float alpha = pow(colorSample.a, 1.3);\n" // for step size = 0.01
-		// "    lowp float alpha = colorSample.a;\n"
-		"    colorAccum.a += alpha;\n"
-		"    colorAccum.xyz += colorSample.xyz * alpha;\n"
-		// "    colorAccum.xyz += mix(colorAccum.xyz, colorSample.xyz, alpha);\n"
-		// "    colorAccum.a += colorSample.a;\n"
-		"    pos += deltaDir;\n"
-		"    lengthAcc += deltaLen;\n"
-		"    if (lengthAcc >= len || colorAccum.a >= 1.0) break;\n"
-		// "    if (lengthAcc >= len) break;\n"
-	    "  }\n"
-
-		"  gl_FragColor = colorAccum;\n"
-		// "  gl_FragColor = vec4(vec3(length(dir)), 1.0);\n"
-		// "  gl_FragColor = texture3D(texture, exitPoint);\n"
+		"    s += stepLength;\n"
+		"  }\n"
 
+		"  if (accum.a <= 0.0) discard;\n"
+		"  gl_FragColor = vec4(accum.rgb / accum.a, accum.a);\n"
 		"}";
 
-	void colormap(double value, float& r, float& g, float& b_)
-	{
-		float value4 = 4.0f * value;
-		float a =  value4 - 1.5f;
-		float b = -value4 + 4.5f;
-		float c =  value4 - 0.5f;
-		float d = -value4 + 3.5f;
-		float e =  value4 + 0.5f;
-		float f = -value4 + 2.5f;
-		r  = std::min(std::max(std::min(a,b), 0.0f), 1.0f);
-		g  = std::min(std::max(std::min(c,d), 0.0f), 1.0f);
-		b_ = std::min(std::max(std::min(e,f), 0.0f), 1.0f);
-	}
-
 	void checkError(const char* msg)
 	{
 		GLenum err;
@@ -216,67 +179,45 @@ namespace {
 	// #define CHECK(x) (x)
 
 	Synchronized<std::list<GLuint>> staleTexturesList;
+
+	// NOTE: no constant opacity offset, otherwise no brick would
+	// ever be empty
+	// const float alphaOffset = 0.03, alphaScale = 0.3;
+	const float alphaOffset = 0, alphaScale = 0.3;
+
+	static_assert(Volume3d::brickSize == GpuResources::brickSize, "the occupancy is computed from the GpuResources bricks");
+	static_assert(BrickPager::brickSize == 64 && BrickPager::paddedBrickSize == 66, "hardcoded in the fragment shader");
 } // namespace
 
-Volume3d::Volume3d(vtkSmartPointer<vtkImageData> data)
- : mMaterial(MaterialSharedPtr(new Material(vertexShader, fragmentShader))),
-   mBackFaceMaterial(MaterialSharedPtr(new Material(backFaceVertexShader, backFaceFragmentShader))),
+Volume3d::Volume3d(GpuResourcesSharedPtr resources)
+ : mResources(resources),
+   mMaterial(Material::get(vertexShader, (resources && resources->getPager() ? "#define PAGED\n" : "") + std::string(fragmentShader))),
    mBound(false),
-   mVertexAttrib(-1), mBFVertexAttrib(-1),
-   mProjectionUniform(-1), mModelViewUniform(-1), mDimensionsUniform(-1), mClipPlaneUniform(-1), mSpacingUniform(-1), mScreenSizeUniform(-1),
-   mBFProjectionUniform(-1), mBFModelViewUniform(-1), mBFDimensionsUniform(-1), mBFSpacingUniform(-1),
-   mTextureHandle(0), mBackFaceTextureHandle(0),
-   mFrameBuffer(0)
+   mVertexAttrib(-1),
+   mProjectionUniform(-1), mModelViewUniform(-1), mDimensionsUniform(-1), mSpacingUniform(-1),
+   mEyePosUniform(-1), mClipPlaneUniform(-1), mVoxelDimsUniform(-1), mBrickDimsUniform(-1), mStepSizeUniform(-1), mOpacityUniform(-1),
+   mPageDimsUniform(-1), mAtlasDimsUniform(-1),
+   mVertexBuffer(0), mIndexBuffer(0), mVertexArray(0),
+   mOccupancyTextureHandle(0),
+   mGeneration(0),
+   mOpacity(1.0f), mStepSize(1.0f)
 {
-	android_assert(data);
+	android_assert(mResources);
 
 	clearClipPlane();
 
-	// Check if the data dimension is 3
-	int dim = data->GetDataDimension();
-	LOGD("dimension = %d", dim);
-	if (dim != 3) {
-		throw std::runtime_error(
-			"Volume: data is not 3D (dimension = " + Utility::toString(dim) + ")"
-		);
-	}
-
-	if (!data->GetPointData() || !data->GetPointData()->GetScalars())
-		throw std::runtime_error("IsoSurface: unsupported data");
-
-	data->GetDimensions(mDimensions);
+	// (the data itself is checked by GpuResources)
+	std::copy(mResources->getDimensions(), mResources->getDimensions()+3, mDimensions);
 	LOGD("dimensions %d %d %d", mDimensions[0], mDimensions[1], mDimensions[2]);
 
-	double spacing[3];
-	data->GetSpacing(spacing);
-	LOGD("spacing %f %f %f", spacing[0], spacing[1], spacing[2]);
-	mSpacing = Vector3(spacing[0], spacing[1], spacing[2]);//.normalized();
+	mSpacing = mResources->getSpacing();
+	LOGD("spacing %f %f %f", mSpacing.x, mSpacing.y, mSpacing.z);
 
-	data->GetPointData()->GetScalars()->GetRange(mRange);
+	mRange[0] = mResources->getRange()[0];
+	mRange[1] = mResources->getRange()[1];
 	LOGD("range min=%f max=%f", mRange[0], mRange[1]);
 
-	vtkDataArray* scalars = data->GetPointData()->GetScalars();
-	android_assert(scalars);
-
-	unsigned int num = scalars->GetNumberOfTuples();
-	android_assert(num == static_cast<unsigned>(mDimensions[0]*mDimensions[1]*mDimensions[2]));
-	mTexture.resize(num*4);
-
-	for (unsigned int i = 0; i < num; ++i) {
-		double value = scalars->GetComponent(i, 0);
-		double norm = (value-mRange[0]) / (mRange[1]-mRange[0]);
-		float r, g, b;
-		colormap(norm, r, g, b);
-		mTexture[i*4+0] = r*255;
-		mTexture[i*4+1] = g*255;
-		mTexture[i*4+2] = b*255;
-		mTexture[i*4+3] = (0.03+0.3*norm)*255;
-		// mTexture[i*4+3] = (0.03+0.97*norm)*255;
-		// mTexture[i*4+3] = 0.3*norm*255;
-		// mTexture[i*4+3] = (0.3+0.7*norm)*255;
-		// mTexture[i*4+3] = (0.1+0.7*norm)*255;
-		// mTexture[i*4+3] = norm*255;
-	}
+	computeOccupancy();
 
 	LOGD("loading finished");
 }
@@ -285,11 +226,64 @@ Volume3d::~Volume3d()
 {
 	// Schedule texture to be cleared
 	synchronized (staleTexturesList) {
-		if (mTextureHandle != 0)
-			staleTexturesList.emplace_back(mTextureHandle);
-		if (mBackFaceTextureHandle != 0)
-			staleTexturesList.emplace_back(mBackFaceTextureHandle);
+		if (mOccupancyTextureHandle != 0)
+			staleTexturesList.emplace_back(mOccupancyTextureHandle);
+	}
+}
+
+std::size_t Volume3d::getMemoryUsage() const
+{
+	return mOccupancy.capacity();
+}
+
+void Volume3d::computeOccupancy()
+{
+	mGeneration = mResources->getGeneration();
+	std::copy(mResources->getBrickDimensions(), mResources->getBrickDimensions()+3, mBrickDimensions);
+
+	// Maximum opacity over each range of values: "maxAlpha[min][max]"
+	// (same lookup as the fragment shader)
+	const TransferFunction tf(alphaOffset, alphaScale);
+	std::vector<unsigned char> maxAlpha(256*256, 0);
+	for (int min = 0; min < 256; ++min) {
+		unsigned char alpha = 0;
+		for (int max = min; max < 256; ++max) {
+			alpha = std::max(alpha, tf.getAlpha(max / 255.0f));
+			maxAlpha[min*256 + max] = alpha;
+		}
+	}
+
+	const std::vector<unsigned char>& ranges = mResources->getBrickRanges();
+	mOccupancy.resize(ranges.size() / 2);
+	for (std::size_t i = 0; i < mOccupancy.size(); ++i) {
+		const unsigned char min = ranges[i*2+0], max = ranges[i*2+1];
+		mOccupancy[i] = (min <= max ? maxAlpha[min*256 + max] : 0);
 	}
+
+	// LOGD("occupancy: %d x %d x %d bricks", mBrickDimensions[0], mBrickDimensions[1], mBrickDimensions[2]);
+}
+
+// (GL context)
+void Volume3d::updateOccupancy()
+{
+	if (mGeneration == mResources->getGeneration())
+		return;
+
+	computeOccupancy();
+
+	// (same grid, same brick dimensions)
+	CHECK(glBindTexture(GL_TEXTURE_3D, mOccupancyTextureHandle));
+	CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+	CHECK(glTexSubImage3D(
+		GL_TEXTURE_3D,
+		0,
+		0, 0, 0,
+		mBrickDimensions[0], mBrickDimensions[1], mBrickDimensions[2],
+		GL_LUMINANCE,
+		GL_UNSIGNED_BYTE,
+		mOccupancy.data()
+	));
+	CHECK(glBindTexture(GL_TEXTURE_3D, 0));
 }
 
 bool Volume3d::hasClipPlane()
@@ -317,124 +311,113 @@ void Volume3d::clearClipPlane()
 void Volume3d::bind()
 {
 	CHECK(mMaterial->bind());
-	CHECK(mBackFaceMaterial->bind());
 
 	mVertexAttrib = mMaterial->getAttribute("vertex");
 	mModelViewUniform = mMaterial->getUniform("modelView");
 	mProjectionUniform = mMaterial->getUniform("projection");
 	mDimensionsUniform = mMaterial->getUniform("dimensions");
-	mClipPlaneUniform = mMaterial->getUniform("clipPlane");
 	mSpacingUniform = mMaterial->getUniform("spacing");
-	// mScreenSizeUniform = mMaterial->getUniform("screenSize");
-
-	mBFVertexAttrib = mBackFaceMaterial->getAttribute("vertex");
-	mBFModelViewUniform = mBackFaceMaterial->getUniform("modelView");
-	mBFProjectionUniform = mBackFaceMaterial->getUniform("projection");
-	mBFDimensionsUniform = mBackFaceMaterial->getUniform("dimensions");
-	mBFSpacingUniform = mBackFaceMaterial->getUniform("spacing");
+	mEyePosUniform = mMaterial->getUniform("eyePos");
+	mClipPlaneUniform = mMaterial->getUniform("clipPlane");
+	mVoxelDimsUniform = mMaterial->getUniform("voxelDims");
+	mBrickDimsUniform = mMaterial->getUniform("brickDims");
+	mStepSizeUniform = mMaterial->getUniform("stepSize");
+	mOpacityUniform = mMaterial->getUniform("opacity");
 
 	android_assert(mVertexAttrib != -1);
 	android_assert(mModelViewUniform != -1);
 	android_assert(mProjectionUniform != -1);
 	android_assert(mDimensionsUniform != -1);
-	android_assert(mClipPlaneUniform != -1);
 	android_assert(mSpacingUniform != -1);
-	// android_assert(mScreenSizeUniform != -1);
-	android_assert(mBFVertexAttrib != -1);
-	android_assert(mBFModelViewUniform != -1);
-	android_assert(mBFProjectionUniform != -1);
-	android_assert(mBFDimensionsUniform != -1);
-	android_assert(mBFSpacingUniform != -1);
+	android_assert(mEyePosUniform != -1);
+	android_assert(mClipPlaneUniform != -1);
+	android_assert(mVoxelDimsUniform != -1);
+	android_assert(mBrickDimsUniform != -1);
+	android_assert(mStepSizeUniform != -1);
+	android_assert(mOpacityUniform != -1);
 
-	// checkError("get{Attribute/Uniform}");
+	// Texture units
+	GLint textureSampler = mMaterial->getUniform("texture");
+	GLint occupancySampler = mMaterial->getUniform("occupancy");
+	GLint transferFunctionSampler = mMaterial->getUniform("transferFunction");
+	android_assert(textureSampler != -1);
+	android_assert(occupancySampler != -1);
+	android_assert(transferFunctionSampler != -1);
+	CHECK(glUseProgram(mMaterial->getHandle()));
+	CHECK(glUniform1i(textureSampler, 0));
+	CHECK(glUniform1i(occupancySampler, 1));
+	CHECK(glUniform1i(transferFunctionSampler, 2));
+
+	if (mResources->getPager()) {
+		mPageDimsUniform = mMaterial->getUniform("pageDims");
+		mAtlasDimsUniform = mMaterial->getUniform("atlasDims");
+		GLint pageTableSampler = mMaterial->getUniform("pageTable");
+		android_assert(mPageDimsUniform != -1);
+		android_assert(mAtlasDimsUniform != -1);
+		android_assert(pageTableSampler != -1);
+		CHECK(glUniform1i(pageTableSampler, 3));
+	}
 
 	// Required because input is not RGBA (i.e. not aligned to a 4-byte boundary)
 	// http://www.opengl.org/wiki/Common_Mistakes#Texture_upload_and_pixel_reads
 	CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
 
-	CHECK(glGenTextures(1, &mTextureHandle));
-	CHECK(glBindTexture(GL_TEXTURE_3D/*_OES*/, mTextureHandle));
-	CHECK(glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
-	CHECK(glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+	mResources->bind();
+
+	// Occupancy texture (one texel per brick, sampled at texel centers)
+	CHECK(glGenTextures(1, &mOccupancyTextureHandle));
+	CHECK(glBindTexture(GL_TEXTURE_3D/*_OES*/, mOccupancyTextureHandle));
+	CHECK(glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+	CHECK(glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
 	CHECK(glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
 	CHECK(glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
 	CHECK(glTexParameteri(GL_TEXTURE_3D/*_OES*/, GL_TEXTURE_WRAP_R/*_OES*/, GL_CLAMP_TO_EDGE));
 
-	// PFNGLTEXIMAGE3DOESPROC glTexImage3DOES = nullptr;
-	// glTexImage3DOES = GetProcAddress<PFNGLTEXIMAGE3DOESPROC>("glTexImage3DOES");
-
-	// Initialize the texture
-	// CHECK(glTexImage3DOES(
 	CHECK(glTexImage3D(
 		GL_TEXTURE_3D/*_OES*/,
 		0,
-		GL_RGBA,
-		mDimensions[0], mDimensions[1], mDimensions[2],
+		GL_LUMINANCE,
+		mBrickDimensions[0], mBrickDimensions[1], mBrickDimensions[2],
 		0,
-		GL_RGBA,
+		GL_LUMINANCE,
 		GL_UNSIGNED_BYTE,
-		mTexture.data()
+		mOccupancy.data()
 	));
 
-	// Init the backface texture
-	CHECK(glGenTextures(1, &mBackFaceTextureHandle));
-	CHECK(glBindTexture(GL_TEXTURE_2D, mBackFaceTextureHandle));
-	CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-	CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
-	CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-	CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-	CHECK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, screenWidth, screenHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
-	CHECK(glBindTexture(GL_TEXTURE_2D, 0));
-
-    // // Create a depth framebuffer
-    // GLuint depthBuffer;
-    // glGenRenderbuffers(1, &depthBuffer);
-    // glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
-    // glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, screenWidth, screenHeight);
-	// glBindRenderbuffer(GL_RENDERBUFFER, 0);
-
-	CHECK(glGenFramebuffers(1, &mFrameBuffer));
-	CHECK(glBindFramebuffer(GL_FRAMEBUFFER, mFrameBuffer));
-	CHECK(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mBackFaceTextureHandle, 0));
-    // glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
-    GLenum result = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (result != GL_FRAMEBUFFER_COMPLETE) {
-	    throw std::runtime_error("Unable to create the depth framebuffer: error " + Utility::toString(result));
-    }
-    CHECK(glBindFramebuffer(GL_FRAMEBUFFER, 0));
-
-    static const GLfloat vertices[24] = {
-	    0.0, 0.0, 0.0,
-	    0.0, 0.0, 1.0,
-	    0.0, 1.0, 0.0,
-	    0.0, 1.0, 1.0,
-	    1.0, 0.0, 0.0,
-	    1.0, 0.0, 1.0,
-	    1.0, 1.0, 0.0,
-	    1.0, 1.0, 1.0
-    };
-    // draw the six faces of the boundbox by drawwing triangles
-    // draw it contra-clockwise
-    // front: 1 5 7 3
-    // back: 0 2 6 4
-    // left：0 1 3 2
-    // right:7 5 4 6
-    // up: 2 3 7 6
-    // down: 1 0 4 5
-    static const GLushort indices[36] = {
-        1, 5, 7,
-        7, 3, 1,
-        0, 2, 6,
-        6, 4, 0,
-        0, 1, 3,
-        3, 2, 0,
-        7, 5, 4,
-        4, 6, 7,
-        2, 3, 7,
-        7, 6, 2,
-        1, 0, 4,
-        4, 5, 1
-    };
+	CHECK(glBindTexture(GL_TEXTURE_3D/*_OES*/, 0));
+
+	static const GLfloat vertices[24] = {
+		0.0, 0.0, 0.0,
+		0.0, 0.0, 1.0,
+		0.0, 1.0, 0.0,
+		0.0, 1.0, 1.0,
+		1.0, 0.0, 0.0,
+		1.0, 0.0, 1.0,
+		1.0, 1.0, 0.0,
+		1.0, 1.0, 1.0
+	};
+	// draw the six faces of the boundbox by drawwing triangles
+	// draw it contra-clockwise
+	// front: 1 5 7 3
+	// back: 0 2 6 4
+	// left：0 1 3 2
+	// right:7 5 4 6
+	// up: 2 3 7 6
+	// down: 1 0 4 5
+	static const GLushort indices[36] = {
+		1, 5, 7,
+		7, 3, 1,
+		0, 2, 6,
+		6, 4, 0,
+		0, 1, 3,
+		3, 2, 0,
+		7, 5, 4,
+		4, 6, 7,
+		2, 3, 7,
+		7, 6, 2,
+		1, 0, 4,
+		4, 5, 1
+	};
 
 	// Allocate 2 VBOs
 	GLuint vbos[2];
@@ -446,9 +429,18 @@ void Volume3d::bind()
 	CHECK(glBindBuffer(GL_ARRAY_BUFFER, 0));
 
 	mIndexBuffer = vbos[1];
+
+	// Vertices and indices
+	if (mVertexArray == 0)
+		CHECK(glGenVertexArrays(1, &mVertexArray));
+	CHECK(glBindVertexArray(mVertexArray));
+	CHECK(glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer));
+	CHECK(glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, nullptr));
+	CHECK(glEnableVertexAttribArray(mVertexAttrib));
 	CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer));
 	CHECK(glBufferData(GL_ELEMENT_ARRAY_BUFFER, 36*sizeof(GLushort), indices, GL_STATIC_DRAW));
-	CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+	CHECK(glBindVertexArray(0));
+	CHECK(glBindBuffer(GL_ARRAY_BUFFER, 0));
 
 	mBound = true;
 }
@@ -470,70 +462,68 @@ void Volume3d::render(const Matrix4& projectionMatrix, const Matrix4& modelViewM
 
 	android_assert(mMaterial);
 
-	// Uniforms
-	CHECK(glUseProgram(mMaterial->getHandle()));
-	CHECK(glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_));
-	// CHECK(glUniformMatrix4fv(mModelViewUniform, 1, false, modelViewMatrix.data_));
-	CHECK(glUniformMatrix4fv(mModelViewUniform, 1, false, (modelViewMatrix * Matrix4::makeTransform(-Vector3(mDimensions[0]*mSpacing.x, mDimensions[1]*mSpacing.y, -mDimensions[2]*mSpacing.z)/2)).data_));
-	CHECK(glUniform4fv(mClipPlaneUniform, 1, mClipEq));
-	CHECK(glUniform3f(mSpacingUniform, mSpacing.x, mSpacing.y, mSpacing.z));
-	CHECK(glUniform3i(mDimensionsUniform, mDimensions[0], mDimensions[1], mDimensions[2]));
-	// CHECK(glUniform2f(mScreenSizeUniform, screenWidth, screenHeight));
+	updateOccupancy();
 
-	// Uniforms 2
-	CHECK(glUseProgram(mBackFaceMaterial->getHandle()));
-	CHECK(glUniformMatrix4fv(mBFProjectionUniform, 1, false, projectionMatrix.data_));
-	// CHECK(glUniformMatrix4fv(mBFModelViewUniform, 1, false, modelViewMatrix.data_));
-	CHECK(glUniformMatrix4fv(mBFModelViewUniform, 1, false, (modelViewMatrix * Matrix4::makeTransform(-Vector3(mDimensions[0]*mSpacing.x, mDimensions[1]*mSpacing.y, -mDimensions[2]*mSpacing.z)/2)).data_));
-	CHECK(glUniform3f(mBFSpacingUniform, mSpacing.x, mSpacing.y, mSpacing.z));
-	CHECK(glUniform3i(mBFDimensionsUniform, mDimensions[0], mDimensions[1], mDimensions[2]));
+	const Vector3 scale = Vector3(mDimensions[0], mDimensions[1], mDimensions[2]) * mSpacing;
+	const Matrix4 mv = modelViewMatrix * Matrix4::makeTransform(-Vector3(scale.x, scale.y, -scale.z)/2);
 
-	CHECK(glActiveTexture(GL_TEXTURE0));
-	CHECK(glBindTexture(GL_TEXTURE_3D/*_OES*/, mTextureHandle));
+	// Box coordinates to eye coordinates (same as the vertex shader)
+	const Matrix4 boxToEye = mv * Matrix4::makeTransform(Vector3::zero(), Quaternion::identity(), Vector3(scale.x, scale.y, -scale.z));
+	const Vector3 eyePos = boxToEye.inverse() * Vector3::zero();
 
-	CHECK(glUseProgram(mMaterial->getHandle()));
-	GLint textureSampler = mMaterial->getUniform("texture");
-	android_assert(textureSampler != -1);
-	CHECK(glUniform1i(textureSampler, 0));
+	// Clip plane in box coordinates (the default one never clips)
+	float clipEq[4] = { 0, 0, 0, -1 };
+	if (hasClipPlane()) {
+		for (int j = 0; j < 4; ++j)
+			clipEq[j] = mClipEq[0]*boxToEye[j][0] + mClipEq[1]*boxToEye[j][1] + mClipEq[2]*boxToEye[j][2] + mClipEq[3]*boxToEye[j][3];
+	}
 
-	CHECK(glActiveTexture(GL_TEXTURE1));
-	CHECK(glBindTexture(GL_TEXTURE_2D, mBackFaceTextureHandle));
+	// Pages in the bricks seen from here
+	BrickPager* pager = mResources->getPager();
+	if (pager)
+		pager->update(projectionMatrix * boxToEye, clipEq);
 
+	// Uniforms
 	CHECK(glUseProgram(mMaterial->getHandle()));
-	GLint backFaceTextureSampler = mMaterial->getUniform("backFaceTexture");
-	android_assert(backFaceTextureSampler != -1);
-	CHECK(glUniform1i(backFaceTextureSampler, 1));
+	CHECK(glUniformMatrix4fv(mProjectionUniform, 1, false, projectionMatrix.data_));
+	CHECK(glUniformMatrix4fv(mModelViewUniform, 1, false, mv.data_));
+	CHECK(glUniform3f(mSpacingUniform, mSpacing.x, mSpacing.y, mSpacing.z));
+	CHECK(glUniform3i(mDimensionsUniform, mDimensions[0], mDimensions[1], mDimensions[2]));
+	CHECK(glUniform3f(mEyePosUniform, eyePos.x, eyePos.y, eyePos.z));
+	CHECK(glUniform4fv(mClipPlaneUniform, 1, clipEq));
+	CHECK(glUniform3f(mVoxelDimsUniform, mDimensions[0], mDimensions[1], mDimensions[2]));
+	CHECK(glUniform3f(mBrickDimsUniform, mBrickDimensions[0], mBrickDimensions[1], mBrickDimensions[2]));
+	CHECK(glUniform1f(mStepSizeUniform, mStepSize));
+	CHECK(glUniform1f(mOpacityUniform, mOpacity));
+
+	if (pager) {
+		const int* pageDims = pager->getPageTableDimensions();
+		const int* atlasDims = pager->getAtlasDimensions();
+		CHECK(glUniform3f(mPageDimsUniform, pageDims[0], pageDims[1], pageDims[2]));
+		CHECK(glUniform3f(mAtlasDimsUniform, atlasDims[0], atlasDims[1], atlasDims[2]));
+		CHECK(glActiveTexture(GL_TEXTURE3));
+		CHECK(glBindTexture(GL_TEXTURE_3D, pager->getPageTableTexture()));
+	}
 
-	// Vertices
-	android_assert(mVertexBuffer != 0);
-	CHECK(glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer));
-	android_assert(mVertexAttrib != -1);
-	CHECK(glVertexAttribPointer(mVertexAttrib, 3, GL_FLOAT, false, 0, nullptr));
-	CHECK(glEnableVertexAttribArray(mVertexAttrib));
+	CHECK(glActiveTexture(GL_TEXTURE2));
+	CHECK(glBindTexture(GL_TEXTURE_2D, mResources->getTransferFunctionTexture(alphaOffset, alphaScale)));
+	CHECK(glActiveTexture(GL_TEXTURE1));
+	CHECK(glBindTexture(GL_TEXTURE_3D/*_OES*/, mOccupancyTextureHandle));
+	CHECK(glActiveTexture(GL_TEXTURE0));
+	CHECK(glBindTexture(GL_TEXTURE_3D/*_OES*/, pager ? pager->getAtlasTexture() : mResources->getScalarTexture()));
 
-	// Indices
-	android_assert(mIndexBuffer != 0);
-	CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffer));
+	// Vertices and indices
+	android_assert(mVertexArray != 0);
+	CHECK(glBindVertexArray(mVertexArray));
 
-	// Render the back texture
-	CHECK(glBindFramebuffer(GL_FRAMEBUFFER, mFrameBuffer));
-	CHECK(glUseProgram(mBackFaceMaterial->getHandle()));
-	CHECK(glClearColor(0, 0, 0, 1));
-	CHECK(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+	// Only keep the faces pointing away from the viewer (exit
+	// points). The z axis flip in the vertex shader mirrors the box,
+	// hence GL_BACK rather than GL_FRONT. Back faces are still
+	// rasterized when the viewer is inside the volume.
 	CHECK(glEnable(GL_CULL_FACE));
-	CHECK(glCullFace(GL_FRONT));
+	CHECK(glCullFace(GL_BACK));
 	CHECK(glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, nullptr));
 	CHECK(glDisable(GL_CULL_FACE));
-	CHECK(glBindFramebuffer(GL_FRAMEBUFFER, 0));
-
-	// Render the volume
-	CHECK(glUseProgram(mMaterial->getHandle()));
-	CHECK(glEnable(GL_CULL_FACE));
-	CHECK(glCullFace(GL_BACK));
-	CHECK(glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_SHORT, nullptr)); // XXX: error here
-
-	CHECK(glBindBuffer(GL_ARRAY_BUFFER, 0));
-	CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
 
-	CHECK(glDisableVertexAttribArray(mVertexAttrib));
+	CHECK(glBindVertexArray(0));
 }
@@ -3,16 +3,17 @@
 
 #include "global.h"
 
-#include <vtkSmartPointer.h>
-
 #include <list>
 
-class vtkImageData;
-
+// Ray casting volume renderer (alternative to the slice-based
+// Volume, with the same interface). Paged datasets are sampled at
+// full resolution through their BrickPager.
 class Volume3d
 {
 public:
-	Volume3d(vtkSmartPointer<vtkImageData> data);
+	// The scalar texture is shared with the other users of
+	// "resources"
+	Volume3d(GpuResourcesSharedPtr resources);
 	~Volume3d();
 
 	// (GL context)
@@ -27,23 +28,50 @@ public:
 	double getMinValue() const { return mRange[0]; }
 	double getMaxValue() const { return mRange[1]; }
 
+	void setOpacity(float opacity) { mOpacity = opacity; }
+
+	// Base distance between two samples along a ray, in voxels.
+	// Steps get longer as the ray becomes opaque.
+	void setStepSize(float voxels) { mStepSize = voxels; }
+
+	// Size (in voxels) of the bricks of the occupancy texture used
+	// to skip empty space (same as GpuResources::brickSize).
+	// NOTE: hardcoded in the fragment shader.
+	static const int brickSize = 8;
+
+	// CPU-side memory held by the volume, in bytes (not including
+	// the shared resources)
+	std::size_t getMemoryUsage() const;
+
 private:
 	bool hasClipPlane();
 
-	MaterialSharedPtr mMaterial, mBackFaceMaterial;
+	// Per-brick maximum opacity, from the brick value ranges
+	void computeOccupancy();
+
+	// Computes the occupancy again if the data has been replaced
+	// (see GpuResources::replaceData())
+	// (GL context)
+	void updateOccupancy();
+
+	GpuResourcesSharedPtr mResources;
+	MaterialSharedPtr mMaterial;
 	bool mBound;
-	GLint mVertexAttrib, mBFVertexAttrib;
-	GLint mProjectionUniform, mModelViewUniform, mDimensionsUniform, mClipPlaneUniform, mSpacingUniform, mScreenSizeUniform;
-	GLint mBFProjectionUniform, mBFModelViewUniform, mBFDimensionsUniform, mBFSpacingUniform;
+	GLint mVertexAttrib;
+	GLint mProjectionUniform, mModelViewUniform, mDimensionsUniform, mSpacingUniform;
+	GLint mEyePosUniform, mClipPlaneUniform, mVoxelDimsUniform, mBrickDimsUniform, mStepSizeUniform, mOpacityUniform;
+	GLint mPageDimsUniform, mAtlasDimsUniform; // (paged datasets only)
 	GLuint mVertexBuffer;
 	GLuint mIndexBuffer;
-	std::vector<unsigned char> mTexture;
-	int mDimensions[3];
+	GLuint mVertexArray;
+	std::vector<unsigned char> mOccupancy;
+	int mDimensions[3], mBrickDimensions[3];
 	double mRange[2];
 	Vector3 mSpacing;
-	GLuint mTextureHandle, mBackFaceTextureHandle;
-	GLuint mFrameBuffer;
+	GLuint mOccupancyTextureHandle;
+	unsigned int mGeneration; // (of mResources, when mOccupancy was computed)
 	float mClipEq[4];
+	float mOpacity, mStepSize;
 };
 
 #endif /* VOLUME3D_H */
@@ -0,0 +1,276 @@
+#include "volume_cache.h"
+
+#include "util/file.h"
+
+#include <vtkImageData.h>
+#include <vtkPointData.h>
+#include <vtkDataArray.h>
+#include <vtkCommand.h>
+
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+	const char cacheMagic[4] = { 'F', 'L', 'V', 'C' };
+	const uint32_t cacheVersion = 1;
+	const uint64_t dataAlignment = 64; // (array data offsets)
+
+	enum ArrayRole { ROLE_SCALARS = 0, ROLE_VECTORS = 1 };
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		int64_t sourceMtimeNs, sourceSize; // (staleness check)
+		int32_t dimensions[3];
+		int32_t arrayCount;
+		double origin[3], spacing[3];
+	};
+
+	struct ArrayHeader
+	{
+		int32_t role, dataType, components, reserved;
+		int64_t tuples;
+		uint64_t offset; // from the beginning of the file
+		char name[64];
+	};
+
+	static_assert(sizeof(Header) == 88, "unexpected cache header size");
+	static_assert(sizeof(ArrayHeader) == 96, "unexpected cache array header size");
+
+	uint64_t alignOffset(uint64_t offset)
+	{
+		return (offset + dataAlignment-1) / dataAlignment * dataAlignment;
+	}
+
+	bool isSupported(int dataType)
+	{
+		switch (dataType) {
+			case VTK_CHAR: case VTK_SIGNED_CHAR: case VTK_UNSIGNED_CHAR:
+			case VTK_SHORT: case VTK_UNSIGNED_SHORT:
+			case VTK_INT: case VTK_UNSIGNED_INT:
+			case VTK_FLOAT: case VTK_DOUBLE:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	// Keeps the cache file mapped as long as an array points into it
+	class MappingOwner : public vtkCommand
+	{
+	public:
+		static MappingOwner* New()
+		{ return new MappingOwner; }
+
+		virtual void Execute(vtkObject* vtkNotUsed(caller),
+		                     unsigned long event,
+		                     void* vtkNotUsed(calldata))
+		{
+			if (event == vtkCommand::DeleteEvent)
+				mapping.reset();
+		}
+
+		File::MappingSharedPtr mapping;
+	};
+} // namespace
+
+std::string VolumeCache::getFileName(const std::string& sourceFileName)
+{
+	return sourceFileName + ".cache";
+}
+
+vtkSmartPointer<vtkImageData> VolumeCache::load(const std::string& sourceFileName)
+{
+	const std::string fileName = getFileName(sourceFileName);
+
+	long long mtimeNs, size, sourceMtimeNs, sourceSize;
+	if (!File::getInfo(fileName, mtimeNs, size))
+		return nullptr;
+	if (!File::getInfo(sourceFileName, sourceMtimeNs, sourceSize))
+		return nullptr;
+
+	try {
+		File::MappingSharedPtr mapping = std::make_shared<File::Mapping>(fileName);
+		char* base = mapping->getData();
+		const uint64_t mappedSize = mapping->getSize();
+
+		Header header;
+		if (mappedSize < sizeof(header))
+			throw std::runtime_error("truncated header");
+		std::memcpy(&header, base, sizeof(header));
+
+		if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion)
+			throw std::runtime_error("unknown format");
+
+		if (header.sourceMtimeNs != sourceMtimeNs || header.sourceSize != sourceSize) {
+			LOGI("Ignoring stale cache: %s", fileName.c_str());
+			return nullptr;
+		}
+
+		if (header.arrayCount < 0 || header.arrayCount > 2
+		    || mappedSize < sizeof(Header) + header.arrayCount*sizeof(ArrayHeader))
+			throw std::runtime_error("invalid array count");
+
+		if (header.dimensions[0] <= 0 || header.dimensions[1] <= 0 || header.dimensions[2] <= 0)
+			throw std::runtime_error("invalid dimensions");
+
+		const int64_t pointCount = int64_t(header.dimensions[0]) * header.dimensions[1] * header.dimensions[2];
+
+		vtkSmartPointer<vtkImageData> data = vtkSmartPointer<vtkImageData>::New();
+		data->SetDimensions(header.dimensions[0], header.dimensions[1], header.dimensions[2]);
+		data->SetOrigin(header.origin);
+		data->SetSpacing(header.spacing);
+
+		vtkSmartPointer<MappingOwner> owner = vtkSmartPointer<MappingOwner>::New();
+		owner->mapping = mapping;
+
+		for (int i = 0; i < header.arrayCount; ++i) {
+			ArrayHeader ah;
+			std::memcpy(&ah, base + sizeof(Header) + i*sizeof(ArrayHeader), sizeof(ah));
+			ah.name[sizeof(ah.name)-1] = '\0';
+
+			if (!isSupported(ah.dataType) || ah.components <= 0 || ah.tuples != pointCount
+			    || ah.offset % dataAlignment != 0)
+				throw std::runtime_error("invalid array header");
+
+			vtkSmartPointer<vtkDataArray> array = vtkSmartPointer<vtkDataArray>::Take(vtkDataArray::CreateDataArray(ah.dataType));
+			const uint64_t values = uint64_t(ah.tuples) * ah.components;
+			const uint64_t bytes = values * array->GetDataTypeSize();
+			if (ah.offset > mappedSize || bytes > mappedSize - ah.offset)
+				throw std::runtime_error("truncated array");
+
+			if (ah.name[0] != '\0')
+				array->SetName(ah.name);
+			array->SetNumberOfComponents(ah.components);
+			array->SetVoidArray(base + ah.offset, values, 1); // (1: never freed by VTK)
+			array->AddObserver(vtkCommand::DeleteEvent, owner);
+
+			if (ah.role == ROLE_SCALARS)
+				data->GetPointData()->SetScalars(array);
+			else if (ah.role == ROLE_VECTORS)
+				data->GetPointData()->SetVectors(array);
+			else
+				throw std::runtime_error("invalid array role");
+		}
+
+		LOGI("Mapped cache: %s", fileName.c_str());
+		return data;
+
+	} catch (const std::exception& e) {
+		LOGW("Ignoring invalid cache: %s: %s", fileName.c_str(), e.what());
+		return nullptr;
+	}
+}
+
+bool VolumeCache::save(const std::string& sourceFileName, vtkImageData* data)
+{
+	android_assert(data);
+
+	const std::string fileName = getFileName(sourceFileName);
+
+	long long sourceMtimeNs, sourceSize;
+	if (!File::getInfo(sourceFileName, sourceMtimeNs, sourceSize))
+		return false;
+
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version = cacheVersion;
+	header.sourceMtimeNs = sourceMtimeNs;
+	header.sourceSize = sourceSize;
+
+	int dims[3];
+	data->GetDimensions(dims);
+	std::copy(dims, dims+3, header.dimensions);
+	data->GetOrigin(header.origin);
+	data->GetSpacing(header.spacing);
+
+	std::vector<vtkDataArray*> arrays;
+	std::vector<ArrayHeader> arrayHeaders;
+	if (data->GetPointData()) {
+		if (vtkDataArray* scalars = data->GetPointData()->GetScalars()) {
+			arrays.push_back(scalars);
+			arrayHeaders.push_back(ArrayHeader());
+			arrayHeaders.back().role = ROLE_SCALARS;
+		}
+		if (vtkDataArray* vectors = data->GetPointData()->GetVectors()) {
+			arrays.push_back(vectors);
+			arrayHeaders.push_back(ArrayHeader());
+			arrayHeaders.back().role = ROLE_VECTORS;
+		}
+	}
+	header.arrayCount = arrays.size();
+
+	uint64_t offset = alignOffset(sizeof(Header) + arrays.size()*sizeof(ArrayHeader));
+	for (unsigned int i = 0; i < arrays.size(); ++i) {
+		vtkDataArray* array = arrays[i];
+		ArrayHeader& ah = arrayHeaders[i];
+
+		if (!isSupported(array->GetDataType())) {
+			LOGW("Not caching %s: unsupported array type (%d)", sourceFileName.c_str(), array->GetDataType());
+			return false;
+		}
+
+		const char* name = array->GetName();
+		std::memset(ah.name, 0, sizeof(ah.name));
+		if (name)
+			std::strncpy(ah.name, name, sizeof(ah.name)-1);
+		ah.dataType = array->GetDataType();
+		ah.components = array->GetNumberOfComponents();
+		ah.reserved = 0;
+		ah.tuples = array->GetNumberOfTuples();
+		ah.offset = offset;
+		offset = alignOffset(offset + uint64_t(ah.tuples) * ah.components * array->GetDataTypeSize());
+	}
+
+	// Written to a temporary file first, so that an interrupted write
+	// never leaves a truncated cache behind. Unique to the thread: the
+	// dataset loader and the time series prefetch tasks may save the
+	// same cache at the same time (the last rename wins).
+	const std::string tmpFileName = fileName + ".tmp." + Utility::toString(getpid())
+		+ "." + Utility::toString(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+	{
+		std::ofstream file(tmpFileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			LOGW("Unable to write cache: %s", tmpFileName.c_str());
+			return false;
+		}
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(arrayHeaders.data()), arrayHeaders.size()*sizeof(ArrayHeader));
+
+		uint64_t pos = sizeof(Header) + arrayHeaders.size()*sizeof(ArrayHeader);
+		const std::vector<char> padding(dataAlignment, 0);
+		for (unsigned int i = 0; i < arrays.size(); ++i) {
+			const ArrayHeader& ah = arrayHeaders[i];
+			file.write(padding.data(), ah.offset - pos);
+			const uint64_t bytes = uint64_t(ah.tuples) * ah.components * arrays[i]->GetDataTypeSize();
+			file.write(static_cast<const char*>(arrays[i]->GetVoidPointer(0)), bytes);
+			pos = ah.offset + bytes;
+		}
+
+		if (!file) {
+			LOGW("Unable to write cache: %s", tmpFileName.c_str());
+			file.close();
+			std::remove(tmpFileName.c_str());
+			return false;
+		}
+	}
+
+	if (std::rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+		LOGW("Unable to write cache: %s", fileName.c_str());
+		std::remove(tmpFileName.c_str());
+		return false;
+	}
+
+	LOGI("Wrote cache: %s", fileName.c_str());
+	return true;
+}
@@ -0,0 +1,28 @@
+#ifndef VOLUME_CACHE_H
+#define VOLUME_CACHE_H
+
+#include "global.h"
+
+#include <vtkSmartPointer.h>
+
+class vtkImageData;
+
+// Native binary copy of a dataset, written next to the source file
+// ("<source>.cache") on first load: a header followed by the raw
+// point scalars and vectors. Later loads map the cache file into
+// memory and point the vtkImageData arrays at it without copying.
+// A cache whose recorded source modification time or size doesn't
+// match the source file anymore is ignored (and rewritten).
+namespace VolumeCache
+{
+	std::string getFileName(const std::string& sourceFileName);
+
+	// Returns null if there is no valid cache for "sourceFileName"
+	vtkSmartPointer<vtkImageData> load(const std::string& sourceFileName);
+
+	// Returns false if the cache couldn't be written (e.g. read-only
+	// directory or unsupported array types)
+	bool save(const std::string& sourceFileName, vtkImageData* data);
+}
+
+#endif /* VOLUME_CACHE_H */